@@ -2,6 +2,7 @@
 
 #include <atomic>
 #include <chrono>
+#include <functional>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -9,6 +10,7 @@
 #include <Eigen/Geometry>
 
 #include <common_robotics_utilities/utility.hpp>
+#include <tri_realtime_common/realtime_thread_config.hpp>
 
 namespace dji_robomaster_ep_driver
 {
@@ -54,9 +56,15 @@ class DJIRobomasterEPInterfaceTCP
 public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
+  // command_thread_config is applied to the command loop thread when it
+  // starts; logging_fn reports how it was applied.
   DJIRobomasterEPInterfaceTCP(
       const std::string& robot_ip_address, const int32_t robot_port,
-      const int32_t safety_timeout_ms);
+      const int32_t safety_timeout_ms,
+      const tri_realtime_common::RealtimeThreadConfig& command_thread_config =
+          tri_realtime_common::RealtimeThreadConfig(),
+      const std::function<void(const std::string&)>& logging_fn =
+          [] (const std::string&) {});
 
   ~DJIRobomasterEPInterfaceTCP() { Stop(); }
 
@@ -95,6 +103,8 @@ private:
   }
 
   int32_t safety_timeout_ms_ = 0;
+  tri_realtime_common::RealtimeThreadConfig command_thread_config_;
+  std::function<void(const std::string&)> logging_fn_;
 
   int socket_fd_ = -1;
   mutable std::mutex state_mutex_;
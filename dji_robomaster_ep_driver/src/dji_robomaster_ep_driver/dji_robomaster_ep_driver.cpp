@@ -58,7 +58,11 @@ DJIRobomasterEPState::DJIRobomasterEPState(
 
 DJIRobomasterEPInterfaceTCP::DJIRobomasterEPInterfaceTCP(
     const std::string& robot_ip_address, const int32_t robot_port,
-    const int32_t safety_timeout_ms) : safety_timeout_ms_(safety_timeout_ms)
+    const int32_t safety_timeout_ms,
+    const tri_realtime_common::RealtimeThreadConfig& command_thread_config,
+    const std::function<void(const std::string&)>& logging_fn)
+    : safety_timeout_ms_(safety_timeout_ms),
+      command_thread_config_(command_thread_config), logging_fn_(logging_fn)
 {
   if (safety_timeout_ms_ <= 0)
   {
@@ -203,6 +207,9 @@ void DJIRobomasterEPInterfaceTCP::Stop()
 
 void DJIRobomasterEPInterfaceTCP::CommandLoop()
 {
+  tri_realtime_common::ConfigureCurrentThread(
+      command_thread_config_, "robomaster_cmd", logging_fn_);
+
   const std::chrono::milliseconds safety_timeout(safety_timeout_ms_);
 
   while (run_command_thread_.load())
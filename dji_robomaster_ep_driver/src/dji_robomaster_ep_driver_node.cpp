@@ -13,6 +13,8 @@
 #include <ros/ros.h>
 #include <std_msgs/Float64.h>
 #include <tf2_msgs/TFMessage.h>
+#include <tri_realtime_common/realtime_thread_config.hpp>
+#include <tri_realtime_common/ros_realtime_thread_config.hpp>
 
 namespace dji_robomaster_ep_driver
 {
@@ -25,7 +27,8 @@ public:
       const ros::NodeHandle& nh, const std::string& robot_ip_address,
       const int32_t robot_port, const std::string& robot_name,
       const std::string& odometry_frame_name,
-      const std::string& robot_frame_name)
+      const std::string& robot_frame_name,
+      const tri_realtime_common::RealtimeThreadConfig& command_thread_config)
       : nh_(nh), odometry_frame_name_(odometry_frame_name),
         robot_frame_name_(robot_frame_name)
   {
@@ -45,9 +48,15 @@ public:
     // Commands time out after 100ms
     const int32_t safety_timeout_ms = 100;
 
+    const auto logging_fn = [] (const std::string& message)
+    {
+      ROS_INFO("%s", message.c_str());
+    };
+
     robot_interface_ = std::unique_ptr<DJIRobomasterEPInterfaceTCP>(
         new DJIRobomasterEPInterfaceTCP(
-            robot_ip_address, robot_port, safety_timeout_ms));
+            robot_ip_address, robot_port, safety_timeout_ms,
+            command_thread_config, logging_fn));
   }
 
   void Loop(const double loop_hz)
@@ -169,10 +178,17 @@ int main(int argc, char** argv)
   const std::string robot_frame_name = nhp.param(
       std::string("robot_frame_name"), std::string("robomaster_body"));
   const double loop_hz = nhp.param(std::string("loop_hz"), 60.0);
+  const tri_realtime_common::RealtimeThreadConfig command_thread_config =
+      tri_realtime_common::LoadRealtimeThreadConfig(nhp, "command_thread");
 
   dji_robomaster_ep_driver::DJIRobomasterEPDriver driver(
       nh, robot_ip_address, robot_port, robot_name, odometry_frame_name,
-      robot_frame_name);
+      robot_frame_name, command_thread_config);
+  tri_realtime_common::LockProcessMemoryIfRequested(
+      nhp, [] (const std::string& message)
+      {
+        ROS_INFO("%s", message.c_str());
+      });
   driver.Loop(loop_hz);
   return 0;
 }
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace lightweight_ur_interface
+{
+// Lock-free bounded single-producer single-consumer queue that never blocks
+// the producer. When the queue is full, Push() drops the oldest queued item
+// to make room for the new one. In the rare case that the consumer is copying
+// out the oldest item at that moment, the new item is dropped instead. Both
+// cases are counted by DroppedCount().
+//
+// Each slot carries a sequence number in the style of Vyukov's bounded queue:
+// a slot at position pos is free when its sequence is pos, holds an item when
+// its sequence is pos + 1, and is released for position pos + capacity once
+// the consumer has copied the item out. Both the consumer and a dropping
+// producer claim the oldest item with a CAS on the head position, so an item
+// is never overwritten while it is being read.
+//
+// Allocator allows over-aligned item types, such as those containing
+// fixed-size Eigen members, to use Eigen::aligned_allocator.
+template<typename T, typename Allocator = std::allocator<T>>
+class BoundedSpscQueue
+{
+private:
+
+  struct Slot
+  {
+    std::atomic<uint64_t> sequence;
+    T value;
+  };
+
+  using SlotAllocator
+      = typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>;
+
+  std::vector<Slot, SlotAllocator> slots_;
+  // Padded onto separate cache lines, since they are written by different
+  // threads. Padding rather than alignas keeps the queue allocatable with the
+  // pre-C++17 operator new.
+  std::atomic<uint64_t> head_;
+  char head_padding_[64];
+  std::atomic<uint64_t> tail_;
+  char tail_padding_[64];
+  std::atomic<uint64_t> dropped_count_;
+
+  inline Slot& SlotAt(const uint64_t position)
+  {
+    return slots_[static_cast<size_t>(position % slots_.size())];
+  }
+
+public:
+
+  explicit BoundedSpscQueue(const size_t capacity)
+    : slots_(capacity), head_(0), tail_(0), dropped_count_(0)
+  {
+    if (capacity == 0)
+    {
+      throw std::invalid_argument("capacity must be greater than zero");
+    }
+    for (size_t idx = 0; idx < slots_.size(); idx++)
+    {
+      slots_[idx].sequence.store(idx, std::memory_order_relaxed);
+    }
+  }
+
+  inline size_t Capacity() const { return slots_.size(); }
+
+  inline uint64_t DroppedCount() const
+  {
+    return dropped_count_.load(std::memory_order_relaxed);
+  }
+
+  // Producer: enqueues a copy of value without blocking. Returns false if an
+  // item had to be dropped to do so.
+  bool Push(const T& value)
+  {
+    const uint64_t position = tail_.load(std::memory_order_relaxed);
+    Slot& slot = SlotAt(position);
+    bool dropped = false;
+    if (slot.sequence.load(std::memory_order_acquire) != position)
+    {
+      // The slot still holds the item from one lap ago, so the queue is full.
+      // Claim that item (the oldest) unless the consumer already has.
+      uint64_t oldest_position = position - slots_.size();
+      if (head_.compare_exchange_strong(oldest_position, oldest_position + 1,
+                                        std::memory_order_acq_rel,
+                                        std::memory_order_acquire))
+      {
+        dropped = true;
+      }
+      else if (slot.sequence.load(std::memory_order_acquire) != position)
+      {
+        // The consumer is still copying out this slot, so drop the new item
+        dropped_count_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+    if (dropped)
+    {
+      dropped_count_.fetch_add(1, std::memory_order_relaxed);
+    }
+    slot.value = value;
+    slot.sequence.store(position + 1, std::memory_order_release);
+    tail_.store(position + 1, std::memory_order_release);
+    return !dropped;
+  }
+
+  // Consumer: dequeues the oldest item into value. Returns false if the queue
+  // is empty.
+  bool TryPop(T& value)
+  {
+    uint64_t position = head_.load(std::memory_order_relaxed);
+    while (true)
+    {
+      Slot& slot = SlotAt(position);
+      const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence != (position + 1))
+      {
+        if (position == tail_.load(std::memory_order_acquire))
+        {
+          return false;
+        }
+        // The producer dropped the item at position, so move past it
+        position = head_.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (head_.compare_exchange_weak(position, position + 1,
+                                      std::memory_order_acq_rel,
+                                      std::memory_order_relaxed))
+      {
+        value = slot.value;
+        slot.sequence.store(position + slots_.size(),
+                            std::memory_order_release);
+        return true;
+      }
+    }
+  }
+};
+}  // namespace lightweight_ur_interface
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+namespace lightweight_ur_interface
+{
+// Ordered mailbox of commands waiting to be sent, which drops commands that
+// a newer command makes redundant. Posting a command replaces the newest
+// pending command if newer.Supersedes(older) returns true for them, and
+// appends it otherwise, so commands that must all be delivered (e.g. mode
+// transitions) keep their order while a burst of streamed commands collapses
+// to the latest one.
+//
+// Command must provide bool Supersedes(const Command& older) const. The
+// mailbox is not thread-safe.
+template<typename Command, typename Allocator=std::allocator<Command>>
+class CoalescingCommandMailbox
+{
+private:
+
+  std::vector<Command, Allocator> pending_;
+  uint64_t num_posted_;
+  uint64_t num_superseded_;
+  uint64_t num_delivered_;
+
+public:
+
+  // Reserves space for reserve_size pending commands, so posting does not
+  // allocate unless more commands than that are pending.
+  explicit CoalescingCommandMailbox(const size_t reserve_size)
+    : num_posted_(0), num_superseded_(0), num_delivered_(0)
+  {
+    pending_.reserve(reserve_size);
+  }
+
+  void Post(const Command& command)
+  {
+    num_posted_++;
+    if ((pending_.size() > 0) && command.Supersedes(pending_.back()))
+    {
+      pending_.back() = command;
+      num_superseded_++;
+    }
+    else
+    {
+      pending_.push_back(command);
+    }
+  }
+
+  // Pending commands, oldest first.
+  inline const std::vector<Command, Allocator>& Pending() const
+  {
+    return pending_;
+  }
+
+  inline bool Empty() const { return pending_.empty(); }
+
+  // Removes all pending commands once they have been sent.
+  void MarkDelivered()
+  {
+    num_delivered_ += pending_.size();
+    pending_.clear();
+  }
+
+  inline uint64_t NumPosted() const { return num_posted_; }
+
+  inline uint64_t NumSuperseded() const { return num_superseded_; }
+
+  inline uint64_t NumDelivered() const { return num_delivered_; }
+};
+}  // namespace lightweight_ur_interface
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <lightweight_ur_interface/coalescing_command_mailbox.hpp>
+
+namespace lightweight_ur_interface
+{
+// Sends commands on a dedicated thread as soon as they are posted, rather
+// than on the next tick of a polling loop. Posted commands wait in a
+// CoalescingCommandMailbox, and the sender thread, woken by a condition
+// variable, passes all pending commands to send_fn in one batch.
+//
+// Batches are spaced at least min_send_spacing seconds apart, so a burst of
+// commands cannot flood the receiver; commands posted while the sender waits
+// out the spacing coalesce in the mailbox. If pace_fn is provided, the sender
+// calls it before taking each batch, so it can hold the batch until a
+// particular send time (e.g. a phase of the robot's control cycle); commands
+// posted meanwhile coalesce the same way. If send_fn returns false, the
+// sender stops sending and Failed() returns true. Start() takes an optional
+// function the sender thread runs before its loop, e.g. to set its
+// scheduling policy.
+template<typename Command, typename Allocator=std::allocator<Command>>
+class CommandSenderThread
+{
+private:
+
+  CoalescingCommandMailbox<Command, Allocator> mailbox_;
+  std::vector<Command, Allocator> sending_;
+  std::function<bool(const std::vector<Command, Allocator>&)> send_fn_;
+  std::function<void(void)> pace_fn_;
+  std::chrono::steady_clock::duration min_send_spacing_;
+  mutable std::mutex mailbox_mutex_;
+  std::condition_variable mailbox_cv_;
+  bool running_;
+  std::atomic<bool> failed_;
+  std::thread sender_thread_;
+
+  void SendLoop(const std::function<void(void)>& thread_setup_fn)
+  {
+    if (thread_setup_fn)
+    {
+      thread_setup_fn();
+    }
+    std::chrono::steady_clock::time_point next_send_time
+        = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mailbox_mutex_);
+    while (true)
+    {
+      mailbox_cv_.wait(lock, [&] ()
+      {
+        return (!mailbox_.Empty() || !running_);
+      });
+      if (mailbox_.Empty())
+      {
+        // Only reached once stopped with nothing left to send
+        break;
+      }
+      if (pace_fn_)
+      {
+        lock.unlock();
+        pace_fn_();
+        lock.lock();
+      }
+      if (std::chrono::steady_clock::now() < next_send_time)
+      {
+        mailbox_cv_.wait_until(lock, next_send_time, [&] ()
+        {
+          return (std::chrono::steady_clock::now() >= next_send_time);
+        });
+      }
+      // Sending happens outside the lock, so posting never waits on the
+      // network. sending_ keeps its capacity between batches.
+      sending_.assign(mailbox_.Pending().begin(), mailbox_.Pending().end());
+      mailbox_.MarkDelivered();
+      lock.unlock();
+      const bool sent = send_fn_(sending_);
+      next_send_time = std::chrono::steady_clock::now() + min_send_spacing_;
+      lock.lock();
+      if (!sent)
+      {
+        failed_.store(true);
+        break;
+      }
+    }
+  }
+
+public:
+
+  CommandSenderThread(
+      const size_t reserve_size, const double min_send_spacing,
+      const std::function<bool(const std::vector<Command, Allocator>&)>&
+          send_fn,
+      const std::function<void(void)>& pace_fn = std::function<void(void)>())
+    : mailbox_(reserve_size), send_fn_(send_fn), pace_fn_(pace_fn),
+      running_(false), failed_(false)
+  {
+    if (min_send_spacing < 0.0)
+    {
+      throw std::invalid_argument("min_send_spacing < 0.0");
+    }
+    sending_.reserve(reserve_size);
+    min_send_spacing_
+        = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(min_send_spacing));
+  }
+
+  ~CommandSenderThread()
+  {
+    Stop();
+  }
+
+  void Start(const std::function<void(void)>& thread_setup_fn
+                 = std::function<void(void)>())
+  {
+    std::lock_guard<std::mutex> lock(mailbox_mutex_);
+    if (!running_ && !sender_thread_.joinable())
+    {
+      running_ = true;
+      sender_thread_ = std::thread(
+          &CommandSenderThread::SendLoop, this, thread_setup_fn);
+    }
+  }
+
+  // Sends any commands still pending, then stops the sender thread.
+  void Stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      running_ = false;
+    }
+    mailbox_cv_.notify_all();
+    if (sender_thread_.joinable())
+    {
+      sender_thread_.join();
+    }
+  }
+
+  void Post(const Command& command)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      mailbox_.Post(command);
+    }
+    mailbox_cv_.notify_one();
+  }
+
+  inline bool Failed() const { return failed_.load(); }
+
+  uint64_t NumPosted() const
+  {
+    std::lock_guard<std::mutex> lock(mailbox_mutex_);
+    return mailbox_.NumPosted();
+  }
+
+  uint64_t NumSuperseded() const
+  {
+    std::lock_guard<std::mutex> lock(mailbox_mutex_);
+    return mailbox_.NumSuperseded();
+  }
+
+  uint64_t NumDelivered() const
+  {
+    std::lock_guard<std::mutex> lock(mailbox_mutex_);
+    return mailbox_.NumDelivered();
+  }
+};
+}  // namespace lightweight_ur_interface
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <string>
 #include <sstream>
 
@@ -8,8 +9,21 @@ namespace lightweight_ur_driver
 inline std::string MakeControlProgram(
     const std::string& our_ip_address, const int32_t control_port,
     const double float_conversion_ratio, const double stop_deceleration,
-    const double speed_acceleration, const double speed_command_wait)
+    const double speed_acceleration, const double speed_command_wait,
+    const double servoj_time, const double servoj_lookahead_time,
+    const double servoj_gain, const int32_t waypoint_buffer_size,
+    const int32_t waypoint_low_water_mark)
 {
+  // URScript lists have a fixed size, so the waypoint ring buffer is declared
+  // as literal lists of zeros
+  std::ostringstream waypoint_list_strm;
+  waypoint_list_strm << "[";
+  for (int32_t idx = 0; idx < waypoint_buffer_size; idx++)
+  {
+    waypoint_list_strm << ((idx > 0) ? ", 0.0" : "0.0");
+  }
+  waypoint_list_strm << "]";
+  const std::string waypoint_list = waypoint_list_strm.str();
   // URScript is whitespace- and indentation-sensitive
   // Do not modify to match C++ style!
   std::ostringstream control_script_strm;
@@ -20,24 +34,32 @@ inline std::string MakeControlProgram(
   control_script_strm << "    STOP_DECELERATION = " + std::to_string(stop_deceleration) + "\n";
   control_script_strm << "    SPEED_ACCELERATION = " + std::to_string(speed_acceleration) + "\n";
   control_script_strm << "    SPEED_COMMAND_WAIT = " + std::to_string(speed_command_wait) + "\n";
+  control_script_strm << "    SERVOJ_TIME = " + std::to_string(servoj_time) + "\n";
+  control_script_strm << "    SERVOJ_LOOKAHEAD_TIME = " + std::to_string(servoj_lookahead_time) + "\n";
+  control_script_strm << "    SERVOJ_GAIN = " + std::to_string(servoj_gain) + "\n";
+  control_script_strm << "    WAYPOINT_BUFFER_SIZE = " + std::to_string(waypoint_buffer_size) + "\n";
+  control_script_strm << "    WAYPOINT_LOW_WATER_MARK = " + std::to_string(waypoint_low_water_mark) + "\n";
+  control_script_strm << "    MICROSECONDS_PER_SECOND = 1000000.0\n";
   control_script_strm << "    MODE_IDLE = 0\n";
   control_script_strm << "    MODE_TEACH = 1\n";
   control_script_strm << "    MODE_SPEEDJ = 2\n";
   control_script_strm << "    MODE_SPEEDL = 3\n";
   control_script_strm << "    MODE_WRENCH = 4\n";
+  control_script_strm << "    MODE_SERVOJ = 5\n";
+  control_script_strm << "    MODE_WAYPOINTS = 6\n";
   control_script_strm << "    MODE_RIGID = 0\n";
   control_script_strm << "    MODE_FORCE = 1\n";
   control_script_strm << "    MODE_DONT_CHANGE = 2\n";
   control_script_strm << "    MODE_KEEP_LIMITS = 3\n";
-  control_script_strm << "    command_speed = [0.0, 0.0, 0.0, 0.0, 0.0, 0.0]\n";
+  control_script_strm << "    command_target = [0.0, 0.0, 0.0, 0.0, 0.0, 0.0]\n";
   control_script_strm << "    command_wrench = [0.0, 0.0, 0.0, 0.0, 0.0, 0.0]\n";
   control_script_strm << "    command_force_mode_limits = [0.0, 0.0, 0.0, 0.0, 0.0, 0.0]\n";
   control_script_strm << "    command_force_mode_selection_vector = [0, 0, 0, 0, 0, 0]\n";
   control_script_strm << "    command_control_mode = MODE_IDLE\n";
   control_script_strm << "    command_force_mode = MODE_RIGID\n";
-  control_script_strm << "    def update_command(new_speed, new_wrench, new_fml, new_fmsv, new_control_mode, new_force_mode):\n";
+  control_script_strm << "    def update_command(new_target, new_wrench, new_fml, new_fmsv, new_control_mode, new_force_mode):\n";
   control_script_strm << "        enter_critical\n";
-  control_script_strm << "        command_speed = new_speed\n";
+  control_script_strm << "        command_target = new_target\n";
   control_script_strm << "        command_wrench = new_wrench\n";
   control_script_strm << "        command_force_mode_limits = new_fml\n";
   control_script_strm << "        command_force_mode_selection_vector = new_fmsv\n";
@@ -45,6 +67,98 @@ inline std::string MakeControlProgram(
   control_script_strm << "        command_force_mode = new_force_mode\n";
   control_script_strm << "        exit_critical\n";
   control_script_strm << "    end\n";
+  // Waypoints are stored as a duration (time since the previous waypoint)
+  // and six joint positions, in parallel lists indexed by ring buffer slot
+  control_script_strm << "    waypoint_durations = " + waypoint_list + "\n";
+  control_script_strm << "    waypoint_q0 = " + waypoint_list + "\n";
+  control_script_strm << "    waypoint_q1 = " + waypoint_list + "\n";
+  control_script_strm << "    waypoint_q2 = " + waypoint_list + "\n";
+  control_script_strm << "    waypoint_q3 = " + waypoint_list + "\n";
+  control_script_strm << "    waypoint_q4 = " + waypoint_list + "\n";
+  control_script_strm << "    waypoint_q5 = " + waypoint_list + "\n";
+  control_script_strm << "    waypoint_read_index = 0\n";
+  control_script_strm << "    waypoint_write_index = 0\n";
+  control_script_strm << "    waypoint_count = 0\n";
+  control_script_strm << "    waypoints_consumed = 0\n";
+  control_script_strm << "    waypoint_report_pending = False\n";
+  control_script_strm << "    waypoint_restart = True\n";
+  control_script_strm << "    waypoint_start = [0.0, 0.0, 0.0, 0.0, 0.0, 0.0]\n";
+  control_script_strm << "    waypoint_setpoint = [0.0, 0.0, 0.0, 0.0, 0.0, 0.0]\n";
+  control_script_strm << "    waypoint_elapsed = 0.0\n";
+  control_script_strm << "    def push_waypoints(params):\n";
+  control_script_strm << "        enter_critical\n";
+  control_script_strm << "        if params[23] == 1:\n";
+  control_script_strm << "            waypoints_consumed = waypoints_consumed + waypoint_count\n";
+  control_script_strm << "            waypoint_count = 0\n";
+  control_script_strm << "            waypoint_read_index = waypoint_write_index\n";
+  control_script_strm << "            waypoint_restart = True\n";
+  control_script_strm << "            waypoint_report_pending = True\n";
+  control_script_strm << "        end\n";
+  control_script_strm << "        i = 0\n";
+  control_script_strm << "        while i < params[22]:\n";
+  control_script_strm << "            if waypoint_count < WAYPOINT_BUFFER_SIZE:\n";
+  control_script_strm << "                base = 1 + (6 * i)\n";
+  control_script_strm << "                waypoint_durations[waypoint_write_index] = params[19 + i] / MICROSECONDS_PER_SECOND\n";
+  control_script_strm << "                waypoint_q0[waypoint_write_index] = params[base] / FLOAT_CONVERSION\n";
+  control_script_strm << "                waypoint_q1[waypoint_write_index] = params[base + 1] / FLOAT_CONVERSION\n";
+  control_script_strm << "                waypoint_q2[waypoint_write_index] = params[base + 2] / FLOAT_CONVERSION\n";
+  control_script_strm << "                waypoint_q3[waypoint_write_index] = params[base + 3] / FLOAT_CONVERSION\n";
+  control_script_strm << "                waypoint_q4[waypoint_write_index] = params[base + 4] / FLOAT_CONVERSION\n";
+  control_script_strm << "                waypoint_q5[waypoint_write_index] = params[base + 5] / FLOAT_CONVERSION\n";
+  control_script_strm << "                waypoint_write_index = waypoint_write_index + 1\n";
+  control_script_strm << "                if waypoint_write_index == WAYPOINT_BUFFER_SIZE:\n";
+  control_script_strm << "                    waypoint_write_index = 0\n";
+  control_script_strm << "                end\n";
+  control_script_strm << "                waypoint_count = waypoint_count + 1\n";
+  control_script_strm << "            end\n";
+  control_script_strm << "            i = i + 1\n";
+  control_script_strm << "        end\n";
+  control_script_strm << "        command_control_mode = MODE_WAYPOINTS\n";
+  control_script_strm << "        command_force_mode = MODE_DONT_CHANGE\n";
+  control_script_strm << "        exit_critical\n";
+  control_script_strm << "    end\n";
+  // Advances through the buffer by one servoj period, interpolating linearly
+  // from the last waypoint reached, and holds position if the buffer runs
+  // dry. Returns the total consumed for the PC to refill from, or -1.
+  control_script_strm << "    def next_waypoint_setpoint(restart):\n";
+  control_script_strm << "        enter_critical\n";
+  control_script_strm << "        if restart or waypoint_restart:\n";
+  control_script_strm << "            waypoint_start = get_target_joint_positions()\n";
+  control_script_strm << "            waypoint_elapsed = 0.0\n";
+  control_script_strm << "            waypoint_restart = False\n";
+  control_script_strm << "        end\n";
+  control_script_strm << "        waypoint_setpoint = waypoint_start\n";
+  control_script_strm << "        if waypoint_count > 0:\n";
+  control_script_strm << "            idx = waypoint_read_index\n";
+  control_script_strm << "            waypoint_elapsed = waypoint_elapsed + SERVOJ_TIME\n";
+  control_script_strm << "            if waypoint_elapsed >= waypoint_durations[idx]:\n";
+  control_script_strm << "                waypoint_elapsed = waypoint_elapsed - waypoint_durations[idx]\n";
+  control_script_strm << "                waypoint_start = [waypoint_q0[idx], waypoint_q1[idx], waypoint_q2[idx], waypoint_q3[idx], waypoint_q4[idx], waypoint_q5[idx]]\n";
+  control_script_strm << "                waypoint_setpoint = waypoint_start\n";
+  control_script_strm << "                waypoint_read_index = idx + 1\n";
+  control_script_strm << "                if waypoint_read_index == WAYPOINT_BUFFER_SIZE:\n";
+  control_script_strm << "                    waypoint_read_index = 0\n";
+  control_script_strm << "                end\n";
+  control_script_strm << "                waypoint_count = waypoint_count - 1\n";
+  control_script_strm << "                waypoints_consumed = waypoints_consumed + 1\n";
+  control_script_strm << "                if waypoint_count <= WAYPOINT_LOW_WATER_MARK:\n";
+  control_script_strm << "                    waypoint_report_pending = True\n";
+  control_script_strm << "                end\n";
+  control_script_strm << "            else:\n";
+  control_script_strm << "                alpha = waypoint_elapsed / waypoint_durations[idx]\n";
+  control_script_strm << "                waypoint_setpoint = [waypoint_start[0] + (alpha * (waypoint_q0[idx] - waypoint_start[0])), waypoint_start[1] + (alpha * (waypoint_q1[idx] - waypoint_start[1])), waypoint_start[2] + (alpha * (waypoint_q2[idx] - waypoint_start[2])), waypoint_start[3] + (alpha * (waypoint_q3[idx] - waypoint_start[3])), waypoint_start[4] + (alpha * (waypoint_q4[idx] - waypoint_start[4])), waypoint_start[5] + (alpha * (waypoint_q5[idx] - waypoint_start[5]))]\n";
+  control_script_strm << "            end\n";
+  control_script_strm << "        else:\n";
+  control_script_strm << "            waypoint_elapsed = 0.0\n";
+  control_script_strm << "        end\n";
+  control_script_strm << "        report = -1\n";
+  control_script_strm << "        if waypoint_report_pending:\n";
+  control_script_strm << "            report = waypoints_consumed\n";
+  control_script_strm << "            waypoint_report_pending = False\n";
+  control_script_strm << "        end\n";
+  control_script_strm << "        exit_critical\n";
+  control_script_strm << "        return report\n";
+  control_script_strm << "    end\n";
   control_script_strm << "    thread command_thread():\n";
   control_script_strm << "        active_force_mode_limits = [0.0, 0.0, 0.0, 0.0, 0.0, 0.0]\n";
   control_script_strm << "        active_force_mode_selection_vector = [0, 0, 0, 0, 0, 0]\n";
@@ -52,7 +166,7 @@ inline std::string MakeControlProgram(
   control_script_strm << "        active_force_mode = MODE_RIGID\n";
   control_script_strm << "        while True:\n";
   control_script_strm << "            enter_critical\n";
-  control_script_strm << "            cmd_speed = command_speed\n";
+  control_script_strm << "            cmd_target = command_target\n";
   control_script_strm << "            cmd_wrench = command_wrench\n";
   control_script_strm << "            cmd_force_mode_limits = command_force_mode_limits\n";
   control_script_strm << "            cmd_force_mode_selection_vector = command_force_mode_selection_vector\n";
@@ -86,13 +200,23 @@ inline std::string MakeControlProgram(
   control_script_strm << "            end\n";
   control_script_strm << "            if cmd_control_mode == MODE_SPEEDJ:\n";
   control_script_strm << "                active_control_mode = MODE_SPEEDJ\n";
-  control_script_strm << "                speedj(cmd_speed, SPEED_ACCELERATION, SPEED_COMMAND_WAIT)\n";
+  control_script_strm << "                speedj(cmd_target, SPEED_ACCELERATION, SPEED_COMMAND_WAIT)\n";
   control_script_strm << "            elif cmd_control_mode == MODE_SPEEDL:\n";
   control_script_strm << "                active_control_mode = MODE_SPEEDL\n";
-  control_script_strm << "                speedl(cmd_speed, SPEED_ACCELERATION, SPEED_COMMAND_WAIT)\n";
+  control_script_strm << "                speedl(cmd_target, SPEED_ACCELERATION, SPEED_COMMAND_WAIT)\n";
+  control_script_strm << "            elif cmd_control_mode == MODE_SERVOJ:\n";
+  control_script_strm << "                active_control_mode = MODE_SERVOJ\n";
+  control_script_strm << "                servoj(cmd_target, 0, 0, SERVOJ_TIME, SERVOJ_LOOKAHEAD_TIME, SERVOJ_GAIN)\n";
+  control_script_strm << "            elif cmd_control_mode == MODE_WAYPOINTS:\n";
+  control_script_strm << "                consumed_report = next_waypoint_setpoint(active_control_mode != MODE_WAYPOINTS)\n";
+  control_script_strm << "                active_control_mode = MODE_WAYPOINTS\n";
+  control_script_strm << "                servoj(waypoint_setpoint, 0, 0, SERVOJ_TIME, SERVOJ_LOOKAHEAD_TIME, SERVOJ_GAIN)\n";
+  control_script_strm << "                if consumed_report >= 0:\n";
+  control_script_strm << "                    socket_send_int(consumed_report)\n";
+  control_script_strm << "                end\n";
 //  control_script_strm << "            elif cmd_control_mode == MODE_WRENCH:\n";
 //  control_script_strm << "                active_control_mode = MODE_WRENCH\n";
-//  control_script_strm << "                speedl(cmd_speed, SPEED_ACCELERATION, SPEED_COMMAND_WAIT)\n";
+//  control_script_strm << "                speedl(cmd_target, SPEED_ACCELERATION, SPEED_COMMAND_WAIT)\n";
   control_script_strm << "            else:\n";
   control_script_strm << "                sync()\n";
   control_script_strm << "            end\n";
@@ -105,15 +229,17 @@ inline std::string MakeControlProgram(
   control_script_strm << "        params = socket_read_binary_integer(6 + 6 + 6 + 6 + 3)\n";
   control_script_strm << "        valid_data = params[0]\n";
   control_script_strm << "        if valid_data > 0:\n";
-  control_script_strm << "            recv_speed = [params[1] / FLOAT_CONVERSION, params[2] / FLOAT_CONVERSION, params[3] / FLOAT_CONVERSION, params[4] / FLOAT_CONVERSION, params[5] / FLOAT_CONVERSION, params[6] / FLOAT_CONVERSION]\n";
+  control_script_strm << "            recv_target = [params[1] / FLOAT_CONVERSION, params[2] / FLOAT_CONVERSION, params[3] / FLOAT_CONVERSION, params[4] / FLOAT_CONVERSION, params[5] / FLOAT_CONVERSION, params[6] / FLOAT_CONVERSION]\n";
   control_script_strm << "            recv_wrench = [params[7] / FLOAT_CONVERSION, params[8] / FLOAT_CONVERSION, params[9] / FLOAT_CONVERSION, params[10] / FLOAT_CONVERSION, params[11] / FLOAT_CONVERSION, params[12] / FLOAT_CONVERSION]\n";
   control_script_strm << "            recv_force_mode_limits = [params[13] / FLOAT_CONVERSION, params[14] / FLOAT_CONVERSION, params[15] / FLOAT_CONVERSION, params[16] / FLOAT_CONVERSION, params[17] / FLOAT_CONVERSION, params[18] / FLOAT_CONVERSION]\n";
   control_script_strm << "            recv_force_mode_selection_vector = [params[19], params[20], params[21], params[22], params[23], params[24]]\n";
   control_script_strm << "            recv_control_mode = params[25]\n";
   control_script_strm << "            recv_force_mode = params[26]\n";
   control_script_strm << "            recv_running = params[27]\n";
-  control_script_strm << "            if recv_running == 1:\n";
-  control_script_strm << "                update_command(recv_speed, recv_wrench, recv_force_mode_limits, recv_force_mode_selection_vector, recv_control_mode, recv_force_mode)\n";
+  control_script_strm << "            if (recv_running == 1) and (recv_control_mode == MODE_WAYPOINTS):\n";
+  control_script_strm << "                push_waypoints(params)\n";
+  control_script_strm << "            elif recv_running == 1:\n";
+  control_script_strm << "                update_command(recv_target, recv_wrench, recv_force_mode_limits, recv_force_mode_selection_vector, recv_control_mode, recv_force_mode)\n";
   control_script_strm << "            else:\n";
   control_script_strm << "                update_command([0.0, 0.0, 0.0, 0.0, 0.0, 0.0], [0.0, 0.0, 0.0, 0.0, 0.0, 0.0], [0.0, 0.0, 0.0, 0.0, 0.0, 0.0], [0, 0, 0, 0, 0, 0], MODE_IDLE, MODE_RIGID)\n";
   control_script_strm << "            end\n";
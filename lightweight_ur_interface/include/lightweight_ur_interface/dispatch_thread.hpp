@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <lightweight_ur_interface/bounded_spsc_queue.hpp>
+
+namespace lightweight_ur_interface
+{
+// Hands items from a latency-sensitive producer thread (e.g. the robot recv
+// thread) to handler_fn on a dedicated thread, so that slow handlers such as
+// ROS message construction and publishing never delay the producer. Items
+// pass through a BoundedSpscQueue, which drops the oldest items if the
+// handler falls behind, and the dispatch thread sleeps on an eventfd while
+// the queue is empty. Start() takes an optional function the dispatch thread
+// runs before its loop, e.g. to set its scheduling policy.
+template<typename T, typename Allocator = std::allocator<T>>
+class DispatchThread
+{
+private:
+
+  BoundedSpscQueue<T, Allocator> queue_;
+  std::function<void(const T&)> handler_fn_;
+  int wake_fd_;
+  std::atomic<bool> running_;
+  std::thread dispatch_thread_;
+
+  void Wake()
+  {
+    const uint64_t increment = 1;
+    const ssize_t written = write(wake_fd_, &increment, sizeof(increment));
+    // The only possible failure is counter overflow, which still wakes
+    static_cast<void>(written);
+  }
+
+  void DispatchLoop(const std::function<void(void)>& thread_setup_fn)
+  {
+    if (thread_setup_fn)
+    {
+      thread_setup_fn();
+    }
+    // The item lives on this thread's stack, which is suitably aligned for
+    // types with fixed-size Eigen members
+    T item;
+    while (running_.load())
+    {
+      uint64_t wakeups = 0;
+      const ssize_t read_size = read(wake_fd_, &wakeups, sizeof(wakeups));
+      if ((read_size < 0) && (errno != EINTR))
+      {
+        throw std::runtime_error("Failed to read dispatch eventfd");
+      }
+      while (queue_.TryPop(item))
+      {
+        handler_fn_(item);
+      }
+    }
+  }
+
+public:
+
+  DispatchThread(const size_t capacity,
+                 const std::function<void(const T&)>& handler_fn)
+    : queue_(capacity), handler_fn_(handler_fn)
+  {
+    running_.store(false);
+    wake_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd_ < 0)
+    {
+      throw std::runtime_error("Failed to create dispatch eventfd");
+    }
+  }
+
+  ~DispatchThread()
+  {
+    Stop();
+    close(wake_fd_);
+  }
+
+  void Start(const std::function<void(void)>& thread_setup_fn
+                 = std::function<void(void)>())
+  {
+    if (!running_.load())
+    {
+      running_.store(true);
+      dispatch_thread_ = std::thread(
+          &DispatchThread::DispatchLoop, this, thread_setup_fn);
+    }
+  }
+
+  void Stop()
+  {
+    if (running_.load())
+    {
+      running_.store(false);
+      Wake();
+      dispatch_thread_.join();
+    }
+  }
+
+  // Called from the producer thread; never blocks. Returns false if an item
+  // was dropped because the handler is not keeping up.
+  bool Dispatch(const T& item)
+  {
+    const bool queued_without_drop = queue_.Push(item);
+    Wake();
+    return queued_without_drop;
+  }
+
+  inline uint64_t DroppedCount() const { return queue_.DroppedCount(); }
+};
+}  // namespace lightweight_ur_interface
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <atomic>
+
+namespace lightweight_ur_interface
+{
+// Wait-free single-producer single-consumer channel holding the most recently
+// published value, implemented as a triple buffer. The producer fills its
+// private write buffer and publishes it by swapping it with the shared middle
+// buffer; the consumer takes the middle buffer by swapping it with its private
+// read buffer. Neither side ever blocks or copies the other side's buffer, so
+// a slow consumer cannot delay the producer, and the consumer always sees a
+// complete value. Intermediate values are overwritten if the consumer does not
+// keep up.
+//
+// Each published value is tagged with a sequence number, starting at 1 and
+// increasing by one per publish, so the consumer can detect stale or skipped
+// values. A sequence number of 0 means that nothing has been published yet.
+template<typename T>
+class LatestValueChannel
+{
+private:
+
+  static constexpr uint8_t kIndexMask = 0x03;
+  static constexpr uint8_t kFreshFlag = 0x04;
+
+  struct Slot
+  {
+    T value;
+    uint64_t sequence = 0;
+  };
+
+  std::array<Slot, 3> slots_;
+  // Index of the middle buffer, plus kFreshFlag if it holds a value that the
+  // consumer has not taken yet
+  std::atomic<uint8_t> middle_state_;
+  // Owned by the producer
+  uint8_t write_index_;
+  uint64_t published_sequence_;
+  // Owned by the consumer
+  uint8_t read_index_;
+
+public:
+
+  LatestValueChannel()
+    : middle_state_(1), write_index_(0), published_sequence_(0),
+      read_index_(2) {}
+
+  // Producer: the buffer to fill before calling Publish().
+  inline T& WriteBuffer() { return slots_[write_index_].value; }
+
+  // Producer: publishes the write buffer, returning its sequence number.
+  uint64_t Publish()
+  {
+    published_sequence_++;
+    slots_[write_index_].sequence = published_sequence_;
+    const uint8_t previous_middle_state = middle_state_.exchange(
+        static_cast<uint8_t>(write_index_ | kFreshFlag),
+        std::memory_order_acq_rel);
+    write_index_ = static_cast<uint8_t>(previous_middle_state & kIndexMask);
+    return published_sequence_;
+  }
+
+  // Producer: copies value into the write buffer and publishes it.
+  uint64_t Publish(const T& value)
+  {
+    WriteBuffer() = value;
+    return Publish();
+  }
+
+  // Consumer: takes the most recently published value, if there is one newer
+  // than the current read buffer. Returns true if the read buffer changed.
+  bool Update()
+  {
+    if ((middle_state_.load(std::memory_order_acquire) & kFreshFlag) == 0)
+    {
+      return false;
+    }
+    const uint8_t previous_middle_state
+        = middle_state_.exchange(read_index_, std::memory_order_acq_rel);
+    read_index_ = static_cast<uint8_t>(previous_middle_state & kIndexMask);
+    return true;
+  }
+
+  // Consumer: the value taken by the last call to Update().
+  inline const T& Latest() const { return slots_[read_index_].value; }
+
+  // Consumer: sequence number of Latest(), or 0 if nothing was taken yet.
+  inline uint64_t LatestSequence() const
+  {
+    return slots_[read_index_].sequence;
+  }
+};
+}  // namespace lightweight_ur_interface
@@ -0,0 +1,662 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <memory>
+#include <vector>
+#include <map>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <Eigen/Geometry>
+#include <time.h>
+#include <chrono>
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <std_srvs/Empty.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <geometry_msgs/TwistStamped.h>
+#include <common_robotics_utilities/print.hpp>
+#include <common_robotics_utilities/math.hpp>
+#include <common_robotics_utilities/ros_conversions.hpp>
+#include <lightweight_ur_interface/ur_robot_config.hpp>
+#include <lightweight_ur_interface/ur_shared_memory_channel.hpp>
+#include <lightweight_ur_interface/ur_controller_plugin.hpp>
+#include <lightweight_ur_interface/dispatch_thread.hpp>
+#include <lightweight_ur_interface/latest_value_channel.hpp>
+
+namespace lightweight_ur_interface
+{
+using common_robotics_utilities::utility::ClampValue;
+using common_robotics_utilities::ros_conversions::GeometryPoseToEigenIsometry3d;
+
+class URCartesianController : public URControllerPlugin
+{
+private:
+
+  typedef Eigen::Matrix<double, 6, 1> Twist;
+
+  static constexpr size_t IN_PROCESS_PUBLISH_QUEUE_CAPACITY = 16;
+
+  // Latest target from the callback thread if run in process. Aborts are
+  // counted, so that one followed by a new target before the next Update()
+  // is not lost.
+  struct InProcessTarget
+  {
+    bool valid;
+    uint64_t num_aborts;
+    Eigen::Isometry3d target_pose;
+  };
+
+  std::vector<PIDParams> axis_controller_parameters_;
+  std::vector<double> axis_velocity_limits_;
+  std::string pose_frame_;
+  std::string twist_frame_;
+
+  bool target_pose_valid_;
+  bool current_pose_valid_;
+  // Set by each valid state feedback message, cleared by each state-triggered
+  // controller step
+  bool new_state_feedback_;
+  Eigen::Isometry3d target_pose_;
+  Eigen::Isometry3d current_pose_;
+
+  Twist pose_error_integral_;
+  Twist last_pose_error_;
+
+  // Exchanges state and twist commands with the hardware interface through
+  // shared memory instead of topics, if enabled. Shared memory state is in
+  // the hardware interface's base frame, so pose_frame_ must be that frame,
+  // and twists are commanded in it or in the tool frame.
+  std::unique_ptr<URSharedMemoryClient> shared_memory_ptr_;
+  // Set if run by the hardware interface, which takes the latest command
+  // from each Update(). State is then also in the base frame.
+  bool in_process_;
+  bool in_process_command_valid_;
+  URSharedCommand in_process_command_;
+  // Queues target and abort callbacks for the spinner thread if run in
+  // process, so they never run on the thread that runs Update(). Declared
+  // before nh_, which uses it.
+  ros::CallbackQueue in_process_callback_queue_;
+  // Hands targets and aborts from the spinner thread to Update()
+  LatestValueChannel<InProcessTarget> in_process_target_channel_;
+  // Aborts requested by callbacks, only used by the spinner thread
+  uint64_t in_process_num_aborts_requested_;
+  // Aborts applied by Update()
+  uint64_t in_process_num_aborts_applied_;
+
+  ros::NodeHandle nh_;
+  ros::Publisher command_pub_;
+  ros::Subscriber feedback_sub_;
+  ros::Subscriber pose_target_sub_;
+  ros::ServiceServer abort_server_;
+  // Builds and publishes mirrored commands if run in process, so the thread
+  // that runs Update() never does. Declared after the publisher it uses.
+  std::unique_ptr<DispatchThread<URSharedCommand>> in_process_publisher_ptr_;
+  // Runs callbacks if run in process. Declared last, so that it is stopped
+  // before anything its callbacks use is destroyed.
+  std::unique_ptr<ros::AsyncSpinner> in_process_spinner_ptr_;
+
+public:
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  URCartesianController(const ros::NodeHandle& nh,
+                        const std::string& pose_frame,
+                        const std::string& twist_frame,
+                        const std::string& target_pose_topic,
+                        const std::string& pose_feedback_topic,
+                        const std::string& twist_command_topic,
+                        const std::string& abort_service,
+                        const std::string& shared_memory_name,
+                        const bool in_process,
+                        const std::vector<PIDParams>&
+                          axis_controller_parameters,
+                        const std::vector<double>& axis_velocity_limits)
+    : nh_(nh)
+  {
+    pose_error_integral_ = Twist::Zero();
+    last_pose_error_ = Twist::Zero();
+    target_pose_valid_ = false;
+    current_pose_valid_ = false;
+    new_state_feedback_ = false;
+    in_process_ = in_process;
+    in_process_command_valid_ = false;
+    in_process_num_aborts_requested_ = 0;
+    in_process_num_aborts_applied_ = 0;
+    target_pose_ = Eigen::Isometry3d::Identity();
+    current_pose_ = Eigen::Isometry3d::Identity();
+    if (axis_controller_parameters.size() != 6)
+    {
+      throw std::invalid_argument(
+            "Number of provided axis controller parameters != 6");
+    }
+    axis_controller_parameters_ = axis_controller_parameters;
+    if (axis_velocity_limits.size() != 6)
+    {
+      throw std::invalid_argument(
+            "Number of provided axis effort limits != 6");
+    }
+    axis_velocity_limits_ = axis_velocity_limits;
+    pose_frame_ = pose_frame;
+    twist_frame_ = twist_frame;
+    if (in_process_)
+    {
+      ROS_INFO("Running in process with the hardware interface");
+      nh_.setCallbackQueue(&in_process_callback_queue_);
+    }
+    else if (!shared_memory_name.empty())
+    {
+      ROS_INFO("Exchanging state and twist commands through shared memory %s",
+               shared_memory_name.c_str());
+      shared_memory_ptr_ = std::unique_ptr<URSharedMemoryClient>(
+          new URSharedMemoryClient(shared_memory_name,
+                                   [] (const std::string& message)
+      {
+        ROS_INFO("%s", message.c_str());
+      }));
+    }
+    else
+    {
+      feedback_sub_
+          = nh_.subscribe(pose_feedback_topic,
+                          1,
+                          &URCartesianController::PoseFeedbackCallback,
+                          this);
+    }
+    // Commands that go to the hardware interface directly are still
+    // published for introspection, but on a topic of their own, as the
+    // hardware interface would execute them again from its command topic
+    const std::string command_topic
+        = (in_process_ || !shared_memory_name.empty())
+          ? twist_command_topic + "_mirror" : twist_command_topic;
+    command_pub_ = nh_.advertise<geometry_msgs::TwistStamped>(command_topic,
+                                                             1,
+                                                             false);
+    pose_target_sub_ = nh_.subscribe(target_pose_topic,
+                                     1,
+                                     &URCartesianController::PoseTargetCallback,
+                                     this);
+    abort_server_ = nh_.advertiseService(abort_service,
+                                         &URCartesianController::AbortCB,
+                                         this);
+    if (in_process_)
+    {
+      in_process_publisher_ptr_
+          = std::unique_ptr<DispatchThread<URSharedCommand>>(
+              new DispatchThread<URSharedCommand>(
+                  IN_PROCESS_PUBLISH_QUEUE_CAPACITY,
+                  [this] (const URSharedCommand& shared_command)
+      {
+        PublishInProcess(shared_command);
+      }));
+      in_process_publisher_ptr_->Start();
+      in_process_spinner_ptr_ = std::unique_ptr<ros::AsyncSpinner>(
+          new ros::AsyncSpinner(1, &in_process_callback_queue_));
+      in_process_spinner_ptr_->start();
+    }
+  }
+
+  // Handles callbacks as they arrive, for up to timeout seconds, until a new
+  // state feedback message has been received. Returns false if none arrived.
+  bool WaitForStateFeedback(const double timeout)
+  {
+    if (shared_memory_ptr_)
+    {
+      // Wait on shared memory, and handle other callbacks once per state
+      URSharedState shared_state;
+      const bool received
+          = shared_memory_ptr_->WaitForNewState(timeout, shared_state);
+      ros::getGlobalCallbackQueue()->callAvailable();
+      if (received)
+      {
+        SharedStateFeedback(shared_state);
+      }
+      return received;
+    }
+    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(timeout));
+    const bool received = new_state_feedback_;
+    new_state_feedback_ = false;
+    return received;
+  }
+
+  void Loop(const double control_rate, const bool state_triggered)
+  {
+    const double control_interval = 1.0 / control_rate;
+    ros::Rate spin_rate(control_rate);
+    const uint8_t supersample_rate = 0x01;
+    uint8_t iteration_count = 0x01;
+    while (ros::ok())
+    {
+      // Process callbacks
+      if (state_triggered)
+      {
+        // Step once per state feedback message, as soon as it arrives, so
+        // that commands keep a fixed phase relative to the robot's cycle
+        if (!WaitForStateFeedback(control_interval))
+        {
+          continue;
+        }
+      }
+      else
+      {
+        ros::spinOnce();
+        URSharedState shared_state;
+        if (shared_memory_ptr_
+            && shared_memory_ptr_->ReadNewState(shared_state))
+        {
+          SharedStateFeedback(shared_state);
+        }
+      }
+      // Run controller
+      if (iteration_count == supersample_rate)
+      {
+        Step(control_interval);
+        iteration_count = 0x01;
+      }
+      else
+      {
+        iteration_count++;
+      }
+      // Spin
+      if (!state_triggered)
+      {
+        spin_rate.sleep();
+      }
+    }
+  }
+
+  // Takes the latest target and aborts from the spinner thread, then steps
+  // once
+  virtual bool Update(const URSharedState& state,
+                      const double control_interval,
+                      URSharedCommand& command)
+  {
+    in_process_command_valid_ = false;
+    TakeInProcessTarget();
+    SharedStateFeedback(state);
+    Step(control_interval);
+    if (in_process_command_valid_)
+    {
+      command = in_process_command_;
+    }
+    return in_process_command_valid_;
+  }
+
+  // Runs the controller once, from the latest pose and target
+  void Step(const double control_interval)
+  {
+    if (target_pose_valid_ && current_pose_valid_)
+    {
+      const Twist raw_pose_correction
+          = ComputeRawNextStep(current_pose_, target_pose_, control_interval);
+      const Twist real_pose_correction
+          = LimitCorrectionTwist(raw_pose_correction);
+      CommandTwist(real_pose_correction, twist_frame_);
+    }
+  }
+
+  inline bool AbortCB(std_srvs::Empty::Request& req,
+                      std_srvs::Empty::Response& res)
+  {
+    UNUSED(req);
+    UNUSED(res);
+    ROS_INFO("Aborting pose target");
+    if (in_process_)
+    {
+      in_process_num_aborts_requested_++;
+      PublishInProcessTarget(false, Eigen::Isometry3d::Identity());
+    }
+    else
+    {
+      Abort();
+    }
+    return true;
+  }
+
+  inline void Abort()
+  {
+    const Twist stop_twist = Twist::Zero();
+    CommandTwist(stop_twist, twist_frame_);
+    target_pose_valid_ = false;
+    pose_error_integral_ = Twist::Zero();
+    last_pose_error_ = Twist::Zero();
+  }
+
+  // Called from the spinner thread with each target or abort
+  inline void PublishInProcessTarget(const bool valid,
+                                     const Eigen::Isometry3d& target_pose)
+  {
+    InProcessTarget& target = in_process_target_channel_.WriteBuffer();
+    target.valid = valid;
+    target.num_aborts = in_process_num_aborts_requested_;
+    target.target_pose = target_pose;
+    in_process_target_channel_.Publish();
+  }
+
+  // Called from Update() to apply the latest target and any aborts
+  inline void TakeInProcessTarget()
+  {
+    if (in_process_target_channel_.Update())
+    {
+      const InProcessTarget& target = in_process_target_channel_.Latest();
+      if (target.num_aborts != in_process_num_aborts_applied_)
+      {
+        in_process_num_aborts_applied_ = target.num_aborts;
+        Abort();
+      }
+      if (target.valid)
+      {
+        target_pose_ = target.target_pose;
+      }
+      target_pose_valid_ = target.valid;
+    }
+  }
+
+  inline void SetTargetPose(const bool valid,
+                            const Eigen::Isometry3d& target_pose)
+  {
+    if (in_process_)
+    {
+      PublishInProcessTarget(valid, target_pose);
+    }
+    else
+    {
+      if (valid)
+      {
+        target_pose_ = target_pose;
+      }
+      target_pose_valid_ = valid;
+    }
+  }
+
+  inline Twist ComputeNewPoseErrorIntegral(
+      const Twist& raw_pose_error_integral) const
+  {
+    Twist limited_pose_error_integral;
+    limited_pose_error_integral(0)
+        = ClampValue(raw_pose_error_integral(0),
+                     -axis_controller_parameters_[0].Iclamp(),
+                      axis_controller_parameters_[0].Iclamp());
+    limited_pose_error_integral(1)
+        = ClampValue(raw_pose_error_integral(1),
+                     -axis_controller_parameters_[1].Iclamp(),
+                      axis_controller_parameters_[1].Iclamp());
+    limited_pose_error_integral(2)
+        = ClampValue(raw_pose_error_integral(2),
+                     -axis_controller_parameters_[2].Iclamp(),
+                      axis_controller_parameters_[2].Iclamp());
+    limited_pose_error_integral(3)
+        = ClampValue(raw_pose_error_integral(3),
+                     -axis_controller_parameters_[3].Iclamp(),
+                      axis_controller_parameters_[3].Iclamp());
+    limited_pose_error_integral(4)
+        = ClampValue(raw_pose_error_integral(4),
+                     -axis_controller_parameters_[4].Iclamp(),
+                      axis_controller_parameters_[4].Iclamp());
+    limited_pose_error_integral(5)
+        = ClampValue(raw_pose_error_integral(5),
+                     -axis_controller_parameters_[5].Iclamp(),
+                      axis_controller_parameters_[5].Iclamp());
+    return limited_pose_error_integral;
+  }
+
+  inline Twist ComputePoseError(const Eigen::Isometry3d& current_pose,
+                                const Eigen::Isometry3d& target_pose) const
+  {
+    return common_robotics_utilities::math::TwistBetweenTransforms(current_pose,
+                                                           target_pose);
+  }
+
+  inline Twist ComputeRawNextStep(const Eigen::Isometry3d& current_pose,
+                                  const Eigen::Isometry3d& target_pose,
+                                  const double time_interval)
+  {
+    // Compute the pose error in our 'world frame'
+    const Twist pose_error = ComputePoseError(current_pose, target_pose);
+    // Compute the integral of pose error & update the stored value
+    pose_error_integral_
+        = ComputeNewPoseErrorIntegral(pose_error_integral_
+                                      + (pose_error * time_interval));
+    // Compute the derivative of pose error
+    const Twist pose_error_derivative
+        = (pose_error - last_pose_error_) / time_interval;
+    // Update the stored pose error
+    last_pose_error_ = pose_error;
+    // Convert pose errors into cartesian velocity
+    Twist raw_pose_correction;
+    raw_pose_correction(0)
+        = (pose_error(0) * axis_controller_parameters_[0].Kp())
+          + (pose_error_integral_(0) * axis_controller_parameters_[0].Ki())
+          + (pose_error_derivative(0) * axis_controller_parameters_[0].Kd());
+    raw_pose_correction(1)
+        = (pose_error(1) * axis_controller_parameters_[1].Kp())
+          + (pose_error_integral_(1) * axis_controller_parameters_[1].Ki())
+          + (pose_error_derivative(1) * axis_controller_parameters_[1].Kd());
+    raw_pose_correction(2)
+        = (pose_error(2) * axis_controller_parameters_[2].Kp())
+          + (pose_error_integral_(2) * axis_controller_parameters_[2].Ki())
+          + (pose_error_derivative(2) * axis_controller_parameters_[2].Kd());
+    raw_pose_correction(3)
+        = (pose_error(3) * axis_controller_parameters_[3].Kp())
+          + (pose_error_integral_(3) * axis_controller_parameters_[3].Ki())
+          + (pose_error_derivative(3) * axis_controller_parameters_[3].Kd());
+    raw_pose_correction(4)
+        = (pose_error(4) * axis_controller_parameters_[4].Kp())
+          + (pose_error_integral_(4) * axis_controller_parameters_[4].Ki())
+          + (pose_error_derivative(4) * axis_controller_parameters_[4].Kd());
+    raw_pose_correction(5)
+        = (pose_error(5) * axis_controller_parameters_[5].Kp())
+          + (pose_error_integral_(5) * axis_controller_parameters_[5].Ki())
+          + (pose_error_derivative(5) * axis_controller_parameters_[5].Kd());
+    return raw_pose_correction;
+  }
+
+  inline Twist LimitCorrectionTwist(const Twist& raw_twist) const
+  {
+    Twist limited_twist;
+    limited_twist(0) = ClampValue(raw_twist(0),
+                                  -axis_velocity_limits_[0],
+                                  axis_velocity_limits_[0]);
+    limited_twist(1) = ClampValue(raw_twist(1),
+                                  -axis_velocity_limits_[1],
+                                  axis_velocity_limits_[1]);
+    limited_twist(2) = ClampValue(raw_twist(2),
+                                  -axis_velocity_limits_[2],
+                                  axis_velocity_limits_[2]);
+    limited_twist(3) = ClampValue(raw_twist(3),
+                                  -axis_velocity_limits_[3],
+                                  axis_velocity_limits_[3]);
+    limited_twist(4) = ClampValue(raw_twist(4),
+                                  -axis_velocity_limits_[4],
+                                  axis_velocity_limits_[4]);
+    limited_twist(5) = ClampValue(raw_twist(5),
+                                  -axis_velocity_limits_[5],
+                                  axis_velocity_limits_[5]);
+    return limited_twist;
+  }
+
+  inline void CommandTwist(const Twist& command, const std::string& frame)
+  {
+    if (in_process_ || shared_memory_ptr_)
+    {
+      URSharedCommand shared_command;
+      shared_command.type = (frame == pose_frame_) ? kSharedCommandSpeedLBase
+                                                   : kSharedCommandSpeedLTool;
+      shared_command.reserved = 0;
+      std::copy(command.data(), command.data() + 6,
+                shared_command.values.begin());
+      if (in_process_)
+      {
+        in_process_command_ = shared_command;
+        in_process_command_valid_ = true;
+        in_process_publisher_ptr_->Dispatch(shared_command);
+      }
+      else if (!shared_memory_ptr_->PostCommand(shared_command))
+      {
+        ROS_WARN_THROTTLE(1.0, "Failed to post shared memory command");
+      }
+    }
+    // Mirrored commands are only built if someone is listening. In process,
+    // the publisher thread builds them.
+    if (!in_process_
+        && (!shared_memory_ptr_ || (command_pub_.getNumSubscribers() > 0)))
+    {
+      PublishCommandMessage(command, frame);
+    }
+  }
+
+  inline void PublishCommandMessage(const Twist& command,
+                                    const std::string& frame)
+  {
+    geometry_msgs::TwistStamped command_msg;
+    command_msg.header.frame_id = frame;
+    command_msg.header.stamp = ros::Time::now();
+    command_msg.twist.linear.x = command(0, 0);
+    command_msg.twist.linear.y = command(1, 0);
+    command_msg.twist.linear.z = command(2, 0);
+    command_msg.twist.angular.x = command(3, 0);
+    command_msg.twist.angular.y = command(4, 0);
+    command_msg.twist.angular.z = command(5, 0);
+    command_pub_.publish(command_msg);
+  }
+
+  // Called from the in process publisher thread
+  inline void PublishInProcess(const URSharedCommand& shared_command)
+  {
+    if (command_pub_.getNumSubscribers() > 0)
+    {
+      Twist command;
+      std::copy(shared_command.values.begin(), shared_command.values.end(),
+                command.data());
+      const std::string& frame
+          = (shared_command.type == kSharedCommandSpeedLBase) ? pose_frame_
+                                                              : twist_frame_;
+      PublishCommandMessage(command, frame);
+    }
+  }
+
+  inline void PoseTargetCallback(geometry_msgs::PoseStamped target_pose)
+  {
+    if (target_pose.header.frame_id == pose_frame_)
+    {
+      ROS_INFO("Starting execution to a new target pose");
+      SetTargetPose(true, GeometryPoseToEigenIsometry3d(target_pose.pose));
+    }
+    else
+    {
+      ROS_WARN("Invalid target pose frame %s, should be %s",
+               target_pose.header.frame_id.c_str(), pose_frame_.c_str());
+      SetTargetPose(false, Eigen::Isometry3d::Identity());
+    }
+  }
+
+  inline void SharedStateFeedback(const URSharedState& shared_state)
+  {
+    const Eigen::Translation3d tcp_position(shared_state.tcp_position[0],
+                                            shared_state.tcp_position[1],
+                                            shared_state.tcp_position[2]);
+    const Eigen::Quaterniond tcp_orientation(shared_state.tcp_orientation[3],
+                                             shared_state.tcp_orientation[0],
+                                             shared_state.tcp_orientation[1],
+                                             shared_state.tcp_orientation[2]);
+    current_pose_ = tcp_position * tcp_orientation;
+    current_pose_valid_ = true;
+  }
+
+  inline void PoseFeedbackCallback(geometry_msgs::PoseStamped pose_feedback)
+  {
+    if (pose_feedback.header.frame_id == pose_frame_)
+    {
+      current_pose_ = GeometryPoseToEigenIsometry3d(pose_feedback.pose);
+      current_pose_valid_ = true;
+      new_state_feedback_ = true;
+    }
+    else
+    {
+      ROS_WARN("Invalid feedback pose frame %s, should be %s",
+               pose_feedback.header.frame_id.c_str(), pose_frame_.c_str());
+      current_pose_valid_ = false;
+    }
+  }
+};
+
+// Builds a cartesian controller from the params in nhp. Unless set by params,
+// topics of the hardware interface start with topic_prefix, the controller's
+// own service with controller_prefix, and poses and twists are in base_frame
+// and ee_frame. An in-process controller is run by the hardware interface
+// through Update(), and does not subscribe to state.
+inline std::unique_ptr<URCartesianController> MakeCartesianController(
+    const ros::NodeHandle& nh, const ros::NodeHandle& nhp,
+    const std::string& topic_prefix, const std::string& controller_prefix,
+    const std::string& base_frame, const std::string& ee_frame,
+    const bool in_process)
+{
+  const std::string DEFAULT_TARGET_POSE_TOPIC
+      = topic_prefix + "target_cartesian_pose";
+  const std::string DEFAULT_POSE_FEEDBACK_TOPIC = topic_prefix + "ee_pose";
+  const std::string DEFAULT_TWIST_COMMAND_TOPIC
+      = topic_prefix + "ee_twist_command";
+  const std::string DEFAULT_ABORT_SERVICE = controller_prefix + "abort";
+  const double DEFAULT_TRANSLATION_KP = 1.0;
+  const double DEFAULT_ROTATION_KP = 1.0;
+  const double DEFAULT_TRANSLATION_KD = 0.1;
+  const double DEFAULT_ROTATION_KD = 0.1;
+  const double DEFAULT_MAX_LINEAR_VELOCITY = 0.5;
+  const double DEFAULT_MAX_ANGULAR_VELOCITY = 1.0;
+  // If set, pose feedback and twist commands use the hardware interface's
+  // shared memory channel instead of topics
+  const std::string DEFAULT_SHARED_MEMORY_NAME = "";
+  const std::string pose_frame
+      = nhp.param(std::string("pose_frame"), base_frame);
+  const std::string twist_frame
+      = nhp.param(std::string("twist_frame"), ee_frame);
+  const std::string target_pose_topic
+      = nhp.param(std::string("target_pose_topic"), DEFAULT_TARGET_POSE_TOPIC);
+  const std::string pose_feedback_topic
+      = nhp.param(std::string("pose_feedback_topic"),
+                  DEFAULT_POSE_FEEDBACK_TOPIC);
+  const std::string twist_command_topic
+      = nhp.param(std::string("twist_command_topic"),
+                  DEFAULT_TWIST_COMMAND_TOPIC);
+  const std::string abort_service
+      = nhp.param(std::string("abort_service"), DEFAULT_ABORT_SERVICE);
+  const std::string shared_memory_name
+      = nhp.param(std::string("shared_memory_name"),
+                  DEFAULT_SHARED_MEMORY_NAME);
+  const double translation_kp
+      = std::abs(nhp.param(std::string("translation_kp"),
+                           DEFAULT_TRANSLATION_KP));
+  const double rotation_kp
+      = std::abs(nhp.param(std::string("rotation_kp"), DEFAULT_ROTATION_KP));
+  const double translation_kd
+      = std::abs(nhp.param(std::string("translation_kd"),
+                           DEFAULT_TRANSLATION_KD));
+  const double rotation_kd
+      = std::abs(nhp.param(std::string("rotation_kd"), DEFAULT_ROTATION_KD));
+  const double max_linear_velocity
+      = std::abs(nhp.param(std::string("max_linear_velocity"),
+                           DEFAULT_MAX_LINEAR_VELOCITY));
+  const double max_angular_velocity
+      = std::abs(nhp.param(std::string("max_angular_velocity"),
+                           DEFAULT_MAX_ANGULAR_VELOCITY));
+  if (in_process && (pose_frame != base_frame))
+  {
+    throw std::invalid_argument(
+          "In-process cartesian controller pose_frame must be " + base_frame);
+  }
+  const std::vector<PIDParams> axis_controller_params
+      = GetDefaultPoseControllerParams(
+          translation_kp, translation_kd, rotation_kp, rotation_kd);
+  const std::vector<double> axis_velocity_limits = {
+      max_linear_velocity, max_linear_velocity, max_linear_velocity,
+      max_angular_velocity, max_angular_velocity, max_angular_velocity};
+  return std::unique_ptr<URCartesianController>(
+      new URCartesianController(
+          nh, pose_frame, twist_frame, target_pose_topic, pose_feedback_topic,
+          twist_command_topic, abort_service, shared_memory_name, in_process,
+          axis_controller_params, axis_velocity_limits));
+}
+}
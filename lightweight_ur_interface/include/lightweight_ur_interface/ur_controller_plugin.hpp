@@ -0,0 +1,27 @@
+#pragma once
+
+#include <lightweight_ur_interface/ur_shared_memory_channel.hpp>
+
+namespace lightweight_ur_interface
+{
+// Controller run by a hardware interface in its own process, instead of as
+// a separate node. Each robot state is passed to Update() on the thread that
+// received it, and the command returned is queued lock-free to be limited
+// and sent to the robot, with no topic or shared memory hop on either side.
+// State and commands are those of the shared memory channel, with joint
+// values in the order of GetOrderedJointNames().
+class URControllerPlugin
+{
+public:
+
+  virtual ~URControllerPlugin() {}
+
+  // Called for each state but the first, with the time in seconds since the
+  // state before it. Returns true if command should be sent. Runs on the
+  // thread that receives robot state, so it must not block, take locks or
+  // publish; anything else should be handed to a thread of its own.
+  virtual bool Update(const URSharedState& state,
+                      const double control_interval,
+                      URSharedCommand& command) = 0;
+};
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <lightweight_ur_interface/ur_minimal_realtime_driver.hpp>
+
+namespace lightweight_ur_interface
+{
+// Dashboard server (port 29999). Requests and replies are single lines of
+// text, and the server answers requests in the order they were sent, so any
+// number of requests can be in flight at once. The server greets each new
+// connection with a line of its own before answering requests.
+
+constexpr uint16_t kDashboardServerPort = 29999;
+
+struct URDashboardReply
+{
+  std::string request;
+  // Reply line without its line ending, or the reason the request failed
+  std::string reply;
+  // True if the reply starts with the prefix expected for the request
+  bool success;
+};
+
+// Client for the dashboard server of the robot at robot_host. Requests are
+// sent from the calling thread and never wait for their replies; each reply
+// is passed to its request's callback on the recv thread (or the thread of
+// the shared URIOReactor, if started with StartRecv(reactor)) as it arrives.
+// Requests made while disconnected, or still outstanding when the connection
+// drops, fail immediately. The watchdog only runs while replies are
+// outstanding, since the server sends nothing otherwise.
+class URDashboardClient
+{
+private:
+
+  struct PendingRequest
+  {
+    uint64_t id;
+    std::string request;
+    std::string success_prefix;
+    std::function<void(const URDashboardReply&)> reply_fn;
+  };
+
+  static constexpr size_t kMaxReplyLength = 4096;
+
+  URRobotConnection connection_;
+  std::atomic<bool> running_;
+  std::thread recv_thread_;
+  std::function<void(const std::string&)> logging_fn_;
+  // Serializes threads sending requests, so the order of sends and pending
+  // requests is the same. Never taken by the recv thread.
+  std::mutex send_mutex_;
+  uint64_t next_request_id_;
+  // Guards pending requests between threads sending requests and the recv
+  // thread. Never held while sending.
+  std::mutex request_mutex_;
+  std::deque<PendingRequest> pending_requests_;
+  // Owned by the recv thread
+  std::string reply_buffer_;
+  bool awaiting_greeting_;
+  URIOReactor* reactor_ptr_;
+
+  void FailPendingRequests(const std::string& reason);
+
+  void HandleLine(const std::string& line);
+
+  void HandleConnected();
+
+  bool ExpectingData();
+
+  void ReadSocket(const int socket_fd);
+
+  void ProcessConnectionEvents();
+
+  void RecvLoop();
+
+public:
+
+  URDashboardClient(
+    const std::string& robot_host,
+    const std::function<void(const std::string&)>& logging_fn,
+    const uint16_t port = kDashboardServerPort,
+    const URRealtimeConnectionParams& connection_params
+        = URRealtimeConnectionParams());
+
+  ~URDashboardClient();
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  void StartRecv();
+
+  // Runs the connection on reactor instead of a recv thread of its own.
+  // reactor must outlive StopRecv().
+  void StartRecv(URIOReactor& reactor);
+
+  void StopRecv();
+
+  inline bool IsConnected() const { return connection_.IsReady(); }
+
+  // Returns false if not connected within timeout seconds.
+  inline bool WaitForConnection(const double timeout)
+  { return connection_.WaitForReady(timeout); }
+
+  // Sends request (without a line ending). reply_fn, which may be empty, is
+  // called once with the reply, or with the reason the request failed.
+  // Returns false if the request could not be sent, in which case reply_fn
+  // has already been called.
+  bool Request(const std::string& request, const std::string& success_prefix,
+               const std::function<void(const URDashboardReply&)>& reply_fn);
+
+  inline bool UnlockProtectiveStop(
+      const std::function<void(const URDashboardReply&)>& reply_fn)
+  {
+    return Request("unlock protective stop", "Protective stop releasing",
+                   reply_fn);
+  }
+
+  inline bool CloseSafetyPopup(
+      const std::function<void(const URDashboardReply&)>& reply_fn)
+  { return Request("close safety popup", "closing safety popup", reply_fn); }
+
+  // Starts the loaded program
+  inline bool Play(
+      const std::function<void(const URDashboardReply&)>& reply_fn)
+  { return Request("play", "Starting program", reply_fn); }
+
+  // Stops the running program, including programs sent as URScript
+  inline bool Stop(
+      const std::function<void(const URDashboardReply&)>& reply_fn)
+  { return Request("stop", "Stopped", reply_fn); }
+
+  // Replies "Robotmode: <mode>", e.g. "Robotmode: RUNNING"
+  inline bool QueryRobotMode(
+      const std::function<void(const URDashboardReply&)>& reply_fn)
+  { return Request("robotmode", "Robotmode: ", reply_fn); }
+
+  // Replies "Safetymode: <mode>", e.g. "Safetymode: PROTECTIVE_STOP"
+  inline bool QuerySafetyMode(
+      const std::function<void(const URDashboardReply&)>& reply_fn)
+  { return Request("safetymode", "Safetymode: ", reply_fn); }
+};
+}
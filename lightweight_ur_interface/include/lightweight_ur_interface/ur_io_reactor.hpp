@@ -0,0 +1,120 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <tri_realtime_common/realtime_thread_config.hpp>
+#include <lightweight_ur_interface/bounded_spsc_queue.hpp>
+
+namespace lightweight_ur_interface
+{
+// Runs the I/O of any number of connections on one thread, which waits on a
+// single epoll instance for all of them. Each source is a file descriptor
+// and a handler, called on the reactor thread while the fd is readable or
+// has hung up, until the handler returns false or the source is removed. A
+// source may itself be an epoll instance, such as that of a
+// URRobotConnection, whose handler then processes its pending events.
+//
+// Hosting several robots on one reactor replaces a recv thread per
+// connection with a single thread, which applies reactor_thread_config when
+// it starts. Data from every robot is then handled on that thread in arrival
+// order, and cycle_fn (if provided) runs after each batch of ready sources,
+// so work that needs the latest state of several robots can be done there
+// once per cycle rather than once per robot.
+//
+// The reactor thread never takes a lock. Sources are added and removed
+// through a queue of requests, which the reactor thread applies between
+// rounds of epoll_wait, so that changing the sources of one robot never
+// stalls the I/O of the others.
+class URIOReactor
+{
+private:
+
+  // Registered with epoll as the event's data.ptr, so it must not move
+  // while watched
+  struct Source
+  {
+    int fd;
+    std::function<bool(void)> handler_fn;
+  };
+
+  struct SourceRequest
+  {
+    bool add;
+    int fd;
+    std::function<bool(void)> handler_fn;
+    // Completed by the reactor thread once the request has been applied
+    std::promise<void>* completion;
+  };
+
+  int epoll_fd_;
+  int wake_fd_;
+  std::atomic<bool> running_;
+  std::thread reactor_thread_;
+  std::function<void(const std::string&)> logging_fn_;
+  tri_realtime_common::RealtimeThreadConfig reactor_thread_config_;
+  std::string thread_name_;
+  std::function<void(void)> cycle_fn_;
+  // Serializes threads adding and removing sources, Start() and Stop().
+  // Never taken by the reactor thread. A request holds it until the reactor
+  // thread has applied it, so at most one request is ever queued, and the
+  // reactor cannot stop with a request pending.
+  std::mutex requests_mutex_;
+  BoundedSpscQueue<SourceRequest> source_requests_;
+  // Only used by the reactor thread while it runs, and under
+  // requests_mutex_ while it does not
+  std::map<int, std::unique_ptr<Source>> sources_;
+  // Sources whose handler returned false in the current round, freed once
+  // no event of the round can refer to them
+  std::vector<std::unique_ptr<Source>> finished_sources_;
+
+  void Wake();
+
+  void ApplySourceRequest(const SourceRequest& request);
+
+  void RequestSourceChange(const SourceRequest& request);
+
+  void ReactorLoop();
+
+public:
+
+  URIOReactor(
+      const std::function<void(const std::string&)>& logging_fn,
+      const tri_realtime_common::RealtimeThreadConfig& reactor_thread_config
+          = tri_realtime_common::RealtimeThreadConfig(),
+      const std::string& thread_name = "ur_reactor",
+      const std::function<void(void)>& cycle_fn = std::function<void(void)>());
+
+  ~URIOReactor();
+
+  URIOReactor(const URIOReactor&) = delete;
+
+  URIOReactor& operator=(const URIOReactor&) = delete;
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  void Start();
+
+  void Stop();
+
+  inline bool IsRunning() const { return running_.load(); }
+
+  // Calls handler_fn on the reactor thread whenever fd is readable, and
+  // stops watching fd once it returns false, e.g. after a peer hangs up.
+  // Sources may be added before or after Start(), from any thread but the
+  // reactor thread, and are watched from the next round of epoll_wait.
+  // Handlers must not block.
+  void AddSource(const int fd, const std::function<bool(void)>& handler_fn);
+
+  // Stops watching fd. Once this returns, its handler is not running and
+  // will not be called again, so fd may be closed. Must not be called from
+  // a handler, since it waits for the reactor thread to finish its round.
+  void RemoveSource(const int fd);
+};
+}
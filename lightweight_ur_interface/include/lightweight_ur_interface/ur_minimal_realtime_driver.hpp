@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <cstring>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <array>
 #include <vector>
 #include <map>
 #include <string>
@@ -11,19 +14,31 @@
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <functional>
+#include <memory>
 #include <Eigen/Geometry>
 #include <common_robotics_utilities/print.hpp>
 #include <common_robotics_utilities/serialization.hpp>
+#include <lightweight_ur_interface/ur_io_reactor.hpp>
+#include <lightweight_ur_interface/ur_network_byte_order.hpp>
+#include <lightweight_ur_interface/ur_stream_capture.hpp>
+#include <tri_realtime_common/realtime_thread_config.hpp>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <iostream>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 
@@ -55,32 +70,210 @@ DeserializeKnownSizeVector(
       deserialized, bytes_read);
 }
 
+// Fields of the realtime interface state packet that can be decoded
+enum URRealtimeField : uint32_t
+{
+  kControllerUptime = 0,
+  kTargetPosition,
+  kTargetVelocity,
+  kTargetAcceleration,
+  kTargetCurrent,
+  kTargetTorque,
+  kActualPosition,
+  kActualVelocity,
+  kActualCurrent,
+  kControlCurrent,
+  kActualTcpPose,
+  kActualTcpTwist,
+  kActualTcpWrench,
+  kTargetTcpPose,
+  kTargetTcpTwist,
+  kMotorTemperature,
+  kControllerRtLoopTime,
+  kRobotMode,
+  kJointMode,
+  kSafetyMode,
+  kActualTcpAcceleration,
+  kTrajectoryLimiterSpeedScaling,
+  kLinearMomentumNorm,
+  kMainboardVoltage,
+  kMotorboardVoltage,
+  kMainboardCurrent,
+  kJointVoltage,
+  kDigitalInputBits,
+  kDigitalOutputBits,
+  kProgramState,
+  kElbowPosition,
+  kElbowVelocity,
+  kSafetyStatus,
+  kNumRealtimeFields
+};
+
+typedef uint64_t URRealtimeFieldMask;
+
+constexpr URRealtimeFieldMask RealtimeFieldBit(const URRealtimeField field)
+{
+  return static_cast<URRealtimeFieldMask>(1) << field;
+}
+
+constexpr URRealtimeFieldMask kAllRealtimeFields
+    = RealtimeFieldBit(kNumRealtimeFields) - 1;
+
+// The fields needed by nodes that only track the motion of the arm
+constexpr URRealtimeFieldMask kMotionRealtimeFields
+    = RealtimeFieldBit(kControllerUptime)
+      | RealtimeFieldBit(kActualPosition)
+      | RealtimeFieldBit(kActualVelocity)
+      | RealtimeFieldBit(kActualTcpPose);
+
+// Number of doubles in each field
+constexpr uint32_t kRealtimeFieldSizes[kNumRealtimeFields] =
+{
+  1, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 1, 1, 6, 1, 3, 1, 1, 1, 1,
+  1, 6, 1, 1, 1, 3, 3, 1
+};
+
+// Offset of a field that is not present in a packet layout
+constexpr uint32_t kAbsentRealtimeField = 0xffffffff;
+
+// Packet layouts of the realtime interface, one per message length. Offsets
+// are in doubles from the end of the length field, and skip the test value
+// and the blocks reserved for use by Universal Robots. Protocol versions are
+// the earliest controller software producing the layout, encoded as
+// major + (minor / 100) so that 3.10 sorts after 3.5.
+
+// CB2 1.8
+struct URRealtimeLayout812
+{
+  static constexpr uint32_t kMessageLength = 812;
+  static constexpr double kProtocolVersion = 1.08;
+  static constexpr uint32_t kFieldOffsets[kNumRealtimeFields] =
+  {
+    0, 1, 7, 13, 19, 25, 31, 37, 43, kAbsentRealtimeField, 73, 79, 67,
+    kAbsentRealtimeField, kAbsentRealtimeField, 86, 92, 94, 95,
+    kAbsentRealtimeField, 49, kAbsentRealtimeField, kAbsentRealtimeField,
+    kAbsentRealtimeField, kAbsentRealtimeField, kAbsentRealtimeField,
+    kAbsentRealtimeField, 85, kAbsentRealtimeField, kAbsentRealtimeField,
+    kAbsentRealtimeField, kAbsentRealtimeField, kAbsentRealtimeField
+  };
+};
+
+// CB3 3.0-3.1
+struct URRealtimeLayout1044
+{
+  static constexpr uint32_t kMessageLength = 1044;
+  static constexpr double kProtocolVersion = 3.00;
+  static constexpr uint32_t kFieldOffsets[kNumRealtimeFields] =
+  {
+    0, 1, 7, 13, 19, 25, 31, 37, 43, 49, 55, 61, 67, 73, 79, 86, 92, 94, 95,
+    101, 108, 117, 118, 121, 122, 123, 124, 85, kAbsentRealtimeField,
+    kAbsentRealtimeField, kAbsentRealtimeField, kAbsentRealtimeField,
+    kAbsentRealtimeField
+  };
+};
+
+// CB3 3.2-3.4, adds digital outputs and program state
+struct URRealtimeLayout1060
+{
+  static constexpr uint32_t kMessageLength = 1060;
+  static constexpr double kProtocolVersion = 3.02;
+  static constexpr uint32_t kFieldOffsets[kNumRealtimeFields] =
+  {
+    0, 1, 7, 13, 19, 25, 31, 37, 43, 49, 55, 61, 67, 73, 79, 86, 92, 94, 95,
+    101, 108, 117, 118, 121, 122, 123, 124, 85, 130, 131,
+    kAbsentRealtimeField, kAbsentRealtimeField, kAbsentRealtimeField
+  };
+};
+
+// CB3 3.5-3.9 and e-Series 5.0-5.3, adds elbow position and velocity
+struct URRealtimeLayout1108
+{
+  static constexpr uint32_t kMessageLength = 1108;
+  static constexpr double kProtocolVersion = 3.05;
+  static constexpr uint32_t kFieldOffsets[kNumRealtimeFields] =
+  {
+    0, 1, 7, 13, 19, 25, 31, 37, 43, 49, 55, 61, 67, 73, 79, 86, 92, 94, 95,
+    101, 108, 117, 118, 121, 122, 123, 124, 85, 130, 131, 132, 135,
+    kAbsentRealtimeField
+  };
+};
+
+// CB3 3.10+ and e-Series 5.4+, adds safety status
+struct URRealtimeLayout1116
+{
+  static constexpr uint32_t kMessageLength = 1116;
+  static constexpr double kProtocolVersion = 3.10;
+  static constexpr uint32_t kFieldOffsets[kNumRealtimeFields] =
+  {
+    0, 1, 7, 13, 19, 25, 31, 37, 43, 49, 55, 61, 67, 73, 79, 86, 92, 94, 95,
+    101, 108, 117, 118, 121, 122, 123, 124, 85, 130, 131, 132, 135, 138
+  };
+};
+
+// Fields present in Layout
+template<typename Layout>
+constexpr URRealtimeFieldMask AvailableRealtimeFields(const uint32_t field = 0)
+{
+  return (field >= kNumRealtimeFields)
+      ? 0
+      : (((Layout::kFieldOffsets[field] != kAbsentRealtimeField)
+          ? RealtimeFieldBit(static_cast<URRealtimeField>(field)) : 0)
+         | AvailableRealtimeFields<Layout>(field + 1));
+}
+
+// Number of payload doubles that must be present to decode the fields in
+// field_mask using Layout.
+template<typename Layout>
+constexpr uint32_t RequiredRealtimePayloadSize(
+    const URRealtimeFieldMask field_mask, const uint32_t field = 0,
+    const uint32_t required_size = 0)
+{
+  return (field >= kNumRealtimeFields)
+      ? required_size
+      : RequiredRealtimePayloadSize<Layout>(
+          field_mask, field + 1,
+          (((field_mask & AvailableRealtimeFields<Layout>()
+             & RealtimeFieldBit(static_cast<URRealtimeField>(field))) != 0)
+           && ((Layout::kFieldOffsets[field] + kRealtimeFieldSizes[field])
+               > required_size))
+              ? (Layout::kFieldOffsets[field] + kRealtimeFieldSizes[field])
+              : required_size);
+}
+
 class URRealtimeState
 {
+public:
+
+  typedef std::array<double, 6> Array6d;
+  typedef std::array<double, 3> Array3d;
+
 private:
   template<typename T>
   using Deserialized
       = common_robotics_utilities::serialization::Deserialized<T>;
 
-  std::vector<double> target_position_;
-  std::vector<double> target_velocity_;
-  std::vector<double> target_acceleration_;
-  std::vector<double> target_current_;
-  std::vector<double> target_torque_;
-  std::vector<double> actual_position_;
-  std::vector<double> actual_velocity_;
-  std::vector<double> actual_acceleration_;
-  std::vector<double> actual_current_;
-  std::vector<double> actual_torque_;
-  std::vector<double> control_current_;
-  std::vector<double> motor_temperature_;
-  std::vector<double> joint_voltage_;
-  std::vector<double> joint_mode_;
-  std::vector<double> actual_tcp_acceleration_;
-  std::vector<double> raw_target_tcp_pose_;
-  std::vector<double> raw_actual_tcp_pose_;
-  Eigen::Isometry3d target_tcp_pose_;
-  Eigen::Isometry3d actual_tcp_pose_;
+  // All members are fixed-size, so deserializing into an existing state
+  // performs no heap allocations.
+  Array6d target_position_;
+  Array6d target_velocity_;
+  Array6d target_acceleration_;
+  Array6d target_current_;
+  Array6d target_torque_;
+  Array6d actual_position_;
+  Array6d actual_velocity_;
+  Array6d actual_acceleration_;
+  Array6d actual_current_;
+  Array6d actual_torque_;
+  Array6d control_current_;
+  Array6d motor_temperature_;
+  Array6d joint_voltage_;
+  Array6d joint_mode_;
+  Array3d actual_tcp_acceleration_;
+  Array6d raw_target_tcp_pose_;
+  Array6d raw_actual_tcp_pose_;
+  // Poses are computed from the raw TCP vectors on first access
+  mutable Eigen::Isometry3d target_tcp_pose_;
+  mutable Eigen::Isometry3d actual_tcp_pose_;
   Eigen::Matrix<double, 6, 1> target_tcp_twist_;
   Eigen::Matrix<double, 6, 1> target_tcp_wrench_;
   Eigen::Matrix<double, 6, 1> actual_tcp_twist_;
@@ -95,21 +288,45 @@ private:
   double mainboard_voltage_;
   double motorboard_voltage_;
   double mainboard_current_;
+  double digital_input_bits_;
+  double digital_output_bits_;
+  double program_state_;
+  Array3d elbow_position_;
+  Array3d elbow_velocity_;
+  double safety_status_;
+  int64_t receive_time_ns_;
+  int64_t sample_time_ns_;
+  int64_t monotonic_sample_time_ns_;
+  URRealtimeFieldMask decoded_fields_;
+  mutable bool target_tcp_pose_valid_;
+  mutable bool actual_tcp_pose_valid_;
   bool initialized_;
 
-  static inline Deserialized<std::vector<double>>
-  DeserializeKnownSizeDoubleVector(
-      const size_t size, const std::vector<uint8_t>& buffer,
-      const uint64_t starting_offset)
+  // Copies a single field out of the host-order payload if it is present in
+  // both FieldMask and Layout. Since both the mask and the offset table are
+  // compile-time constants, each decoder is a fixed sequence of copies and
+  // unrequested or absent fields compile away entirely.
+  template<typename Layout, URRealtimeFieldMask FieldMask,
+           URRealtimeField Field>
+  static inline void DecodeField(const double* payload, double* values)
   {
-    return DeserializeKnownSizeVector<double, std::vector<double>>(
-      size, buffer, starting_offset,
-      common_robotics_utilities::serialization
-          ::DeserializeNetworkMemcpyable<double>);
+    if ((FieldMask & AvailableRealtimeFields<Layout>()
+         & RealtimeFieldBit(Field)) != 0)
+    {
+      constexpr uint32_t field_offset = Layout::kFieldOffsets[Field];
+      constexpr uint32_t field_size = kRealtimeFieldSizes[Field];
+      std::memcpy(values, payload + field_offset, field_size * sizeof(double));
+    }
   }
 
+  // Checks that buffer holds a complete message of exactly
+  // expected_message_length bytes.
+  static void CheckMessageLength(
+      const std::vector<uint8_t>& buffer, const uint64_t starting_offset,
+      const uint32_t expected_message_length);
+
   static inline Eigen::Isometry3d TcpVectorToTransform(
-      const std::vector<double>& tcp_vector)
+      const Array6d& tcp_vector)
   {
     const Eigen::Translation3d translation(tcp_vector[0],
                                            tcp_vector[1],
@@ -135,36 +352,54 @@ private:
     return transform;
   }
 
-  static inline Eigen::Matrix<double, 6, 1> TcpVelocityToTwist(
-      const std::vector<double>& tcp_velocity)
+  template<size_t N>
+  static inline std::vector<double> ToVector(const std::array<double, N>& array)
   {
-    Eigen::Matrix<double, 6, 1> twist = Eigen::Matrix<double, 6, 1>::Zero();
-    twist(0, 0) = tcp_velocity[0];
-    twist(1, 0) = tcp_velocity[1];
-    twist(2, 0) = tcp_velocity[2];
-    twist(3, 0) = tcp_velocity[3];
-    twist(4, 0) = tcp_velocity[4];
-    twist(5, 0) = tcp_velocity[5];
-    return twist;
+    return std::vector<double>(array.begin(), array.end());
   }
 
-  static inline Eigen::Matrix<double, 6, 1> TcpForceToWrench(
-      const std::vector<double>& tcp_velocity)
-  {
-    Eigen::Matrix<double, 6, 1> twist = Eigen::Matrix<double, 6, 1>::Zero();
-    twist(0, 0) = tcp_velocity[0];
-    twist(1, 0) = tcp_velocity[1];
-    twist(2, 0) = tcp_velocity[2];
-    twist(3, 0) = tcp_velocity[3];
-    twist(4, 0) = tcp_velocity[4];
-    twist(5, 0) = tcp_velocity[5];
-    return twist;
-  }
+  // Storage of the kRealtimeFieldSizes[field] doubles of field
+  double* FieldStorage(const URRealtimeField field);
 
 public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-  URRealtimeState() : initialized_(false) {}
+  URRealtimeState()
+    : protocol_version_(0.0), controller_uptime_(0.0),
+      controller_rt_loop_time_(0.0), robot_mode_(0.0), safety_mode_(0.0),
+      trajectory_limiter_speed_scaling_(0.0), linear_momentum_norm_(0.0),
+      mainboard_voltage_(0.0), motorboard_voltage_(0.0),
+      mainboard_current_(0.0), digital_input_bits_(0.0),
+      digital_output_bits_(0.0), program_state_(0.0), safety_status_(0.0),
+      receive_time_ns_(0), sample_time_ns_(0), monotonic_sample_time_ns_(0),
+      decoded_fields_(0),
+      target_tcp_pose_valid_(false), actual_tcp_pose_valid_(false),
+      initialized_(false)
+  {
+    target_position_.fill(0.0);
+    target_velocity_.fill(0.0);
+    target_acceleration_.fill(0.0);
+    target_current_.fill(0.0);
+    target_torque_.fill(0.0);
+    actual_position_.fill(0.0);
+    actual_velocity_.fill(0.0);
+    actual_acceleration_.fill(0.0);
+    actual_current_.fill(0.0);
+    actual_torque_.fill(0.0);
+    control_current_.fill(0.0);
+    motor_temperature_.fill(0.0);
+    joint_voltage_.fill(0.0);
+    joint_mode_.fill(0.0);
+    actual_tcp_acceleration_.fill(0.0);
+    elbow_position_.fill(0.0);
+    elbow_velocity_.fill(0.0);
+    raw_target_tcp_pose_.fill(0.0);
+    raw_actual_tcp_pose_.fill(0.0);
+    target_tcp_twist_.setZero();
+    target_tcp_wrench_.setZero();
+    actual_tcp_twist_.setZero();
+    actual_tcp_wrench_.setZero();
+  }
 
   inline static Deserialized<URRealtimeState> Deserialize(
       const std::vector<uint8_t>& buffer, const uint64_t starting_offset)
@@ -176,61 +411,249 @@ public:
         deserialized_state, bytes_read);
   }
 
+  // Reads the length field of the message at starting_offset.
+  static uint32_t ReadMessageLength(
+      const std::vector<uint8_t>& buffer, const uint64_t starting_offset);
+
+  // Deserializes in place into this (caller-owned) state without allocating,
+  // selecting the packet layout from the message length.
   uint64_t DeserializeSelf(
       const std::vector<uint8_t>& buffer, const uint64_t starting_offset);
 
-  inline bool Initialized() { return initialized_; }
+  // Deserializes only the fields in FieldMask from a message with the given
+  // Layout, leaving all other fields untouched. Derived TCP poses are computed
+  // lazily on first access.
+  template<typename Layout, URRealtimeFieldMask FieldMask>
+  uint64_t DeserializeFields(
+      const std::vector<uint8_t>& buffer, const uint64_t starting_offset)
+  {
+    constexpr URRealtimeFieldMask decoded_fields
+        = FieldMask & AvailableRealtimeFields<Layout>();
+    constexpr uint32_t required_payload_size
+        = RequiredRealtimePayloadSize<Layout>(FieldMask);
+    static_assert((sizeof(int32_t) + (required_payload_size * sizeof(double)))
+                  <= Layout::kMessageLength,
+                  "Layout field offsets exceed its message length");
+    CheckMessageLength(buffer, starting_offset, Layout::kMessageLength);
+    // Byte-swap the needed prefix of the payload in one pass, then copy the
+    // requested fields out of host-order doubles.
+    alignas(32) double payload[
+        (required_payload_size > 0) ? required_payload_size : 1];
+    NetworkDoublesToHost(buffer.data() + starting_offset + sizeof(int32_t),
+                         required_payload_size, payload);
+    DecodeField<Layout, FieldMask, kControllerUptime>(
+        payload, &controller_uptime_);
+    DecodeField<Layout, FieldMask, kTargetPosition>(
+        payload, target_position_.data());
+    DecodeField<Layout, FieldMask, kTargetVelocity>(
+        payload, target_velocity_.data());
+    DecodeField<Layout, FieldMask, kTargetAcceleration>(
+        payload, target_acceleration_.data());
+    DecodeField<Layout, FieldMask, kTargetCurrent>(
+        payload, target_current_.data());
+    DecodeField<Layout, FieldMask, kTargetTorque>(
+        payload, target_torque_.data());
+    DecodeField<Layout, FieldMask, kActualPosition>(
+        payload, actual_position_.data());
+    DecodeField<Layout, FieldMask, kActualVelocity>(
+        payload, actual_velocity_.data());
+    DecodeField<Layout, FieldMask, kActualCurrent>(
+        payload, actual_current_.data());
+    DecodeField<Layout, FieldMask, kControlCurrent>(
+        payload, control_current_.data());
+    DecodeField<Layout, FieldMask, kActualTcpPose>(
+        payload, raw_actual_tcp_pose_.data());
+    DecodeField<Layout, FieldMask, kActualTcpTwist>(
+        payload, actual_tcp_twist_.data());
+    DecodeField<Layout, FieldMask, kActualTcpWrench>(
+        payload, actual_tcp_wrench_.data());
+    DecodeField<Layout, FieldMask, kTargetTcpPose>(
+        payload, raw_target_tcp_pose_.data());
+    DecodeField<Layout, FieldMask, kTargetTcpTwist>(
+        payload, target_tcp_twist_.data());
+    DecodeField<Layout, FieldMask, kMotorTemperature>(
+        payload, motor_temperature_.data());
+    DecodeField<Layout, FieldMask, kControllerRtLoopTime>(
+        payload, &controller_rt_loop_time_);
+    DecodeField<Layout, FieldMask, kRobotMode>(payload, &robot_mode_);
+    DecodeField<Layout, FieldMask, kJointMode>(payload, joint_mode_.data());
+    DecodeField<Layout, FieldMask, kSafetyMode>(payload, &safety_mode_);
+    DecodeField<Layout, FieldMask, kActualTcpAcceleration>(
+        payload, actual_tcp_acceleration_.data());
+    DecodeField<Layout, FieldMask, kTrajectoryLimiterSpeedScaling>(
+        payload, &trajectory_limiter_speed_scaling_);
+    DecodeField<Layout, FieldMask, kLinearMomentumNorm>(
+        payload, &linear_momentum_norm_);
+    DecodeField<Layout, FieldMask, kMainboardVoltage>(
+        payload, &mainboard_voltage_);
+    DecodeField<Layout, FieldMask, kMotorboardVoltage>(
+        payload, &motorboard_voltage_);
+    DecodeField<Layout, FieldMask, kMainboardCurrent>(
+        payload, &mainboard_current_);
+    DecodeField<Layout, FieldMask, kJointVoltage>(
+        payload, joint_voltage_.data());
+    DecodeField<Layout, FieldMask, kDigitalInputBits>(
+        payload, &digital_input_bits_);
+    DecodeField<Layout, FieldMask, kDigitalOutputBits>(
+        payload, &digital_output_bits_);
+    DecodeField<Layout, FieldMask, kProgramState>(payload, &program_state_);
+    DecodeField<Layout, FieldMask, kElbowPosition>(
+        payload, elbow_position_.data());
+    DecodeField<Layout, FieldMask, kElbowVelocity>(
+        payload, elbow_velocity_.data());
+    DecodeField<Layout, FieldMask, kSafetyStatus>(payload, &safety_status_);
+    if ((decoded_fields & RealtimeFieldBit(kActualTcpPose)) != 0)
+    {
+      actual_tcp_pose_valid_ = false;
+    }
+    if ((decoded_fields & RealtimeFieldBit(kTargetTcpPose)) != 0)
+    {
+      target_tcp_pose_valid_ = false;
+    }
+    protocol_version_ = Layout::kProtocolVersion;
+    decoded_fields_ = decoded_fields;
+    initialized_ = true;
+    return Layout::kMessageLength;
+  }
+
+  // Stores the kRealtimeFieldSizes[field] values of field, for states decoded
+  // from a transport other than the realtime interface (e.g. RTDE). Call
+  // FinishFieldUpdate() once every field of an update has been stored.
+  inline void SetFieldValues(const URRealtimeField field, const double* values)
+  {
+    std::memcpy(FieldStorage(field), values,
+                kRealtimeFieldSizes[field] * sizeof(double));
+  }
+
+  // Completes an update made with SetFieldValues(), in which decoded_fields
+  // were stored.
+  void FinishFieldUpdate(const URRealtimeFieldMask decoded_fields,
+                         const double protocol_version);
+
+  inline bool Initialized() const { return initialized_; }
+
+  // Fields decoded from the most recent packet, which excludes fields not
+  // present in its layout
+  inline URRealtimeFieldMask DecodedFields() const { return decoded_fields_; }
+
+  // Fixed-size accessors, which do not allocate.
 
-  inline const std::vector<double>& TargetPosition() const
+  inline const Array6d& TargetPositionArray() const
   { return target_position_; }
 
-  inline const std::vector<double>& TargetVelocity() const
+  inline const Array6d& TargetVelocityArray() const
   { return target_velocity_; }
 
-  inline const std::vector<double>& TargetAcceleration() const
+  inline const Array6d& TargetAccelerationArray() const
   { return target_acceleration_; }
 
-  inline const std::vector<double>& TargetCurrent() const
+  inline const Array6d& TargetCurrentArray() const
   { return target_current_; }
 
-  inline const std::vector<double>& TargetTorque() const
+  inline const Array6d& TargetTorqueArray() const
   { return target_torque_; }
 
-  inline const std::vector<double>& ActualPosition() const
+  inline const Array6d& ActualPositionArray() const
   { return actual_position_; }
 
-  inline const std::vector<double>& ActualVelocity() const
+  inline const Array6d& ActualVelocityArray() const
   { return actual_velocity_; }
 
-  inline const std::vector<double>& ActualAcceleration() const
+  inline const Array6d& ActualAccelerationArray() const
   { return actual_acceleration_; }
 
-  inline const std::vector<double>& ActualCurrent() const
+  inline const Array6d& ActualCurrentArray() const
   { return actual_current_; }
 
-  inline const std::vector<double>& ActualTorque() const
+  inline const Array6d& ActualTorqueArray() const
   { return actual_torque_; }
 
-  inline const std::vector<double>& ControlCurrent() const
+  inline const Array6d& ControlCurrentArray() const
   { return control_current_; }
 
-  inline const std::vector<double>& MotorTemperature() const
+  inline const Array6d& MotorTemperatureArray() const
   { return motor_temperature_; }
 
-  inline const std::vector<double>& JointVoltage() const
+  inline const Array6d& JointVoltageArray() const
   { return joint_voltage_; }
 
-  inline const std::vector<double>& JointMode() const
+  inline const Array6d& JointModeArray() const
   { return joint_mode_; }
 
-  inline const std::vector<double>& ActualTcpAcceleration() const
+  inline const Array3d& ActualTcpAccelerationArray() const
   { return actual_tcp_acceleration_; }
 
-  inline const std::vector<double>& RawTargetTcpPose() const
+  inline const Array6d& RawTargetTcpPoseArray() const
   { return raw_target_tcp_pose_; }
 
+  inline const Array6d& RawActualTcpPoseArray() const
+  { return raw_actual_tcp_pose_; }
+
+  inline const Array3d& ElbowPositionArray() const
+  { return elbow_position_; }
+
+  inline const Array3d& ElbowVelocityArray() const
+  { return elbow_velocity_; }
+
+  // Compatibility accessors, which copy into a new std::vector<double>.
+
+  inline std::vector<double> TargetPosition() const
+  { return ToVector(target_position_); }
+
+  inline std::vector<double> TargetVelocity() const
+  { return ToVector(target_velocity_); }
+
+  inline std::vector<double> TargetAcceleration() const
+  { return ToVector(target_acceleration_); }
+
+  inline std::vector<double> TargetCurrent() const
+  { return ToVector(target_current_); }
+
+  inline std::vector<double> TargetTorque() const
+  { return ToVector(target_torque_); }
+
+  inline std::vector<double> ActualPosition() const
+  { return ToVector(actual_position_); }
+
+  inline std::vector<double> ActualVelocity() const
+  { return ToVector(actual_velocity_); }
+
+  inline std::vector<double> ActualAcceleration() const
+  { return ToVector(actual_acceleration_); }
+
+  inline std::vector<double> ActualCurrent() const
+  { return ToVector(actual_current_); }
+
+  inline std::vector<double> ActualTorque() const
+  { return ToVector(actual_torque_); }
+
+  inline std::vector<double> ControlCurrent() const
+  { return ToVector(control_current_); }
+
+  inline std::vector<double> MotorTemperature() const
+  { return ToVector(motor_temperature_); }
+
+  inline std::vector<double> JointVoltage() const
+  { return ToVector(joint_voltage_); }
+
+  inline std::vector<double> JointMode() const
+  { return ToVector(joint_mode_); }
+
+  inline std::vector<double> ActualTcpAcceleration() const
+  { return ToVector(actual_tcp_acceleration_); }
+
+  inline std::vector<double> RawTargetTcpPose() const
+  { return ToVector(raw_target_tcp_pose_); }
+
   inline const Eigen::Isometry3d& TargetTcpPose() const
-  { return target_tcp_pose_; }
+  {
+    if (!target_tcp_pose_valid_)
+    {
+      target_tcp_pose_ = TcpVectorToTransform(raw_target_tcp_pose_);
+      target_tcp_pose_valid_ = true;
+    }
+    return target_tcp_pose_;
+  }
 
   inline const Eigen::Matrix<double, 6, 1>& TargetTcpTwist() const
   { return target_tcp_twist_; }
@@ -238,11 +661,18 @@ public:
   inline const Eigen::Matrix<double, 6, 1>& TargetTcpWrench() const
   { return target_tcp_wrench_; }
 
-  inline const std::vector<double>& RawActualTcpPose() const
-  { return raw_actual_tcp_pose_; }
+  inline std::vector<double> RawActualTcpPose() const
+  { return ToVector(raw_actual_tcp_pose_); }
 
   inline const Eigen::Isometry3d& ActualTcpPose() const
-  { return actual_tcp_pose_; }
+  {
+    if (!actual_tcp_pose_valid_)
+    {
+      actual_tcp_pose_ = TcpVectorToTransform(raw_actual_tcp_pose_);
+      actual_tcp_pose_valid_ = true;
+    }
+    return actual_tcp_pose_;
+  }
 
   inline const Eigen::Matrix<double, 6, 1>& ActualTcpTwist() const
   { return actual_tcp_twist_; }
@@ -279,32 +709,848 @@ public:
 
   inline double MainboardCurrent() const
   { return mainboard_current_; }
+
+  inline uint64_t DigitalInputBits() const
+  { return static_cast<uint64_t>(digital_input_bits_); }
+
+  inline uint64_t DigitalOutputBits() const
+  { return static_cast<uint64_t>(digital_output_bits_); }
+
+  inline double ProgramState() const
+  { return program_state_; }
+
+  inline double SafetyStatus() const
+  { return safety_status_; }
+
+  // Arrival time of the packet, in nanoseconds since the epoch of
+  // CLOCK_REALTIME, as timestamped by the kernel when it was received.
+  inline int64_t ReceiveTimeNanoseconds() const
+  { return receive_time_ns_; }
+
+  inline void SetReceiveTimeNanoseconds(const int64_t receive_time_ns)
+  { receive_time_ns_ = receive_time_ns; }
+
+  // Estimated time at which the controller sampled this state, in
+  // nanoseconds since the epoch of CLOCK_REALTIME (i.e. ROS time). This is
+  // the receive time until the controller clock has been estimated.
+  inline int64_t SampleTimeNanoseconds() const
+  { return sample_time_ns_; }
+
+  // As SampleTimeNanoseconds(), but in CLOCK_MONOTONIC.
+  inline int64_t MonotonicSampleTimeNanoseconds() const
+  { return monotonic_sample_time_ns_; }
+
+  inline void SetSampleTimeNanoseconds(const int64_t sample_time_ns,
+                                       const int64_t monotonic_sample_time_ns)
+  {
+    sample_time_ns_ = sample_time_ns;
+    monotonic_sample_time_ns_ = monotonic_sample_time_ns;
+  }
 };
 
-class URRealtimeInterface
+inline int64_t TimespecToNanoseconds(const struct timespec& time)
+{
+  return (static_cast<int64_t>(time.tv_sec) * 1000000000)
+         + static_cast<int64_t>(time.tv_nsec);
+}
+
+// Affine map from controller uptime to a host clock, in nanoseconds.
+class URControllerClockEstimate
+{
+private:
+
+  double anchor_controller_uptime_;
+  int64_t anchor_host_time_ns_;
+  double rate_;
+  bool valid_;
+
+public:
+
+  URControllerClockEstimate(const double anchor_controller_uptime,
+                            const int64_t anchor_host_time_ns,
+                            const double rate)
+    : anchor_controller_uptime_(anchor_controller_uptime),
+      anchor_host_time_ns_(anchor_host_time_ns), rate_(rate), valid_(true) {}
+
+  URControllerClockEstimate()
+    : anchor_controller_uptime_(0.0), anchor_host_time_ns_(0), rate_(1.0),
+      valid_(false) {}
+
+  inline bool Valid() const { return valid_; }
+
+  // Host seconds elapsed per second of controller uptime
+  inline double Rate() const { return rate_; }
+
+  // Drift of the controller clock relative to the host clock, in parts per
+  // million
+  inline double DriftPpm() const { return (rate_ - 1.0) * 1e6; }
+
+  inline int64_t ControllerUptimeToHostTime(
+      const double controller_uptime) const
+  {
+    return anchor_host_time_ns_ + static_cast<int64_t>(std::llround(
+        (controller_uptime - anchor_controller_uptime_) * rate_ * 1e9));
+  }
+};
+
+// Estimates the host time at which the controller sampled each state from
+// pairs of controller uptime and host receive time.
+//
+// The rate of the controller clock relative to the host clock is a least
+// squares fit over a sliding window of samples. Network and scheduling delays
+// only ever make packets late, so rather than the mean, the offset fits the
+// earliest-arriving sample in the window (the lower envelope), which leaves
+// only the minimum transport latency unaccounted for. The fit is recomputed
+// every refit_interval samples, and around the newest sample so that the
+// sums stay well-conditioned however long the controller has been up.
+//
+// Host times must come from a clock that is not stepped, e.g.
+// CLOCK_MONOTONIC.
+class URControllerClockEstimator
+{
+private:
+
+  struct Sample
+  {
+    double controller_uptime;
+    int64_t host_time_ns;
+  };
+
+  static constexpr size_t kMinimumSamplesToFit = 10;
+
+  std::vector<Sample> samples_;
+  size_t refit_interval_;
+  size_t next_sample_index_;
+  size_t num_samples_;
+  size_t samples_since_fit_;
+  double last_controller_uptime_;
+  URControllerClockEstimate estimate_;
+
+  void Fit();
+
+public:
+
+  URControllerClockEstimator(const size_t window_size,
+                             const size_t refit_interval)
+    : samples_(window_size), refit_interval_(refit_interval),
+      next_sample_index_(0), num_samples_(0), samples_since_fit_(0),
+      last_controller_uptime_(0.0)
+  {
+    if (window_size < kMinimumSamplesToFit)
+    {
+      throw std::invalid_argument("window_size must be at least "
+                                  + std::to_string(kMinimumSamplesToFit));
+    }
+    if (refit_interval == 0)
+    {
+      throw std::invalid_argument("refit_interval must be greater than zero");
+    }
+  }
+
+  void AddSample(const double controller_uptime, const int64_t host_time_ns);
+
+  // Discards all samples and the current estimate.
+  void Reset();
+
+  inline const URControllerClockEstimate& Estimate() const
+  { return estimate_; }
+};
+
+// Running count, mean, standard deviation, minimum and maximum of a series of
+// samples, accumulated with Welford's algorithm.
+class URRunningStatistic
+{
+private:
+
+  uint64_t count_;
+  double mean_;
+  double sum_squared_deviations_;
+  double min_;
+  double max_;
+
+public:
+
+  URRunningStatistic()
+    : count_(0), mean_(0.0), sum_squared_deviations_(0.0), min_(0.0),
+      max_(0.0) {}
+
+  inline void AddSample(const double sample)
+  {
+    count_++;
+    const double deviation = sample - mean_;
+    mean_ += deviation / static_cast<double>(count_);
+    sum_squared_deviations_ += deviation * (sample - mean_);
+    min_ = (count_ == 1) ? sample : std::min(min_, sample);
+    max_ = (count_ == 1) ? sample : std::max(max_, sample);
+  }
+
+  inline uint64_t Count() const { return count_; }
+
+  inline double Mean() const { return mean_; }
+
+  inline double StdDev() const
+  {
+    return (count_ > 1)
+        ? std::sqrt(sum_squared_deviations_ / static_cast<double>(count_ - 1))
+        : 0.0;
+  }
+
+  inline double Min() const { return min_; }
+
+  inline double Max() const { return max_; }
+};
+
+// Arrival statistics for realtime state packets. All times are in seconds.
+//
+// The arrival period is the time between kernel receive timestamps of
+// consecutive packets. Jitter is the arrival period minus the change in
+// controller uptime over the same packets, so it measures delay variation
+// added between the controller and this host, independent of the controller
+// period. A gap is a change in controller uptime of more than 1.5 controller
+// periods, where the controller period is the smallest uptime change seen.
+class URRealtimeArrivalStatistics
 {
 private:
 
+  URRunningStatistic arrival_period_;
+  URRunningStatistic jitter_;
+  double controller_period_;
+  uint64_t num_packets_;
+  uint64_t num_gaps_;
+  uint64_t num_missed_packets_;
+  int64_t last_receive_time_ns_;
+  double last_controller_uptime_;
+  bool has_last_packet_;
+
+public:
+
+  URRealtimeArrivalStatistics()
+    : controller_period_(0.0), num_packets_(0), num_gaps_(0),
+      num_missed_packets_(0), last_receive_time_ns_(0),
+      last_controller_uptime_(0.0), has_last_packet_(false) {}
+
+  void AddPacket(const int64_t receive_time_ns,
+                 const double controller_uptime);
+
+  // Starts a new series, e.g. after reconnecting, without discarding the
+  // statistics accumulated so far.
+  inline void Restart() { has_last_packet_ = false; }
+
+  inline uint64_t NumPackets() const { return num_packets_; }
+
+  // Arrival periods across gaps are excluded
+  inline const URRunningStatistic& ArrivalPeriod() const
+  { return arrival_period_; }
+
+  inline const URRunningStatistic& Jitter() const { return jitter_; }
+
+  inline double ControllerPeriod() const { return controller_period_; }
+
+  inline uint64_t NumGaps() const { return num_gaps_; }
+
+  inline uint64_t NumMissedPackets() const { return num_missed_packets_; }
+};
+
+// Statistics of the cycles run by a URStatePhaseLock.
+class URPhaseLockStatistics
+{
+private:
+
+  URRunningStatistic send_phase_;
+  uint64_t num_cycles_;
+  uint64_t num_overruns_;
+  uint64_t num_skipped_states_;
+
+public:
+
+  URPhaseLockStatistics()
+    : num_cycles_(0), num_overruns_(0), num_skipped_states_(0) {}
+
+  void AddCycle(const double send_phase, const bool overrun,
+                const uint64_t skipped_states)
+  {
+    send_phase_.AddSample(send_phase);
+    num_cycles_++;
+    num_overruns_ += (overrun) ? 1 : 0;
+    num_skipped_states_ += skipped_states;
+  }
+
+  // Time from receiving each state to the start of its send, in seconds
+  inline const URRunningStatistic& SendPhase() const { return send_phase_; }
+
+  inline uint64_t NumCycles() const { return num_cycles_; }
+
+  // Cycles that only reached their send time after the next state arrived
+  inline uint64_t NumOverruns() const { return num_overruns_; }
+
+  // States that arrived without a cycle of their own
+  inline uint64_t NumSkippedStates() const { return num_skipped_states_; }
+};
+
+// Locks a periodic send (or control) cycle to the arrival of realtime states,
+// so that commands reach the robot at a consistent phase of its control cycle
+// instead of beating against it. The recv callback calls NotifyState() for
+// every state, and the cycle calls WaitForSendTime() before each send, which
+// returns send_offset after the kernel received the next state.
+// NotifyState() never locks, so it is safe to call from a shared reactor.
+class URStatePhaseLock
+{
+private:
+
+  int64_t send_offset_ns_;
+  // Receive time of the latest state, in CLOCK_MONOTONIC
+  std::atomic<int64_t> latest_receive_time_ns_;
+  std::atomic<uint64_t> num_states_;
+  // Signalled for each state, to wake the cycle waiting for one
+  int state_fd_;
+  // Owned by the cycle thread
+  uint64_t num_used_states_;
+  // Guards statistics between the cycle thread and readers
+  mutable std::mutex statistics_mutex_;
+  URPhaseLockStatistics statistics_;
+
+  bool WaitForState(const double timeout);
+
+public:
+
+  explicit URStatePhaseLock(const double send_offset);
+
+  ~URStatePhaseLock();
+
+  URStatePhaseLock(const URStatePhaseLock&) = delete;
+
+  URStatePhaseLock& operator=(const URStatePhaseLock&) = delete;
+
+  // Called from the recv thread for each state.
+  void NotifyState(const URRealtimeState& state);
+
+  // Waits until send_offset after the receipt of the latest state not yet
+  // used by a cycle, waiting up to timeout seconds for one to arrive if
+  // needed. Returns immediately if the send time has already passed. Returns
+  // false on timeout, and true otherwise. Only call from one thread.
+  bool WaitForSendTime(const double timeout);
+
+  URPhaseLockStatistics Statistics() const;
+};
+
+// Reassembles length-prefixed UR packets from a TCP byte stream. TCP may
+// split a packet across several reads or coalesce several packets into one, so
+// received bytes are appended to a fixed-size ring buffer and complete packets
+// are drained from it, each copied into a reusable contiguous packet buffer.
+// Packets start with a big-endian length of length_prefix_size bytes (4 for
+// the realtime interface, 2 for RTDE) that includes the prefix itself.
+class URStreamFramer
+{
+private:
+
+  std::vector<uint8_t> ring_buffer_;
+  size_t ring_mask_;
+  uint64_t read_position_;
+  uint64_t write_position_;
+  uint32_t max_packet_size_;
+  uint32_t length_prefix_size_;
+  uint64_t discarded_bytes_;
+  std::vector<uint8_t> packet_buffer_;
+
+  inline uint8_t PeekByte(const uint64_t position) const
+  {
+    return ring_buffer_[static_cast<size_t>(position) & ring_mask_];
+  }
+
+  uint32_t PeekPacketLength() const;
+
+  void CopyOut(const uint64_t position, const size_t size, uint8_t* dest) const;
+
+public:
+
+  URStreamFramer(const size_t capacity, const uint32_t max_packet_size,
+                 const uint32_t length_prefix_size = 4);
+
+  inline size_t BufferedBytes() const
+  {
+    return static_cast<size_t>(write_position_ - read_position_);
+  }
+
+  inline size_t FreeBytes() const
+  {
+    return ring_buffer_.size() - BufferedBytes();
+  }
+
+  inline uint64_t DiscardedBytes() const { return discarded_bytes_; }
+
+  // Fills up to two regions describing the free space of the ring buffer, so
+  // that a single readv() can write directly into the buffer. Returns the
+  // number of regions filled.
+  int PrepareWrite(struct iovec* regions);
+
+  // Marks bytes written into the regions from PrepareWrite() as buffered.
+  void CommitWrite(const size_t bytes_written);
+
+  // Appends bytes from an external buffer, returning the number appended.
+  size_t Append(const uint8_t* data, const size_t size);
+
+  // Calls packet_fn for every complete packet currently buffered, in order.
+  // Returns the number of packets drained.
+  size_t DrainPackets(
+      const std::function<void(const std::vector<uint8_t>&)>& packet_fn);
+
+  void Reset();
+};
+
+// Decoder for a single packet layout, for example
+// &URRealtimeState::DeserializeFields<URRealtimeLayout1116, FieldMask>
+typedef uint64_t (URRealtimeState::*URRealtimeDecoderFn)(
+    const std::vector<uint8_t>&, const uint64_t);
+
+struct URRealtimeLayoutDecoder
+{
+  uint32_t message_length;
+  double protocol_version;
+  URRealtimeDecoderFn decoder_fn;
+};
+
+constexpr size_t kNumRealtimeLayouts = 5;
+
+typedef std::array<URRealtimeLayoutDecoder, kNumRealtimeLayouts>
+    URRealtimeDecoderTable;
+
+template<typename Layout, URRealtimeFieldMask FieldMask>
+inline URRealtimeLayoutDecoder MakeRealtimeLayoutDecoder()
+{
+  URRealtimeLayoutDecoder layout_decoder;
+  layout_decoder.message_length = Layout::kMessageLength;
+  layout_decoder.protocol_version = Layout::kProtocolVersion;
+  layout_decoder.decoder_fn
+      = &URRealtimeState::DeserializeFields<Layout, FieldMask>;
+  return layout_decoder;
+}
+
+// Decoders of the fields in FieldMask for every supported packet layout
+template<URRealtimeFieldMask FieldMask>
+inline URRealtimeDecoderTable MakeRealtimeDecoderTable()
+{
+  const URRealtimeDecoderTable decoder_table =
+  {{
+    MakeRealtimeLayoutDecoder<URRealtimeLayout812, FieldMask>(),
+    MakeRealtimeLayoutDecoder<URRealtimeLayout1044, FieldMask>(),
+    MakeRealtimeLayoutDecoder<URRealtimeLayout1060, FieldMask>(),
+    MakeRealtimeLayoutDecoder<URRealtimeLayout1108, FieldMask>(),
+    MakeRealtimeLayoutDecoder<URRealtimeLayout1116, FieldMask>()
+  }};
+  return decoder_table;
+}
+
+// Returns the decoder for packets of message_length bytes, or nullptr if no
+// supported layout has that length.
+inline const URRealtimeLayoutDecoder* SelectRealtimeDecoder(
+    const URRealtimeDecoderTable& decoder_table, const uint32_t message_length)
+{
+  for (const URRealtimeLayoutDecoder& layout_decoder : decoder_table)
+  {
+    if (layout_decoder.message_length == message_length)
+    {
+      return &layout_decoder;
+    }
+  }
+  return nullptr;
+}
+
+// Stamps each decoded state with its receive time and the estimated time at
+// which the controller sampled it, and tracks the arrival statistics and
+// controller clock estimate of the stream the states came from.
+class URStateTimestamper
+{
+private:
+
+  // 10 seconds of samples at 500 Hz, refit at 10 Hz
+  static constexpr size_t kClockEstimatorWindowSize = 5000;
+  static constexpr size_t kClockEstimatorRefitInterval = 50;
+
+  URRealtimeArrivalStatistics arrival_statistics_;
+  URControllerClockEstimator clock_estimator_;
+
+public:
+
+  URStateTimestamper()
+    : clock_estimator_(kClockEstimatorWindowSize,
+                       kClockEstimatorRefitInterval) {}
+
+  // Stamps state, whose controller uptime has been decoded, as received at
+  // receive_time_ns (CLOCK_REALTIME).
+  void Stamp(URRealtimeState& state, const int64_t receive_time_ns,
+             const int64_t monotonic_to_realtime_ns);
+
+  // Starts a new stream, keeping the clock estimate.
+  inline void Restart() { arrival_statistics_.Restart(); }
+
+  inline void Reset()
+  {
+    arrival_statistics_ = URRealtimeArrivalStatistics();
+    clock_estimator_.Reset();
+  }
+
+  inline const URRealtimeArrivalStatistics& ArrivalStatistics() const
+  { return arrival_statistics_; }
+
+  inline const URControllerClockEstimate& ClockEstimate() const
+  { return clock_estimator_.Estimate(); }
+};
+
+// Frames and decodes a realtime byte stream, stamps each state with its
+// receive and estimated sample times, and passes it to state_callback_fn.
+// This is the path shared by live data in URRealtimeInterface and captured
+// data in URRealtimeReplay.
+class URRealtimeStreamDecoder
+{
+private:
+
+  static constexpr size_t kRecvRingBufferSize = 16384;
+  static constexpr uint32_t kMaxPacketSize = 4096;
+
+  URStreamFramer framer_;
+  URRealtimeDecoderTable decoder_table_;
+  std::function<void(const URRealtimeState&)> state_callback_fn_;
+  std::function<void(const std::string&)> logging_fn_;
+  // Every packet is decoded into the same state to avoid allocations
+  URRealtimeState latest_state_;
+  URStateTimestamper timestamper_;
+  // The packet layout is selected from the first packet of each stream,
+  // after which each packet only needs its length compared against it
+  const URRealtimeLayoutDecoder* layout_decoder_;
+  uint32_t last_rejected_length_;
+  int64_t receive_time_ns_;
+  int64_t monotonic_to_realtime_ns_;
+
+  void DecodePacket(const std::vector<uint8_t>& packet);
+
+  void DrainPackets();
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  URRealtimeStreamDecoder(
+      const URRealtimeDecoderTable& decoder_table,
+      const std::function<void(const URRealtimeState&)>& state_callback_fn,
+      const std::function<void(const std::string&)>& logging_fn);
+
+  URRealtimeStreamDecoder(const URRealtimeStreamDecoder&) = delete;
+
+  URRealtimeStreamDecoder& operator=(const URRealtimeStreamDecoder&) = delete;
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  // Fills up to two regions of free buffer space for a single readv() or
+  // recvmsg() to write into. Returns the number of regions filled.
+  inline int PrepareWrite(struct iovec* regions)
+  { return framer_.PrepareWrite(regions); }
+
+  // Frames and decodes the bytes written into the regions from
+  // PrepareWrite(), which were received at receive_time_ns (CLOCK_REALTIME).
+  void CommitWrite(const size_t bytes_written, const int64_t receive_time_ns,
+                   const int64_t monotonic_to_realtime_ns);
+
+  // As CommitWrite(), but for bytes from an external buffer.
+  void Append(const uint8_t* data, const size_t size,
+              const int64_t receive_time_ns,
+              const int64_t monotonic_to_realtime_ns);
+
+  // Starts a new stream, e.g. after reconnecting. Buffered partial packets
+  // are discarded and the layout is selected again, since the controller may
+  // have been updated in the meantime.
+  void Restart();
+
+  // As Restart(), but also discards the arrival statistics and the clock
+  // estimate.
+  void Reset();
+
+  inline const URRealtimeArrivalStatistics& ArrivalStatistics() const
+  { return timestamper_.ArrivalStatistics(); }
+
+  inline const URControllerClockEstimate& ClockEstimate() const
+  { return timestamper_.ClockEstimate(); }
+};
+
+// Replays a capture file recorded by URRealtimeInterface::StartCapture()
+// through URRealtimeStreamDecoder, exactly as the recorded bytes were
+// received, so that decoding and everything downstream of state_callback_fn
+// can be benchmarked and debugged without a robot.
+class URRealtimeReplay
+{
+private:
+
+  URStreamCaptureReader reader_;
+  URRealtimeStreamDecoder stream_decoder_;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  URRealtimeReplay(
+      const std::string& capture_path,
+      const std::function<void(const URRealtimeState&)>& state_callback_fn,
+      const std::function<void(const std::string&)>& logging_fn,
+      const URRealtimeDecoderTable& decoder_table
+          = MakeRealtimeDecoderTable<kAllRealtimeFields>());
+
+  // Replays the whole capture. If at_recorded_speed is true, each read is
+  // delivered with its recorded spacing, otherwise as fast as possible.
+  // Returns the number of bytes replayed.
+  uint64_t Run(const bool at_recorded_speed);
+
+  inline const URRealtimeArrivalStatistics& ArrivalStatistics() const
+  { return stream_decoder_.ArrivalStatistics(); }
+
+  inline const URControllerClockEstimate& ClockEstimate() const
+  { return stream_decoder_.ClockEstimate(); }
+};
+
+// Connection timing for URRobotConnection. All values are in seconds.
+class URRealtimeConnectionParams
+{
+private:
+
+  double connect_timeout_;
+  double min_reconnect_backoff_;
+  double max_reconnect_backoff_;
+  double watchdog_timeout_;
+
+public:
+
+  URRealtimeConnectionParams(const double connect_timeout,
+                             const double min_reconnect_backoff,
+                             const double max_reconnect_backoff,
+                             const double watchdog_timeout)
+    : connect_timeout_(connect_timeout),
+      min_reconnect_backoff_(min_reconnect_backoff),
+      max_reconnect_backoff_(max_reconnect_backoff),
+      watchdog_timeout_(watchdog_timeout)
+  {
+    if ((connect_timeout_ <= 0.0) || (min_reconnect_backoff_ <= 0.0)
+        || (max_reconnect_backoff_ < min_reconnect_backoff_)
+        || (watchdog_timeout_ <= 0.0))
+    {
+      throw std::invalid_argument(
+          "Timeouts and backoffs must be positive, and max_reconnect_backoff"
+          " must not be less than min_reconnect_backoff");
+    }
+  }
+
+  URRealtimeConnectionParams()
+    : connect_timeout_(1.0), min_reconnect_backoff_(0.1),
+      max_reconnect_backoff_(2.0), watchdog_timeout_(0.5) {}
+
+  // Time allowed for a connection attempt to complete
+  inline double ConnectTimeout() const { return connect_timeout_; }
+
+  // Delay before the first reconnect attempt, doubled after each failure
+  inline double MinReconnectBackoff() const { return min_reconnect_backoff_; }
+
+  inline double MaxReconnectBackoff() const { return max_reconnect_backoff_; }
+
+  // A connection that receives no data for this long is considered failed
+  inline double WatchdogTimeout() const { return watchdog_timeout_; }
+};
+
+// Reads from socket_fd into regions, returning the result of recvmsg(). On
+// success, receive_time_ns is the kernel receive timestamp (CLOCK_REALTIME)
+// of the most recent segment read, or the current time if the socket does not
+// provide one, and monotonic_to_realtime_ns is the current offset from
+// CLOCK_MONOTONIC to CLOCK_REALTIME.
+ssize_t RecvTimestamped(const int socket_fd, struct iovec* regions,
+                        const int num_regions, int64_t& receive_time_ns,
+                        int64_t& monotonic_to_realtime_ns);
+
+// A TCP connection to one port of the robot, driven by a single I/O thread.
+// Run() loops over the robot socket, a timerfd that provides connect,
+// reconnect and watchdog deadlines, and an eventfd used to stop the loop, so
+// the thread never sleeps blindly or blocks in connect(). Connections are
+// retried with exponential backoff, and a connection that receives no data
+// for the watchdog timeout is dropped and retried.
+class URRobotConnection
+{
+private:
+
+  enum ConnectionState : uint8_t
+  {
+    kDisconnected,
+    kConnecting,
+    kConnected
+  };
+
+  // Guards socket_fd_ between the I/O thread, which opens and closes it, and
+  // threads calling Send(). Only held to swap or duplicate the fd.
+  std::mutex socket_mutex_;
   int socket_fd_;
+  int epoll_fd_;
+  int timer_fd_;
+  int wake_fd_;
   struct sockaddr_in robot_addr_;
-  std::mutex socket_mutex_;
-  std::atomic<bool> connected_;
+  std::atomic<bool> ready_;
+  // Notified when the connection becomes ready
+  std::mutex ready_mutex_;
+  std::condition_variable ready_cv_;
+  std::function<void(const std::string&)> logging_fn_;
+  URRealtimeConnectionParams connection_params_;
+  // Owned by the I/O thread
+  ConnectionState connection_state_;
+  double reconnect_backoff_;
+  uint64_t connection_count_;
+  std::chrono::steady_clock::time_point last_data_time_;
+
+  void ArmTimer(const double initial_delay, const double interval);
+
+  void BeginConnect();
+
+  bool CompleteConnect();
+
+  void HandleTimer(const std::function<bool(void)>& expecting_data_fn);
+
+  void CloseSocket();
+
+  void WaitAndDispatch(const int timeout_ms,
+                       const std::function<void(const int)>& connected_fn,
+                       const std::function<void(const int)>& readable_fn,
+                       const std::function<bool(void)>& expecting_data_fn);
+
+public:
+
+  URRobotConnection(const std::string& robot_host, const uint16_t port,
+                    const URRealtimeConnectionParams& connection_params,
+                    const std::function<void(const std::string&)>& logging_fn);
+
+  ~URRobotConnection();
+
+  URRobotConnection(const URRobotConnection&) = delete;
+
+  URRobotConnection& operator=(const URRobotConnection&) = delete;
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  // Runs on the I/O thread until running is false, calling connected_fn
+  // once each new connection is established and readable_fn whenever its
+  // socket has data. Both receive the socket fd. For protocols where the
+  // robot only sends replies, expecting_data_fn limits the watchdog to times
+  // when it returns true, e.g. while requests are outstanding.
+  void Run(const std::atomic<bool>& running,
+           const std::function<void(const int)>& connected_fn,
+           const std::function<void(const int)>& readable_fn,
+           const std::function<bool(void)>& expecting_data_fn
+               = std::function<bool(void)>());
+
+  // Wakes Run(), so that it notices running has been cleared.
+  void Wake();
+
+  // Alternatively, the connection can be driven by an external event loop
+  // such as URIOReactor, which calls ProcessEvents() whenever EventFd() is
+  // readable, in place of Run(). Open() starts connecting, and the thread
+  // calling ProcessEvents() is then the I/O thread until Close().
+  inline int EventFd() const { return epoll_fd_; }
+
+  void Open();
+
+  // Handles all pending events without blocking, with callbacks as Run().
+  void ProcessEvents(const std::function<void(const int)>& connected_fn,
+                     const std::function<void(const int)>& readable_fn,
+                     const std::function<bool(void)>& expecting_data_fn
+                         = std::function<bool(void)>());
+
+  // Drops the connection without reconnecting.
+  void Close();
+
+  // Drops the connection and schedules a reconnect. Only call from the I/O
+  // thread, e.g. from the Run() callbacks.
+  void Reconnect(const std::string& reason);
+
+  // Feeds the watchdog. Only call from the I/O thread.
+  inline void NoteDataReceived()
+  { last_data_time_ = std::chrono::steady_clock::now(); }
+
+  // Marks the current connection as ready for use, e.g. once a protocol
+  // handshake has completed, and wakes WaitForReady(). Only call from the
+  // I/O thread.
+  void MarkReady();
+
+  inline bool IsReady() const { return ready_.load(); }
+
+  // Returns false if not ready within timeout seconds.
+  bool WaitForReady(const double timeout);
+
+  // True while a connection is established, whether or not it is ready.
+  // Only call from the I/O thread.
+  inline bool IsOpen() const { return connection_state_ == kConnected; }
+
+  // Number of connections established so far
+  inline uint64_t ConnectionCount() const { return connection_count_; }
+
+  // Writes all of data to the socket, waiting for space in the send buffer
+  // if needed. Safe to call from any thread. Returns the number of bytes
+  // written, which is less than size on failure or if not connected.
+  size_t Send(const uint8_t* data, const size_t size);
+};
+
+// Streams state from the realtime interface (port 30003). The recv thread
+// runs the URRobotConnection loop, and applies recv_thread_config (e.g.
+// SCHED_FIFO priority and CPU affinity) when it starts. State callbacks run
+// on the recv thread. Alternatively, StartRecv(reactor) runs the connection
+// on a URIOReactor shared with other connections, whose thread then calls
+// the state callbacks, and recv_thread_config is unused.
+class URRealtimeInterface
+{
+private:
+
+  static constexpr uint16_t kRealtimePort = 30003;
+
+  URRobotConnection connection_;
   std::atomic<bool> running_;
   std::thread recv_thread_;
   std::function<void(const URRealtimeState&)> state_received_callback_fn_;
   std::function<void(const std::string&)> logging_fn_;
+  URRealtimeDecoderTable decoder_table_;
+  tri_realtime_common::RealtimeThreadConfig recv_thread_config_;
+  // The recv thread updates its own statistics and copies them here only if
+  // the lock is free, so readers never delay it
+  mutable std::mutex statistics_mutex_;
+  URRealtimeArrivalStatistics published_arrival_statistics_;
+  URControllerClockEstimate published_clock_estimate_;
+  // Read by the recv thread without locking. StartCapture() and
+  // StopCapture() swap the writer out and wait for capture_in_use_ to clear
+  // before deleting it.
+  std::atomic<URStreamCaptureWriter*> capture_writer_ptr_;
+  std::atomic<bool> capture_in_use_;
+  // Owned by the recv thread (or reactor thread)
+  URRealtimeStreamDecoder stream_decoder_;
+  URIOReactor* reactor_ptr_;
+
+  void HandleConnected();
 
-  void ConnectToRobot();
+  void ReadSocket(const int socket_fd);
+
+  void CaptureRead(
+      const struct iovec* regions, const int num_regions, const size_t size,
+      const int64_t receive_time_ns, const int64_t monotonic_to_realtime_ns);
+
+  // Publishes capture_writer_ptr to the recv thread and returns the previous
+  // writer once the recv thread is done with it.
+  std::unique_ptr<URStreamCaptureWriter> SwapCaptureWriter(
+      URStreamCaptureWriter* capture_writer_ptr);
+
+  void ProcessConnectionEvents();
 
   void RecvLoop();
 
 public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
   URRealtimeInterface(
     const std::string& robot_host,
     const std::function<void(const URRealtimeState&)>&
       state_received_callback_fn,
-    const std::function<void(const std::string&)>& logging_fn);
+    const std::function<void(const std::string&)>& logging_fn,
+    const URRealtimeConnectionParams& connection_params
+        = URRealtimeConnectionParams(),
+    const URRealtimeDecoderTable& decoder_table
+        = MakeRealtimeDecoderTable<kAllRealtimeFields>(),
+    const tri_realtime_common::RealtimeThreadConfig& recv_thread_config
+        = tri_realtime_common::RealtimeThreadConfig());
 
   ~URRealtimeInterface();
 
@@ -312,8 +1558,32 @@ public:
 
   void StartRecv();
 
+  // Runs the connection on reactor instead of a recv thread of its own.
+  // reactor must outlive StopRecv().
+  void StartRecv(URIOReactor& reactor);
+
   void StopRecv();
 
   bool SendURScriptCommand(const std::string& command);
+
+  inline bool IsConnected() const { return connection_.IsReady(); }
+
+  // Connections are made asynchronously by the recv thread, so callers that
+  // must send commands right after StartRecv() wait here. Returns false if
+  // not connected within timeout seconds.
+  bool WaitForConnection(const double timeout);
+
+  // Arrival statistics of all packets received so far
+  URRealtimeArrivalStatistics ArrivalStatistics() const;
+
+  // Current map from controller uptime to CLOCK_MONOTONIC
+  URControllerClockEstimate ControllerClockEstimate() const;
+
+  // Records every read from the robot socket, with its kernel receive time,
+  // to a capture file at capture_path that URRealtimeReplay can replay.
+  // Replaces any capture in progress.
+  void StartCapture(const std::string& capture_path);
+
+  void StopCapture();
 };
 }
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <endian.h>
+#if defined(__AVX512BW__) || defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+namespace lightweight_ur_interface
+{
+// Converts count big-endian doubles starting at network_data into host
+// doubles, one double at a time.
+inline void NetworkDoublesToHostScalar(
+    const uint8_t* network_data, const size_t count, double* host_values)
+{
+  for (size_t idx = 0; idx < count; idx++)
+  {
+    uint64_t network_bits = 0;
+    std::memcpy(&network_bits, network_data + (idx * sizeof(double)),
+                sizeof(network_bits));
+    const uint64_t host_bits = be64toh(network_bits);
+    std::memcpy(host_values + idx, &host_bits, sizeof(host_bits));
+  }
+}
+
+// Converts count big-endian doubles starting at network_data into host
+// doubles in a single pass. Neither pointer needs to be aligned, but stores
+// are fastest when host_values is 32-byte aligned. Uses AVX-512BW, AVX2 or
+// SSSE3 byte shuffles when the build enables them, and falls back to the
+// scalar conversion otherwise.
+inline void NetworkDoublesToHost(
+    const uint8_t* network_data, const size_t count, double* host_values)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+  std::memcpy(host_values, network_data, count * sizeof(double));
+#else
+  size_t idx = 0;
+#if defined(__AVX512BW__)
+  const __m512i swap_mask_512 = _mm512_set_epi64(
+      0x08090a0b0c0d0e0fLL, 0x0001020304050607LL,
+      0x08090a0b0c0d0e0fLL, 0x0001020304050607LL,
+      0x08090a0b0c0d0e0fLL, 0x0001020304050607LL,
+      0x08090a0b0c0d0e0fLL, 0x0001020304050607LL);
+  for (; (idx + 8) <= count; idx += 8)
+  {
+    const __m512i network_block = _mm512_loadu_si512(
+        network_data + (idx * sizeof(double)));
+    _mm512_storeu_si512(host_values + idx,
+                        _mm512_shuffle_epi8(network_block, swap_mask_512));
+  }
+#endif
+#if defined(__AVX2__)
+  const __m256i swap_mask_256 = _mm256_setr_epi8(
+      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  // Two independent blocks per iteration to keep both shuffle ports busy
+  for (; (idx + 8) <= count; idx += 8)
+  {
+    const uint8_t* network_block = network_data + (idx * sizeof(double));
+    const __m256i network_block_0 = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(network_block));
+    const __m256i network_block_1 = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(network_block + 32));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(host_values + idx),
+        _mm256_shuffle_epi8(network_block_0, swap_mask_256));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(host_values + idx + 4),
+        _mm256_shuffle_epi8(network_block_1, swap_mask_256));
+  }
+  for (; (idx + 4) <= count; idx += 4)
+  {
+    const __m256i network_block = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(
+            network_data + (idx * sizeof(double))));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(host_values + idx),
+        _mm256_shuffle_epi8(network_block, swap_mask_256));
+  }
+#endif
+#if defined(__SSSE3__)
+  const __m128i swap_mask_128 = _mm_setr_epi8(
+      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  for (; (idx + 2) <= count; idx += 2)
+  {
+    const __m128i network_block = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(
+            network_data + (idx * sizeof(double))));
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(host_values + idx),
+        _mm_shuffle_epi8(network_block, swap_mask_128));
+  }
+#endif
+  NetworkDoublesToHostScalar(
+      network_data + (idx * sizeof(double)), count - idx, host_values + idx);
+#endif
+}
+
+// Converts count host doubles, each multiplied by scale and truncated toward
+// zero, into big-endian int32 values starting at network_data, one value at a
+// time. Scaled values must fit in an int32.
+inline void ScaledDoublesToNetworkInt32Scalar(
+    const double* host_values, const size_t count, const double scale,
+    uint8_t* network_data)
+{
+  for (size_t idx = 0; idx < count; idx++)
+  {
+    const int32_t host_value
+        = static_cast<int32_t>(host_values[idx] * scale);
+    const uint32_t network_bits = htobe32(static_cast<uint32_t>(host_value));
+    std::memcpy(network_data + (idx * sizeof(int32_t)), &network_bits,
+                sizeof(network_bits));
+  }
+}
+
+// Converts count host doubles, each multiplied by scale and truncated toward
+// zero, into big-endian int32 values starting at network_data. Multiplies,
+// converts and byte-swaps four values at a time with AVX, or two at a time
+// with SSSE3, and falls back to the scalar conversion otherwise.
+inline void ScaledDoublesToNetworkInt32(
+    const double* host_values, const size_t count, const double scale,
+    uint8_t* network_data)
+{
+  size_t idx = 0;
+#if (__BYTE_ORDER == __LITTLE_ENDIAN) && defined(__SSSE3__)
+  const __m128i swap_mask_128 = _mm_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+#if defined(__AVX__)
+  const __m256d scale_256 = _mm256_set1_pd(scale);
+  for (; (idx + 4) <= count; idx += 4)
+  {
+    const __m128i host_block = _mm256_cvttpd_epi32(
+        _mm256_mul_pd(_mm256_loadu_pd(host_values + idx), scale_256));
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(network_data + (idx * sizeof(int32_t))),
+        _mm_shuffle_epi8(host_block, swap_mask_128));
+  }
+#endif
+  const __m128d scale_128 = _mm_set1_pd(scale);
+  for (; (idx + 2) <= count; idx += 2)
+  {
+    const __m128i host_block = _mm_cvttpd_epi32(
+        _mm_mul_pd(_mm_loadu_pd(host_values + idx), scale_128));
+    _mm_storel_epi64(
+        reinterpret_cast<__m128i*>(network_data + (idx * sizeof(int32_t))),
+        _mm_shuffle_epi8(host_block, swap_mask_128));
+  }
+#endif
+  ScaledDoublesToNetworkInt32Scalar(
+      host_values + idx, count - idx, scale,
+      network_data + (idx * sizeof(int32_t)));
+}
+
+// Converts count host int32 values into big-endian int32 values starting at
+// network_data.
+inline void Int32ToNetwork(
+    const int32_t* host_values, const size_t count, uint8_t* network_data)
+{
+  for (size_t idx = 0; idx < count; idx++)
+  {
+    const uint32_t network_bits
+        = htobe32(static_cast<uint32_t>(host_values[idx]));
+    std::memcpy(network_data + (idx * sizeof(int32_t)), &network_bits,
+                sizeof(network_bits));
+  }
+}
+}  // namespace lightweight_ur_interface
@@ -0,0 +1,897 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+#include <map>
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <std_srvs/Empty.h>
+#include <sensor_msgs/JointState.h>
+#include <control_msgs/JointTrajectoryControllerState.h>
+#include <lightweight_ur_interface/ur_robot_config.hpp>
+#include <lightweight_ur_interface/ur_shared_memory_channel.hpp>
+#include <lightweight_ur_interface/ur_controller_plugin.hpp>
+#include <lightweight_ur_interface/dispatch_thread.hpp>
+#include <lightweight_ur_interface/latest_value_channel.hpp>
+#include <lightweight_ur_interface/PositionCommand.h>
+#include <lightweight_ur_interface/VelocityCommand.h>
+#include <common_robotics_utilities/print.hpp>
+#include <common_robotics_utilities/math.hpp>
+#include <common_robotics_utilities/conversions.hpp>
+
+namespace lightweight_ur_interface
+{
+using common_robotics_utilities::print::Print;
+using common_robotics_utilities::utility::ClampValue;
+using common_robotics_utilities::utility::ClampValueAndWarn;
+using common_robotics_utilities::math::Add;
+using common_robotics_utilities::math::Sub;
+using common_robotics_utilities::math::Multiply;
+using common_robotics_utilities::math::Divide;
+using common_robotics_utilities::utility::IsSubset;
+using common_robotics_utilities::utility::GetKeysFromMapLike;
+
+class URPositionController : public URControllerPlugin
+{
+private:
+
+  static constexpr size_t IN_PROCESS_PUBLISH_QUEUE_CAPACITY = 16;
+
+  // Values of the first joint_names_.size() joints are set. Fixed size, so
+  // handing them between threads never allocates; an in-process controller
+  // has at most the robot's six joints.
+  typedef std::array<double, 6> InProcessJointValues;
+
+  // Status or mirrored command of one step, published on its own thread if
+  // run in process
+  struct InProcessPublication
+  {
+    bool is_status;
+    InProcessJointValues target_config;
+    InProcessJointValues target_velocities;
+    InProcessJointValues current_config;
+    InProcessJointValues current_velocities;
+  };
+
+  // Latest target from the callback thread if run in process. Aborts are
+  // counted, so that one followed by a new target before the next Update()
+  // is not lost.
+  struct InProcessTarget
+  {
+    bool valid;
+    uint64_t num_aborts;
+    InProcessJointValues target_config;
+  };
+
+  std::vector<std::string> joint_names_;
+  std::vector<std::pair<double, double>> joint_position_limits_;
+  std::vector<double> joint_velocity_limits_;
+  std::vector<double> joint_acceleration_limits_;
+  std::vector<PIDParams> joint_controller_parameters_;
+  bool limit_acceleration_;
+  bool autoscale_velocities_;
+
+  bool target_config_valid_;
+  bool current_state_valid_;
+  // Set by each valid state feedback message, cleared by each state-triggered
+  // controller step
+  bool new_state_feedback_;
+  std::vector<double> target_config_;
+  std::vector<double> current_config_;
+  std::vector<double> current_velocities_;
+  std::vector<double> previous_velocity_command_;
+  // Exchanges state and velocity commands with the hardware interface
+  // through shared memory instead of topics, if enabled
+  std::unique_ptr<URSharedMemoryClient> shared_memory_ptr_;
+  // Index of each of our joints in the robot's joint order
+  std::vector<size_t> shared_joint_indices_;
+  // Set if run by the hardware interface, which takes the latest command
+  // from each Update()
+  bool in_process_;
+  bool in_process_command_valid_;
+  URSharedCommand in_process_command_;
+  // Queues target and abort callbacks for the spinner thread if run in
+  // process, so they never run on the thread that runs Update(). Declared
+  // before nh_, which uses it.
+  ros::CallbackQueue in_process_callback_queue_;
+  // Hands targets and aborts from the spinner thread to Update()
+  LatestValueChannel<InProcessTarget> in_process_target_channel_;
+  // Aborts requested by callbacks, only used by the spinner thread
+  uint64_t in_process_num_aborts_requested_;
+  // Aborts applied by Update()
+  uint64_t in_process_num_aborts_applied_;
+
+  std::vector<double> config_error_integrals_;
+  std::vector<double> last_config_errors_;
+  // Intermediate results of each step, sized once so stepping doesn't
+  // allocate
+  std::vector<double> raw_config_correction_;
+  std::vector<double> config_correction_;
+  std::vector<double> velocity_limited_config_correction_;
+  std::vector<double> acceleration_limited_config_correction_;
+  const std::vector<double> zero_velocities_;
+
+  ros::NodeHandle nh_;
+  ros::Publisher status_pub_;
+  ros::Publisher command_pub_;
+  ros::Subscriber feedback_sub_;
+  ros::Subscriber position_command_sub_;
+  ros::ServiceServer abort_server_;
+  // Reused for every publication, so steady-state steps don't allocate
+  InProcessPublication in_process_publication_;
+  // Builds and publishes messages if run in process, so the thread that
+  // runs Update() never does. Declared after the publishers it uses.
+  std::unique_ptr<DispatchThread<InProcessPublication>>
+      in_process_publisher_ptr_;
+  // Runs callbacks if run in process. Declared last, so that it is stopped
+  // before anything its callbacks use is destroyed.
+  std::unique_ptr<ros::AsyncSpinner> in_process_spinner_ptr_;
+
+public:
+
+  URPositionController(
+      const ros::NodeHandle& nh,
+      const std::string& position_command_topic,
+      const std::string& state_feedback_topic,
+      const std::string& velocity_command_topic,
+      const std::string& status_topic,
+      const std::string& abort_service,
+      const std::string& shared_memory_name,
+      const bool in_process,
+      const std::map<std::string, JointLimits>& joint_limits,
+      const std::map<std::string, PIDParams> joint_controller_params,
+      const bool limit_acceleration,
+      const bool autoscale_velocities)
+    : zero_velocities_(joint_limits.size(), 0.0), nh_(nh)
+  {
+    limit_acceleration_ = limit_acceleration;
+    autoscale_velocities_ = autoscale_velocities;
+    target_config_valid_ = false;
+    current_state_valid_ = false;
+    new_state_feedback_ = false;
+    in_process_ = in_process;
+    in_process_command_valid_ = false;
+    in_process_num_aborts_requested_ = 0;
+    in_process_num_aborts_applied_ = 0;
+    joint_names_ = GetKeysFromMapLike<std::string, JointLimits>(joint_limits);
+    target_config_ = std::vector<double>(joint_names_.size(), 0.0);
+    current_config_ = std::vector<double>(joint_names_.size(), 0.0);
+    current_velocities_ = std::vector<double>(joint_names_.size(), 0.0);
+    previous_velocity_command_ = std::vector<double>(joint_names_.size(), 0.0);
+    config_error_integrals_ = std::vector<double>(joint_names_.size(), 0.0);
+    last_config_errors_ = std::vector<double>(joint_names_.size(), 0.0);
+    raw_config_correction_ = std::vector<double>(joint_names_.size(), 0.0);
+    config_correction_ = std::vector<double>(joint_names_.size(), 0.0);
+    velocity_limited_config_correction_
+        = std::vector<double>(joint_names_.size(), 0.0);
+    acceleration_limited_config_correction_
+        = std::vector<double>(joint_names_.size(), 0.0);
+    joint_position_limits_.resize(joint_names_.size());
+    joint_velocity_limits_.resize(joint_names_.size());
+    joint_acceleration_limits_.resize(joint_names_.size());
+    joint_controller_parameters_.resize(joint_names_.size());
+    for (size_t joint = 0; joint < joint_names_.size(); joint++)
+    {
+      const std::string& joint_name = joint_names_[joint];
+      const JointLimits& limits = joint_limits.at(joint_name);
+      joint_position_limits_[joint] = limits.PositionLimits();
+      joint_velocity_limits_[joint] = limits.MaxVelocity();
+      joint_acceleration_limits_[joint] = limits.MaxAcceleration();
+      const PIDParams& params = joint_controller_params.at(joint_name);
+      joint_controller_parameters_[joint] = params;
+    }
+    ROS_INFO(
+        "Running with joint limits:\n%s\nand joint controller parameters:\n%s",
+        Print(joint_limits, false, "\n").c_str(),
+        Print(joint_controller_params, false, "\n").c_str());
+    status_pub_
+        = nh_.advertise<control_msgs::JointTrajectoryControllerState>(
+            status_topic, 1, false);
+    if (in_process_)
+    {
+      ROS_INFO("Running in process with the hardware interface");
+      nh_.setCallbackQueue(&in_process_callback_queue_);
+      shared_joint_indices_ = GetOrderedJointIndices(joint_names_);
+    }
+    else if (!shared_memory_name.empty())
+    {
+      ROS_INFO("Exchanging state and velocity commands through shared memory"
+               " %s", shared_memory_name.c_str());
+      shared_memory_ptr_ = std::unique_ptr<URSharedMemoryClient>(
+          new URSharedMemoryClient(shared_memory_name,
+                                   [] (const std::string& message)
+      {
+        ROS_INFO("%s", message.c_str());
+      }));
+      shared_joint_indices_ = GetOrderedJointIndices(joint_names_);
+    }
+    else
+    {
+      feedback_sub_
+          = nh_.subscribe(state_feedback_topic,
+                          1,
+                          &URPositionController::StateFeedbackCallback,
+                          this);
+    }
+    // Commands that go to the hardware interface directly are still
+    // published for introspection, but on a topic of their own, as the
+    // hardware interface would execute them again from its command topic
+    const std::string command_topic
+        = (in_process_ || !shared_memory_name.empty())
+          ? velocity_command_topic + "_mirror" : velocity_command_topic;
+    command_pub_
+        = nh_.advertise<lightweight_ur_interface::VelocityCommand>(
+            command_topic, 1, false);
+    position_command_sub_
+        = nh_.subscribe(position_command_topic,
+                        1,
+                        &URPositionController::PositionCommandCallback,
+                        this);
+    abort_server_
+        = nh_.advertiseService(abort_service,
+                               &URPositionController::AbortCB,
+                               this);
+    if (in_process_)
+    {
+      in_process_publisher_ptr_
+          = std::unique_ptr<DispatchThread<InProcessPublication>>(
+              new DispatchThread<InProcessPublication>(
+                  IN_PROCESS_PUBLISH_QUEUE_CAPACITY,
+                  [this] (const InProcessPublication& publication)
+      {
+        PublishInProcess(publication);
+      }));
+      in_process_publisher_ptr_->Start();
+      in_process_spinner_ptr_ = std::unique_ptr<ros::AsyncSpinner>(
+          new ros::AsyncSpinner(1, &in_process_callback_queue_));
+      in_process_spinner_ptr_->start();
+    }
+  }
+
+  // Handles callbacks as they arrive, for up to timeout seconds, until a new
+  // state feedback message has been received. Returns false if none arrived.
+  bool WaitForStateFeedback(const double timeout)
+  {
+    if (shared_memory_ptr_)
+    {
+      // Wait on shared memory, and handle other callbacks once per state
+      URSharedState shared_state;
+      const bool received
+          = shared_memory_ptr_->WaitForNewState(timeout, shared_state);
+      ros::getGlobalCallbackQueue()->callAvailable();
+      if (received)
+      {
+        SharedStateFeedback(shared_state);
+      }
+      return received;
+    }
+    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(timeout));
+    const bool received = new_state_feedback_;
+    new_state_feedback_ = false;
+    return received;
+  }
+
+  void Loop(const double control_rate, const bool state_triggered)
+  {
+    const double control_interval = 1.0 / control_rate;
+    ros::Rate spin_rate(control_rate);
+    const uint8_t supersample_rate = 0x01;
+    uint8_t iteration_count = 0x01;
+    while (ros::ok())
+    {
+      // Process callbacks
+      if (state_triggered)
+      {
+        // Step once per state feedback message, as soon as it arrives, so
+        // that commands keep a fixed phase relative to the robot's cycle
+        if (!WaitForStateFeedback(control_interval))
+        {
+          continue;
+        }
+      }
+      else
+      {
+        ros::spinOnce();
+        URSharedState shared_state;
+        if (shared_memory_ptr_
+            && shared_memory_ptr_->ReadNewState(shared_state))
+        {
+          SharedStateFeedback(shared_state);
+        }
+      }
+      // Run controller
+      if (iteration_count == supersample_rate)
+      {
+        Step(control_interval);
+        iteration_count = 0x01;
+      }
+      else
+      {
+        iteration_count++;
+      }
+      // Spin
+      if (!state_triggered)
+      {
+        spin_rate.sleep();
+      }
+    }
+  }
+
+  // Takes the latest target and aborts from the spinner thread, then steps
+  // once
+  virtual bool Update(const URSharedState& state,
+                      const double control_interval,
+                      URSharedCommand& command)
+  {
+    in_process_command_valid_ = false;
+    TakeInProcessTarget();
+    SharedStateFeedback(state);
+    Step(control_interval);
+    if (in_process_command_valid_)
+    {
+      command = in_process_command_;
+    }
+    return in_process_command_valid_;
+  }
+
+  // Runs the controller once, from the latest state and target
+  void Step(const double control_interval)
+  {
+    if (target_config_valid_ && current_state_valid_)
+    {
+      ComputeRawNextStep(current_config_,
+                         target_config_,
+                         control_interval,
+                         raw_config_correction_);
+      if (autoscale_velocities_)
+      {
+        AutoscaleCorrection(current_config_,
+                            target_config_,
+                            raw_config_correction_,
+                            config_correction_);
+        LimitCorrectionVelocities(config_correction_,
+                                  velocity_limited_config_correction_);
+      }
+      else
+      {
+        LimitCorrectionVelocities(raw_config_correction_,
+                                  velocity_limited_config_correction_);
+      }
+      if (limit_acceleration_)
+      {
+        LimitCorrectionAccelerations(velocity_limited_config_correction_,
+                                     previous_velocity_command_,
+                                     control_interval,
+                                     acceleration_limited_config_correction_);
+        CommandVelocities(acceleration_limited_config_correction_);
+        previous_velocity_command_ = acceleration_limited_config_correction_;
+        PublishState(target_config_,
+                     acceleration_limited_config_correction_,
+                     current_config_,
+                     current_velocities_);
+      }
+      else
+      {
+        CommandVelocities(velocity_limited_config_correction_);
+        previous_velocity_command_ = velocity_limited_config_correction_;
+        PublishState(target_config_,
+                     velocity_limited_config_correction_,
+                     current_config_,
+                     current_velocities_);
+      }
+    }
+    else if (current_state_valid_)
+    {
+      previous_velocity_command_ = zero_velocities_;
+      PublishState(current_config_,
+                   zero_velocities_,
+                   current_config_,
+                   current_velocities_);
+    }
+  }
+
+  void PublishState(const std::vector<double>& target_config,
+                    const std::vector<double>& target_velocities,
+                    const std::vector<double>& current_config,
+                    const std::vector<double>& current_velocities)
+  {
+    if (in_process_)
+    {
+      in_process_publication_.is_status = true;
+      CopyJointValues(target_config, in_process_publication_.target_config);
+      CopyJointValues(target_velocities,
+                      in_process_publication_.target_velocities);
+      CopyJointValues(current_config, in_process_publication_.current_config);
+      CopyJointValues(current_velocities,
+                      in_process_publication_.current_velocities);
+      in_process_publisher_ptr_->Dispatch(in_process_publication_);
+    }
+    else
+    {
+      PublishStatusMessage(target_config,
+                           target_velocities,
+                           current_config,
+                           current_velocities);
+    }
+  }
+
+  void PublishStatusMessage(const std::vector<double>& target_config,
+                            const std::vector<double>& target_velocities,
+                            const std::vector<double>& current_config,
+                            const std::vector<double>& current_velocities)
+  {
+    control_msgs::JointTrajectoryControllerState state_msg;
+    state_msg.joint_names = joint_names_;
+    state_msg.desired.positions = target_config;
+    state_msg.desired.velocities = target_velocities;
+    state_msg.actual.positions = current_config;
+    state_msg.actual.velocities = current_velocities;
+    state_msg.error.positions = Sub(target_config, current_config);
+    state_msg.error.velocities = Sub(target_velocities, current_velocities);
+    status_pub_.publish(state_msg);
+  }
+
+  inline void CopyJointValues(const std::vector<double>& values,
+                              InProcessJointValues& joint_values) const
+  {
+    std::copy(values.begin(), values.end(), joint_values.begin());
+  }
+
+  inline std::vector<double> JointValuesVector(
+      const InProcessJointValues& joint_values) const
+  {
+    return std::vector<double>(joint_values.begin(),
+                               joint_values.begin() + joint_names_.size());
+  }
+
+  bool AbortCB(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res)
+  {
+    UNUSED(req);
+    UNUSED(res);
+    ROS_INFO("Aborting position target");
+    if (in_process_)
+    {
+      in_process_num_aborts_requested_++;
+      PublishInProcessTarget(false, std::vector<double>());
+    }
+    else
+    {
+      Abort();
+    }
+    return true;
+  }
+
+  void Abort()
+  {
+    CommandVelocities(zero_velocities_);
+    target_config_valid_ = false;
+    std::fill(config_error_integrals_.begin(), config_error_integrals_.end(),
+              0.0);
+    std::fill(last_config_errors_.begin(), last_config_errors_.end(), 0.0);
+  }
+
+  // Called from the spinner thread with each target or abort
+  void PublishInProcessTarget(const bool valid,
+                              const std::vector<double>& target_config)
+  {
+    InProcessTarget& target = in_process_target_channel_.WriteBuffer();
+    target.valid = valid;
+    target.num_aborts = in_process_num_aborts_requested_;
+    if (valid)
+    {
+      CopyJointValues(target_config, target.target_config);
+    }
+    in_process_target_channel_.Publish();
+  }
+
+  // Called from Update() to apply the latest target and any aborts
+  void TakeInProcessTarget()
+  {
+    if (in_process_target_channel_.Update())
+    {
+      const InProcessTarget& target = in_process_target_channel_.Latest();
+      if (target.num_aborts != in_process_num_aborts_applied_)
+      {
+        in_process_num_aborts_applied_ = target.num_aborts;
+        Abort();
+      }
+      if (target.valid)
+      {
+        std::copy(target.target_config.begin(),
+                  target.target_config.begin() + joint_names_.size(),
+                  target_config_.begin());
+      }
+      target_config_valid_ = target.valid;
+    }
+  }
+
+  // Each of the following writes one value per joint to its last argument,
+  // which must already be sized to match
+
+  void ComputeRawNextStep(const std::vector<double>& current_config,
+                          const std::vector<double>& target_config,
+                          const double time_interval,
+                          std::vector<double>& feedback_terms)
+  {
+    for (size_t idx = 0; idx < feedback_terms.size(); idx++)
+    {
+      const double joint_config_error
+          = target_config[idx] - current_config[idx];
+      const double last_joint_config_error = last_config_errors_[idx];
+      const PIDParams& params = joint_controller_parameters_[idx];
+      const double joint_config_error_integral_update
+          = ((last_joint_config_error * 0.5) + (joint_config_error * 0.5))
+            * time_interval;
+      const double joint_config_error_integral
+          = ClampValue(config_error_integrals_[idx]
+                       + joint_config_error_integral_update,
+                       -params.Iclamp(),
+                       params.Iclamp());
+      config_error_integrals_[idx] = joint_config_error_integral;
+      const double joint_config_error_derivative
+          = (joint_config_error - last_joint_config_error) / time_interval;
+      last_config_errors_[idx] = joint_config_error;
+      // Compute Feedback terms
+      const double p_term = joint_config_error * params.Kp();
+      const double i_term = joint_config_error_integral * params.Ki();
+      const double d_term = joint_config_error_derivative * params.Kd();
+      const double feedback_term = p_term + i_term + d_term;
+      feedback_terms[idx] = feedback_term;
+    }
+  }
+
+  void AutoscaleCorrection(const std::vector<double>& current_position,
+                           const std::vector<double>& target_position,
+                           const std::vector<double>& raw_correction,
+                           std::vector<double>& autoscaled_correction) const
+  {
+    double max_position_error = -std::numeric_limits<double>::infinity();
+    for (size_t idx = 0; idx < current_position.size(); idx++)
+    {
+      max_position_error
+          = std::max(max_position_error,
+                     target_position[idx] - current_position[idx]);
+    }
+    for (size_t idx = 0; idx < autoscaled_correction.size(); idx++)
+    {
+      const double raw_axis_correction = raw_correction[idx];
+      const double axis_error = target_position[idx] - current_position[idx];
+      const double axis_error_ratio
+          = std::abs(axis_error / max_position_error);
+      const double autoscaled_axis_correction
+          = raw_axis_correction * axis_error_ratio;
+      autoscaled_correction[idx] = autoscaled_axis_correction;
+    }
+  }
+
+  void LimitCorrectionVelocities(const std::vector<double>& raw_velocities,
+                                 std::vector<double>& limited_velocities) const
+  {
+    for (size_t idx = 0; idx < limited_velocities.size(); idx++)
+    {
+      const double raw_velocity = raw_velocities[idx];
+      const double velocity_limit = joint_velocity_limits_[idx];
+      const double limited_velocity
+          = ClampValue(raw_velocity, -velocity_limit, velocity_limit);
+      limited_velocities[idx] = limited_velocity;
+    }
+  }
+
+  void LimitCorrectionAccelerations(
+      const std::vector<double>& desired_velocities,
+      const std::vector<double>& current_velocities,
+      const double timestep,
+      std::vector<double>& limited_velocities) const
+  {
+    for (size_t idx = 0; idx < limited_velocities.size(); idx++)
+    {
+      const double desired_velocity = desired_velocities[idx];
+      const double current_velocity = current_velocities[idx];
+      const double acceleration_limit = joint_acceleration_limits_[idx];
+      const double desired_acceleration
+          = (desired_velocity - current_velocity) / timestep;
+      const double limited_acceleration
+          = ClampValue(desired_acceleration,
+                       -acceleration_limit,
+                       acceleration_limit);
+      const double limited_velocity
+          = current_velocity + (limited_acceleration * timestep);
+      const double fully_limited_velocity
+          = ClampValue(limited_velocity,
+                       -std::abs(desired_velocity),
+                       std::abs(desired_velocity));
+      limited_velocities[idx] = fully_limited_velocity;
+    }
+  }
+
+  void CommandVelocities(const std::vector<double>& velocities)
+  {
+    if (velocities.size() == joint_names_.size())
+    {
+      if (in_process_ || shared_memory_ptr_)
+      {
+        URSharedCommand command;
+        command.type = kSharedCommandSpeedJ;
+        command.reserved = 0;
+        // Joints we don't control are held still
+        command.values.fill(0.0);
+        for (size_t idx = 0; idx < joint_names_.size(); idx++)
+        {
+          command.values[shared_joint_indices_[idx]] = velocities[idx];
+        }
+        if (in_process_)
+        {
+          in_process_command_ = command;
+          in_process_command_valid_ = true;
+        }
+        else if (!shared_memory_ptr_->PostCommand(command))
+        {
+          ROS_WARN_THROTTLE(1.0, "Failed to post shared memory command");
+        }
+      }
+      if (in_process_)
+      {
+        in_process_publication_.is_status = false;
+        CopyJointValues(velocities, in_process_publication_.target_velocities);
+        in_process_publisher_ptr_->Dispatch(in_process_publication_);
+      }
+      // Mirrored commands are only built if someone is listening
+      else if (!shared_memory_ptr_ || (command_pub_.getNumSubscribers() > 0))
+      {
+        PublishCommandMessage(velocities);
+      }
+    }
+  }
+
+  void PublishCommandMessage(const std::vector<double>& velocities)
+  {
+    lightweight_ur_interface::VelocityCommand command_msg;
+    command_msg.name = joint_names_;
+    command_msg.velocity = velocities;
+    command_pub_.publish(command_msg);
+  }
+
+  // Called from the in process publisher thread
+  void PublishInProcess(const InProcessPublication& publication)
+  {
+    if (publication.is_status)
+    {
+      PublishStatusMessage(JointValuesVector(publication.target_config),
+                           JointValuesVector(publication.target_velocities),
+                           JointValuesVector(publication.current_config),
+                           JointValuesVector(publication.current_velocities));
+    }
+    else if (command_pub_.getNumSubscribers() > 0)
+    {
+      PublishCommandMessage(JointValuesVector(publication.target_velocities));
+    }
+  }
+
+  void PositionCommandCallback(
+      lightweight_ur_interface::PositionCommand config_target)
+  {
+    if (config_target.name.size() == config_target.position.size())
+    {
+      // Push the command into a map
+      std::map<std::string, double> command_map;
+      for (size_t idx = 0; idx < config_target.name.size(); idx++)
+      {
+        const std::string& name = config_target.name[idx];
+        const double command = config_target.position[idx];
+        command_map[name] = command;
+      }
+      // Extract the joint commands in order
+      std::vector<double> target_config(joint_names_.size(), 0.0);
+      bool command_valid = true;
+      for (size_t idx = 0; idx < joint_names_.size(); idx++)
+      {
+        // Get the name of the joint
+        const std::string& joint_name = joint_names_[idx];
+        // Get the position limits of the joint
+        const std::pair<double, double>& joint_position_limit
+            = joint_position_limits_[idx];
+        // Get the commanded value
+        const auto found_itr = command_map.find(joint_name);
+        if (found_itr != command_map.end())
+        {
+          const double position = found_itr->second;
+          const double limited_position
+              = ClampValueAndWarn(position,
+                                  joint_position_limit.first,
+                                  joint_position_limit.second);
+          target_config[idx] = limited_position;
+        }
+        else
+        {
+          ROS_WARN("Invalid PositionCommand: joint %s missing",
+                   joint_name.c_str());
+          command_valid = false;
+        }
+      }
+      if (command_valid == true)
+      {
+        ROS_INFO("Starting execution to a new target configuration");
+      }
+      SetTargetConfig(command_valid, target_config);
+    }
+    else
+    {
+      ROS_WARN("Invalid PositionCommand: %zu names, %zu positions",
+               config_target.name.size(), config_target.position.size());
+      SetTargetConfig(false, std::vector<double>());
+    }
+  }
+
+  void SetTargetConfig(const bool valid,
+                       const std::vector<double>& target_config)
+  {
+    if (in_process_)
+    {
+      PublishInProcessTarget(valid, target_config);
+    }
+    else
+    {
+      if (valid)
+      {
+        target_config_ = target_config;
+      }
+      target_config_valid_ = valid;
+    }
+  }
+
+  void SharedStateFeedback(const URSharedState& shared_state)
+  {
+    for (size_t idx = 0; idx < joint_names_.size(); idx++)
+    {
+      const size_t shared_idx = shared_joint_indices_[idx];
+      current_config_[idx] = shared_state.joint_position[shared_idx];
+      current_velocities_[idx] = shared_state.joint_velocity[shared_idx];
+    }
+    current_state_valid_ = true;
+  }
+
+  void StateFeedbackCallback(sensor_msgs::JointState config_feedback)
+  {
+    if ((config_feedback.name.size() == config_feedback.position.size())
+        && (config_feedback.name.size() == config_feedback.velocity.size())
+        && IsSubset<std::string>(config_feedback.name, joint_names_))
+    {
+      // Push the joint state into a map
+      std::map<std::string, std::pair<double, double>> joint_state_map;
+      for (size_t idx = 0; idx < config_feedback.name.size(); idx++)
+      {
+        const std::string& name = config_feedback.name[idx];
+        const double position = config_feedback.position[idx];
+        const double velocity = config_feedback.velocity[idx];
+        joint_state_map[name] = std::make_pair(position, velocity);
+      }
+      // Extract the joint state in order
+      std::vector<double> current_config(joint_names_.size(), 0.0);
+      std::vector<double> current_velocities(joint_names_.size(), 0.0);
+      bool config_valid = true;
+      for (size_t idx = 0; idx < joint_names_.size(); idx++)
+      {
+        const std::string& joint_name = joint_names_[idx];
+        const auto found_itr = joint_state_map.find(joint_name);
+        if (found_itr != joint_state_map.end())
+        {
+          const double position = found_itr->second.first;
+          const double velocity = found_itr->second.second;
+          current_config[idx] = position;
+          current_velocities[idx] = velocity;
+        }
+        else
+        {
+          ROS_WARN("Invalid JointState feedback: joint %s missing",
+                   joint_name.c_str());
+          config_valid = false;
+        }
+      }
+      if (config_valid == true)
+      {
+        current_config_ = current_config;
+        current_velocities_ = current_velocities;
+        current_state_valid_ = true;
+        new_state_feedback_ = true;
+      }
+    }
+    else
+    {
+      ROS_WARN("Invalid JointState feedback: %zu names, %zu positions",
+               config_feedback.name.size(), config_feedback.position.size());
+      current_state_valid_ = false;
+    }
+  }
+};
+
+// Builds a position controller from the params in nhp. Unless set by params,
+// topics of the hardware interface start with topic_prefix, and the
+// controller's own topic and service with controller_prefix. An in-process
+// controller is run by the hardware interface through Update(), and does not
+// subscribe to state.
+inline std::unique_ptr<URPositionController> MakePositionController(
+    const ros::NodeHandle& nh, const ros::NodeHandle& nhp,
+    const std::string& topic_prefix, const std::string& controller_prefix,
+    const bool in_process)
+{
+  const std::string DEFAULT_POSITION_COMMAND_TOPIC
+      = topic_prefix + "joint_command_position";
+  const std::string DEFAULT_STATUS_TOPIC = controller_prefix + "status";
+  const std::string DEFAULT_STATE_FEEDBACK_TOPIC
+      = topic_prefix + "joint_states";
+  const std::string DEFAULT_VELOCITY_COMMAND_TOPIC
+      = topic_prefix + "joint_command_velocity";
+  const std::string DEFAULT_ABORT_SERVICE = controller_prefix + "abort";
+  // If set, state feedback and velocity commands use the hardware interface's
+  // shared memory channel instead of topics
+  const std::string DEFAULT_SHARED_MEMORY_NAME = "";
+  const double DEFAULT_VELOCITY_LIMIT_SCALING = 0.5;
+  const double DEFAULT_ACCELERATION_LIMIT_SCALING = 0.5;
+  const double DEFAULT_BASE_KP = 1.0;
+  const double DEFAULT_BASE_KD = 0.1;
+  const bool DEFAULT_LIMIT_ACCELERATION = false;
+  const bool DEFAULT_ENABLE_VELOCITY_AUTOSCALING = true;
+  const std::string position_command_topic
+      = nhp.param(std::string("position_command_topic"),
+                  DEFAULT_POSITION_COMMAND_TOPIC);
+  const std::string state_feedback_topic
+      = nhp.param(std::string("state_feedback_topic"),
+                  DEFAULT_STATE_FEEDBACK_TOPIC);
+  const std::string velocity_command_topic
+      = nhp.param(std::string("velocity_command_topic"),
+                  DEFAULT_VELOCITY_COMMAND_TOPIC);
+  const std::string status_topic
+      = nhp.param(std::string("status_topic"), DEFAULT_STATUS_TOPIC);
+  const std::string abort_service
+      = nhp.param(std::string("abort_service"), DEFAULT_ABORT_SERVICE);
+  const std::string shared_memory_name
+      = nhp.param(std::string("shared_memory_name"),
+                  DEFAULT_SHARED_MEMORY_NAME);
+  const double velocity_limit_scaling
+      = std::abs(nhp.param(std::string("velocity_limit_scaling"),
+                           DEFAULT_VELOCITY_LIMIT_SCALING));
+  const double acceleration_limit_scaling
+      = std::abs(nhp.param(std::string("acceleration_limit_scaling"),
+                           DEFAULT_ACCELERATION_LIMIT_SCALING));
+  const double real_velocity_limit_scaling
+      = ClampValueAndWarn(velocity_limit_scaling, 0.0, 1.0);
+  const double real_acceleration_limit_scaling
+      = ClampValueAndWarn(acceleration_limit_scaling, 0.0, 1.0);
+  const double base_kp
+      = std::abs(nhp.param(std::string("base_kp"), DEFAULT_BASE_KP));
+  const double base_kd
+      = std::abs(nhp.param(std::string("base_kd"), DEFAULT_BASE_KD));
+  const bool limit_acceleration
+      = nhp.param(std::string("limit_acceleration"),
+                  DEFAULT_LIMIT_ACCELERATION);
+  const bool enable_velocity_autoscaling
+      = nhp.param(std::string("enable_velocity_autoscaling"),
+                  DEFAULT_ENABLE_VELOCITY_AUTOSCALING);
+  // Joint limits
+  const std::map<std::string, JointLimits> limits
+      = GetLimits(real_velocity_limit_scaling,
+                  real_acceleration_limit_scaling);
+  // Joint PID params
+  const std::map<std::string, PIDParams> params
+      = GetDefaultPositionControllerParams(base_kp, 0.0, base_kd, 0.0);
+  return std::unique_ptr<URPositionController>(
+      new URPositionController(
+          nh, position_command_topic, state_feedback_topic,
+          velocity_command_topic, status_topic, abort_service,
+          shared_memory_name, in_process, limits, params, limit_acceleration,
+          enable_velocity_autoscaling));
+}
+}
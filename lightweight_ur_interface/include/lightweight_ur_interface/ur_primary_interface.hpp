@@ -0,0 +1,296 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <lightweight_ur_interface/ur_minimal_realtime_driver.hpp>
+#include <tri_realtime_common/realtime_thread_config.hpp>
+
+namespace lightweight_ur_interface
+{
+// Primary (port 30001) and secondary (port 30002) client interfaces. The
+// controller sends a version message on connect, then a robot state message
+// at 10 Hz and robot messages (errors, runtime exceptions, safety mode
+// changes) as they occur. Every message starts with a big-endian int32 length,
+// which includes the 5-byte header, and a uint8 message type. Robot state
+// messages contain sub-packages with the same header layout. Only the
+// primary interface sends robot messages.
+
+constexpr uint16_t kPrimaryInterfacePort = 30001;
+constexpr uint16_t kSecondaryInterfacePort = 30002;
+
+enum URPrimaryMessageType : uint8_t
+{
+  kPrimaryRobotState = 16,
+  kPrimaryRobotMessage = 20
+};
+
+enum URPrimaryPackageType : uint8_t
+{
+  kPrimaryRobotModeData = 0,
+  kPrimaryJointData = 1,
+  kPrimaryToolData = 2
+};
+
+enum URPrimaryRobotMessageType : uint8_t
+{
+  kPrimaryTextMessage = 0,
+  kPrimaryVersionMessage = 3,
+  kPrimarySafetyModeMessage = 5,
+  kPrimaryErrorCodeMessage = 6,
+  kPrimaryKeyMessage = 7,
+  kPrimaryRuntimeExceptionMessage = 10
+};
+
+// Robot modes reported in robot mode data
+enum URRobotMode : int8_t
+{
+  kRobotModeNoController = -1,
+  kRobotModeDisconnected = 0,
+  kRobotModeConfirmSafety = 1,
+  kRobotModeBooting = 2,
+  kRobotModePowerOff = 3,
+  kRobotModePowerOn = 4,
+  kRobotModeIdle = 5,
+  kRobotModeBackdrive = 6,
+  kRobotModeRunning = 7,
+  kRobotModeUpdatingFirmware = 8
+};
+
+const char* RobotModeName(const int8_t robot_mode);
+
+struct URRobotModeData
+{
+  uint64_t timestamp;
+  bool real_robot_connected;
+  bool real_robot_enabled;
+  bool robot_power_on;
+  bool emergency_stopped;
+  bool protective_stopped;
+  bool program_running;
+  bool program_paused;
+  int8_t robot_mode;
+  uint8_t control_mode;
+  double target_speed_fraction;
+  double speed_scaling;
+  double target_speed_fraction_limit;
+};
+
+struct URJointData
+{
+  std::array<double, 6> actual_position;
+  std::array<double, 6> target_position;
+  std::array<double, 6> actual_velocity;
+  std::array<float, 6> actual_current;
+  std::array<float, 6> actual_voltage;
+  std::array<float, 6> motor_temperature;
+  std::array<float, 6> micro_temperature;
+  std::array<uint8_t, 6> joint_mode;
+};
+
+struct URToolData
+{
+  std::array<int8_t, 2> analog_input_range;
+  std::array<double, 2> analog_input;
+  float tool_voltage_48v;
+  uint8_t tool_output_voltage;
+  float tool_current;
+  float tool_temperature;
+  uint8_t tool_mode;
+};
+
+// A robot message. Fields not carried by message_type are zero. text (and
+// title, for key messages) point into the parser's packet buffer, so they are
+// only valid during the callback.
+struct URRobotMessage
+{
+  uint64_t timestamp;
+  int8_t source;
+  uint8_t message_type;
+  // Error, key and safety mode messages
+  int32_t code;
+  int32_t argument;
+  // Error code messages
+  int32_t report_level;
+  // Safety mode messages
+  uint8_t safety_mode;
+  // Runtime exception messages
+  int32_t line_number;
+  int32_t column_number;
+  const char* title;
+  size_t title_length;
+  const char* text;
+  size_t text_length;
+
+  inline std::string Title() const { return std::string(title, title_length); }
+
+  inline std::string Text() const { return std::string(text, text_length); }
+};
+
+// Changes of the robot and program state, detected from consecutive robot
+// mode data
+enum URPrimaryEventType : uint8_t
+{
+  kPrimaryRobotModeChanged,
+  kPrimaryProgramStarted,
+  kPrimaryProgramStopped,
+  kPrimaryProgramPaused,
+  kPrimaryProgramResumed,
+  kPrimaryProtectiveStop,
+  kPrimaryProtectiveStopCleared,
+  kPrimaryEmergencyStop,
+  kPrimaryEmergencyStopCleared
+};
+
+const char* PrimaryEventName(const URPrimaryEventType event_type);
+
+struct URPrimaryEvent
+{
+  URPrimaryEventType type;
+  // Robot mode data in which the change was detected
+  const URRobotModeData* robot_mode_data;
+};
+
+// Callbacks of URPrimaryStreamParser. Any may be left empty.
+struct URPrimaryCallbacks
+{
+  std::function<void(const URRobotModeData&)> robot_mode_data_fn;
+  std::function<void(const URJointData&)> joint_data_fn;
+  std::function<void(const URToolData&)> tool_data_fn;
+  std::function<void(const URRobotMessage&)> robot_message_fn;
+  std::function<void(const URPrimaryEvent&)> event_fn;
+};
+
+// Incrementally parses the primary/secondary message stream. Bytes are
+// appended as they are read, and every complete message is parsed and
+// reported as soon as it has arrived, so state changes are seen within one
+// 10 Hz cycle. Messages are framed in a fixed-size ring buffer and parsed in
+// place, so parsing does not allocate.
+class URPrimaryStreamParser
+{
+private:
+
+  static constexpr size_t kRecvRingBufferSize = 131072;
+  static constexpr uint32_t kMaxMessageSize = 65536;
+
+  URStreamFramer framer_;
+  URPrimaryCallbacks callbacks_;
+  std::function<void(const std::string&)> logging_fn_;
+  URRobotModeData robot_mode_data_;
+  bool have_robot_mode_data_;
+  URJointData joint_data_;
+  URToolData tool_data_;
+  uint64_t malformed_packages_;
+
+  void ParseMessage(const std::vector<uint8_t>& message);
+
+  void ParseRobotState(const uint8_t* data, const uint32_t size);
+
+  bool ParseRobotModeData(const uint8_t* data, const uint32_t size);
+
+  bool ParseJointData(const uint8_t* data, const uint32_t size);
+
+  bool ParseToolData(const uint8_t* data, const uint32_t size);
+
+  bool ParseRobotMessage(const uint8_t* data, const uint32_t size);
+
+  void EmitEvents(const URRobotModeData& previous,
+                  const URRobotModeData& current);
+
+public:
+
+  URPrimaryStreamParser(
+      const URPrimaryCallbacks& callbacks,
+      const std::function<void(const std::string&)>& logging_fn);
+
+  URPrimaryStreamParser(const URPrimaryStreamParser&) = delete;
+
+  URPrimaryStreamParser& operator=(const URPrimaryStreamParser&) = delete;
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  // Fills up to two regions of free buffer space for a single readv() or
+  // recvmsg() to write into. Returns the number of regions filled.
+  inline int PrepareWrite(struct iovec* regions)
+  { return framer_.PrepareWrite(regions); }
+
+  // Parses the bytes written into the regions from PrepareWrite().
+  void CommitWrite(const size_t bytes_written);
+
+  // As CommitWrite(), but for bytes from an external buffer.
+  void Append(const uint8_t* data, const size_t size);
+
+  // Starts a new stream, e.g. after reconnecting. Events are not reported
+  // for differences between the last robot mode data of the old stream and
+  // the first of the new one.
+  void Restart();
+
+  // Packages and messages too short for their type, so far
+  inline uint64_t NumMalformedPackages() const { return malformed_packages_; }
+};
+
+// Streams the primary or secondary interface of the robot at robot_host,
+// passing parsed data, robot messages and state change events to callbacks
+// on the recv thread, which applies recv_thread_config when it starts, or on
+// the thread of a shared URIOReactor if started with StartRecv(reactor).
+// Connections, reconnects and the watchdog are handled by URRobotConnection;
+// since state arrives at 10 Hz, the watchdog timeout should be well above
+// 0.1 seconds.
+class URPrimaryInterface
+{
+private:
+
+  URRobotConnection connection_;
+  std::atomic<bool> running_;
+  std::thread recv_thread_;
+  URPrimaryCallbacks callbacks_;
+  std::function<void(const std::string&)> logging_fn_;
+  tri_realtime_common::RealtimeThreadConfig recv_thread_config_;
+  // Owned by the recv thread (or reactor thread)
+  URPrimaryStreamParser parser_;
+  URIOReactor* reactor_ptr_;
+
+  void HandleConnected();
+
+  void ReadSocket(const int socket_fd);
+
+  void ProcessConnectionEvents();
+
+  void RecvLoop();
+
+public:
+
+  URPrimaryInterface(
+    const std::string& robot_host,
+    const URPrimaryCallbacks& callbacks,
+    const std::function<void(const std::string&)>& logging_fn,
+    const uint16_t port = kPrimaryInterfacePort,
+    const URRealtimeConnectionParams& connection_params
+        = URRealtimeConnectionParams(),
+    const tri_realtime_common::RealtimeThreadConfig& recv_thread_config
+        = tri_realtime_common::RealtimeThreadConfig());
+
+  ~URPrimaryInterface();
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  void StartRecv();
+
+  // Runs the connection on reactor instead of a recv thread of its own.
+  // reactor must outlive StopRecv().
+  void StartRecv(URIOReactor& reactor);
+
+  void StopRecv();
+
+  inline bool IsConnected() const { return connection_.IsReady(); }
+
+  // Returns false if not connected within timeout seconds.
+  inline bool WaitForConnection(const double timeout)
+  { return connection_.WaitForReady(timeout); }
+};
+}
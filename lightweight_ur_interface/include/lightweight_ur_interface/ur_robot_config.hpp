@@ -7,6 +7,8 @@
 #include <map>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
 #include <common_robotics_utilities/utility.hpp>
 
 namespace lightweight_ur_interface
@@ -134,6 +136,27 @@ inline std::vector<std::string> GetOrderedJointNames()
                                   "wrist_3_joint"};
 }
 
+// Index of each of joint_names in GetOrderedJointNames()
+inline std::vector<size_t> GetOrderedJointIndices(
+    const std::vector<std::string>& joint_names)
+{
+  const std::vector<std::string> ordered_joint_names = GetOrderedJointNames();
+  std::vector<size_t> ordered_joint_indices(joint_names.size(), 0);
+  for (size_t idx = 0; idx < joint_names.size(); idx++)
+  {
+    const auto found_itr = std::find(ordered_joint_names.begin(),
+                                     ordered_joint_names.end(),
+                                     joint_names[idx]);
+    if (found_itr == ordered_joint_names.end())
+    {
+      throw std::invalid_argument("Unknown joint " + joint_names[idx]);
+    }
+    ordered_joint_indices[idx] = static_cast<size_t>(
+        std::distance(ordered_joint_names.begin(), found_itr));
+  }
+  return ordered_joint_indices;
+}
+
 inline std::map<std::string, JointLimits> GetDefaultLimits()
 {
   std::map<std::string, JointLimits> joint_limits;
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <lightweight_ur_interface/ur_minimal_realtime_driver.hpp>
+#include <tri_realtime_common/realtime_thread_config.hpp>
+
+namespace lightweight_ur_interface
+{
+// Real-Time Data Exchange (RTDE) protocol, version 2, served on port 30004 by
+// CB3 3.4+ and e-Series controllers. Every package starts with a big-endian
+// uint16 size, which includes the 3-byte header, and a uint8 package type.
+// Clients set up an output recipe naming the variables the controller should
+// stream and an input recipe naming the registers the client will write, so
+// only the data that is actually used crosses the wire.
+
+constexpr uint16_t kRTDEPort = 30004;
+constexpr uint16_t kRTDEProtocolVersion = 2;
+constexpr uint32_t kRTDEHeaderSize = 3;
+
+enum URRTDEPackageType : uint8_t
+{
+  kRTDERequestProtocolVersion = 'V',
+  kRTDEGetURControlVersion = 'v',
+  kRTDETextMessage = 'M',
+  kRTDEDataPackage = 'U',
+  kRTDEControlPackageSetupOutputs = 'O',
+  kRTDEControlPackageSetupInputs = 'I',
+  kRTDEControlPackageStart = 'S',
+  kRTDEControlPackagePause = 'P'
+};
+
+enum URRTDEDataType : uint8_t
+{
+  kRTDEBool,
+  kRTDEUInt8,
+  kRTDEUInt32,
+  kRTDEUInt64,
+  kRTDEInt32,
+  kRTDEDouble,
+  kRTDEVector3d,
+  kRTDEVector6d,
+  kRTDEVector6Int32,
+  kRTDEVector6UInt32,
+  // Returned in place of a type for variables the controller does not have
+  kRTDENotFound,
+  // Returned in place of a type for inputs another client already writes
+  kRTDEInUse
+};
+
+// Parses a type name returned by the controller, throwing on unknown names.
+URRTDEDataType ParseRTDEDataType(const std::string& type_name);
+
+const char* RTDEDataTypeName(const URRTDEDataType type);
+
+// Size in bytes of a value of type on the wire
+uint32_t RTDEDataTypeSize(const URRTDEDataType type);
+
+// Number of elements in a value of type
+uint32_t RTDEDataTypeCount(const URRTDEDataType type);
+
+// RTDE output variable and type providing each realtime field
+constexpr const char* kRTDEFieldNames[kNumRealtimeFields] =
+{
+  "timestamp", "target_q", "target_qd", "target_qdd", "target_current",
+  "target_moment", "actual_q", "actual_qd", "actual_current",
+  "joint_control_output", "actual_TCP_pose", "actual_TCP_speed",
+  "actual_TCP_force", "target_TCP_pose", "target_TCP_speed",
+  "joint_temperatures", "actual_execution_time", "robot_mode", "joint_mode",
+  "safety_mode", "actual_tool_accelerometer", "speed_scaling",
+  "actual_momentum", "actual_main_voltage", "actual_robot_voltage",
+  "actual_robot_current", "actual_joint_voltage", "actual_digital_input_bits",
+  "actual_digital_output_bits", "runtime_state", "elbow_position",
+  "elbow_velocity", "safety_status"
+};
+
+constexpr URRTDEDataType kRTDEFieldTypes[kNumRealtimeFields] =
+{
+  kRTDEDouble, kRTDEVector6d, kRTDEVector6d, kRTDEVector6d, kRTDEVector6d,
+  kRTDEVector6d, kRTDEVector6d, kRTDEVector6d, kRTDEVector6d, kRTDEVector6d,
+  kRTDEVector6d, kRTDEVector6d, kRTDEVector6d, kRTDEVector6d, kRTDEVector6d,
+  kRTDEVector6d, kRTDEDouble, kRTDEInt32, kRTDEVector6Int32, kRTDEInt32,
+  kRTDEVector3d, kRTDEDouble, kRTDEDouble, kRTDEDouble, kRTDEDouble,
+  kRTDEDouble, kRTDEVector6d, kRTDEUInt64, kRTDEUInt64, kRTDEUInt32,
+  kRTDEVector3d, kRTDEVector3d, kRTDEInt32
+};
+
+// Splits a comma-separated RTDE variable or type list.
+std::vector<std::string> SplitRTDEVariableList(const std::string& list);
+
+// Builds a complete package of type with the given payload.
+std::vector<uint8_t> MakeRTDEPackage(const URRTDEPackageType type,
+                                     const std::vector<uint8_t>& payload);
+
+// Converts the value of type at network_data into count host doubles, where
+// count is RTDEDataTypeCount(type).
+void RTDEValueToDoubles(const URRTDEDataType type, const uint8_t* network_data,
+                        double* values);
+
+// Converts RTDEDataTypeCount(type) host doubles into a value of type at
+// network_data. Integer types are rounded to the nearest integer.
+void DoublesToRTDEValue(const URRTDEDataType type, const double* values,
+                        uint8_t* network_data);
+
+// Output recipe streaming the realtime fields in field_mask, which decodes
+// data packages directly into a URRealtimeState.
+class URRTDEOutputRecipe
+{
+private:
+
+  struct Entry
+  {
+    URRealtimeField field;
+    URRTDEDataType type;
+    uint32_t offset;
+  };
+
+  URRealtimeFieldMask field_mask_;
+  std::vector<Entry> entries_;
+  uint32_t payload_size_;
+  uint8_t recipe_id_;
+  bool configured_;
+
+public:
+
+  explicit URRTDEOutputRecipe(const URRealtimeFieldMask field_mask);
+
+  inline URRealtimeFieldMask FieldMask() const { return field_mask_; }
+
+  inline bool Configured() const { return configured_; }
+
+  // Comma-separated variable names for the setup outputs request
+  std::string VariableNames() const;
+
+  // Applies the setup outputs response. Returns the fields the controller
+  // does not provide, which must be removed from the recipe before it can be
+  // set up; the recipe is only configured if there are none. Throws if the
+  // controller reports a type other than the expected one.
+  URRealtimeFieldMask Configure(const uint8_t recipe_id,
+                                const std::string& variable_types);
+
+  // Decodes the data package packet (including its header) into state,
+  // leaving fields outside the recipe untouched. Returns false if the
+  // package is not for this recipe or has the wrong size.
+  bool Decode(const std::vector<uint8_t>& packet,
+              const double protocol_version, URRealtimeState& state) const;
+};
+
+// Input recipe writing the named input registers (e.g.
+// "input_int_register_0" or "input_double_register_12"), all of which must
+// have scalar types.
+class URRTDEInputRecipe
+{
+private:
+
+  std::vector<std::string> variable_names_;
+  std::vector<URRTDEDataType> types_;
+  std::vector<uint32_t> offsets_;
+  uint32_t payload_size_;
+  uint8_t recipe_id_;
+  bool configured_;
+
+public:
+
+  explicit URRTDEInputRecipe(const std::vector<std::string>& variable_names);
+
+  inline const std::vector<std::string>& VariableNames() const
+  { return variable_names_; }
+
+  inline bool Configured() const { return configured_; }
+
+  // Applies the setup inputs response. Throws if any input is missing, in
+  // use by another client, or not a scalar.
+  void Configure(const uint8_t recipe_id, const std::string& variable_types);
+
+  // Size of a complete data package for this recipe
+  inline uint32_t PackageSize() const
+  { return kRTDEHeaderSize + 1 + payload_size_; }
+
+  // Encodes one value per input into package, which must hold PackageSize()
+  // bytes.
+  void Encode(const std::vector<double>& values, uint8_t* package) const;
+};
+
+// Streams state from RTDE (port 30004) with the same callback API as
+// URRealtimeInterface. Only the fields in output_fields are requested, at
+// output_frequency (up to 500 Hz on e-Series, 125 Hz on CB3), which makes
+// packages far smaller and cheaper to decode than the full realtime packet.
+// Commands are written to the input registers named in input_names with
+// SendInputs(), where a program running on the controller can read them.
+// Connections, reconnects and the watchdog are handled by URRobotConnection
+// on the recv thread, which runs the setup handshake on every connection.
+class URRTDEInterface
+{
+private:
+
+  enum HandshakeState : uint8_t
+  {
+    kRequestingProtocolVersion,
+    kRequestingControllerVersion,
+    kSettingUpOutputs,
+    kSettingUpInputs,
+    kStarting,
+    kStreaming
+  };
+
+  static constexpr size_t kRecvRingBufferSize = 16384;
+  static constexpr uint32_t kMaxPackageSize = 4096;
+
+  URRobotConnection connection_;
+  std::atomic<bool> running_;
+  std::thread recv_thread_;
+  std::function<void(const URRealtimeState&)> state_received_callback_fn_;
+  std::function<void(const std::string&)> logging_fn_;
+  URRealtimeFieldMask output_fields_;
+  double output_frequency_;
+  tri_realtime_common::RealtimeThreadConfig recv_thread_config_;
+  // Guards the input recipe between the recv thread, which sets it up, and
+  // threads calling SendInputs(). Never held while sending.
+  std::mutex input_mutex_;
+  URRTDEInputRecipe input_recipe_;
+  // Owned by the recv thread
+  URStreamFramer framer_;
+  URRTDEOutputRecipe output_recipe_;
+  URStateTimestamper timestamper_;
+  URRealtimeState latest_state_;
+  HandshakeState handshake_state_;
+  double protocol_version_;
+  int64_t receive_time_ns_;
+  int64_t monotonic_to_realtime_ns_;
+  // The recv thread updates its own statistics and copies them here only if
+  // the lock is free, so readers never delay it
+  mutable std::mutex statistics_mutex_;
+  URRealtimeArrivalStatistics published_arrival_statistics_;
+  URControllerClockEstimate published_clock_estimate_;
+
+  bool SendPackage(const URRTDEPackageType type,
+                   const std::vector<uint8_t>& payload);
+
+  void BeginHandshake();
+
+  void SetupOutputs();
+
+  void SetupInputsOrStart();
+
+  void HandlePackage(const std::vector<uint8_t>& packet);
+
+  void HandleHandshakeResponse(const std::vector<uint8_t>& packet);
+
+  void HandleTextMessage(const std::vector<uint8_t>& packet);
+
+  void ReadSocket(const int socket_fd);
+
+  void RecvLoop();
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  URRTDEInterface(
+    const std::string& robot_host,
+    const std::function<void(const URRealtimeState&)>&
+      state_received_callback_fn,
+    const std::function<void(const std::string&)>& logging_fn,
+    const URRealtimeFieldMask output_fields,
+    const double output_frequency,
+    const std::vector<std::string>& input_names
+        = std::vector<std::string>(),
+    const URRealtimeConnectionParams& connection_params
+        = URRealtimeConnectionParams(),
+    const tri_realtime_common::RealtimeThreadConfig& recv_thread_config
+        = tri_realtime_common::RealtimeThreadConfig());
+
+  ~URRTDEInterface();
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  void StartRecv();
+
+  void StopRecv();
+
+  // Writes one value per input register, in the order of input_names.
+  // Returns false if not streaming or the write failed.
+  bool SendInputs(const std::vector<double>& values);
+
+  // True once the handshake has completed and state is streaming
+  inline bool IsConnected() const { return connection_.IsReady(); }
+
+  // Returns false if not streaming within timeout seconds.
+  inline bool WaitForConnection(const double timeout)
+  { return connection_.WaitForReady(timeout); }
+
+  // Arrival statistics of all packages received so far
+  URRealtimeArrivalStatistics ArrivalStatistics() const;
+
+  // Current map from controller uptime to CLOCK_MONOTONIC
+  URControllerClockEstimate ControllerClockEstimate() const;
+};
+}
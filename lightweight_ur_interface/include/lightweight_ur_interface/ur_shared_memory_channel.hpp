@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+namespace lightweight_ur_interface
+{
+// State and command channel between a hardware interface and controllers
+// running on the same host, through a POSIX shared memory segment. This
+// skips message serialization and the loopback network stack on the control
+// path, which the ROS topics cost on every state and command.
+//
+// The segment holds one state slot, guarded by a seqlock so that the writer
+// never waits on readers, and a single-producer single-consumer ring of
+// commands. Both sides wait on futexes in the segment, so a controller wakes
+// as soon as a state is published and the hardware interface as soon as a
+// command is posted. Joint values are in the order of GetOrderedJointNames().
+
+enum URSharedCommandType : uint32_t
+{
+  kSharedCommandSpeedJ = 1,
+  // Twists in the robot base frame, or the tool frame of the latest state
+  kSharedCommandSpeedLBase = 2,
+  kSharedCommandSpeedLTool = 3
+};
+
+struct URSharedState
+{
+  // Estimated time the controller sampled the state, as for ROS stamps
+  uint64_t sample_time_ns;
+  std::array<double, 6> joint_position;
+  std::array<double, 6> joint_velocity;
+  std::array<double, 6> joint_effort;
+  // TCP pose in the base frame, as a position and an xyzw quaternion
+  std::array<double, 3> tcp_position;
+  std::array<double, 4> tcp_orientation;
+  // TCP twist in the base frame, linear then angular
+  std::array<double, 6> tcp_twist;
+};
+
+struct URSharedCommand
+{
+  uint32_t type;
+  uint32_t reserved;
+  std::array<double, 6> values;
+};
+
+struct URSharedMemorySegment;
+
+// Creates the segment under name (e.g. "/ur10"), replacing any segment left
+// behind by a server that has exited, and removes it on destruction. Throws
+// if a running server already serves the name. State is published from any
+// single thread. Posted commands are reported to commands_ready_fn on the
+// server's own thread, and taken with TakeCommand() from any single thread.
+class URSharedMemoryServer
+{
+private:
+
+  std::string name_;
+  URSharedMemorySegment* segment_;
+  std::function<void(const std::string&)> logging_fn_;
+  std::function<void(void)> commands_ready_fn_;
+  std::atomic<bool> running_;
+  std::thread wait_thread_;
+
+  void WaitLoop();
+
+public:
+
+  URSharedMemoryServer(
+      const std::string& name,
+      const std::function<void(const std::string&)>& logging_fn,
+      const std::function<void(void)>& commands_ready_fn);
+
+  ~URSharedMemoryServer();
+
+  URSharedMemoryServer(const URSharedMemoryServer&) = delete;
+
+  URSharedMemoryServer& operator=(const URSharedMemoryServer&) = delete;
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  inline const std::string& Name() const { return name_; }
+
+  void Start();
+
+  void Stop();
+
+  // Wakes any controllers waiting for state. Never blocks.
+  void PublishState(const URSharedState& state);
+
+  // Returns false once no commands are pending.
+  bool TakeCommand(URSharedCommand& command);
+};
+
+// Opens the segment of a server, retrying while it does not exist, and
+// reopens it if the server is restarted. Only one client at a time may post
+// commands, and the first to do so claims the command ring until it exits;
+// any number may read state. Not thread-safe.
+class URSharedMemoryClient
+{
+private:
+
+  static constexpr double kReopenInterval = 0.5;
+
+  std::string name_;
+  URSharedMemorySegment* segment_;
+  // Identifies the segment mapped, to tell whether the name now refers to
+  // the segment of a restarted server
+  uint64_t segment_inode_;
+  std::function<void(const std::string&)> logging_fn_;
+  uint32_t last_state_sequence_;
+  bool open_warned_;
+  bool producer_claimed_;
+  bool producer_claim_warned_;
+  uint64_t dropped_commands_;
+  std::chrono::steady_clock::time_point last_state_time_;
+  std::chrono::steady_clock::time_point last_open_attempt_time_;
+
+  bool EnsureOpen();
+
+  void Close();
+
+  bool ClaimProducer();
+
+public:
+
+  URSharedMemoryClient(
+      const std::string& name,
+      const std::function<void(const std::string&)>& logging_fn);
+
+  ~URSharedMemoryClient();
+
+  URSharedMemoryClient(const URSharedMemoryClient&) = delete;
+
+  URSharedMemoryClient& operator=(const URSharedMemoryClient&) = delete;
+
+  inline void Log(const std::string& message) { logging_fn_(message); }
+
+  inline bool IsOpen() const { return segment_ != nullptr; }
+
+  inline uint64_t DroppedCommands() const { return dropped_commands_; }
+
+  // Copies the latest state if it is newer than the last one read. Never
+  // blocks.
+  bool ReadNewState(URSharedState& state);
+
+  // As ReadNewState(), but waits up to timeout seconds for a new state.
+  bool WaitForNewState(const double timeout, URSharedState& state);
+
+  // Returns false if the command was not posted, because the server is not
+  // running, another client holds the command ring, or the ring is full.
+  bool PostCommand(const URSharedCommand& command);
+};
+}
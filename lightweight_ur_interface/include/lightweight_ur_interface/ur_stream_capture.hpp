@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <sys/uio.h>
+
+namespace lightweight_ur_interface
+{
+// Capture files hold the raw byte stream received from a UR controller as a
+// sequence of records, one per read from the socket, each tagged with the
+// kernel receive time of the read. Everything is in host byte order, so
+// captures are only portable between hosts of the same endianness, which is
+// checked when opening them.
+//
+// File layout:
+//   URStreamCaptureFileHeader
+//   repeated:
+//     URStreamCaptureRecordHeader
+//     size bytes of stream data, zero-padded to a multiple of 8 bytes
+//
+// Files are grown in large preallocated chunks and truncated to the data
+// written when closed. A capture that was not closed cleanly (e.g. the process
+// crashed) ends in zero-filled space, which readers treat as the end of the
+// capture.
+struct URStreamCaptureFileHeader
+{
+  char magic[8];
+  uint32_t byte_order_mark;
+  uint32_t version;
+};
+
+struct URStreamCaptureRecordHeader
+{
+  // Kernel receive time of the read, in CLOCK_REALTIME
+  int64_t receive_time_ns;
+  // Offset from CLOCK_MONOTONIC to CLOCK_REALTIME at the time of the read
+  int64_t monotonic_to_realtime_ns;
+  uint64_t size;
+};
+
+struct URStreamCaptureRecord
+{
+  int64_t receive_time_ns;
+  int64_t monotonic_to_realtime_ns;
+  const uint8_t* data;
+  size_t size;
+};
+
+// Appends records to a memory-mapped capture file. Appending is a memcpy into
+// the mapping, except when the file must grow by another chunk.
+class URStreamCaptureWriter
+{
+private:
+
+  static constexpr size_t kGrowthSize = 16 * 1024 * 1024;
+
+  std::string path_;
+  int fd_;
+  uint8_t* mapping_;
+  size_t mapped_size_;
+  size_t written_size_;
+
+  void Reserve(const size_t size);
+
+public:
+
+  // Creates (or truncates) the capture file at path.
+  explicit URStreamCaptureWriter(const std::string& path);
+
+  ~URStreamCaptureWriter();
+
+  URStreamCaptureWriter(const URStreamCaptureWriter&) = delete;
+
+  URStreamCaptureWriter& operator=(const URStreamCaptureWriter&) = delete;
+
+  // Appends one record containing size bytes gathered from regions.
+  void Append(const int64_t receive_time_ns,
+              const int64_t monotonic_to_realtime_ns,
+              const struct iovec* regions, const int num_regions,
+              const size_t size);
+
+  inline const std::string& Path() const { return path_; }
+
+  inline size_t WrittenSize() const { return written_size_; }
+};
+
+// Reads records from a memory-mapped capture file.
+class URStreamCaptureReader
+{
+private:
+
+  int fd_;
+  const uint8_t* mapping_;
+  size_t mapped_size_;
+  size_t read_offset_;
+
+public:
+
+  explicit URStreamCaptureReader(const std::string& path);
+
+  ~URStreamCaptureReader();
+
+  URStreamCaptureReader(const URStreamCaptureReader&) = delete;
+
+  URStreamCaptureReader& operator=(const URStreamCaptureReader&) = delete;
+
+  // Reads the next record, whose data points into the mapping and remains
+  // valid for the lifetime of the reader. Returns false at the end of the
+  // capture.
+  bool NextRecord(URStreamCaptureRecord& record);
+
+  void Rewind();
+};
+}  // namespace lightweight_ur_interface
@@ -0,0 +1,252 @@
+#include <lightweight_ur_interface/ur_dashboard_client.hpp>
+
+namespace lightweight_ur_interface
+{
+URDashboardClient::URDashboardClient(
+    const std::string& robot_host,
+    const std::function<void(const std::string&)>& logging_fn,
+    const uint16_t port,
+    const URRealtimeConnectionParams& connection_params)
+  : connection_(robot_host, port, connection_params, logging_fn),
+    logging_fn_(logging_fn), next_request_id_(0), awaiting_greeting_(true),
+    reactor_ptr_(nullptr)
+{
+  running_.store(false);
+}
+
+URDashboardClient::~URDashboardClient()
+{
+  StopRecv();
+}
+
+void URDashboardClient::StartRecv()
+{
+  if (!running_.load())
+  {
+    Log("Starting dashboard client recv thread loop...");
+    running_.store(true);
+    recv_thread_ = std::thread(&URDashboardClient::RecvLoop, this);
+  }
+}
+
+void URDashboardClient::StartRecv(URIOReactor& reactor)
+{
+  if (!running_.load())
+  {
+    Log("Starting dashboard client recv on shared I/O reactor...");
+    running_.store(true);
+    reactor_ptr_ = &reactor;
+    connection_.Open();
+    reactor.AddSource(connection_.EventFd(), [this] ()
+    {
+      ProcessConnectionEvents();
+      return true;
+    });
+  }
+}
+
+void URDashboardClient::StopRecv()
+{
+  if (running_.load())
+  {
+    running_.store(false);
+    if (reactor_ptr_ != nullptr)
+    {
+      reactor_ptr_->RemoveSource(connection_.EventFd());
+      connection_.Close();
+      reactor_ptr_ = nullptr;
+      FailPendingRequests("Dashboard client stopped");
+    }
+    else
+    {
+      connection_.Wake();
+    }
+  }
+  if (recv_thread_.joinable())
+  {
+    recv_thread_.join();
+  }
+}
+
+bool URDashboardClient::Request(
+    const std::string& request, const std::string& success_prefix,
+    const std::function<void(const URDashboardReply&)>& reply_fn)
+{
+  const std::string line = request + "\n";
+  // Serializes senders, so that requests are sent in the order they are
+  // queued without holding request_mutex_, which the recv thread needs,
+  // while waiting on the socket
+  std::lock_guard<std::mutex> send_lock(send_mutex_);
+  const uint64_t request_id = next_request_id_++;
+  std::string failure;
+  if (!connection_.IsReady())
+  {
+    failure = "Not connected to dashboard server";
+  }
+  else
+  {
+    {
+      std::lock_guard<std::mutex> lock(request_mutex_);
+      pending_requests_.push_back(
+          PendingRequest{request_id, request, success_prefix, reply_fn});
+    }
+    const size_t bytes_written = connection_.Send(
+        reinterpret_cast<const uint8_t*>(line.data()), line.size());
+    if (bytes_written == line.size())
+    {
+      return true;
+    }
+    // If the connection was lost meanwhile, the request has already been
+    // failed along with the rest of the queue
+    bool request_removed = false;
+    {
+      std::lock_guard<std::mutex> lock(request_mutex_);
+      for (auto itr = pending_requests_.begin();
+           itr != pending_requests_.end(); ++itr)
+      {
+        if (itr->id == request_id)
+        {
+          pending_requests_.erase(itr);
+          request_removed = true;
+          break;
+        }
+      }
+    }
+    if (!request_removed)
+    {
+      return false;
+    }
+    failure = "Failed to send request";
+  }
+  if (reply_fn)
+  {
+    reply_fn(URDashboardReply{request, failure, false});
+  }
+  return false;
+}
+
+void URDashboardClient::FailPendingRequests(const std::string& reason)
+{
+  std::deque<PendingRequest> failed_requests;
+  {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    failed_requests.swap(pending_requests_);
+  }
+  for (const PendingRequest& failed_request : failed_requests)
+  {
+    if (failed_request.reply_fn)
+    {
+      failed_request.reply_fn(
+          URDashboardReply{failed_request.request, reason, false});
+    }
+  }
+}
+
+void URDashboardClient::HandleLine(const std::string& line)
+{
+  if (awaiting_greeting_)
+  {
+    awaiting_greeting_ = false;
+    Log("Connected to dashboard server [" + line + "]");
+    connection_.MarkReady();
+    return;
+  }
+  PendingRequest answered_request;
+  {
+    std::lock_guard<std::mutex> lock(request_mutex_);
+    if (pending_requests_.empty())
+    {
+      // Requests are only dropped from the queue when their connection is
+      // lost, so this is the reply to one sent while reconnecting
+      Log("Ignoring unexpected dashboard server reply [" + line + "]");
+      return;
+    }
+    answered_request = pending_requests_.front();
+    pending_requests_.pop_front();
+  }
+  if (answered_request.reply_fn)
+  {
+    const bool success
+        = (line.compare(0, answered_request.success_prefix.size(),
+                        answered_request.success_prefix) == 0);
+    answered_request.reply_fn(
+        URDashboardReply{answered_request.request, line, success});
+  }
+}
+
+void URDashboardClient::ReadSocket(const int socket_fd)
+{
+  char buffer[1024];
+  const ssize_t bytes_read = read(socket_fd, buffer, sizeof(buffer));
+  if (bytes_read > 0)
+  {
+    connection_.NoteDataReceived();
+    reply_buffer_.append(buffer, static_cast<size_t>(bytes_read));
+    size_t line_start = 0;
+    size_t line_end = reply_buffer_.find('\n');
+    while (line_end != std::string::npos)
+    {
+      size_t line_length = line_end - line_start;
+      if ((line_length > 0) && (reply_buffer_[line_end - 1] == '\r'))
+      {
+        line_length--;
+      }
+      HandleLine(reply_buffer_.substr(line_start, line_length));
+      line_start = line_end + 1;
+      line_end = reply_buffer_.find('\n', line_start);
+    }
+    reply_buffer_.erase(0, line_start);
+    if (reply_buffer_.size() > kMaxReplyLength)
+    {
+      connection_.Reconnect("Dashboard server reply exceeds "
+                            + std::to_string(kMaxReplyLength) + " bytes");
+      FailPendingRequests("Connection to dashboard server lost");
+    }
+  }
+  else if (bytes_read == 0)
+  {
+    connection_.Reconnect("Connection closed by robot");
+    FailPendingRequests("Connection to dashboard server lost");
+  }
+  else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+  {
+    connection_.Reconnect("Failed to read: " + std::string(strerror(errno)));
+    FailPendingRequests("Connection to dashboard server lost");
+  }
+}
+
+void URDashboardClient::HandleConnected()
+{
+  // Requests of a connection the watchdog dropped are never answered
+  FailPendingRequests("Connection to dashboard server lost");
+  reply_buffer_.clear();
+  awaiting_greeting_ = true;
+}
+
+bool URDashboardClient::ExpectingData()
+{
+  if (awaiting_greeting_)
+  {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(request_mutex_);
+  return !pending_requests_.empty();
+}
+
+void URDashboardClient::ProcessConnectionEvents()
+{
+  connection_.ProcessEvents(
+      [this] (const int) { HandleConnected(); },
+      [this] (const int socket_fd) { ReadSocket(socket_fd); },
+      [this] () { return ExpectingData(); });
+}
+
+void URDashboardClient::RecvLoop()
+{
+  connection_.Run(running_,
+                  [this] (const int) { HandleConnected(); },
+                  [this] (const int socket_fd) { ReadSocket(socket_fd); },
+                  [this] () { return ExpectingData(); });
+  FailPendingRequests("Dashboard client stopped");
+}
+}
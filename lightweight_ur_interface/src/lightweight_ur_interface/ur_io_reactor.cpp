@@ -0,0 +1,229 @@
+#include <lightweight_ur_interface/ur_io_reactor.hpp>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <cstring>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace lightweight_ur_interface
+{
+URIOReactor::URIOReactor(
+    const std::function<void(const std::string&)>& logging_fn,
+    const tri_realtime_common::RealtimeThreadConfig& reactor_thread_config,
+    const std::string& thread_name,
+    const std::function<void(void)>& cycle_fn)
+  : logging_fn_(logging_fn), reactor_thread_config_(reactor_thread_config),
+    thread_name_(thread_name), cycle_fn_(cycle_fn), source_requests_(1)
+{
+  running_.store(false);
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0)
+  {
+    perror(nullptr);
+    throw std::runtime_error("Failed to create epoll instance");
+  }
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd_ < 0)
+  {
+    perror(nullptr);
+    close(epoll_fd_);
+    throw std::runtime_error("Failed to create eventfd");
+  }
+  struct epoll_event event;
+  std::memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  // Sources are told apart by their data.ptr, which is null for the eventfd
+  event.data.ptr = nullptr;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) != 0)
+  {
+    perror(nullptr);
+    close(wake_fd_);
+    close(epoll_fd_);
+    throw std::runtime_error("Failed to add eventfd to epoll instance");
+  }
+}
+
+URIOReactor::~URIOReactor()
+{
+  Stop();
+  close(wake_fd_);
+  close(epoll_fd_);
+}
+
+void URIOReactor::Start()
+{
+  std::lock_guard<std::mutex> lock(requests_mutex_);
+  if (!running_.load())
+  {
+    Log("Starting I/O reactor thread loop...");
+    running_.store(true);
+    reactor_thread_ = std::thread(&URIOReactor::ReactorLoop, this);
+  }
+}
+
+void URIOReactor::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(requests_mutex_);
+    if (running_.load())
+    {
+      running_.store(false);
+      Wake();
+    }
+  }
+  if (reactor_thread_.joinable())
+  {
+    reactor_thread_.join();
+  }
+}
+
+void URIOReactor::Wake()
+{
+  const uint64_t increment = 1;
+  const ssize_t written = write(wake_fd_, &increment, sizeof(increment));
+  // The only possible failure is counter overflow, which still wakes
+  static_cast<void>(written);
+}
+
+void URIOReactor::AddSource(const int fd,
+                            const std::function<bool(void)>& handler_fn)
+{
+  SourceRequest request;
+  request.add = true;
+  request.fd = fd;
+  request.handler_fn = handler_fn;
+  request.completion = nullptr;
+  RequestSourceChange(request);
+}
+
+void URIOReactor::RemoveSource(const int fd)
+{
+  SourceRequest request;
+  request.add = false;
+  request.fd = fd;
+  request.completion = nullptr;
+  RequestSourceChange(request);
+}
+
+void URIOReactor::RequestSourceChange(const SourceRequest& request)
+{
+  std::lock_guard<std::mutex> lock(requests_mutex_);
+  if (running_.load())
+  {
+    std::promise<void> completion;
+    std::future<void> applied = completion.get_future();
+    SourceRequest queued_request = request;
+    queued_request.completion = &completion;
+    // Cannot drop, since the queue only ever holds this request
+    source_requests_.Push(queued_request);
+    Wake();
+    // Rethrows any failure to apply the request
+    applied.get();
+  }
+  else
+  {
+    ApplySourceRequest(request);
+  }
+}
+
+void URIOReactor::ApplySourceRequest(const SourceRequest& request)
+{
+  if (request.add)
+  {
+    if (sources_.count(request.fd) > 0)
+    {
+      throw std::invalid_argument(
+          "fd " + std::to_string(request.fd) + " is already a reactor source");
+    }
+    std::unique_ptr<Source> source(new Source());
+    source->fd = request.fd;
+    source->handler_fn = request.handler_fn;
+    struct epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = source.get();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, request.fd, &event) != 0)
+    {
+      throw std::runtime_error("Failed to add fd " + std::to_string(request.fd)
+                               + " to reactor: "
+                               + std::string(strerror(errno)));
+    }
+    sources_[request.fd] = std::move(source);
+  }
+  else
+  {
+    const auto found_source = sources_.find(request.fd);
+    if (found_source != sources_.end())
+    {
+      const int ctl_res
+          = epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, request.fd, nullptr);
+      static_cast<void>(ctl_res);
+      sources_.erase(found_source);
+    }
+  }
+}
+
+void URIOReactor::ReactorLoop()
+{
+  tri_realtime_common::ConfigureCurrentThread(
+      reactor_thread_config_, thread_name_, logging_fn_);
+  const int max_events = 16;
+  struct epoll_event events[max_events];
+  finished_sources_.reserve(max_events);
+  while (running_.load())
+  {
+    const int num_events = epoll_wait(epoll_fd_, events, max_events, -1);
+    if (num_events < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror(nullptr);
+      throw std::runtime_error("Failed to epoll_wait");
+    }
+    for (int idx = 0; idx < num_events; idx++)
+    {
+      Source* const source = static_cast<Source*>(events[idx].data.ptr);
+      if (source == nullptr)
+      {
+        uint64_t wakeups = 0;
+        const ssize_t read_size = read(wake_fd_, &wakeups, sizeof(wakeups));
+        static_cast<void>(read_size);
+      }
+      else if (!source->handler_fn())
+      {
+        const int ctl_res
+            = epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, source->fd, nullptr);
+        static_cast<void>(ctl_res);
+        const auto found_source = sources_.find(source->fd);
+        finished_sources_.push_back(std::move(found_source->second));
+        sources_.erase(found_source);
+      }
+    }
+    finished_sources_.clear();
+    // Applied between rounds, so no handler of a changed source is running
+    // and no event of this round refers to a removed one
+    SourceRequest request;
+    while (source_requests_.TryPop(request))
+    {
+      try
+      {
+        ApplySourceRequest(request);
+        request.completion->set_value();
+      }
+      catch (...)
+      {
+        request.completion->set_exception(std::current_exception());
+      }
+    }
+    if (cycle_fn_)
+    {
+      cycle_fn_();
+    }
+  }
+}
+}
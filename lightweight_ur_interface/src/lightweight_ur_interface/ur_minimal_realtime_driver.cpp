@@ -2,324 +2,1359 @@
 
 namespace lightweight_ur_interface
 {
-using common_robotics_utilities::serialization::DeserializeNetworkMemcpyable;
+constexpr uint32_t URRealtimeLayout812::kFieldOffsets[kNumRealtimeFields];
+constexpr uint32_t URRealtimeLayout1044::kFieldOffsets[kNumRealtimeFields];
+constexpr uint32_t URRealtimeLayout1060::kFieldOffsets[kNumRealtimeFields];
+constexpr uint32_t URRealtimeLayout1108::kFieldOffsets[kNumRealtimeFields];
+constexpr uint32_t URRealtimeLayout1116::kFieldOffsets[kNumRealtimeFields];
 
-uint64_t URRealtimeState::DeserializeSelf(const std::vector<uint8_t>& buffer,
-                                          const uint64_t starting_offset)
+uint32_t URRealtimeState::ReadMessageLength(
+    const std::vector<uint8_t>& buffer, const uint64_t starting_offset)
 {
-  uint64_t current_offset = starting_offset;
-  const auto deser_length
-      = DeserializeNetworkMemcpyable<int32_t>(buffer, current_offset);
-  const int32_t message_length = deser_length.Value();
-  current_offset += deser_length.BytesRead();
-  if ((buffer.size() - current_offset) < static_cast<uint64_t>(message_length))
+  if ((buffer.size() < starting_offset)
+      || ((buffer.size() - starting_offset) < sizeof(int32_t)))
+  {
+    throw std::runtime_error("Insufficient buffer to deserialize message"
+                             " length: buffer.size()="
+                             + std::to_string(buffer.size())
+                             + " starting_offset="
+                             + std::to_string(starting_offset));
+  }
+  uint32_t network_length = 0;
+  std::memcpy(&network_length, buffer.data() + starting_offset,
+              sizeof(network_length));
+  return be32toh(network_length);
+}
+
+void URRealtimeState::CheckMessageLength(
+    const std::vector<uint8_t>& buffer, const uint64_t starting_offset,
+    const uint32_t expected_message_length)
+{
+  // The message length includes the length field itself
+  const uint32_t message_length = ReadMessageLength(buffer, starting_offset);
+  if (message_length != expected_message_length)
+  {
+    throw std::runtime_error("Message length does not match layout:"
+                             " message_length="
+                             + std::to_string(message_length)
+                             + " expected="
+                             + std::to_string(expected_message_length));
+  }
+  if ((buffer.size() - starting_offset) < message_length)
   {
     throw std::runtime_error("Insufficient buffer to deserialize message:"
                              " buffer.size()=" + std::to_string(buffer.size())
-                             + " current_offset="
-                             + std::to_string(current_offset)
+                             + " starting_offset="
+                             + std::to_string(starting_offset)
                              + " message_length="
                              + std::to_string(message_length));
   }
-  const auto deser_uptime
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  controller_uptime_ = deser_uptime.Value();
-  current_offset += deser_uptime.BytesRead();
-  const auto deser_target_position
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  target_position_ = deser_target_position.Value();
-  current_offset += deser_target_position.BytesRead();
-  const auto deser_target_velocity
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  target_velocity_ = deser_target_velocity.Value();
-  current_offset += deser_target_velocity.BytesRead();
-  const auto deser_target_acceleration
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  target_acceleration_ = deser_target_acceleration.Value();
-  current_offset += deser_target_acceleration.BytesRead();
-  const auto deser_target_current
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  target_current_ = deser_target_current.Value();
-  current_offset += deser_target_current.BytesRead();
-  const auto deser_target_torque
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  target_torque_ = deser_target_torque.Value();
-  current_offset += deser_target_torque.BytesRead();
-  const auto deser_actual_position
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  actual_position_ = deser_actual_position.Value();
-  current_offset += deser_actual_position.BytesRead();
-  const auto deser_actual_velocity
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  actual_velocity_ = deser_actual_velocity.Value();
-  current_offset += deser_actual_velocity.BytesRead();
-  const auto deser_actual_current
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  actual_current_ = deser_actual_current.Value();
-  current_offset += deser_actual_current.BytesRead();
-  const auto deser_control_current
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  control_current_ = deser_control_current.Value();
-  current_offset += deser_control_current.BytesRead();
-  const auto deser_actual_tcp_vector
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  raw_actual_tcp_pose_ = deser_actual_tcp_vector.Value();
-  actual_tcp_pose_ = TcpVectorToTransform(raw_actual_tcp_pose_);
-  current_offset += deser_actual_tcp_vector.BytesRead();
-  const auto deser_actual_tcp_twist
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  actual_tcp_twist_ = TcpVelocityToTwist(deser_actual_tcp_twist.Value());
-  current_offset += deser_actual_tcp_twist.BytesRead();
-  const auto deser_actual_tcp_wrench
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  actual_tcp_wrench_ = TcpForceToWrench(deser_actual_tcp_wrench.Value());
-  current_offset += deser_actual_tcp_wrench.BytesRead();
-  const auto deser_target_tcp_vector
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  raw_target_tcp_pose_ = deser_target_tcp_vector.Value();
-  target_tcp_pose_ = TcpVectorToTransform(raw_target_tcp_pose_);
-  current_offset += deser_target_tcp_vector.BytesRead();
-  const auto deser_target_tcp_twist
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  target_tcp_twist_ = TcpVelocityToTwist(deser_target_tcp_twist.Value());
-  current_offset += deser_target_tcp_twist.BytesRead();
-  const auto deser_digital_io_bits
-      = DeserializeNetworkMemcpyable<uint64_t>(buffer, current_offset);
-  current_offset += deser_digital_io_bits.BytesRead();
-  const auto deser_motor_temperature
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  motor_temperature_ = deser_motor_temperature.Value();
-  current_offset += deser_motor_temperature.BytesRead();
-  const auto deser_controller_rt_loop_time
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  controller_rt_loop_time_ = deser_controller_rt_loop_time.Value();
-  current_offset += deser_controller_rt_loop_time.BytesRead();
-  const auto deser_test_val
-      = DeserializeNetworkMemcpyable<uint64_t>(buffer, current_offset);
-  current_offset += deser_test_val.BytesRead();
-  const auto deser_robot_mode
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  robot_mode_ = deser_robot_mode.Value();
-  current_offset += deser_robot_mode.BytesRead();
-  const auto deser_joint_mode
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  joint_mode_ = deser_joint_mode.Value();
-  current_offset += deser_joint_mode.BytesRead();
-  const auto deser_safety_mode
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  safety_mode_ = deser_safety_mode.Value();
-  current_offset += deser_safety_mode.BytesRead();
-  const auto deser_actual_tcp_acceleration
-      = DeserializeKnownSizeDoubleVector(3, buffer, current_offset);
-  actual_tcp_acceleration_ = deser_actual_tcp_acceleration.Value();
-  current_offset += deser_actual_tcp_acceleration.BytesRead();
-  const auto deser_trajectory_limiter_speed_scaling
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  trajectory_limiter_speed_scaling_
-      = deser_trajectory_limiter_speed_scaling.Value();
-  current_offset += deser_trajectory_limiter_speed_scaling.BytesRead();
-  const auto deser_linear_momentum_norm
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  linear_momentum_norm_ = deser_linear_momentum_norm.Value();
-  current_offset += deser_linear_momentum_norm.BytesRead();
-  const auto deser_mainboard_voltage
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  mainboard_voltage_ = deser_mainboard_voltage.Value();
-  current_offset += deser_mainboard_voltage.BytesRead();
-  const auto deser_motorboard_voltage
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  motorboard_voltage_ = deser_motorboard_voltage.Value();
-  current_offset += deser_motorboard_voltage.BytesRead();
-  const auto deser_mainboard_current
-      = DeserializeNetworkMemcpyable<double>(buffer, current_offset);
-  mainboard_current_ = deser_mainboard_current.Value();
-  current_offset += deser_mainboard_current.BytesRead();
-  const auto deser_joint_voltage
-      = DeserializeKnownSizeDoubleVector(6, buffer, current_offset);
-  joint_voltage_ = deser_joint_voltage.Value();
-  current_offset += deser_joint_voltage.BytesRead();
-  const uint64_t bytes_read = current_offset - starting_offset;
+}
+
+uint64_t URRealtimeState::DeserializeSelf(
+    const std::vector<uint8_t>& buffer, const uint64_t starting_offset)
+{
+  static const URRealtimeDecoderTable decoder_table
+      = MakeRealtimeDecoderTable<kAllRealtimeFields>();
+  const uint32_t message_length = ReadMessageLength(buffer, starting_offset);
+  const URRealtimeLayoutDecoder* layout_decoder
+      = SelectRealtimeDecoder(decoder_table, message_length);
+  if (layout_decoder == nullptr)
+  {
+    throw std::runtime_error("Unsupported realtime message length "
+                             + std::to_string(message_length));
+  }
+  return (this->*(layout_decoder->decoder_fn))(buffer, starting_offset);
+}
+
+double* URRealtimeState::FieldStorage(const URRealtimeField field)
+{
+  switch (field)
+  {
+    case kControllerUptime:
+      return &controller_uptime_;
+    case kTargetPosition:
+      return target_position_.data();
+    case kTargetVelocity:
+      return target_velocity_.data();
+    case kTargetAcceleration:
+      return target_acceleration_.data();
+    case kTargetCurrent:
+      return target_current_.data();
+    case kTargetTorque:
+      return target_torque_.data();
+    case kActualPosition:
+      return actual_position_.data();
+    case kActualVelocity:
+      return actual_velocity_.data();
+    case kActualCurrent:
+      return actual_current_.data();
+    case kControlCurrent:
+      return control_current_.data();
+    case kActualTcpPose:
+      return raw_actual_tcp_pose_.data();
+    case kActualTcpTwist:
+      return actual_tcp_twist_.data();
+    case kActualTcpWrench:
+      return actual_tcp_wrench_.data();
+    case kTargetTcpPose:
+      return raw_target_tcp_pose_.data();
+    case kTargetTcpTwist:
+      return target_tcp_twist_.data();
+    case kMotorTemperature:
+      return motor_temperature_.data();
+    case kControllerRtLoopTime:
+      return &controller_rt_loop_time_;
+    case kRobotMode:
+      return &robot_mode_;
+    case kJointMode:
+      return joint_mode_.data();
+    case kSafetyMode:
+      return &safety_mode_;
+    case kActualTcpAcceleration:
+      return actual_tcp_acceleration_.data();
+    case kTrajectoryLimiterSpeedScaling:
+      return &trajectory_limiter_speed_scaling_;
+    case kLinearMomentumNorm:
+      return &linear_momentum_norm_;
+    case kMainboardVoltage:
+      return &mainboard_voltage_;
+    case kMotorboardVoltage:
+      return &motorboard_voltage_;
+    case kMainboardCurrent:
+      return &mainboard_current_;
+    case kJointVoltage:
+      return joint_voltage_.data();
+    case kDigitalInputBits:
+      return &digital_input_bits_;
+    case kDigitalOutputBits:
+      return &digital_output_bits_;
+    case kProgramState:
+      return &program_state_;
+    case kElbowPosition:
+      return elbow_position_.data();
+    case kElbowVelocity:
+      return elbow_velocity_.data();
+    case kSafetyStatus:
+      return &safety_status_;
+    default:
+      throw std::invalid_argument("Invalid realtime field "
+                                  + std::to_string(field));
+  }
+}
+
+void URRealtimeState::FinishFieldUpdate(
+    const URRealtimeFieldMask decoded_fields, const double protocol_version)
+{
+  if ((decoded_fields & RealtimeFieldBit(kActualTcpPose)) != 0)
+  {
+    actual_tcp_pose_valid_ = false;
+  }
+  if ((decoded_fields & RealtimeFieldBit(kTargetTcpPose)) != 0)
+  {
+    target_tcp_pose_valid_ = false;
+  }
+  protocol_version_ = protocol_version;
+  decoded_fields_ = decoded_fields;
+  initialized_ = true;
+}
+
+URStreamFramer::URStreamFramer(const size_t capacity,
+                               const uint32_t max_packet_size,
+                               const uint32_t length_prefix_size)
+  : read_position_(0), write_position_(0), max_packet_size_(max_packet_size),
+    length_prefix_size_(length_prefix_size), discarded_bytes_(0)
+{
+  if ((capacity == 0) || ((capacity & (capacity - 1)) != 0))
+  {
+    throw std::invalid_argument("capacity must be a power of two");
+  }
+  if ((length_prefix_size == 0) || (length_prefix_size > sizeof(uint32_t)))
+  {
+    throw std::invalid_argument("length_prefix_size must be in [1, 4]");
+  }
+  if ((max_packet_size <= length_prefix_size) || (max_packet_size > capacity))
+  {
+    throw std::invalid_argument(
+        "max_packet_size must be larger than the length prefix and no larger"
+        " than capacity");
+  }
+  ring_buffer_.resize(capacity, 0x00);
+  ring_mask_ = capacity - 1;
+  packet_buffer_.reserve(max_packet_size);
+}
+
+uint32_t URStreamFramer::PeekPacketLength() const
+{
+  uint32_t packet_length = 0;
+  for (uint32_t idx = 0; idx < length_prefix_size_; idx++)
+  {
+    packet_length = (packet_length << 8) | PeekByte(read_position_ + idx);
+  }
+  return packet_length;
+}
+
+void URStreamFramer::CopyOut(
+    const uint64_t position, const size_t size, uint8_t* dest) const
+{
+  const size_t start_index = static_cast<size_t>(position) & ring_mask_;
+  const size_t first_size = std::min(size, ring_buffer_.size() - start_index);
+  std::memcpy(dest, ring_buffer_.data() + start_index, first_size);
+  if (first_size < size)
+  {
+    std::memcpy(dest + first_size, ring_buffer_.data(), size - first_size);
+  }
+}
+
+int URStreamFramer::PrepareWrite(struct iovec* regions)
+{
+  const size_t free_bytes = FreeBytes();
+  if (free_bytes == 0)
+  {
+    return 0;
+  }
+  const size_t write_index = static_cast<size_t>(write_position_) & ring_mask_;
+  const size_t first_size
+      = std::min(free_bytes, ring_buffer_.size() - write_index);
+  regions[0].iov_base = ring_buffer_.data() + write_index;
+  regions[0].iov_len = first_size;
+  if (first_size < free_bytes)
+  {
+    regions[1].iov_base = ring_buffer_.data();
+    regions[1].iov_len = free_bytes - first_size;
+    return 2;
+  }
+  return 1;
+}
+
+void URStreamFramer::CommitWrite(const size_t bytes_written)
+{
+  if (bytes_written > FreeBytes())
+  {
+    throw std::invalid_argument("bytes_written > FreeBytes()");
+  }
+  write_position_ += bytes_written;
+}
+
+size_t URStreamFramer::Append(const uint8_t* data, const size_t size)
+{
+  struct iovec regions[2];
+  const int num_regions = PrepareWrite(regions);
+  size_t appended = 0;
+  for (int idx = 0; idx < num_regions; idx++)
+  {
+    const size_t to_copy = std::min(size - appended, regions[idx].iov_len);
+    std::memcpy(regions[idx].iov_base, data + appended, to_copy);
+    appended += to_copy;
+  }
+  CommitWrite(appended);
+  return appended;
+}
+
+size_t URStreamFramer::DrainPackets(
+    const std::function<void(const std::vector<uint8_t>&)>& packet_fn)
+{
+  size_t packets_drained = 0;
+  while (BufferedBytes() >= length_prefix_size_)
+  {
+    const uint32_t packet_length = PeekPacketLength();
+    if ((packet_length <= length_prefix_size_)
+        || (packet_length > max_packet_size_))
+    {
+      // Not a plausible length prefix, so we have lost packet alignment.
+      // Skip a byte at a time until a plausible packet start is found.
+      read_position_++;
+      discarded_bytes_++;
+      continue;
+    }
+    if (BufferedBytes() < packet_length)
+    {
+      // Wait for the rest of the packet to arrive
+      break;
+    }
+    // Resizing within the reserved capacity does not allocate
+    packet_buffer_.resize(packet_length);
+    CopyOut(read_position_, packet_length, packet_buffer_.data());
+    read_position_ += packet_length;
+    packets_drained++;
+    packet_fn(packet_buffer_);
+  }
+  return packets_drained;
+}
+
+void URStreamFramer::Reset()
+{
+  read_position_ = 0;
+  write_position_ = 0;
+}
+
+void URControllerClockEstimator::AddSample(const double controller_uptime,
+                                           const int64_t host_time_ns)
+{
+  // Uptime going backwards means the controller restarted
+  if ((num_samples_ > 0) && (controller_uptime < last_controller_uptime_))
+  {
+    Reset();
+  }
+  last_controller_uptime_ = controller_uptime;
+  samples_[next_sample_index_] = Sample{controller_uptime, host_time_ns};
+  next_sample_index_ = (next_sample_index_ + 1) % samples_.size();
+  num_samples_ = std::min(num_samples_ + 1, samples_.size());
+  samples_since_fit_++;
+  if ((num_samples_ >= kMinimumSamplesToFit)
+      && (!estimate_.Valid() || (samples_since_fit_ >= refit_interval_)))
+  {
+    Fit();
+  }
+}
+
+void URControllerClockEstimator::Fit()
+{
+  const Sample& newest
+      = samples_[(next_sample_index_ + samples_.size() - 1) % samples_.size()];
+  // Relative to the newest sample, x is controller seconds and y host seconds
+  double sum_x = 0.0;
+  double sum_y = 0.0;
+  for (size_t idx = 0; idx < num_samples_; idx++)
+  {
+    sum_x += samples_[idx].controller_uptime - newest.controller_uptime;
+    sum_y += static_cast<double>(
+        samples_[idx].host_time_ns - newest.host_time_ns) * 1e-9;
+  }
+  const double mean_x = sum_x / static_cast<double>(num_samples_);
+  const double mean_y = sum_y / static_cast<double>(num_samples_);
+  double sum_xx = 0.0;
+  double sum_xy = 0.0;
+  for (size_t idx = 0; idx < num_samples_; idx++)
+  {
+    const double dx
+        = (samples_[idx].controller_uptime - newest.controller_uptime)
+          - mean_x;
+    const double dy = (static_cast<double>(
+        samples_[idx].host_time_ns - newest.host_time_ns) * 1e-9) - mean_y;
+    sum_xx += dx * dx;
+    sum_xy += dx * dy;
+  }
+  if (sum_xx <= 0.0)
+  {
+    return;
+  }
+  const double rate = sum_xy / sum_xx;
+  double min_residual = std::numeric_limits<double>::infinity();
+  for (size_t idx = 0; idx < num_samples_; idx++)
+  {
+    const double x
+        = samples_[idx].controller_uptime - newest.controller_uptime;
+    const double y = static_cast<double>(
+        samples_[idx].host_time_ns - newest.host_time_ns) * 1e-9;
+    min_residual = std::min(min_residual, y - (rate * x));
+  }
+  estimate_ = URControllerClockEstimate(
+      newest.controller_uptime,
+      newest.host_time_ns + static_cast<int64_t>(std::llround(
+          min_residual * 1e9)),
+      rate);
+  samples_since_fit_ = 0;
+}
+
+void URControllerClockEstimator::Reset()
+{
+  next_sample_index_ = 0;
+  num_samples_ = 0;
+  samples_since_fit_ = 0;
+  estimate_ = URControllerClockEstimate();
+}
+
+void URRealtimeArrivalStatistics::AddPacket(const int64_t receive_time_ns,
+                                            const double controller_uptime)
+{
+  num_packets_++;
+  const double uptime_change = controller_uptime - last_controller_uptime_;
+  // Uptime going backwards means the controller restarted
+  if (has_last_packet_ && (uptime_change > 0.0))
+  {
+    const double arrival_period
+        = static_cast<double>(receive_time_ns - last_receive_time_ns_) * 1e-9;
+    jitter_.AddSample(arrival_period - uptime_change);
+    if ((controller_period_ <= 0.0) || (uptime_change < controller_period_))
+    {
+      controller_period_ = uptime_change;
+    }
+    if (uptime_change > (controller_period_ * 1.5))
+    {
+      num_gaps_++;
+      num_missed_packets_ += static_cast<uint64_t>(
+          std::round(uptime_change / controller_period_)) - 1;
+    }
+    else
+    {
+      arrival_period_.AddSample(arrival_period);
+    }
+  }
+  last_receive_time_ns_ = receive_time_ns;
+  last_controller_uptime_ = controller_uptime;
+  has_last_packet_ = true;
+}
+
+URStatePhaseLock::URStatePhaseLock(const double send_offset)
+  : num_used_states_(0)
+{
+  if (send_offset < 0.0)
+  {
+    throw std::invalid_argument("send_offset < 0.0");
+  }
+  send_offset_ns_ = static_cast<int64_t>(send_offset * 1e9);
+  latest_receive_time_ns_.store(0);
+  num_states_.store(0);
+  state_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (state_fd_ < 0)
+  {
+    perror(nullptr);
+    throw std::runtime_error("Failed to create eventfd");
+  }
+}
+
+URStatePhaseLock::~URStatePhaseLock()
+{
+  close(state_fd_);
+}
+
+void URStatePhaseLock::NotifyState(const URRealtimeState& state)
+{
+  struct timespec realtime_now;
+  struct timespec monotonic_now;
+  clock_gettime(CLOCK_REALTIME, &realtime_now);
+  clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+  const int64_t monotonic_now_ns = TimespecToNanoseconds(monotonic_now);
+  // Receive times are kernel timestamps in CLOCK_REALTIME; states without
+  // one are treated as received now
+  const int64_t receive_time_ns
+      = (state.ReceiveTimeNanoseconds() > 0)
+        ? (state.ReceiveTimeNanoseconds()
+           - (TimespecToNanoseconds(realtime_now) - monotonic_now_ns))
+        : monotonic_now_ns;
+  // The receive time is stored first, so a cycle that sees the new count
+  // also sees this (or a later) receive time
+  latest_receive_time_ns_.store(receive_time_ns, std::memory_order_release);
+  num_states_.fetch_add(1, std::memory_order_release);
+  const uint64_t increment = 1;
+  const ssize_t written = write(state_fd_, &increment, sizeof(increment));
+  static_cast<void>(written);
+}
+
+bool URStatePhaseLock::WaitForState(const double timeout)
+{
+  const auto deadline = std::chrono::steady_clock::now()
+      + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(timeout));
+  // The eventfd stays readable until drained, so a state that arrives after
+  // the check below still wakes the poll
+  while (num_states_.load(std::memory_order_acquire) <= num_used_states_)
+  {
+    const int64_t remaining_ns
+        = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+    if (remaining_ns <= 0)
+    {
+      return false;
+    }
+    struct timespec remaining;
+    remaining.tv_sec = static_cast<time_t>(remaining_ns / 1000000000);
+    remaining.tv_nsec = static_cast<long>(remaining_ns % 1000000000);
+    struct pollfd state_fd;
+    state_fd.fd = state_fd_;
+    state_fd.events = POLLIN;
+    state_fd.revents = 0;
+    if (ppoll(&state_fd, 1, &remaining, nullptr) > 0)
+    {
+      uint64_t notifications = 0;
+      const ssize_t read_size
+          = read(state_fd_, &notifications, sizeof(notifications));
+      static_cast<void>(read_size);
+    }
+  }
+  return true;
+}
+
+bool URStatePhaseLock::WaitForSendTime(const double timeout)
+{
+  if (!WaitForState(timeout))
+  {
+    return false;
+  }
+  const uint64_t cycle_state = num_states_.load(std::memory_order_acquire);
+  const int64_t receive_time_ns
+      = latest_receive_time_ns_.load(std::memory_order_acquire);
+  const uint64_t skipped_states = cycle_state - num_used_states_ - 1;
+  num_used_states_ = cycle_state;
+  const int64_t send_time_ns = receive_time_ns + send_offset_ns_;
+  struct timespec send_time;
+  send_time.tv_sec = static_cast<time_t>(send_time_ns / 1000000000);
+  send_time.tv_nsec = static_cast<long>(send_time_ns % 1000000000);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &send_time, nullptr)
+         == EINTR) {}
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const double send_phase
+      = static_cast<double>(TimespecToNanoseconds(now) - receive_time_ns)
+        * 1e-9;
+  const bool overrun
+      = (num_states_.load(std::memory_order_acquire) > cycle_state);
+  std::lock_guard<std::mutex> lock(statistics_mutex_);
+  statistics_.AddCycle(send_phase, overrun, skipped_states);
+  return true;
+}
+
+URPhaseLockStatistics URStatePhaseLock::Statistics() const
+{
+  std::lock_guard<std::mutex> lock(statistics_mutex_);
+  return statistics_;
+}
+
+void URStateTimestamper::Stamp(URRealtimeState& state,
+                               const int64_t receive_time_ns,
+                               const int64_t monotonic_to_realtime_ns)
+{
+  const double controller_uptime = state.ControllerUptime();
+  state.SetReceiveTimeNanoseconds(receive_time_ns);
+  arrival_statistics_.AddPacket(receive_time_ns, controller_uptime);
+  // Fit against the monotonic clock, so that steps of the realtime clock
+  // do not disturb the estimate
+  const int64_t monotonic_receive_time_ns
+      = receive_time_ns - monotonic_to_realtime_ns;
+  clock_estimator_.AddSample(controller_uptime, monotonic_receive_time_ns);
+  const URControllerClockEstimate& clock_estimate = clock_estimator_.Estimate();
+  const int64_t monotonic_sample_time_ns
+      = clock_estimate.Valid()
+        ? clock_estimate.ControllerUptimeToHostTime(controller_uptime)
+        : monotonic_receive_time_ns;
+  state.SetSampleTimeNanoseconds(
+      monotonic_sample_time_ns + monotonic_to_realtime_ns,
+      monotonic_sample_time_ns);
+}
+
+URRealtimeStreamDecoder::URRealtimeStreamDecoder(
+    const URRealtimeDecoderTable& decoder_table,
+    const std::function<void(const URRealtimeState&)>& state_callback_fn,
+    const std::function<void(const std::string&)>& logging_fn)
+  : framer_(kRecvRingBufferSize, kMaxPacketSize),
+    decoder_table_(decoder_table), state_callback_fn_(state_callback_fn),
+    logging_fn_(logging_fn), layout_decoder_(nullptr),
+    last_rejected_length_(0), receive_time_ns_(0),
+    monotonic_to_realtime_ns_(0) {}
+
+void URRealtimeStreamDecoder::DecodePacket(const std::vector<uint8_t>& packet)
+{
+  const uint32_t packet_size = static_cast<uint32_t>(packet.size());
+  if ((layout_decoder_ == nullptr)
+      || (layout_decoder_->message_length != packet_size))
+  {
+    layout_decoder_ = SelectRealtimeDecoder(decoder_table_, packet_size);
+    if (layout_decoder_ == nullptr)
+    {
+      if (packet_size != last_rejected_length_)
+      {
+        Log("Rejecting realtime packets with unsupported length "
+            + std::to_string(packet_size));
+        last_rejected_length_ = packet_size;
+      }
+      return;
+    }
+    Log("Selected realtime layout for " + std::to_string(packet_size)
+        + " byte packets (protocol version "
+        + std::to_string(layout_decoder_->protocol_version) + ")");
+  }
+  try
+  {
+    (latest_state_.*(layout_decoder_->decoder_fn))(packet, 0);
+    timestamper_.Stamp(latest_state_, receive_time_ns_,
+                       monotonic_to_realtime_ns_);
+    state_callback_fn_(latest_state_);
+  }
+  catch (const std::runtime_error& ex)
+  {
+    Log("Message deserialization failed for " + std::to_string(packet.size())
+        + " byte packet with error " + std::string(ex.what()));
+  }
+}
+
+void URRealtimeStreamDecoder::DrainPackets()
+{
+  // Several packets may have arrived since the last read, so drain all of
+  // them rather than only the first
+  const uint64_t previously_discarded_bytes = framer_.DiscardedBytes();
+  framer_.DrainPackets([this] (const std::vector<uint8_t>& packet)
+  {
+    DecodePacket(packet);
+  });
+  const uint64_t discarded_bytes
+      = framer_.DiscardedBytes() - previously_discarded_bytes;
+  if (discarded_bytes > 0)
+  {
+    Log("Discarded " + std::to_string(discarded_bytes)
+        + " bytes while resynchronizing to packet boundaries");
+  }
+}
+
+void URRealtimeStreamDecoder::CommitWrite(
+    const size_t bytes_written, const int64_t receive_time_ns,
+    const int64_t monotonic_to_realtime_ns)
+{
+  receive_time_ns_ = receive_time_ns;
+  monotonic_to_realtime_ns_ = monotonic_to_realtime_ns;
+  framer_.CommitWrite(bytes_written);
+  DrainPackets();
+}
+
+void URRealtimeStreamDecoder::Append(
+    const uint8_t* data, const size_t size, const int64_t receive_time_ns,
+    const int64_t monotonic_to_realtime_ns)
+{
+  receive_time_ns_ = receive_time_ns;
+  monotonic_to_realtime_ns_ = monotonic_to_realtime_ns;
+  size_t appended = 0;
+  while (appended < size)
+  {
+    const size_t newly_appended
+        = framer_.Append(data + appended, size - appended);
+    appended += newly_appended;
+    DrainPackets();
+    if ((newly_appended == 0) && (framer_.FreeBytes() == 0))
+    {
+      throw std::runtime_error("Stream framer is full and cannot drain");
+    }
+  }
+}
+
+void URRealtimeStreamDecoder::Restart()
+{
+  framer_.Reset();
+  layout_decoder_ = nullptr;
+  last_rejected_length_ = 0;
+  timestamper_.Restart();
+}
+
+void URRealtimeStreamDecoder::Reset()
+{
+  Restart();
+  timestamper_.Reset();
+}
+
+URRealtimeReplay::URRealtimeReplay(
+    const std::string& capture_path,
+    const std::function<void(const URRealtimeState&)>& state_callback_fn,
+    const std::function<void(const std::string&)>& logging_fn,
+    const URRealtimeDecoderTable& decoder_table)
+  : reader_(capture_path),
+    stream_decoder_(decoder_table, state_callback_fn, logging_fn) {}
+
+uint64_t URRealtimeReplay::Run(const bool at_recorded_speed)
+{
+  reader_.Rewind();
+  stream_decoder_.Reset();
+  uint64_t replayed_bytes = 0;
+  bool first_record = true;
+  int64_t first_receive_time_ns = 0;
+  int64_t start_time_ns = 0;
+  URStreamCaptureRecord record;
+  while (reader_.NextRecord(record))
+  {
+    if (first_record)
+    {
+      struct timespec monotonic_now;
+      clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+      start_time_ns = TimespecToNanoseconds(monotonic_now);
+      first_receive_time_ns = record.receive_time_ns;
+      first_record = false;
+    }
+    else if (at_recorded_speed)
+    {
+      const int64_t deliver_time_ns
+          = start_time_ns + (record.receive_time_ns - first_receive_time_ns);
+      struct timespec deliver_time;
+      deliver_time.tv_sec = static_cast<time_t>(deliver_time_ns / 1000000000);
+      deliver_time.tv_nsec = static_cast<long>(deliver_time_ns % 1000000000);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deliver_time,
+                             nullptr) == EINTR) {}
+    }
+    // Recorded timestamps are used as-is, so a replay decodes identically
+    // regardless of its speed
+    stream_decoder_.Append(record.data, record.size, record.receive_time_ns,
+                           record.monotonic_to_realtime_ns);
+    replayed_bytes += record.size;
+  }
+  return replayed_bytes;
+}
+
+ssize_t RecvTimestamped(const int socket_fd, struct iovec* regions,
+                        const int num_regions, int64_t& receive_time_ns,
+                        int64_t& monotonic_to_realtime_ns)
+{
+  alignas(struct cmsghdr) char control_buffer[CMSG_SPACE(
+      sizeof(struct timespec))];
+  struct msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = regions;
+  message.msg_iovlen = static_cast<size_t>(num_regions);
+  message.msg_control = control_buffer;
+  message.msg_controllen = sizeof(control_buffer);
+  const ssize_t bytes_read = recvmsg(socket_fd, &message, 0);
+  if (bytes_read <= 0)
+  {
+    return bytes_read;
+  }
+  // The timestamp is that of the most recent segment read, which all
+  // packets completed by this read share. Fall back to the current time
+  // if the kernel did not provide one.
+  struct timespec receive_time;
+  bool have_receive_time = false;
+  for (struct cmsghdr* control = CMSG_FIRSTHDR(&message);
+       control != nullptr; control = CMSG_NXTHDR(&message, control))
+  {
+    if ((control->cmsg_level == SOL_SOCKET)
+        && (control->cmsg_type == SCM_TIMESTAMPNS))
+    {
+      std::memcpy(&receive_time, CMSG_DATA(control), sizeof(receive_time));
+      have_receive_time = true;
+    }
+  }
+  if (!have_receive_time)
+  {
+    clock_gettime(CLOCK_REALTIME, &receive_time);
+  }
+  receive_time_ns = TimespecToNanoseconds(receive_time);
+  struct timespec realtime_now;
+  struct timespec monotonic_now;
+  clock_gettime(CLOCK_REALTIME, &realtime_now);
+  clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+  monotonic_to_realtime_ns
+      = TimespecToNanoseconds(realtime_now)
+        - TimespecToNanoseconds(monotonic_now);
+  const int enable_flag = 1;
+  setsockopt(socket_fd, IPPROTO_TCP, TCP_QUICKACK,
+             reinterpret_cast<const void*>(&enable_flag), sizeof(int));
   return bytes_read;
 }
 
-URRealtimeInterface::URRealtimeInterface(
-    const std::string& robot_host,
-    const std::function<void(const URRealtimeState&)>&
-      state_received_callback_fn,
+URRobotConnection::URRobotConnection(
+    const std::string& robot_host, const uint16_t port,
+    const URRealtimeConnectionParams& connection_params,
     const std::function<void(const std::string&)>& logging_fn)
-  : state_received_callback_fn_(state_received_callback_fn),
-    logging_fn_(logging_fn)
+  : socket_fd_(-1), logging_fn_(logging_fn),
+    connection_params_(connection_params), connection_state_(kDisconnected),
+    reconnect_backoff_(connection_params.MinReconnectBackoff()),
+    connection_count_(0)
 {
-  connected_.store(false);
+  ready_.store(false);
   struct hostent* nameserver = gethostbyname(robot_host.c_str());
   if (nameserver == nullptr)
   {
     perror(nullptr);
     throw std::runtime_error("Failed to find robot at " + robot_host);
   }
-  Log("Connecting to robot at " + robot_host);
+  Log("Connecting to robot at " + robot_host + ":" + std::to_string(port));
   std::memset(&robot_addr_, 0, sizeof(robot_addr_));
   robot_addr_.sin_family = AF_INET;
   std::memcpy(
       &robot_addr_.sin_addr.s_addr, nameserver->h_addr,
       static_cast<size_t>(nameserver->h_length));
-  robot_addr_.sin_port = htons(30003);
+  robot_addr_.sin_port = htons(port);
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0)
+  {
+    perror(nullptr);
+    throw std::runtime_error("Failed to create epoll instance");
+  }
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if ((timer_fd_ < 0) || (wake_fd_ < 0))
+  {
+    perror(nullptr);
+    throw std::runtime_error("Failed to create timerfd or eventfd");
+  }
+  for (const int fd : {timer_fd_, wake_fd_})
+  {
+    struct epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+      perror(nullptr);
+      throw std::runtime_error("Failed to add fd to epoll instance");
+    }
+  }
+}
+
+URRobotConnection::~URRobotConnection()
+{
+  CloseSocket();
+  close(wake_fd_);
+  close(timer_fd_);
+  close(epoll_fd_);
 }
 
-void URRealtimeInterface::ConnectToRobot()
+void URRobotConnection::ArmTimer(const double initial_delay,
+                                 const double interval)
 {
-  socket_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (socket_fd_ <= 0)
+  const auto to_timespec = [] (const double seconds)
+  {
+    struct timespec time;
+    time.tv_sec = static_cast<time_t>(std::floor(seconds));
+    time.tv_nsec = static_cast<long>(
+        (seconds - std::floor(seconds)) * 1000000000.0);
+    return time;
+  };
+  struct itimerspec timer_spec;
+  timer_spec.it_value = to_timespec(initial_delay);
+  timer_spec.it_interval = to_timespec(interval);
+  // A zero it_value would disarm the timer rather than fire immediately
+  if ((timer_spec.it_value.tv_sec == 0) && (timer_spec.it_value.tv_nsec == 0))
+  {
+    timer_spec.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(timer_fd_, 0, &timer_spec, nullptr) != 0)
   {
     perror(nullptr);
-    throw std::runtime_error("Failed to create socket");
+    throw std::runtime_error("Failed to arm timerfd");
+  }
+}
+
+void URRobotConnection::BeginConnect()
+{
+  const int new_socket_fd
+      = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (new_socket_fd < 0)
+  {
+    Reconnect("Failed to create socket: " + std::string(strerror(errno)));
+    return;
   }
   const int enable_flag = 1;
   const int setnodelay_res
-      = setsockopt(socket_fd_, IPPROTO_TCP, TCP_NODELAY,
+      = setsockopt(new_socket_fd, IPPROTO_TCP, TCP_NODELAY,
                    reinterpret_cast<const void*>(&enable_flag), sizeof(int));
-  if (setnodelay_res != 0)
-  {
-    perror(nullptr);
-    throw std::runtime_error("Failed to enable TCP_NODELAY");
-  }
   const int setquickack_res
-      = setsockopt(socket_fd_, IPPROTO_TCP, TCP_QUICKACK,
+      = setsockopt(new_socket_fd, IPPROTO_TCP, TCP_QUICKACK,
                    reinterpret_cast<const void*>(&enable_flag), sizeof(int));
-  if (setquickack_res != 0)
-  {
-    perror(nullptr);
-    throw std::runtime_error("Failed to enable TCP_QUICKACK");
-  }
   const int setreuseaddr_res
-      = setsockopt(socket_fd_, SOL_SOCKET, SO_REUSEADDR,
+      = setsockopt(new_socket_fd, SOL_SOCKET, SO_REUSEADDR,
+                   reinterpret_cast<const void*>(&enable_flag), sizeof(int));
+  // Have the kernel timestamp packets on arrival, so that state timestamps do
+  // not include our own wakeup and decode latency
+  const int settimestamp_res
+      = setsockopt(new_socket_fd, SOL_SOCKET, SO_TIMESTAMPNS,
                    reinterpret_cast<const void*>(&enable_flag), sizeof(int));
-  if (setreuseaddr_res != 0)
+  if ((setnodelay_res != 0) || (setquickack_res != 0)
+      || (setreuseaddr_res != 0) || (settimestamp_res != 0))
   {
-    perror(nullptr);
-    throw std::runtime_error("Failed to enable SO_REUSEADDR");
-  }
-  connect(socket_fd_, reinterpret_cast<struct sockaddr*>(&robot_addr_),
-          sizeof(robot_addr_));
-  // Since the socket is nonblocking
-  // we must select() on it to make sure it works
-  fd_set writefds;
-  FD_ZERO(&writefds);
-  FD_SET(socket_fd_, &writefds);
-  struct timeval timeout;
-  timeout.tv_sec = 10;
-  timeout.tv_usec = 0;
-  const int select_res
-      = select(socket_fd_ + 1, nullptr, &writefds, nullptr, &timeout);
-  if (select_res <= 0)
+    close(new_socket_fd);
+    Reconnect("Failed to set socket options: "
+              + std::string(strerror(errno)));
+    return;
+  }
   {
-    perror(nullptr);
-    throw std::runtime_error("Failed to select");
+    std::lock_guard<std::mutex> lock(socket_mutex_);
+    socket_fd_ = new_socket_fd;
   }
+  struct epoll_event event;
+  std::memset(&event, 0, sizeof(event));
+  event.events = EPOLLOUT;
+  event.data.fd = socket_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, socket_fd_, &event) != 0)
+  {
+    Reconnect("Failed to add socket to epoll instance: "
+              + std::string(strerror(errno)));
+    return;
+  }
+  connection_state_ = kConnecting;
+  const int connect_res
+      = connect(socket_fd_, reinterpret_cast<struct sockaddr*>(&robot_addr_),
+                sizeof(robot_addr_));
+  if ((connect_res != 0) && (errno != EINPROGRESS))
+  {
+    Reconnect("Failed to connect: " + std::string(strerror(errno)));
+    return;
+  }
+  // Completion (or failure) is reported by the socket becoming writable
+  ArmTimer(connection_params_.ConnectTimeout(), 0.0);
+}
+
+bool URRobotConnection::CompleteConnect()
+{
   int so_error_flag = 0;
-  unsigned int flag_len = 0;
+  socklen_t flag_len = sizeof(so_error_flag);
   const int getsockopt_res
       = getsockopt(socket_fd_, SOL_SOCKET, SO_ERROR, &so_error_flag, &flag_len);
-  if (so_error_flag < 0)
+  if (getsockopt_res != 0)
   {
-    perror(nullptr);
-    throw std::runtime_error("Failed to check socket error");
+    Reconnect("Failed to getsockopt SO_ERROR: "
+              + std::string(strerror(errno)));
+    return false;
   }
-  if (getsockopt_res != 0)
+  if (so_error_flag != 0)
   {
-    perror(nullptr);
-    throw std::runtime_error("Failed to getsockopt SO_ERROR");
+    Reconnect("Failed to connect: " + std::string(strerror(so_error_flag)));
+    return false;
+  }
+  struct epoll_event event;
+  std::memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.fd = socket_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, socket_fd_, &event) != 0)
+  {
+    Reconnect("Failed to watch socket for reads: "
+              + std::string(strerror(errno)));
+    return false;
   }
+  connection_state_ = kConnected;
+  connection_count_++;
+  last_data_time_ = std::chrono::steady_clock::now();
+  // The watchdog checks for stale data at half the timeout, so a dead
+  // connection is detected within 1.5x the timeout
+  const double watchdog_interval = connection_params_.WatchdogTimeout() * 0.5;
+  ArmTimer(watchdog_interval, watchdog_interval);
   Log("Connected to robot");
-  connected_.store(true);
+  return true;
 }
 
-URRealtimeInterface::~URRealtimeInterface()
+void URRobotConnection::HandleTimer(
+    const std::function<bool(void)>& expecting_data_fn)
 {
-  StopRecv();
-  close(socket_fd_);
+  uint64_t expirations = 0;
+  const ssize_t read_size = read(timer_fd_, &expirations, sizeof(expirations));
+  if (read_size != static_cast<ssize_t>(sizeof(expirations)))
+  {
+    return;
+  }
+  if (connection_state_ == kDisconnected)
+  {
+    BeginConnect();
+  }
+  else if (connection_state_ == kConnecting)
+  {
+    Reconnect("Timed out connecting after "
+              + std::to_string(connection_params_.ConnectTimeout())
+              + " seconds");
+  }
+  else if (expecting_data_fn && !expecting_data_fn())
+  {
+    // Nothing is due, so silence is not a failure
+    NoteDataReceived();
+  }
+  else
+  {
+    const double data_age = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - last_data_time_).count();
+    if (data_age > connection_params_.WatchdogTimeout())
+    {
+      Reconnect("No data received for " + std::to_string(data_age)
+                + " seconds");
+    }
+  }
 }
 
-void URRealtimeInterface::StartRecv()
+void URRobotConnection::Reconnect(const std::string& reason)
 {
-  Log("Connecting to robot...");
-  ConnectToRobot();
-  Log("Starting recv thread loop...");
-  running_.store(true);
-  recv_thread_ = std::thread(&URRealtimeInterface::RecvLoop, this);
+  CloseSocket();
+  connection_state_ = kDisconnected;
+  Log("Connection to robot failed [" + reason + "], retrying in "
+      + std::to_string(reconnect_backoff_) + " seconds");
+  ArmTimer(reconnect_backoff_, 0.0);
+  reconnect_backoff_ = std::min(reconnect_backoff_ * 2.0,
+                                connection_params_.MaxReconnectBackoff());
 }
 
-void URRealtimeInterface::StopRecv()
+void URRobotConnection::CloseSocket()
 {
-  running_.store(false);
-  recv_thread_.join();
+  std::lock_guard<std::mutex> lock(socket_mutex_);
+  ready_.store(false);
+  if (socket_fd_ >= 0)
+  {
+    // Shutting down wakes any Send() blocked on a duplicate of the fd, and
+    // closing the fd also removes it from the epoll instance
+    shutdown(socket_fd_, SHUT_RDWR);
+    close(socket_fd_);
+    socket_fd_ = -1;
+  }
 }
 
-void URRealtimeInterface::RecvLoop()
+void URRobotConnection::MarkReady()
+{
+  // Backoff is only reset once a connection is usable, so that connections
+  // which fail their handshake are not retried at the minimum backoff
+  reconnect_backoff_ = connection_params_.MinReconnectBackoff();
+  {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    ready_.store(true);
+  }
+  ready_cv_.notify_all();
+}
+
+bool URRobotConnection::WaitForReady(const double timeout)
+{
+  std::unique_lock<std::mutex> lock(ready_mutex_);
+  return ready_cv_.wait_for(
+      lock, std::chrono::duration<double>(timeout),
+      [&] () { return ready_.load(); });
+}
+
+void URRobotConnection::Wake()
+{
+  const uint64_t increment = 1;
+  const ssize_t written = write(wake_fd_, &increment, sizeof(increment));
+  static_cast<void>(written);
+}
+
+void URRobotConnection::Open()
+{
+  BeginConnect();
+}
+
+void URRobotConnection::Close()
+{
+  CloseSocket();
+  connection_state_ = kDisconnected;
+  // Disarming also discards pending expirations, so a later Open() does not
+  // see a stale connect timeout
+  struct itimerspec timer_spec;
+  std::memset(&timer_spec, 0, sizeof(timer_spec));
+  const int settime_res = timerfd_settime(timer_fd_, 0, &timer_spec, nullptr);
+  static_cast<void>(settime_res);
+}
+
+void URRobotConnection::WaitAndDispatch(
+    const int timeout_ms,
+    const std::function<void(const int)>& connected_fn,
+    const std::function<void(const int)>& readable_fn,
+    const std::function<bool(void)>& expecting_data_fn)
 {
-  std::vector<uint8_t> recv_buffer(2048, 0x00);
-  struct timeval timeout;
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(socket_fd_, &readfds);
-  while (running_.load())
-  {
-    timeout.tv_sec = 0; // Do this each loop as select modifies timeout
-    timeout.tv_usec = 500000; // Set timeout of 0.5 sec
-    const int select_res
-        = select(socket_fd_ + 1, &readfds, nullptr, nullptr, &timeout);
-    if (select_res <= 0)
+  const int max_events = 4;
+  struct epoll_event events[max_events];
+  const int num_events
+      = epoll_wait(epoll_fd_, events, max_events, timeout_ms);
+  if (num_events < 0)
+  {
+    if (errno == EINTR)
     {
-      perror(nullptr);
-      throw std::runtime_error("Failed to select");
+      return;
     }
-    const ssize_t bytes_read
-        = read(socket_fd_, recv_buffer.data(), recv_buffer.size());
-    if (bytes_read > 0)
+    perror(nullptr);
+    throw std::runtime_error("Failed to epoll_wait");
+  }
+  for (int idx = 0; idx < num_events; idx++)
+  {
+    const int event_fd = events[idx].data.fd;
+    if (event_fd == wake_fd_)
     {
-      const int enable_flag = 1;
-      const int setquickack_res = setsockopt(
-          socket_fd_, IPPROTO_TCP, TCP_QUICKACK,
-          reinterpret_cast<const void*>(&enable_flag), sizeof(int));
-      if (setquickack_res != 0)
-      {
-        connected_.store(false);
-        perror(nullptr);
-        throw std::runtime_error("Failed to enable TCP_QUICKACK");
-      }
-      try
+      uint64_t wakeups = 0;
+      const ssize_t read_size = read(wake_fd_, &wakeups, sizeof(wakeups));
+      static_cast<void>(read_size);
+    }
+    else if (event_fd == timer_fd_)
+    {
+      HandleTimer(expecting_data_fn);
+    }
+    else if ((event_fd == socket_fd_) && (socket_fd_ >= 0))
+    {
+      if (connection_state_ == kConnecting)
       {
-        const URRealtimeState latest_state
-            = URRealtimeState::Deserialize(recv_buffer, 0).Value();
-        state_received_callback_fn_(latest_state);
+        if (CompleteConnect())
+        {
+          connected_fn(socket_fd_);
+        }
       }
-      catch (const std::runtime_error& ex)
+      else if (connection_state_ == kConnected)
       {
-        Log("Message deserialization failed for " + std::to_string(bytes_read)
-            + " bytes read with error " + std::string(ex.what()));
+        readable_fn(socket_fd_);
       }
     }
+  }
+}
+
+void URRobotConnection::ProcessEvents(
+    const std::function<void(const int)>& connected_fn,
+    const std::function<void(const int)>& readable_fn,
+    const std::function<bool(void)>& expecting_data_fn)
+{
+  WaitAndDispatch(0, connected_fn, readable_fn, expecting_data_fn);
+}
+
+void URRobotConnection::Run(
+    const std::atomic<bool>& running,
+    const std::function<void(const int)>& connected_fn,
+    const std::function<void(const int)>& readable_fn,
+    const std::function<bool(void)>& expecting_data_fn)
+{
+  Open();
+  while (running.load())
+  {
+    WaitAndDispatch(-1, connected_fn, readable_fn, expecting_data_fn);
+  }
+  Close();
+}
+
+size_t URRobotConnection::Send(const uint8_t* data, const size_t size)
+{
+  // Send on a duplicate of the socket, so that waiting for buffer space does
+  // not hold the lock the I/O thread needs to close or reconnect. Closing the
+  // socket shuts it down, which fails any send in progress on the duplicate.
+  int send_fd = -1;
+  {
+    std::lock_guard<std::mutex> lock(socket_mutex_);
+    if (socket_fd_ >= 0)
+    {
+      send_fd = fcntl(socket_fd_, F_DUPFD_CLOEXEC, 0);
+    }
+  }
+  if (send_fd < 0)
+  {
+    return 0;
+  }
+  // The socket is non-blocking, so a long message may only be partially
+  // written while the send buffer drains
+  const int send_timeout_ms = 1000;
+  size_t bytes_written = 0;
+  while (bytes_written < size)
+  {
+    const ssize_t written = send(send_fd, data + bytes_written,
+                                 size - bytes_written, MSG_NOSIGNAL);
+    if (written > 0)
+    {
+      bytes_written += static_cast<size_t>(written);
+      continue;
+    }
+    struct pollfd writable_fd;
+    writable_fd.fd = send_fd;
+    writable_fd.events = POLLOUT;
+    writable_fd.revents = 0;
+    if ((written < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        && (poll(&writable_fd, 1, send_timeout_ms) > 0))
+    {
+      continue;
+    }
+    break;
+  }
+  close(send_fd);
+  return bytes_written;
+}
+
+URRealtimeInterface::URRealtimeInterface(
+    const std::string& robot_host,
+    const std::function<void(const URRealtimeState&)>&
+      state_received_callback_fn,
+    const std::function<void(const std::string&)>& logging_fn,
+    const URRealtimeConnectionParams& connection_params,
+    const URRealtimeDecoderTable& decoder_table,
+    const tri_realtime_common::RealtimeThreadConfig& recv_thread_config)
+  : connection_(robot_host, kRealtimePort, connection_params, logging_fn),
+    state_received_callback_fn_(state_received_callback_fn),
+    logging_fn_(logging_fn), decoder_table_(decoder_table),
+    recv_thread_config_(recv_thread_config),
+    stream_decoder_(decoder_table_, state_received_callback_fn_, logging_fn_),
+    reactor_ptr_(nullptr)
+{
+  running_.store(false);
+  capture_writer_ptr_.store(nullptr);
+  capture_in_use_.store(false);
+}
+
+URRealtimeInterface::~URRealtimeInterface()
+{
+  StopRecv();
+  SwapCaptureWriter(nullptr);
+}
+
+void URRealtimeInterface::StartRecv()
+{
+  if (!running_.load())
+  {
+    Log("Starting recv thread loop...");
+    running_.store(true);
+    recv_thread_ = std::thread(&URRealtimeInterface::RecvLoop, this);
+  }
+}
+
+void URRealtimeInterface::StartRecv(URIOReactor& reactor)
+{
+  if (!running_.load())
+  {
+    Log("Starting recv on shared I/O reactor...");
+    running_.store(true);
+    reactor_ptr_ = &reactor;
+    connection_.Open();
+    reactor.AddSource(connection_.EventFd(), [this] ()
+    {
+      ProcessConnectionEvents();
+      return true;
+    });
+  }
+}
+
+void URRealtimeInterface::StopRecv()
+{
+  if (running_.load())
+  {
+    running_.store(false);
+    if (reactor_ptr_ != nullptr)
+    {
+      // Once removed, the reactor thread no longer touches the connection
+      reactor_ptr_->RemoveSource(connection_.EventFd());
+      connection_.Close();
+      reactor_ptr_ = nullptr;
+    }
     else
     {
-      connected_.store(false);
-      close(socket_fd_);
-      Log("Connection to robot failed, retrying in 10 seconds");
-      while (running_.load())
+      connection_.Wake();
+    }
+  }
+  if (recv_thread_.joinable())
+  {
+    recv_thread_.join();
+  }
+}
+
+void URRealtimeInterface::HandleConnected()
+{
+  stream_decoder_.Restart();
+  connection_.MarkReady();
+}
+
+void URRealtimeInterface::ReadSocket(const int socket_fd)
+{
+  // Read directly into the free space of the ring buffer
+  struct iovec regions[2];
+  const int num_regions = stream_decoder_.PrepareWrite(regions);
+  int64_t receive_time_ns = 0;
+  int64_t monotonic_to_realtime_ns = 0;
+  const ssize_t bytes_read
+      = RecvTimestamped(socket_fd, regions, num_regions, receive_time_ns,
+                        monotonic_to_realtime_ns);
+  if (bytes_read > 0)
+  {
+    connection_.NoteDataReceived();
+    if (capture_writer_ptr_.load(std::memory_order_relaxed) != nullptr)
+    {
+      CaptureRead(regions, num_regions, static_cast<size_t>(bytes_read),
+                  receive_time_ns, monotonic_to_realtime_ns);
+    }
+    stream_decoder_.CommitWrite(static_cast<size_t>(bytes_read),
+                                receive_time_ns, monotonic_to_realtime_ns);
+    std::unique_lock<std::mutex> statistics_lock(statistics_mutex_,
+                                                 std::try_to_lock);
+    if (statistics_lock.owns_lock())
+    {
+      published_arrival_statistics_ = stream_decoder_.ArrivalStatistics();
+      published_clock_estimate_ = stream_decoder_.ClockEstimate();
+    }
+  }
+  else if (bytes_read == 0)
+  {
+    connection_.Reconnect("Connection closed by robot");
+  }
+  else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+  {
+    connection_.Reconnect("Failed to read: "
+                          + std::string(strerror(errno)));
+  }
+}
+
+void URRealtimeInterface::CaptureRead(
+    const struct iovec* regions, const int num_regions, const size_t size,
+    const int64_t receive_time_ns, const int64_t monotonic_to_realtime_ns)
+{
+  // Marking the writer in use before loading it means that a thread which
+  // swapped it out and then sees capture_in_use_ clear can delete it
+  capture_in_use_.store(true);
+  URStreamCaptureWriter* const capture_writer_ptr = capture_writer_ptr_.load();
+  if (capture_writer_ptr != nullptr)
+  {
+    try
+    {
+      capture_writer_ptr->Append(receive_time_ns, monotonic_to_realtime_ns,
+                                 regions, num_regions, size);
+    }
+    catch (const std::runtime_error& ex)
+    {
+      Log("Stopping capture to " + capture_writer_ptr->Path()
+          + " after error " + std::string(ex.what()));
+      URStreamCaptureWriter* expected_writer_ptr = capture_writer_ptr;
+      // Only retire the writer here if StartCapture() or StopCapture() has
+      // not already swapped it out, in which case that thread deletes it
+      if (capture_writer_ptr_.compare_exchange_strong(expected_writer_ptr,
+                                                      nullptr))
       {
-        try
-        {
-          std::this_thread::sleep_for(std::chrono::duration<double>(10.0));
-          ConnectToRobot();
-          break;
-        }
-        catch (const std::exception& ex)
-        {
-          Log("Connection to robot failed [" + std::string(ex.what()) +
-              "], retrying in 10 seconds");
-        }
+        delete capture_writer_ptr;
       }
     }
   }
+  capture_in_use_.store(false);
+}
+
+std::unique_ptr<URStreamCaptureWriter> URRealtimeInterface::SwapCaptureWriter(
+    URStreamCaptureWriter* capture_writer_ptr)
+{
+  std::unique_ptr<URStreamCaptureWriter> retired_writer_ptr(
+      capture_writer_ptr_.exchange(capture_writer_ptr));
+  // The recv thread may still be appending to the retired writer
+  while (capture_in_use_.load())
+  {
+    std::this_thread::yield();
+  }
+  return retired_writer_ptr;
+}
+
+void URRealtimeInterface::ProcessConnectionEvents()
+{
+  connection_.ProcessEvents(
+      [this] (const int) { HandleConnected(); },
+      [this] (const int socket_fd) { ReadSocket(socket_fd); });
+}
+
+void URRealtimeInterface::RecvLoop()
+{
+  tri_realtime_common::ConfigureCurrentThread(
+      recv_thread_config_, "ur_recv", logging_fn_);
+  connection_.Run(running_,
+                  [this] (const int) { HandleConnected(); },
+                  [this] (const int socket_fd) { ReadSocket(socket_fd); });
+}
+
+URRealtimeArrivalStatistics URRealtimeInterface::ArrivalStatistics() const
+{
+  std::lock_guard<std::mutex> lock(statistics_mutex_);
+  return published_arrival_statistics_;
+}
+
+URControllerClockEstimate URRealtimeInterface::ControllerClockEstimate() const
+{
+  std::lock_guard<std::mutex> lock(statistics_mutex_);
+  return published_clock_estimate_;
+}
+
+void URRealtimeInterface::StartCapture(const std::string& capture_path)
+{
+  // The file is created here, so the recv thread never waits on it
+  std::unique_ptr<URStreamCaptureWriter> capture_writer_ptr(
+      new URStreamCaptureWriter(capture_path));
+  SwapCaptureWriter(capture_writer_ptr.release());
+  Log("Started capturing realtime stream to " + capture_path);
+}
+
+void URRealtimeInterface::StopCapture()
+{
+  const std::unique_ptr<URStreamCaptureWriter> capture_writer_ptr
+      = SwapCaptureWriter(nullptr);
+  if (capture_writer_ptr)
+  {
+    Log("Stopped capturing realtime stream to " + capture_writer_ptr->Path()
+        + " after " + std::to_string(capture_writer_ptr->WrittenSize())
+        + " bytes");
+  }
+}
+
+bool URRealtimeInterface::WaitForConnection(const double timeout)
+{
+  return connection_.WaitForReady(timeout);
 }
 
 bool URRealtimeInterface::SendURScriptCommand(const std::string& command)
@@ -328,12 +1363,12 @@ bool URRealtimeInterface::SendURScriptCommand(const std::string& command)
   const char last_command_char
       = (command.size() > 0) ? static_cast<char>(command.back()) : '\0';
   const bool valid_command_format = (last_command_char == command_end);
-  const bool connected = connected_.load();
+  const bool connected = connection_.IsReady();
   if (valid_command_format && connected)
   {
-    const ssize_t bytes_written
-        = write(socket_fd_, command.c_str(), command.size());
-    if (bytes_written == static_cast<ssize_t>(command.size()))
+    const size_t bytes_written = connection_.Send(
+        reinterpret_cast<const uint8_t*>(command.c_str()), command.size());
+    if (bytes_written == command.size())
     {
       return true;
     }
@@ -0,0 +1,594 @@
+#include <lightweight_ur_interface/ur_primary_interface.hpp>
+
+namespace lightweight_ur_interface
+{
+namespace
+{
+// Message and package headers are an int32 length and a uint8 type
+constexpr uint32_t kPrimaryHeaderSize = 5;
+
+// Reads big-endian values from a package in order. Reading past the end of
+// the package yields zeros and marks the reader as overrun, so that parsers
+// only need to check once at the end.
+class PackageReader
+{
+private:
+
+  const uint8_t* data_;
+  uint32_t size_;
+  uint32_t position_;
+  bool overrun_;
+
+  inline bool Take(const uint32_t bytes, void* value)
+  {
+    if ((size_ - position_) < bytes)
+    {
+      position_ = size_;
+      overrun_ = true;
+      std::memset(value, 0, bytes);
+      return false;
+    }
+    std::memcpy(value, data_ + position_, bytes);
+    position_ += bytes;
+    return true;
+  }
+
+public:
+
+  PackageReader(const uint8_t* data, const uint32_t size)
+    : data_(data), size_(size), position_(0), overrun_(false) {}
+
+  inline bool Overrun() const { return overrun_; }
+
+  inline uint32_t Remaining() const { return size_ - position_; }
+
+  inline const char* Current() const
+  { return reinterpret_cast<const char*>(data_ + position_); }
+
+  inline void Skip(const uint32_t bytes)
+  {
+    uint8_t ignored = 0;
+    for (uint32_t idx = 0; idx < bytes; idx++)
+    {
+      Take(1, &ignored);
+    }
+  }
+
+  inline uint8_t ReadUInt8()
+  {
+    uint8_t value = 0;
+    Take(sizeof(value), &value);
+    return value;
+  }
+
+  inline int8_t ReadInt8() { return static_cast<int8_t>(ReadUInt8()); }
+
+  inline bool ReadBool() { return (ReadUInt8() != 0); }
+
+  inline uint32_t ReadUInt32()
+  {
+    uint32_t value = 0;
+    Take(sizeof(value), &value);
+    return be32toh(value);
+  }
+
+  inline int32_t ReadInt32() { return static_cast<int32_t>(ReadUInt32()); }
+
+  inline uint64_t ReadUInt64()
+  {
+    uint64_t value = 0;
+    Take(sizeof(value), &value);
+    return be64toh(value);
+  }
+
+  inline float ReadFloat()
+  {
+    const uint32_t bits = ReadUInt32();
+    float value = 0.0f;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  inline double ReadDouble()
+  {
+    const uint64_t bits = ReadUInt64();
+    double value = 0.0;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+};
+
+inline uint32_t ReadHeaderLength(const uint8_t* data)
+{
+  uint32_t network_length = 0;
+  std::memcpy(&network_length, data, sizeof(network_length));
+  return be32toh(network_length);
+}
+}  // namespace
+
+const char* RobotModeName(const int8_t robot_mode)
+{
+  switch (robot_mode)
+  {
+    case kRobotModeNoController:
+      return "NO_CONTROLLER";
+    case kRobotModeDisconnected:
+      return "DISCONNECTED";
+    case kRobotModeConfirmSafety:
+      return "CONFIRM_SAFETY";
+    case kRobotModeBooting:
+      return "BOOTING";
+    case kRobotModePowerOff:
+      return "POWER_OFF";
+    case kRobotModePowerOn:
+      return "POWER_ON";
+    case kRobotModeIdle:
+      return "IDLE";
+    case kRobotModeBackdrive:
+      return "BACKDRIVE";
+    case kRobotModeRunning:
+      return "RUNNING";
+    case kRobotModeUpdatingFirmware:
+      return "UPDATING_FIRMWARE";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+const char* PrimaryEventName(const URPrimaryEventType event_type)
+{
+  switch (event_type)
+  {
+    case kPrimaryRobotModeChanged:
+      return "robot mode changed";
+    case kPrimaryProgramStarted:
+      return "program started";
+    case kPrimaryProgramStopped:
+      return "program stopped";
+    case kPrimaryProgramPaused:
+      return "program paused";
+    case kPrimaryProgramResumed:
+      return "program resumed";
+    case kPrimaryProtectiveStop:
+      return "protective stop";
+    case kPrimaryProtectiveStopCleared:
+      return "protective stop cleared";
+    case kPrimaryEmergencyStop:
+      return "emergency stop";
+    case kPrimaryEmergencyStopCleared:
+      return "emergency stop cleared";
+    default:
+      return "unknown event";
+  }
+}
+
+URPrimaryStreamParser::URPrimaryStreamParser(
+    const URPrimaryCallbacks& callbacks,
+    const std::function<void(const std::string&)>& logging_fn)
+  : framer_(kRecvRingBufferSize, kMaxMessageSize), callbacks_(callbacks),
+    logging_fn_(logging_fn), have_robot_mode_data_(false),
+    malformed_packages_(0)
+{
+  std::memset(&robot_mode_data_, 0, sizeof(robot_mode_data_));
+  std::memset(&joint_data_, 0, sizeof(joint_data_));
+  std::memset(&tool_data_, 0, sizeof(tool_data_));
+}
+
+void URPrimaryStreamParser::CommitWrite(const size_t bytes_written)
+{
+  framer_.CommitWrite(bytes_written);
+  framer_.DrainPackets([this] (const std::vector<uint8_t>& message)
+  {
+    ParseMessage(message);
+  });
+}
+
+void URPrimaryStreamParser::Append(const uint8_t* data, const size_t size)
+{
+  size_t appended = 0;
+  while (appended < size)
+  {
+    const size_t newly_appended
+        = framer_.Append(data + appended, size - appended);
+    appended += newly_appended;
+    framer_.DrainPackets([this] (const std::vector<uint8_t>& message)
+    {
+      ParseMessage(message);
+    });
+    if ((newly_appended == 0) && (framer_.FreeBytes() == 0))
+    {
+      throw std::runtime_error("Stream framer is full and cannot drain");
+    }
+  }
+}
+
+void URPrimaryStreamParser::Restart()
+{
+  framer_.Reset();
+  have_robot_mode_data_ = false;
+}
+
+void URPrimaryStreamParser::ParseMessage(const std::vector<uint8_t>& message)
+{
+  // The framer only passes on messages longer than their length field
+  if (message.size() < kPrimaryHeaderSize)
+  {
+    malformed_packages_++;
+    return;
+  }
+  const uint8_t* body = message.data() + kPrimaryHeaderSize;
+  const uint32_t body_size
+      = static_cast<uint32_t>(message.size()) - kPrimaryHeaderSize;
+  const uint8_t message_type = message[4];
+  if (message_type == kPrimaryRobotState)
+  {
+    ParseRobotState(body, body_size);
+  }
+  else if (message_type == kPrimaryRobotMessage)
+  {
+    if (!ParseRobotMessage(body, body_size))
+    {
+      malformed_packages_++;
+    }
+  }
+}
+
+void URPrimaryStreamParser::ParseRobotState(const uint8_t* data,
+                                            const uint32_t size)
+{
+  uint32_t offset = 0;
+  while ((size - offset) >= kPrimaryHeaderSize)
+  {
+    const uint32_t package_length = ReadHeaderLength(data + offset);
+    if ((package_length < kPrimaryHeaderSize)
+        || (package_length > (size - offset)))
+    {
+      malformed_packages_++;
+      return;
+    }
+    const uint8_t package_type = data[offset + 4];
+    const uint8_t* package_body = data + offset + kPrimaryHeaderSize;
+    const uint32_t package_body_size = package_length - kPrimaryHeaderSize;
+    bool parsed = true;
+    if (package_type == kPrimaryRobotModeData)
+    {
+      parsed = ParseRobotModeData(package_body, package_body_size);
+    }
+    else if (package_type == kPrimaryJointData)
+    {
+      parsed = ParseJointData(package_body, package_body_size);
+    }
+    else if (package_type == kPrimaryToolData)
+    {
+      parsed = ParseToolData(package_body, package_body_size);
+    }
+    if (!parsed)
+    {
+      malformed_packages_++;
+    }
+    offset += package_length;
+  }
+}
+
+bool URPrimaryStreamParser::ParseRobotModeData(const uint8_t* data,
+                                               const uint32_t size)
+{
+  PackageReader reader(data, size);
+  URRobotModeData robot_mode_data;
+  robot_mode_data.timestamp = reader.ReadUInt64();
+  robot_mode_data.real_robot_connected = reader.ReadBool();
+  robot_mode_data.real_robot_enabled = reader.ReadBool();
+  robot_mode_data.robot_power_on = reader.ReadBool();
+  robot_mode_data.emergency_stopped = reader.ReadBool();
+  robot_mode_data.protective_stopped = reader.ReadBool();
+  robot_mode_data.program_running = reader.ReadBool();
+  robot_mode_data.program_paused = reader.ReadBool();
+  robot_mode_data.robot_mode = reader.ReadInt8();
+  robot_mode_data.control_mode = reader.ReadUInt8();
+  robot_mode_data.target_speed_fraction = reader.ReadDouble();
+  robot_mode_data.speed_scaling = reader.ReadDouble();
+  if (reader.Overrun())
+  {
+    return false;
+  }
+  // Only sent by 3.2 and later
+  robot_mode_data.target_speed_fraction_limit
+      = (reader.Remaining() >= sizeof(double)) ? reader.ReadDouble() : 0.0;
+  if (have_robot_mode_data_)
+  {
+    EmitEvents(robot_mode_data_, robot_mode_data);
+  }
+  robot_mode_data_ = robot_mode_data;
+  have_robot_mode_data_ = true;
+  if (callbacks_.robot_mode_data_fn)
+  {
+    callbacks_.robot_mode_data_fn(robot_mode_data_);
+  }
+  return true;
+}
+
+bool URPrimaryStreamParser::ParseJointData(const uint8_t* data,
+                                           const uint32_t size)
+{
+  PackageReader reader(data, size);
+  for (size_t idx = 0; idx < 6; idx++)
+  {
+    joint_data_.actual_position[idx] = reader.ReadDouble();
+    joint_data_.target_position[idx] = reader.ReadDouble();
+    joint_data_.actual_velocity[idx] = reader.ReadDouble();
+    joint_data_.actual_current[idx] = reader.ReadFloat();
+    joint_data_.actual_voltage[idx] = reader.ReadFloat();
+    joint_data_.motor_temperature[idx] = reader.ReadFloat();
+    joint_data_.micro_temperature[idx] = reader.ReadFloat();
+    joint_data_.joint_mode[idx] = reader.ReadUInt8();
+  }
+  if (reader.Overrun())
+  {
+    return false;
+  }
+  if (callbacks_.joint_data_fn)
+  {
+    callbacks_.joint_data_fn(joint_data_);
+  }
+  return true;
+}
+
+bool URPrimaryStreamParser::ParseToolData(const uint8_t* data,
+                                          const uint32_t size)
+{
+  PackageReader reader(data, size);
+  tool_data_.analog_input_range[0] = reader.ReadInt8();
+  tool_data_.analog_input_range[1] = reader.ReadInt8();
+  tool_data_.analog_input[0] = reader.ReadDouble();
+  tool_data_.analog_input[1] = reader.ReadDouble();
+  tool_data_.tool_voltage_48v = reader.ReadFloat();
+  tool_data_.tool_output_voltage = reader.ReadUInt8();
+  tool_data_.tool_current = reader.ReadFloat();
+  tool_data_.tool_temperature = reader.ReadFloat();
+  tool_data_.tool_mode = reader.ReadUInt8();
+  if (reader.Overrun())
+  {
+    return false;
+  }
+  if (callbacks_.tool_data_fn)
+  {
+    callbacks_.tool_data_fn(tool_data_);
+  }
+  return true;
+}
+
+bool URPrimaryStreamParser::ParseRobotMessage(const uint8_t* data,
+                                              const uint32_t size)
+{
+  PackageReader reader(data, size);
+  URRobotMessage robot_message;
+  std::memset(&robot_message, 0, sizeof(robot_message));
+  robot_message.timestamp = reader.ReadUInt64();
+  robot_message.source = reader.ReadInt8();
+  robot_message.message_type = reader.ReadUInt8();
+  switch (robot_message.message_type)
+  {
+    case kPrimaryTextMessage:
+    case kPrimaryVersionMessage:
+      break;
+    case kPrimarySafetyModeMessage:
+      robot_message.code = reader.ReadInt32();
+      robot_message.argument = reader.ReadInt32();
+      robot_message.safety_mode = reader.ReadUInt8();
+      // Followed by report data type and report data
+      reader.Skip(2 * sizeof(uint32_t));
+      break;
+    case kPrimaryErrorCodeMessage:
+      robot_message.code = reader.ReadInt32();
+      robot_message.argument = reader.ReadInt32();
+      robot_message.report_level = reader.ReadInt32();
+      // Followed by data type and data
+      reader.Skip(sizeof(uint8_t) + sizeof(uint32_t));
+      break;
+    case kPrimaryKeyMessage:
+    {
+      robot_message.code = reader.ReadInt32();
+      robot_message.argument = reader.ReadInt32();
+      const uint8_t title_length = reader.ReadUInt8();
+      robot_message.title = reader.Current();
+      robot_message.title_length = std::min<size_t>(title_length,
+                                                    reader.Remaining());
+      reader.Skip(title_length);
+      break;
+    }
+    case kPrimaryRuntimeExceptionMessage:
+      robot_message.line_number = reader.ReadInt32();
+      robot_message.column_number = reader.ReadInt32();
+      break;
+    default:
+      // Other message types are not parsed, but still reported
+      break;
+  }
+  if (reader.Overrun())
+  {
+    return false;
+  }
+  if (robot_message.title == nullptr)
+  {
+    robot_message.title = reader.Current();
+  }
+  // Version messages carry structured fields rather than text
+  robot_message.text = reader.Current();
+  robot_message.text_length
+      = (robot_message.message_type != kPrimaryVersionMessage)
+          ? reader.Remaining() : 0;
+  if (callbacks_.robot_message_fn)
+  {
+    callbacks_.robot_message_fn(robot_message);
+  }
+  return true;
+}
+
+void URPrimaryStreamParser::EmitEvents(const URRobotModeData& previous,
+                                       const URRobotModeData& current)
+{
+  if (!callbacks_.event_fn)
+  {
+    return;
+  }
+  const auto emit = [&] (const URPrimaryEventType event_type)
+  {
+    URPrimaryEvent event;
+    event.type = event_type;
+    event.robot_mode_data = &current;
+    callbacks_.event_fn(event);
+  };
+  // Stops are reported before the program changes they cause
+  if (!previous.emergency_stopped && current.emergency_stopped)
+  {
+    emit(kPrimaryEmergencyStop);
+  }
+  if (!previous.protective_stopped && current.protective_stopped)
+  {
+    emit(kPrimaryProtectiveStop);
+  }
+  if (previous.robot_mode != current.robot_mode)
+  {
+    emit(kPrimaryRobotModeChanged);
+  }
+  if (previous.program_running && !current.program_running)
+  {
+    emit(kPrimaryProgramStopped);
+  }
+  else if (!previous.program_running && current.program_running)
+  {
+    emit(kPrimaryProgramStarted);
+  }
+  else if (current.program_running)
+  {
+    if (!previous.program_paused && current.program_paused)
+    {
+      emit(kPrimaryProgramPaused);
+    }
+    else if (previous.program_paused && !current.program_paused)
+    {
+      emit(kPrimaryProgramResumed);
+    }
+  }
+  if (previous.protective_stopped && !current.protective_stopped)
+  {
+    emit(kPrimaryProtectiveStopCleared);
+  }
+  if (previous.emergency_stopped && !current.emergency_stopped)
+  {
+    emit(kPrimaryEmergencyStopCleared);
+  }
+}
+
+URPrimaryInterface::URPrimaryInterface(
+    const std::string& robot_host,
+    const URPrimaryCallbacks& callbacks,
+    const std::function<void(const std::string&)>& logging_fn,
+    const uint16_t port,
+    const URRealtimeConnectionParams& connection_params,
+    const tri_realtime_common::RealtimeThreadConfig& recv_thread_config)
+  : connection_(robot_host, port, connection_params, logging_fn),
+    callbacks_(callbacks), logging_fn_(logging_fn),
+    recv_thread_config_(recv_thread_config), parser_(callbacks_, logging_fn_),
+    reactor_ptr_(nullptr)
+{
+  running_.store(false);
+}
+
+URPrimaryInterface::~URPrimaryInterface()
+{
+  StopRecv();
+}
+
+void URPrimaryInterface::StartRecv()
+{
+  if (!running_.load())
+  {
+    Log("Starting primary interface recv thread loop...");
+    running_.store(true);
+    recv_thread_ = std::thread(&URPrimaryInterface::RecvLoop, this);
+  }
+}
+
+void URPrimaryInterface::StartRecv(URIOReactor& reactor)
+{
+  if (!running_.load())
+  {
+    Log("Starting primary interface recv on shared I/O reactor...");
+    running_.store(true);
+    reactor_ptr_ = &reactor;
+    connection_.Open();
+    reactor.AddSource(connection_.EventFd(), [this] ()
+    {
+      ProcessConnectionEvents();
+      return true;
+    });
+  }
+}
+
+void URPrimaryInterface::StopRecv()
+{
+  if (running_.load())
+  {
+    running_.store(false);
+    if (reactor_ptr_ != nullptr)
+    {
+      reactor_ptr_->RemoveSource(connection_.EventFd());
+      connection_.Close();
+      reactor_ptr_ = nullptr;
+    }
+    else
+    {
+      connection_.Wake();
+    }
+  }
+  if (recv_thread_.joinable())
+  {
+    recv_thread_.join();
+  }
+}
+
+void URPrimaryInterface::HandleConnected()
+{
+  parser_.Restart();
+  connection_.MarkReady();
+}
+
+void URPrimaryInterface::ReadSocket(const int socket_fd)
+{
+  // Read directly into the free space of the ring buffer
+  struct iovec regions[2];
+  const int num_regions = parser_.PrepareWrite(regions);
+  const ssize_t bytes_read = readv(socket_fd, regions, num_regions);
+  if (bytes_read > 0)
+  {
+    connection_.NoteDataReceived();
+    parser_.CommitWrite(static_cast<size_t>(bytes_read));
+  }
+  else if (bytes_read == 0)
+  {
+    connection_.Reconnect("Connection closed by robot");
+  }
+  else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+  {
+    connection_.Reconnect("Failed to read: "
+                          + std::string(strerror(errno)));
+  }
+}
+
+void URPrimaryInterface::ProcessConnectionEvents()
+{
+  connection_.ProcessEvents(
+      [this] (const int) { HandleConnected(); },
+      [this] (const int socket_fd) { ReadSocket(socket_fd); });
+}
+
+void URPrimaryInterface::RecvLoop()
+{
+  tri_realtime_common::ConfigureCurrentThread(
+      recv_thread_config_, "ur_primary_recv", logging_fn_);
+  connection_.Run(running_,
+                  [this] (const int) { HandleConnected(); },
+                  [this] (const int socket_fd) { ReadSocket(socket_fd); });
+}
+}
@@ -0,0 +1,761 @@
+#include <lightweight_ur_interface/ur_rtde_interface.hpp>
+
+namespace lightweight_ur_interface
+{
+namespace
+{
+constexpr const char* kRTDEDataTypeNames[] =
+{
+  "BOOL", "UINT8", "UINT32", "UINT64", "INT32", "DOUBLE", "VECTOR3D",
+  "VECTOR6D", "VECTOR6INT32", "VECTOR6UINT32", "NOT_FOUND", "IN_USE"
+};
+
+constexpr uint32_t kNumRTDEDataTypes
+    = sizeof(kRTDEDataTypeNames) / sizeof(kRTDEDataTypeNames[0]);
+
+inline uint32_t NetworkToHost32(const uint8_t* network_data)
+{
+  uint32_t network_value = 0;
+  std::memcpy(&network_value, network_data, sizeof(network_value));
+  return be32toh(network_value);
+}
+
+inline void HostToNetwork32(const uint32_t value, uint8_t* network_data)
+{
+  const uint32_t network_value = htobe32(value);
+  std::memcpy(network_data, &network_value, sizeof(network_value));
+}
+
+inline bool IsScalarRTDEType(const URRTDEDataType type)
+{
+  return (type == kRTDEBool) || (type == kRTDEUInt8) || (type == kRTDEUInt32)
+         || (type == kRTDEUInt64) || (type == kRTDEInt32)
+         || (type == kRTDEDouble);
+}
+}  // namespace
+
+URRTDEDataType ParseRTDEDataType(const std::string& type_name)
+{
+  for (uint32_t idx = 0; idx < kNumRTDEDataTypes; idx++)
+  {
+    if (type_name == kRTDEDataTypeNames[idx])
+    {
+      return static_cast<URRTDEDataType>(idx);
+    }
+  }
+  throw std::runtime_error("Unknown RTDE data type [" + type_name + "]");
+}
+
+const char* RTDEDataTypeName(const URRTDEDataType type)
+{
+  if (type >= kNumRTDEDataTypes)
+  {
+    throw std::invalid_argument("Invalid RTDE data type "
+                                + std::to_string(type));
+  }
+  return kRTDEDataTypeNames[type];
+}
+
+uint32_t RTDEDataTypeSize(const URRTDEDataType type)
+{
+  switch (type)
+  {
+    case kRTDEBool:
+    case kRTDEUInt8:
+      return 1;
+    case kRTDEUInt32:
+    case kRTDEInt32:
+      return 4;
+    case kRTDEUInt64:
+    case kRTDEDouble:
+      return 8;
+    case kRTDEVector3d:
+      return 24;
+    case kRTDEVector6d:
+      return 48;
+    case kRTDEVector6Int32:
+    case kRTDEVector6UInt32:
+      return 24;
+    default:
+      throw std::invalid_argument(std::string("RTDE data type ")
+                                  + RTDEDataTypeName(type)
+                                  + " has no size");
+  }
+}
+
+uint32_t RTDEDataTypeCount(const URRTDEDataType type)
+{
+  switch (type)
+  {
+    case kRTDEVector3d:
+      return 3;
+    case kRTDEVector6d:
+    case kRTDEVector6Int32:
+    case kRTDEVector6UInt32:
+      return 6;
+    default:
+      return 1;
+  }
+}
+
+std::vector<std::string> SplitRTDEVariableList(const std::string& list)
+{
+  std::vector<std::string> variables;
+  size_t start = 0;
+  while (start <= list.size())
+  {
+    const size_t end = std::min(list.find(',', start), list.size());
+    variables.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+  return variables;
+}
+
+std::vector<uint8_t> MakeRTDEPackage(const URRTDEPackageType type,
+                                     const std::vector<uint8_t>& payload)
+{
+  const size_t package_size = kRTDEHeaderSize + payload.size();
+  if (package_size > std::numeric_limits<uint16_t>::max())
+  {
+    throw std::invalid_argument("RTDE package payload is too large");
+  }
+  std::vector<uint8_t> package(package_size, 0x00);
+  package[0] = static_cast<uint8_t>(package_size >> 8);
+  package[1] = static_cast<uint8_t>(package_size & 0xff);
+  package[2] = type;
+  std::copy(payload.begin(), payload.end(), package.begin() + kRTDEHeaderSize);
+  return package;
+}
+
+void RTDEValueToDoubles(const URRTDEDataType type, const uint8_t* network_data,
+                        double* values)
+{
+  switch (type)
+  {
+    case kRTDEBool:
+    case kRTDEUInt8:
+      values[0] = static_cast<double>(network_data[0]);
+      break;
+    case kRTDEUInt32:
+      values[0] = static_cast<double>(NetworkToHost32(network_data));
+      break;
+    case kRTDEInt32:
+      values[0] = static_cast<double>(
+          static_cast<int32_t>(NetworkToHost32(network_data)));
+      break;
+    case kRTDEUInt64:
+    {
+      uint64_t network_value = 0;
+      std::memcpy(&network_value, network_data, sizeof(network_value));
+      values[0] = static_cast<double>(be64toh(network_value));
+      break;
+    }
+    case kRTDEDouble:
+    case kRTDEVector3d:
+    case kRTDEVector6d:
+      NetworkDoublesToHost(network_data, RTDEDataTypeCount(type), values);
+      break;
+    case kRTDEVector6Int32:
+      for (uint32_t idx = 0; idx < 6; idx++)
+      {
+        values[idx] = static_cast<double>(static_cast<int32_t>(
+            NetworkToHost32(network_data + (idx * sizeof(int32_t)))));
+      }
+      break;
+    case kRTDEVector6UInt32:
+      for (uint32_t idx = 0; idx < 6; idx++)
+      {
+        values[idx] = static_cast<double>(
+            NetworkToHost32(network_data + (idx * sizeof(uint32_t))));
+      }
+      break;
+    default:
+      throw std::invalid_argument(std::string("Cannot decode RTDE data type ")
+                                  + RTDEDataTypeName(type));
+  }
+}
+
+void DoublesToRTDEValue(const URRTDEDataType type, const double* values,
+                        uint8_t* network_data)
+{
+  const uint32_t count = RTDEDataTypeCount(type);
+  for (uint32_t idx = 0; idx < count; idx++)
+  {
+    const double value = values[idx];
+    switch (type)
+    {
+      case kRTDEBool:
+        network_data[idx] = (value != 0.0) ? 1 : 0;
+        break;
+      case kRTDEUInt8:
+        network_data[idx] = static_cast<uint8_t>(std::lround(value));
+        break;
+      case kRTDEUInt32:
+      case kRTDEVector6UInt32:
+        HostToNetwork32(static_cast<uint32_t>(std::llround(value)),
+                        network_data + (idx * sizeof(uint32_t)));
+        break;
+      case kRTDEInt32:
+      case kRTDEVector6Int32:
+        HostToNetwork32(static_cast<uint32_t>(
+                            static_cast<int32_t>(std::lround(value))),
+                        network_data + (idx * sizeof(int32_t)));
+        break;
+      case kRTDEUInt64:
+      {
+        const uint64_t network_value
+            = htobe64(static_cast<uint64_t>(std::llround(value)));
+        std::memcpy(network_data, &network_value, sizeof(network_value));
+        break;
+      }
+      case kRTDEDouble:
+      case kRTDEVector3d:
+      case kRTDEVector6d:
+      {
+        uint64_t host_value = 0;
+        std::memcpy(&host_value, &value, sizeof(host_value));
+        const uint64_t network_value = htobe64(host_value);
+        std::memcpy(network_data + (idx * sizeof(double)), &network_value,
+                    sizeof(network_value));
+        break;
+      }
+      default:
+        throw std::invalid_argument(
+            std::string("Cannot encode RTDE data type ")
+            + RTDEDataTypeName(type));
+    }
+  }
+}
+
+URRTDEOutputRecipe::URRTDEOutputRecipe(const URRealtimeFieldMask field_mask)
+  : field_mask_((field_mask & kAllRealtimeFields)
+                // States are stamped from the controller uptime
+                | RealtimeFieldBit(kControllerUptime)),
+    payload_size_(0), recipe_id_(0), configured_(false)
+{
+  uint32_t offset = 0;
+  for (uint32_t field = 0; field < kNumRealtimeFields; field++)
+  {
+    const URRealtimeField realtime_field = static_cast<URRealtimeField>(field);
+    if ((field_mask_ & RealtimeFieldBit(realtime_field)) != 0)
+    {
+      const URRTDEDataType type = kRTDEFieldTypes[field];
+      if (RTDEDataTypeCount(type) != kRealtimeFieldSizes[field])
+      {
+        throw std::logic_error(std::string("RTDE variable ")
+                               + kRTDEFieldNames[field]
+                               + " does not match the size of its field");
+      }
+      entries_.push_back(Entry{realtime_field, type, offset});
+      offset += RTDEDataTypeSize(type);
+    }
+  }
+  payload_size_ = offset;
+}
+
+std::string URRTDEOutputRecipe::VariableNames() const
+{
+  std::string variable_names;
+  for (const Entry& entry : entries_)
+  {
+    if (!variable_names.empty())
+    {
+      variable_names += ",";
+    }
+    variable_names += kRTDEFieldNames[entry.field];
+  }
+  return variable_names;
+}
+
+URRealtimeFieldMask URRTDEOutputRecipe::Configure(
+    const uint8_t recipe_id, const std::string& variable_types)
+{
+  const std::vector<std::string> types
+      = SplitRTDEVariableList(variable_types);
+  if (types.size() != entries_.size())
+  {
+    throw std::runtime_error("Setup outputs returned "
+                             + std::to_string(types.size()) + " types for "
+                             + std::to_string(entries_.size())
+                             + " variables");
+  }
+  URRealtimeFieldMask unavailable_fields = 0;
+  for (size_t idx = 0; idx < entries_.size(); idx++)
+  {
+    const Entry& entry = entries_[idx];
+    const URRTDEDataType type = ParseRTDEDataType(types[idx]);
+    if (type == kRTDENotFound)
+    {
+      unavailable_fields |= RealtimeFieldBit(entry.field);
+    }
+    else if (type != entry.type)
+    {
+      throw std::runtime_error(std::string("RTDE variable ")
+                               + kRTDEFieldNames[entry.field] + " has type "
+                               + types[idx] + ", expected "
+                               + RTDEDataTypeName(entry.type));
+    }
+  }
+  recipe_id_ = recipe_id;
+  configured_ = (unavailable_fields == 0);
+  return unavailable_fields;
+}
+
+bool URRTDEOutputRecipe::Decode(const std::vector<uint8_t>& packet,
+                                const double protocol_version,
+                                URRealtimeState& state) const
+{
+  if ((!configured_)
+      || (packet.size() != (kRTDEHeaderSize + 1 + payload_size_))
+      || (packet[kRTDEHeaderSize] != recipe_id_))
+  {
+    return false;
+  }
+  const uint8_t* payload = packet.data() + kRTDEHeaderSize + 1;
+  for (const Entry& entry : entries_)
+  {
+    double values[6];
+    RTDEValueToDoubles(entry.type, payload + entry.offset, values);
+    state.SetFieldValues(entry.field, values);
+  }
+  state.FinishFieldUpdate(field_mask_, protocol_version);
+  return true;
+}
+
+URRTDEInputRecipe::URRTDEInputRecipe(
+    const std::vector<std::string>& variable_names)
+  : variable_names_(variable_names), payload_size_(0), recipe_id_(0),
+    configured_(false)
+{
+  for (const std::string& variable_name : variable_names_)
+  {
+    if (variable_name.empty()
+        || (variable_name.find(',') != std::string::npos))
+    {
+      throw std::invalid_argument("Invalid RTDE input name ["
+                                  + variable_name + "]");
+    }
+  }
+}
+
+void URRTDEInputRecipe::Configure(const uint8_t recipe_id,
+                                  const std::string& variable_types)
+{
+  const std::vector<std::string> types
+      = SplitRTDEVariableList(variable_types);
+  if (types.size() != variable_names_.size())
+  {
+    throw std::runtime_error("Setup inputs returned "
+                             + std::to_string(types.size()) + " types for "
+                             + std::to_string(variable_names_.size())
+                             + " inputs");
+  }
+  std::vector<URRTDEDataType> parsed_types;
+  std::vector<uint32_t> offsets;
+  uint32_t offset = 0;
+  for (size_t idx = 0; idx < types.size(); idx++)
+  {
+    const URRTDEDataType type = ParseRTDEDataType(types[idx]);
+    if (!IsScalarRTDEType(type))
+    {
+      throw std::runtime_error("RTDE input " + variable_names_[idx]
+                               + " cannot be used, type is " + types[idx]);
+    }
+    parsed_types.push_back(type);
+    offsets.push_back(offset);
+    offset += RTDEDataTypeSize(type);
+  }
+  types_ = parsed_types;
+  offsets_ = offsets;
+  payload_size_ = offset;
+  recipe_id_ = recipe_id;
+  configured_ = true;
+}
+
+void URRTDEInputRecipe::Encode(const std::vector<double>& values,
+                               uint8_t* package) const
+{
+  if (!configured_)
+  {
+    throw std::runtime_error("Input recipe has not been set up");
+  }
+  if (values.size() != types_.size())
+  {
+    throw std::invalid_argument("Expected " + std::to_string(types_.size())
+                                + " input values, got "
+                                + std::to_string(values.size()));
+  }
+  const uint32_t package_size = PackageSize();
+  package[0] = static_cast<uint8_t>(package_size >> 8);
+  package[1] = static_cast<uint8_t>(package_size & 0xff);
+  package[2] = kRTDEDataPackage;
+  package[kRTDEHeaderSize] = recipe_id_;
+  uint8_t* payload = package + kRTDEHeaderSize + 1;
+  for (size_t idx = 0; idx < types_.size(); idx++)
+  {
+    DoublesToRTDEValue(types_[idx], &values[idx], payload + offsets_[idx]);
+  }
+}
+
+URRTDEInterface::URRTDEInterface(
+    const std::string& robot_host,
+    const std::function<void(const URRealtimeState&)>&
+      state_received_callback_fn,
+    const std::function<void(const std::string&)>& logging_fn,
+    const URRealtimeFieldMask output_fields,
+    const double output_frequency,
+    const std::vector<std::string>& input_names,
+    const URRealtimeConnectionParams& connection_params,
+    const tri_realtime_common::RealtimeThreadConfig& recv_thread_config)
+  : connection_(robot_host, kRTDEPort, connection_params, logging_fn),
+    state_received_callback_fn_(state_received_callback_fn),
+    logging_fn_(logging_fn), output_fields_(output_fields),
+    output_frequency_(output_frequency),
+    recv_thread_config_(recv_thread_config), input_recipe_(input_names),
+    framer_(kRecvRingBufferSize, kMaxPackageSize, sizeof(uint16_t)),
+    output_recipe_(output_fields), handshake_state_(kRequestingProtocolVersion),
+    protocol_version_(0.0), receive_time_ns_(0), monotonic_to_realtime_ns_(0)
+{
+  if ((output_frequency_ <= 0.0) || (output_frequency_ > 500.0))
+  {
+    throw std::invalid_argument("output_frequency must be in (0, 500]");
+  }
+  running_.store(false);
+}
+
+URRTDEInterface::~URRTDEInterface()
+{
+  StopRecv();
+}
+
+void URRTDEInterface::StartRecv()
+{
+  if (!running_.load())
+  {
+    Log("Starting RTDE recv thread loop...");
+    running_.store(true);
+    recv_thread_ = std::thread(&URRTDEInterface::RecvLoop, this);
+  }
+}
+
+void URRTDEInterface::StopRecv()
+{
+  if (running_.load())
+  {
+    running_.store(false);
+    connection_.Wake();
+  }
+  if (recv_thread_.joinable())
+  {
+    recv_thread_.join();
+  }
+}
+
+bool URRTDEInterface::SendPackage(const URRTDEPackageType type,
+                                  const std::vector<uint8_t>& payload)
+{
+  const std::vector<uint8_t> package = MakeRTDEPackage(type, payload);
+  if (connection_.Send(package.data(), package.size()) != package.size())
+  {
+    connection_.Reconnect("Failed to send RTDE package of type "
+                          + std::string(1, static_cast<char>(type)));
+    return false;
+  }
+  return true;
+}
+
+void URRTDEInterface::BeginHandshake()
+{
+  framer_.Reset();
+  timestamper_.Restart();
+  output_recipe_ = URRTDEOutputRecipe(output_fields_);
+  {
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    input_recipe_ = URRTDEInputRecipe(input_recipe_.VariableNames());
+  }
+  handshake_state_ = kRequestingProtocolVersion;
+  const std::vector<uint8_t> payload
+      = {static_cast<uint8_t>(kRTDEProtocolVersion >> 8),
+         static_cast<uint8_t>(kRTDEProtocolVersion & 0xff)};
+  SendPackage(kRTDERequestProtocolVersion, payload);
+}
+
+void URRTDEInterface::SetupOutputs()
+{
+  handshake_state_ = kSettingUpOutputs;
+  std::vector<uint8_t> payload(sizeof(double), 0x00);
+  DoublesToRTDEValue(kRTDEDouble, &output_frequency_, payload.data());
+  const std::string variable_names = output_recipe_.VariableNames();
+  payload.insert(payload.end(), variable_names.begin(), variable_names.end());
+  SendPackage(kRTDEControlPackageSetupOutputs, payload);
+}
+
+void URRTDEInterface::SetupInputsOrStart()
+{
+  std::string variable_names;
+  {
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    for (const std::string& variable_name : input_recipe_.VariableNames())
+    {
+      variable_names += (variable_names.empty() ? "" : ",") + variable_name;
+    }
+  }
+  if (!variable_names.empty())
+  {
+    handshake_state_ = kSettingUpInputs;
+    SendPackage(kRTDEControlPackageSetupInputs,
+                std::vector<uint8_t>(variable_names.begin(),
+                                     variable_names.end()));
+  }
+  else
+  {
+    handshake_state_ = kStarting;
+    SendPackage(kRTDEControlPackageStart, std::vector<uint8_t>());
+  }
+}
+
+void URRTDEInterface::HandleHandshakeResponse(
+    const std::vector<uint8_t>& packet)
+{
+  const uint8_t package_type = packet[2];
+  const uint8_t* payload = packet.data() + kRTDEHeaderSize;
+  const size_t payload_size = packet.size() - kRTDEHeaderSize;
+  if ((handshake_state_ == kRequestingProtocolVersion)
+      && (package_type == kRTDERequestProtocolVersion) && (payload_size >= 1))
+  {
+    if (payload[0] != 1)
+    {
+      connection_.Reconnect("Controller does not support RTDE protocol"
+                            " version "
+                            + std::to_string(kRTDEProtocolVersion));
+      return;
+    }
+    handshake_state_ = kRequestingControllerVersion;
+    SendPackage(kRTDEGetURControlVersion, std::vector<uint8_t>());
+  }
+  else if ((handshake_state_ == kRequestingControllerVersion)
+           && (package_type == kRTDEGetURControlVersion)
+           && (payload_size >= (4 * sizeof(uint32_t))))
+  {
+    const uint32_t major_version = NetworkToHost32(payload);
+    const uint32_t minor_version = NetworkToHost32(payload + 4);
+    const uint32_t bugfix_version = NetworkToHost32(payload + 8);
+    const uint32_t build_version = NetworkToHost32(payload + 12);
+    // Encoded as for the realtime packet layouts, so that 3.10 sorts after
+    // 3.5
+    protocol_version_ = static_cast<double>(major_version)
+                        + (static_cast<double>(minor_version) / 100.0);
+    Log("Controller software version " + std::to_string(major_version) + "."
+        + std::to_string(minor_version) + "." + std::to_string(bugfix_version)
+        + "." + std::to_string(build_version));
+    SetupOutputs();
+  }
+  else if ((handshake_state_ == kSettingUpOutputs)
+           && (package_type == kRTDEControlPackageSetupOutputs)
+           && (payload_size >= 1))
+  {
+    const std::string variable_types(payload + 1, payload + payload_size);
+    const URRealtimeFieldMask unavailable_fields
+        = output_recipe_.Configure(payload[0], variable_types);
+    if (unavailable_fields != 0)
+    {
+      std::string unavailable_names;
+      for (uint32_t field = 0; field < kNumRealtimeFields; field++)
+      {
+        if ((unavailable_fields
+             & RealtimeFieldBit(static_cast<URRealtimeField>(field))) != 0)
+        {
+          unavailable_names += std::string(" ") + kRTDEFieldNames[field];
+        }
+      }
+      if ((unavailable_fields & RealtimeFieldBit(kControllerUptime)) != 0)
+      {
+        connection_.Reconnect("Controller does not provide the RTDE"
+                              " timestamp");
+        return;
+      }
+      Log("Controller does not provide RTDE outputs" + unavailable_names
+          + ", setting up outputs without them");
+      output_fields_ &= ~unavailable_fields;
+      output_recipe_ = URRTDEOutputRecipe(output_fields_);
+      SetupOutputs();
+      return;
+    }
+    SetupInputsOrStart();
+  }
+  else if ((handshake_state_ == kSettingUpInputs)
+           && (package_type == kRTDEControlPackageSetupInputs)
+           && (payload_size >= 1))
+  {
+    const std::string variable_types(payload + 1, payload + payload_size);
+    {
+      std::lock_guard<std::mutex> lock(input_mutex_);
+      input_recipe_.Configure(payload[0], variable_types);
+    }
+    handshake_state_ = kStarting;
+    SendPackage(kRTDEControlPackageStart, std::vector<uint8_t>());
+  }
+  else if ((handshake_state_ == kStarting)
+           && (package_type == kRTDEControlPackageStart)
+           && (payload_size >= 1))
+  {
+    if (payload[0] != 1)
+    {
+      connection_.Reconnect("Controller refused to start RTDE streaming");
+      return;
+    }
+    handshake_state_ = kStreaming;
+    Log("Streaming RTDE outputs [" + output_recipe_.VariableNames() + "] at "
+        + std::to_string(output_frequency_) + " Hz");
+    connection_.MarkReady();
+  }
+  else
+  {
+    connection_.Reconnect("Unexpected RTDE package of type "
+                          + std::string(1, static_cast<char>(package_type))
+                          + " during setup");
+  }
+}
+
+void URRTDEInterface::HandleTextMessage(const std::vector<uint8_t>& packet)
+{
+  // Message and source are each preceded by their uint8 length, followed by
+  // a uint8 warning level
+  const uint8_t* payload = packet.data() + kRTDEHeaderSize;
+  const size_t payload_size = packet.size() - kRTDEHeaderSize;
+  if ((payload_size >= 1)
+      && (payload_size >= (1 + static_cast<size_t>(payload[0]))))
+  {
+    const std::string message(payload + 1, payload + 1 + payload[0]);
+    Log("RTDE message from controller: " + message);
+  }
+}
+
+void URRTDEInterface::HandlePackage(const std::vector<uint8_t>& packet)
+{
+  const uint8_t package_type = packet[2];
+  if (package_type == kRTDETextMessage)
+  {
+    HandleTextMessage(packet);
+  }
+  else if ((handshake_state_ == kStreaming)
+           && (package_type == kRTDEDataPackage))
+  {
+    if (output_recipe_.Decode(packet, protocol_version_, latest_state_))
+    {
+      timestamper_.Stamp(latest_state_, receive_time_ns_,
+                         monotonic_to_realtime_ns_);
+      state_received_callback_fn_(latest_state_);
+    }
+    else
+    {
+      Log("Rejecting RTDE data package of " + std::to_string(packet.size())
+          + " bytes that does not match the output recipe");
+    }
+  }
+  else if (handshake_state_ != kStreaming)
+  {
+    try
+    {
+      HandleHandshakeResponse(packet);
+    }
+    catch (const std::runtime_error& ex)
+    {
+      connection_.Reconnect("RTDE setup failed: " + std::string(ex.what()));
+    }
+  }
+}
+
+void URRTDEInterface::ReadSocket(const int socket_fd)
+{
+  // Read directly into the free space of the ring buffer
+  struct iovec regions[2];
+  const int num_regions = framer_.PrepareWrite(regions);
+  const ssize_t bytes_read
+      = RecvTimestamped(socket_fd, regions, num_regions, receive_time_ns_,
+                        monotonic_to_realtime_ns_);
+  if (bytes_read > 0)
+  {
+    connection_.NoteDataReceived();
+    framer_.CommitWrite(static_cast<size_t>(bytes_read));
+    framer_.DrainPackets([&] (const std::vector<uint8_t>& packet)
+    {
+      // Handling a package may drop the connection, after which the rest of
+      // this read belongs to a stream that no longer exists
+      if (connection_.IsOpen())
+      {
+        HandlePackage(packet);
+      }
+    });
+    std::unique_lock<std::mutex> statistics_lock(statistics_mutex_,
+                                                 std::try_to_lock);
+    if (statistics_lock.owns_lock())
+    {
+      published_arrival_statistics_ = timestamper_.ArrivalStatistics();
+      published_clock_estimate_ = timestamper_.ClockEstimate();
+    }
+  }
+  else if (bytes_read == 0)
+  {
+    connection_.Reconnect("Connection closed by robot");
+  }
+  else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+  {
+    connection_.Reconnect("Failed to read: " + std::string(strerror(errno)));
+  }
+}
+
+void URRTDEInterface::RecvLoop()
+{
+  tri_realtime_common::ConfigureCurrentThread(
+      recv_thread_config_, "ur_rtde_recv", logging_fn_);
+  connection_.Run(running_,
+                  [&] (const int) { BeginHandshake(); },
+                  [&] (const int socket_fd) { ReadSocket(socket_fd); });
+}
+
+bool URRTDEInterface::SendInputs(const std::vector<double>& values)
+{
+  // Encode into a local buffer, so that the recv thread is not kept waiting
+  // on input_mutex_ while the package is sent
+  std::array<uint8_t, kMaxPackageSize> input_package;
+  uint32_t input_package_size = 0;
+  {
+    std::lock_guard<std::mutex> lock(input_mutex_);
+    if (!connection_.IsReady() || !input_recipe_.Configured())
+    {
+      Log("Could not send RTDE inputs - not streaming");
+      return false;
+    }
+    input_package_size = input_recipe_.PackageSize();
+    if (input_package_size > input_package.size())
+    {
+      Log("Could not send RTDE inputs - package of "
+          + std::to_string(input_package_size) + " bytes is too large");
+      return false;
+    }
+    input_recipe_.Encode(values, input_package.data());
+  }
+  const size_t bytes_written
+      = connection_.Send(input_package.data(), input_package_size);
+  if (bytes_written != input_package_size)
+  {
+    Log("Failed to send RTDE inputs, sent " + std::to_string(bytes_written)
+        + " of " + std::to_string(input_package_size) + " bytes");
+    return false;
+  }
+  return true;
+}
+
+URRealtimeArrivalStatistics URRTDEInterface::ArrivalStatistics() const
+{
+  std::lock_guard<std::mutex> lock(statistics_mutex_);
+  return published_arrival_statistics_;
+}
+
+URControllerClockEstimate URRTDEInterface::ControllerClockEstimate() const
+{
+  std::lock_guard<std::mutex> lock(statistics_mutex_);
+  return published_clock_estimate_;
+}
+}
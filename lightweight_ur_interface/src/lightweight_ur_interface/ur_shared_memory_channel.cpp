@@ -0,0 +1,528 @@
+#include <lightweight_ur_interface/ur_shared_memory_channel.hpp>
+
+#include <stdio.h>
+#include <errno.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace lightweight_ur_interface
+{
+namespace
+{
+constexpr uint32_t kSharedMemoryMagic = 0x55525348;
+constexpr uint32_t kSharedMemoryVersion = 2;
+// Must be a power of two, so that indices stay consistent when they wrap
+constexpr uint32_t kSharedCommandRingSize = 64;
+// Bounds how long the server's thread takes to notice Stop()
+constexpr double kCommandWaitTimeout = 0.1;
+// A state write is a short copy, so readers only retry briefly
+constexpr int kMaxStateReadAttempts = 1000;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2,
+              "Shared memory atomics must be lock-free");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "Futex words must be plain 32-bit words");
+}
+
+// Both processes map the segment, so everything in it must be address-free:
+// plain data and lock-free atomics only.
+struct URSharedMemorySegment
+{
+  // Set last by the server, once the rest of the segment is initialized
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  // Set by the server when it exits
+  std::atomic<uint32_t> closed;
+  // Process of the server that created the segment
+  std::atomic<int32_t> server_pid;
+  // Process holding the command ring, or 0
+  std::atomic<int32_t> producer_pid;
+  // Seqlock sequence of the state, odd while it is being written. Readers
+  // wait on it as a futex, and the server only wakes them if any are waiting.
+  alignas(64) std::atomic<uint32_t> state_sequence;
+  std::atomic<uint32_t> state_waiters;
+  URSharedState state;
+  // Written by the client, and waited on by the server as a futex
+  alignas(64) std::atomic<uint32_t> command_write_index;
+  alignas(64) std::atomic<uint32_t> command_read_index;
+  std::atomic<uint32_t> consumer_waiting;
+  std::array<URSharedCommand, kSharedCommandRingSize> commands;
+};
+
+namespace
+{
+// Futexes in shared memory must not use FUTEX_PRIVATE_FLAG
+void FutexWait(std::atomic<uint32_t>& word, const uint32_t expected_value,
+               const double timeout)
+{
+  const double safe_timeout = std::max(timeout, 0.0);
+  struct timespec relative_timeout;
+  relative_timeout.tv_sec = static_cast<time_t>(safe_timeout);
+  relative_timeout.tv_nsec = static_cast<long>(
+      (safe_timeout - static_cast<double>(relative_timeout.tv_sec)) * 1e9);
+  const long wait_res = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+                                FUTEX_WAIT, expected_value, &relative_timeout,
+                                nullptr, 0);
+  static_cast<void>(wait_res);
+}
+
+void FutexWake(std::atomic<uint32_t>& word, const int max_waiters)
+{
+  const long wake_res = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+                                FUTEX_WAKE, max_waiters, nullptr, nullptr, 0);
+  static_cast<void>(wake_res);
+}
+
+double SecondsSince(const std::chrono::steady_clock::time_point& time)
+{
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - time).count();
+}
+
+bool ProcessExited(const int32_t pid)
+{
+  return (kill(pid, 0) != 0) && (errno == ESRCH);
+}
+
+// Returns the process of the server still serving the segment name, or 0 if
+// there is none, or the segment was left behind by one that has exited
+int32_t LiveServerPid(const std::string& name)
+{
+  int32_t live_server_pid = 0;
+  const int shm_fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (shm_fd >= 0)
+  {
+    struct stat shm_stat;
+    if ((fstat(shm_fd, &shm_stat) == 0)
+        && (static_cast<size_t>(shm_stat.st_size)
+            >= sizeof(URSharedMemorySegment)))
+    {
+      void* const memory = mmap(nullptr, sizeof(URSharedMemorySegment),
+                                PROT_READ, MAP_SHARED, shm_fd, 0);
+      if (memory != MAP_FAILED)
+      {
+        const URSharedMemorySegment* const segment
+            = static_cast<const URSharedMemorySegment*>(memory);
+        if ((segment->magic.load(std::memory_order_acquire)
+             == kSharedMemoryMagic)
+            && (segment->version == kSharedMemoryVersion)
+            && (segment->closed.load() == 0))
+        {
+          const int32_t server_pid = segment->server_pid.load();
+          if ((server_pid > 0) && !ProcessExited(server_pid))
+          {
+            live_server_pid = server_pid;
+          }
+        }
+        munmap(memory, sizeof(URSharedMemorySegment));
+      }
+    }
+    close(shm_fd);
+  }
+  return live_server_pid;
+}
+}
+
+URSharedMemoryServer::URSharedMemoryServer(
+    const std::string& name,
+    const std::function<void(const std::string&)>& logging_fn,
+    const std::function<void(void)>& commands_ready_fn)
+  : name_(name), segment_(nullptr), logging_fn_(logging_fn),
+    commands_ready_fn_(commands_ready_fn)
+{
+  running_.store(false);
+  if ((name_.size() < 2) || (name_[0] != '/'))
+  {
+    throw std::invalid_argument(
+        "Shared memory name [" + name_ + "] must be / and a name");
+  }
+  // Creating exclusively first means an existing segment is only examined,
+  // and only removed if its server has exited, when there is one
+  int shm_fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+  if ((shm_fd < 0) && (errno == EEXIST))
+  {
+    // The segment of a running server is never replaced, since its clients
+    // would be left on a mapping no one serves
+    const int32_t live_server_pid = LiveServerPid(name_);
+    if (live_server_pid > 0)
+    {
+      throw std::runtime_error("Shared memory [" + name_ + "] is in use by"
+                               " process " + std::to_string(live_server_pid));
+    }
+    // A segment left behind by a process that crashed cannot be reused,
+    // since its waiters and command ring are in an unknown state
+    Log("Removing shared memory [" + name_ + "] left by an exited server");
+    shm_unlink(name_.c_str());
+    shm_fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+  }
+  if (shm_fd < 0)
+  {
+    throw std::runtime_error("Failed to create shared memory [" + name_
+                             + "]: " + std::string(strerror(errno)));
+  }
+  const size_t segment_size = sizeof(URSharedMemorySegment);
+  if (ftruncate(shm_fd, static_cast<off_t>(segment_size)) != 0)
+  {
+    const std::string error(strerror(errno));
+    close(shm_fd);
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("Failed to size shared memory [" + name_ + "]: "
+                             + error);
+  }
+  void* const memory = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (memory == MAP_FAILED)
+  {
+    const std::string error(strerror(errno));
+    shm_unlink(name_.c_str());
+    throw std::runtime_error("Failed to map shared memory [" + name_ + "]: "
+                             + error);
+  }
+  segment_ = new (memory) URSharedMemorySegment();
+  segment_->version = kSharedMemoryVersion;
+  segment_->closed.store(0);
+  segment_->server_pid.store(static_cast<int32_t>(getpid()));
+  segment_->producer_pid.store(0);
+  segment_->state_sequence.store(0);
+  segment_->state_waiters.store(0);
+  segment_->command_write_index.store(0);
+  segment_->command_read_index.store(0);
+  segment_->consumer_waiting.store(0);
+  segment_->magic.store(kSharedMemoryMagic, std::memory_order_release);
+  Log("Created shared memory state and command channel [" + name_ + "]");
+}
+
+URSharedMemoryServer::~URSharedMemoryServer()
+{
+  Stop();
+  // Clients waiting for state see the segment closed as they wake
+  segment_->closed.store(1);
+  FutexWake(segment_->state_sequence, INT_MAX);
+  munmap(segment_, sizeof(URSharedMemorySegment));
+  shm_unlink(name_.c_str());
+}
+
+void URSharedMemoryServer::Start()
+{
+  if (!running_.load())
+  {
+    Log("Starting shared memory command wait thread loop...");
+    running_.store(true);
+    wait_thread_ = std::thread(&URSharedMemoryServer::WaitLoop, this);
+  }
+}
+
+void URSharedMemoryServer::Stop()
+{
+  if (running_.load())
+  {
+    running_.store(false);
+    FutexWake(segment_->command_write_index, INT_MAX);
+  }
+  if (wait_thread_.joinable())
+  {
+    wait_thread_.join();
+  }
+}
+
+void URSharedMemoryServer::PublishState(const URSharedState& state)
+{
+  const uint32_t sequence
+      = segment_->state_sequence.load(std::memory_order_relaxed);
+  segment_->state_sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(&segment_->state, &state, sizeof(state));
+  segment_->state_sequence.store(sequence + 2);
+  if (segment_->state_waiters.load() > 0)
+  {
+    FutexWake(segment_->state_sequence, INT_MAX);
+  }
+}
+
+bool URSharedMemoryServer::TakeCommand(URSharedCommand& command)
+{
+  const uint32_t read_index
+      = segment_->command_read_index.load(std::memory_order_relaxed);
+  const uint32_t write_index
+      = segment_->command_write_index.load(std::memory_order_acquire);
+  if (read_index == write_index)
+  {
+    return false;
+  }
+  // The client can write anything to the segment, so never trust its index
+  if ((write_index - read_index) > kSharedCommandRingSize)
+  {
+    Log("Discarding commands with invalid shared memory write index");
+    segment_->command_read_index.store(write_index);
+    return false;
+  }
+  command = segment_->commands[read_index % kSharedCommandRingSize];
+  segment_->command_read_index.store(read_index + 1,
+                                     std::memory_order_release);
+  return true;
+}
+
+void URSharedMemoryServer::WaitLoop()
+{
+  // Commands posted before the thread started are reported at once
+  uint32_t notified_write_index = segment_->command_read_index.load();
+  while (running_.load())
+  {
+    const uint32_t write_index = segment_->command_write_index.load();
+    if (write_index != notified_write_index)
+    {
+      notified_write_index = write_index;
+      commands_ready_fn_();
+      continue;
+    }
+    // A client posting after this sees the flag and wakes us, and one that
+    // posted before changed the index, so the wait returns at once
+    segment_->consumer_waiting.store(1);
+    if (segment_->command_write_index.load() == write_index)
+    {
+      FutexWait(segment_->command_write_index, write_index,
+                kCommandWaitTimeout);
+    }
+  }
+}
+
+URSharedMemoryClient::URSharedMemoryClient(
+    const std::string& name,
+    const std::function<void(const std::string&)>& logging_fn)
+  : name_(name), segment_(nullptr), segment_inode_(0),
+    logging_fn_(logging_fn), last_state_sequence_(0), open_warned_(false),
+    producer_claimed_(false), producer_claim_warned_(false),
+    dropped_commands_(0)
+{
+  const std::chrono::steady_clock::duration reopen_interval
+      = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(kReopenInterval));
+  // Allow the first attempt to open immediately
+  last_open_attempt_time_ = std::chrono::steady_clock::now() - reopen_interval;
+  last_state_time_ = last_open_attempt_time_;
+}
+
+URSharedMemoryClient::~URSharedMemoryClient()
+{
+  Close();
+}
+
+bool URSharedMemoryClient::EnsureOpen()
+{
+  const double reopen_interval = kReopenInterval;
+  if ((segment_ != nullptr) && (segment_->closed.load() != 0))
+  {
+    Log("Shared memory [" + name_ + "] closed by server");
+    Close();
+  }
+  // Only a stalled segment may have been replaced by a restarted server
+  const bool stalled = (SecondsSince(last_state_time_) > reopen_interval);
+  if ((segment_ != nullptr) && !stalled)
+  {
+    return true;
+  }
+  if (SecondsSince(last_open_attempt_time_) < reopen_interval)
+  {
+    return (segment_ != nullptr);
+  }
+  last_open_attempt_time_ = std::chrono::steady_clock::now();
+  const int shm_fd = shm_open(name_.c_str(), O_RDWR, 0);
+  if (shm_fd < 0)
+  {
+    if (!open_warned_)
+    {
+      Log("Waiting for shared memory [" + name_ + "]: "
+          + std::string(strerror(errno)));
+      open_warned_ = true;
+    }
+    return (segment_ != nullptr);
+  }
+  struct stat shm_stat;
+  if ((fstat(shm_fd, &shm_stat) != 0)
+      || (static_cast<size_t>(shm_stat.st_size)
+          < sizeof(URSharedMemorySegment)))
+  {
+    // Not yet sized by the server
+    close(shm_fd);
+    return (segment_ != nullptr);
+  }
+  const uint64_t inode = static_cast<uint64_t>(shm_stat.st_ino);
+  if ((segment_ != nullptr) && (inode == segment_inode_))
+  {
+    close(shm_fd);
+    return true;
+  }
+  void* const memory = mmap(nullptr, sizeof(URSharedMemorySegment),
+                            PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (memory == MAP_FAILED)
+  {
+    perror(nullptr);
+    return (segment_ != nullptr);
+  }
+  URSharedMemorySegment* const segment
+      = static_cast<URSharedMemorySegment*>(memory);
+  if ((segment->magic.load(std::memory_order_acquire) != kSharedMemoryMagic)
+      || (segment->version != kSharedMemoryVersion)
+      || (segment->closed.load() != 0))
+  {
+    // Still being initialized, from an incompatible server, or from one that
+    // is exiting
+    munmap(memory, sizeof(URSharedMemorySegment));
+    return (segment_ != nullptr);
+  }
+  Close();
+  segment_ = segment;
+  segment_inode_ = inode;
+  last_state_time_ = std::chrono::steady_clock::now();
+  open_warned_ = false;
+  Log("Opened shared memory state and command channel [" + name_ + "]");
+  return true;
+}
+
+void URSharedMemoryClient::Close()
+{
+  if (segment_ == nullptr)
+  {
+    return;
+  }
+  if (producer_claimed_)
+  {
+    int32_t our_pid = static_cast<int32_t>(getpid());
+    segment_->producer_pid.compare_exchange_strong(our_pid, 0);
+    producer_claimed_ = false;
+  }
+  munmap(segment_, sizeof(URSharedMemorySegment));
+  segment_ = nullptr;
+  segment_inode_ = 0;
+  last_state_sequence_ = 0;
+}
+
+bool URSharedMemoryClient::ClaimProducer()
+{
+  if (producer_claimed_)
+  {
+    return true;
+  }
+  const int32_t our_pid = static_cast<int32_t>(getpid());
+  int32_t holder_pid = 0;
+  bool claimed
+      = segment_->producer_pid.compare_exchange_strong(holder_pid, our_pid);
+  // The claim of a client that exited without releasing it is taken over
+  if (!claimed && ProcessExited(holder_pid))
+  {
+    claimed
+        = segment_->producer_pid.compare_exchange_strong(holder_pid, our_pid);
+  }
+  if (claimed)
+  {
+    producer_claimed_ = true;
+    producer_claim_warned_ = false;
+    Log("Claimed shared memory command ring of [" + name_ + "]");
+  }
+  else if (!producer_claim_warned_)
+  {
+    Log("Shared memory command ring of [" + name_ + "] held by process "
+        + std::to_string(holder_pid));
+    producer_claim_warned_ = true;
+  }
+  return claimed;
+}
+
+bool URSharedMemoryClient::ReadNewState(URSharedState& state)
+{
+  if (!EnsureOpen())
+  {
+    return false;
+  }
+  for (int attempt = 0; attempt < kMaxStateReadAttempts; attempt++)
+  {
+    const uint32_t sequence
+        = segment_->state_sequence.load(std::memory_order_acquire);
+    if ((sequence == 0) || (sequence == last_state_sequence_))
+    {
+      return false;
+    }
+    if ((sequence % 2) != 0)
+    {
+      continue;
+    }
+    URSharedState read_state;
+    std::memcpy(&read_state, &segment_->state, sizeof(read_state));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (segment_->state_sequence.load(std::memory_order_relaxed) == sequence)
+    {
+      state = read_state;
+      last_state_sequence_ = sequence;
+      last_state_time_ = std::chrono::steady_clock::now();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool URSharedMemoryClient::WaitForNewState(const double timeout,
+                                           URSharedState& state)
+{
+  const std::chrono::steady_clock::time_point start_time
+      = std::chrono::steady_clock::now();
+  while (!ReadNewState(state))
+  {
+    const double remaining = timeout - SecondsSince(start_time);
+    if (remaining <= 0.0)
+    {
+      return false;
+    }
+    if (segment_ == nullptr)
+    {
+      // Wait out the timeout, and try to open it again on the next call
+      std::this_thread::sleep_for(std::chrono::duration<double>(remaining));
+      return false;
+    }
+    segment_->state_waiters.fetch_add(1);
+    const uint32_t sequence = segment_->state_sequence.load();
+    if ((sequence == last_state_sequence_) || ((sequence % 2) != 0))
+    {
+      FutexWait(segment_->state_sequence, sequence, remaining);
+    }
+    segment_->state_waiters.fetch_sub(1);
+  }
+  return true;
+}
+
+bool URSharedMemoryClient::PostCommand(const URSharedCommand& command)
+{
+  if (!EnsureOpen() || !ClaimProducer())
+  {
+    return false;
+  }
+  const uint32_t write_index
+      = segment_->command_write_index.load(std::memory_order_relaxed);
+  const uint32_t read_index
+      = segment_->command_read_index.load(std::memory_order_acquire);
+  if ((write_index - read_index) >= kSharedCommandRingSize)
+  {
+    dropped_commands_++;
+    return false;
+  }
+  segment_->commands[write_index % kSharedCommandRingSize] = command;
+  segment_->command_write_index.store(write_index + 1);
+  if (segment_->consumer_waiting.exchange(0) != 0)
+  {
+    FutexWake(segment_->command_write_index, 1);
+  }
+  return true;
+}
+}
@@ -0,0 +1,203 @@
+#include <lightweight_ur_interface/ur_stream_capture.hpp>
+
+#include <stdio.h>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace lightweight_ur_interface
+{
+constexpr char kCaptureMagic[8] = {'U', 'R', 'S', 'T', 'R', 'C', 'A', 'P'};
+constexpr uint32_t kCaptureByteOrderMark = 0x01020304;
+constexpr uint32_t kCaptureVersion = 1;
+
+inline size_t PaddedSize(const size_t size)
+{
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+
+URStreamCaptureWriter::URStreamCaptureWriter(const std::string& path)
+  : path_(path), fd_(-1), mapping_(nullptr), mapped_size_(0),
+    written_size_(0)
+{
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+  {
+    throw std::runtime_error("Failed to create capture file " + path + ": "
+                             + std::string(strerror(errno)));
+  }
+  URStreamCaptureFileHeader header;
+  std::memcpy(header.magic, kCaptureMagic, sizeof(header.magic));
+  header.byte_order_mark = kCaptureByteOrderMark;
+  header.version = kCaptureVersion;
+  try
+  {
+    Reserve(sizeof(header));
+  }
+  catch (...)
+  {
+    close(fd_);
+    throw;
+  }
+  std::memcpy(mapping_, &header, sizeof(header));
+  written_size_ = sizeof(header);
+}
+
+URStreamCaptureWriter::~URStreamCaptureWriter()
+{
+  if (mapping_ != nullptr)
+  {
+    munmap(mapping_, mapped_size_);
+  }
+  // Drop the unused preallocated space
+  if (ftruncate(fd_, static_cast<off_t>(written_size_)) != 0)
+  {
+    perror(nullptr);
+  }
+  close(fd_);
+}
+
+void URStreamCaptureWriter::Reserve(const size_t size)
+{
+  if ((written_size_ + size) <= mapped_size_)
+  {
+    return;
+  }
+  const size_t new_mapped_size
+      = ((written_size_ + size + kGrowthSize - 1) / kGrowthSize) * kGrowthSize;
+  // Allocate the space now, rather than risk SIGBUS writing to a sparse
+  // mapping when the disk is full
+  const int allocate_res
+      = posix_fallocate(fd_, 0, static_cast<off_t>(new_mapped_size));
+  if (allocate_res != 0)
+  {
+    throw std::runtime_error("Failed to grow capture file " + path_ + ": "
+                             + std::string(strerror(allocate_res)));
+  }
+  void* new_mapping = (mapping_ == nullptr)
+      ? mmap(nullptr, new_mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd_, 0)
+      : mremap(mapping_, mapped_size_, new_mapped_size, MREMAP_MAYMOVE);
+  if (new_mapping == MAP_FAILED)
+  {
+    throw std::runtime_error("Failed to map capture file " + path_ + ": "
+                             + std::string(strerror(errno)));
+  }
+  mapping_ = static_cast<uint8_t*>(new_mapping);
+  mapped_size_ = new_mapped_size;
+}
+
+void URStreamCaptureWriter::Append(
+    const int64_t receive_time_ns, const int64_t monotonic_to_realtime_ns,
+    const struct iovec* regions, const int num_regions, const size_t size)
+{
+  const size_t padded_size = PaddedSize(size);
+  Reserve(sizeof(URStreamCaptureRecordHeader) + padded_size);
+  URStreamCaptureRecordHeader record_header;
+  record_header.receive_time_ns = receive_time_ns;
+  record_header.monotonic_to_realtime_ns = monotonic_to_realtime_ns;
+  record_header.size = size;
+  uint8_t* destination = mapping_ + written_size_;
+  std::memcpy(destination, &record_header, sizeof(record_header));
+  destination += sizeof(record_header);
+  size_t copied = 0;
+  for (int idx = 0; (idx < num_regions) && (copied < size); idx++)
+  {
+    const size_t to_copy = std::min(size - copied, regions[idx].iov_len);
+    std::memcpy(destination + copied, regions[idx].iov_base, to_copy);
+    copied += to_copy;
+  }
+  if (copied != size)
+  {
+    throw std::invalid_argument("regions hold fewer than size bytes");
+  }
+  // Preallocated space is already zeroed, so the padding needs no writes
+  written_size_ += sizeof(record_header) + padded_size;
+}
+
+URStreamCaptureReader::URStreamCaptureReader(const std::string& path)
+  : fd_(-1), mapping_(nullptr), mapped_size_(0), read_offset_(0)
+{
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0)
+  {
+    throw std::runtime_error("Failed to open capture file " + path + ": "
+                             + std::string(strerror(errno)));
+  }
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0)
+  {
+    close(fd_);
+    throw std::runtime_error("Failed to stat capture file " + path);
+  }
+  mapped_size_ = static_cast<size_t>(file_stat.st_size);
+  URStreamCaptureFileHeader header;
+  if (mapped_size_ < sizeof(header))
+  {
+    close(fd_);
+    throw std::runtime_error(path + " is too small to be a capture file");
+  }
+  void* mapping
+      = mmap(nullptr, mapped_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (mapping == MAP_FAILED)
+  {
+    close(fd_);
+    throw std::runtime_error("Failed to map capture file " + path + ": "
+                             + std::string(strerror(errno)));
+  }
+  mapping_ = static_cast<const uint8_t*>(mapping);
+  std::memcpy(&header, mapping_, sizeof(header));
+  if ((std::memcmp(header.magic, kCaptureMagic, sizeof(header.magic)) != 0)
+      || (header.byte_order_mark != kCaptureByteOrderMark)
+      || (header.version != kCaptureVersion))
+  {
+    munmap(const_cast<uint8_t*>(mapping_), mapped_size_);
+    close(fd_);
+    throw std::runtime_error(path + " is not a version "
+                             + std::to_string(kCaptureVersion)
+                             + " capture file in host byte order");
+  }
+  read_offset_ = sizeof(header);
+  // Replays read the whole file front to back
+  madvise(const_cast<uint8_t*>(mapping_), mapped_size_, MADV_SEQUENTIAL);
+}
+
+URStreamCaptureReader::~URStreamCaptureReader()
+{
+  munmap(const_cast<uint8_t*>(mapping_), mapped_size_);
+  close(fd_);
+}
+
+bool URStreamCaptureReader::NextRecord(URStreamCaptureRecord& record)
+{
+  URStreamCaptureRecordHeader record_header;
+  if ((mapped_size_ - read_offset_) < sizeof(record_header))
+  {
+    return false;
+  }
+  std::memcpy(&record_header, mapping_ + read_offset_, sizeof(record_header));
+  const size_t data_offset = read_offset_ + sizeof(record_header);
+  // Empty records are never written, so one marks unused preallocated space
+  if ((record_header.size == 0)
+      || (record_header.size > (mapped_size_ - data_offset)))
+  {
+    return false;
+  }
+  record.receive_time_ns = record_header.receive_time_ns;
+  record.monotonic_to_realtime_ns = record_header.monotonic_to_realtime_ns;
+  record.data = mapping_ + data_offset;
+  record.size = static_cast<size_t>(record_header.size);
+  read_offset_ = std::min(mapped_size_, data_offset + PaddedSize(record.size));
+  return true;
+}
+
+void URStreamCaptureReader::Rewind()
+{
+  read_offset_ = sizeof(URStreamCaptureFileHeader);
+}
+}  // namespace lightweight_ur_interface
@@ -0,0 +1,1993 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <cstring>
+#include <cmath>
+#include <array>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <Eigen/Geometry>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <lightweight_ur_interface/ur_robot_config.hpp>
+#include <lightweight_ur_interface/ur_minimal_realtime_driver.hpp>
+#include <lightweight_ur_interface/ur_rtde_interface.hpp>
+#include <lightweight_ur_interface/ur_primary_interface.hpp>
+#include <lightweight_ur_interface/ur_dashboard_client.hpp>
+
+// Stand-in for a UR controller, for exercising URRealtimeInterface, the
+// hardware interfaces and the controllers without an arm. It streams realtime
+// packets on port 30003, runs URScript sent to that port, and for the
+// ur_driver_program uploaded by ur_script_hardware_interface, connects back to
+// the control port and executes the commands it receives. RTDE clients on
+// port 30004 can set up output and input recipes and stream them, though
+// input registers are only stored, since no program reads them. Primary and
+// secondary clients on ports 30001 and 30002 receive robot state at 10 Hz, and
+// primary clients also receive a runtime exception when the driver program
+// fails to connect back. The dashboard server on port 29999 answers mode
+// queries and can stop programs and unlock protective stops, which SIGUSR1
+// triggers. The arm is a UR10
+// kinematic model whose joint velocities track commanded speeds under the
+// commanded acceleration; dynamics, currents and force mode are not modelled.
+namespace lightweight_ur_interface
+{
+typedef std::array<double, 6> Array6d;
+typedef Eigen::Matrix<double, 6, 1> Vector6d;
+typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+
+constexpr uint16_t kRealtimePort = 30003;
+// Standard UR10 DH parameters
+constexpr double kDhA[6] = {0.0, -0.612, -0.5723, 0.0, 0.0, 0.0};
+constexpr double kDhD[6] = {0.1273, 0.0, 0.0, 0.163941, 0.1157, 0.0922};
+constexpr double kDhAlpha[6] = {M_PI_2, 0.0, 0.0, M_PI_2, -M_PI_2, 0.0};
+// Values reported for the robot and each joint while running normally
+constexpr double kJointModeRunning = 253.0;
+constexpr double kSafetyModeNormal = 1.0;
+constexpr double kSafetyModeProtectiveStop = 3.0;
+constexpr double kProgramStateStopped = 1.0;
+constexpr double kProgramStatePlaying = 2.0;
+
+// Frames of each joint (index 0 is the base) and the TCP, in the base frame
+std::array<Eigen::Isometry3d, 7> ComputeJointFrames(const Array6d& q)
+{
+  std::array<Eigen::Isometry3d, 7> frames;
+  frames[0] = Eigen::Isometry3d::Identity();
+  for (size_t idx = 0; idx < 6; idx++)
+  {
+    const Eigen::Isometry3d link_transform
+        = Eigen::Isometry3d(Eigen::AngleAxisd(q[idx], Eigen::Vector3d::UnitZ()))
+          * Eigen::Translation3d(kDhA[idx], 0.0, kDhD[idx])
+          * Eigen::AngleAxisd(kDhAlpha[idx], Eigen::Vector3d::UnitX());
+    frames[idx + 1] = frames[idx] * link_transform;
+  }
+  return frames;
+}
+
+// Jacobian from joint velocities to the TCP twist (linear, angular) in the
+// base frame
+Matrix6d ComputeTcpJacobian(const std::array<Eigen::Isometry3d, 7>& frames)
+{
+  Matrix6d jacobian;
+  const Eigen::Vector3d tcp_position = frames[6].translation();
+  for (size_t idx = 0; idx < 6; idx++)
+  {
+    const Eigen::Vector3d axis = frames[idx].linear().col(2);
+    jacobian.block<3, 1>(0, static_cast<Eigen::Index>(idx))
+        = axis.cross(tcp_position - frames[idx].translation());
+    jacobian.block<3, 1>(3, static_cast<Eigen::Index>(idx)) = axis;
+  }
+  return jacobian;
+}
+
+// UR TCP vectors are position and rotation vector (axis * angle)
+Array6d TransformToTcpVector(const Eigen::Isometry3d& transform)
+{
+  const Eigen::AngleAxisd rotation(transform.linear());
+  const Eigen::Vector3d rotation_vector = rotation.axis() * rotation.angle();
+  return Array6d{{transform.translation().x(), transform.translation().y(),
+                  transform.translation().z(), rotation_vector.x(),
+                  rotation_vector.y(), rotation_vector.z()}};
+}
+
+class EmulatedArm
+{
+public:
+
+  enum MotionMode : uint8_t { kStopped, kSpeedJ, kSpeedL, kServoJ, kTeach };
+
+private:
+
+  // Joint acceleration available to servoj, which is not limited by a
+  // commanded acceleration
+  static constexpr double kServoAcceleration = 20.0;
+
+  Array6d position_;
+  Array6d velocity_;
+  Array6d acceleration_;
+  Array6d target_velocity_;
+  Array6d min_position_;
+  Array6d max_position_;
+  Array6d max_velocity_;
+  Vector6d target_tcp_twist_;
+  Array6d servo_target_position_;
+  double servo_lookahead_time_;
+  MotionMode mode_;
+  double command_acceleration_;
+  // Remaining time of the current speed command, negative if unbounded
+  double command_time_remaining_;
+
+public:
+
+  EmulatedArm(const Array6d& initial_position)
+    : position_(initial_position), servo_lookahead_time_(0.1),
+      mode_(kStopped),
+      command_acceleration_(1.0), command_time_remaining_(-1.0)
+  {
+    velocity_.fill(0.0);
+    acceleration_.fill(0.0);
+    target_velocity_.fill(0.0);
+    target_tcp_twist_.setZero();
+    servo_target_position_ = initial_position;
+    const std::vector<std::string> joint_names = GetOrderedJointNames();
+    const std::map<std::string, JointLimits> limits = GetLimits();
+    for (size_t idx = 0; idx < joint_names.size(); idx++)
+    {
+      const JointLimits& joint_limits = limits.at(joint_names[idx]);
+      min_position_[idx] = joint_limits.MinPosition();
+      max_position_[idx] = joint_limits.MaxPosition();
+      max_velocity_[idx] = joint_limits.MaxVelocity();
+    }
+  }
+
+  void SpeedJ(const Array6d& joint_velocity, const double acceleration,
+              const double time)
+  {
+    mode_ = kSpeedJ;
+    target_velocity_ = joint_velocity;
+    command_acceleration_ = std::abs(acceleration);
+    command_time_remaining_ = (time > 0.0) ? time : -1.0;
+  }
+
+  // Joint accelerations are limited by acceleration, rather than the TCP
+  // acceleration as on a real controller.
+  void SpeedL(const Array6d& tcp_twist, const double acceleration,
+              const double time)
+  {
+    mode_ = kSpeedL;
+    target_tcp_twist_ = Eigen::Map<const Vector6d>(tcp_twist.data());
+    command_acceleration_ = std::abs(acceleration);
+    command_time_remaining_ = (time > 0.0) ? time : -1.0;
+  }
+
+  // The arm closes the distance to target_position with a time constant of
+  // lookahead_time, under the joint velocity limits. The gain of a real
+  // controller's servo loop is not modelled.
+  void ServoJ(const Array6d& target_position, const double lookahead_time)
+  {
+    mode_ = kServoJ;
+    servo_target_position_ = target_position;
+    servo_lookahead_time_ = std::max(lookahead_time, 0.001);
+    command_acceleration_ = kServoAcceleration;
+    command_time_remaining_ = -1.0;
+  }
+
+  void Stop(const double deceleration)
+  {
+    mode_ = kStopped;
+    command_acceleration_ = std::abs(deceleration);
+  }
+
+  // Teach mode holds the arm still, since there is nobody to move it
+  void Teach()
+  {
+    mode_ = kTeach;
+    command_acceleration_ = 10.0;
+  }
+
+  void Step(const double timestep)
+  {
+    if (command_time_remaining_ >= 0.0)
+    {
+      command_time_remaining_ -= timestep;
+      if (command_time_remaining_ < 0.0)
+      {
+        mode_ = kStopped;
+      }
+    }
+    if (mode_ == kSpeedJ)
+    {
+      // Target set by the command
+    }
+    else if (mode_ == kSpeedL)
+    {
+      // Damped least squares keeps speedl usable near singularities
+      const Matrix6d jacobian
+          = ComputeTcpJacobian(ComputeJointFrames(position_));
+      const double damping = 1e-4;
+      const Vector6d joint_velocity
+          = jacobian.transpose()
+            * (jacobian * jacobian.transpose()
+               + (damping * Matrix6d::Identity())).ldlt().solve(
+                  target_tcp_twist_);
+      for (size_t idx = 0; idx < 6; idx++)
+      {
+        target_velocity_[idx] = joint_velocity(static_cast<Eigen::Index>(idx));
+      }
+    }
+    else if (mode_ == kServoJ)
+    {
+      for (size_t idx = 0; idx < 6; idx++)
+      {
+        target_velocity_[idx]
+            = (servo_target_position_[idx] - position_[idx])
+              / std::max(servo_lookahead_time_, timestep);
+      }
+    }
+    else
+    {
+      target_velocity_.fill(0.0);
+    }
+    const double max_velocity_change = command_acceleration_ * timestep;
+    for (size_t idx = 0; idx < 6; idx++)
+    {
+      const double target_velocity
+          = std::max(-max_velocity_[idx],
+                     std::min(max_velocity_[idx], target_velocity_[idx]));
+      const double velocity_change
+          = std::max(-max_velocity_change,
+                     std::min(max_velocity_change,
+                              target_velocity - velocity_[idx]));
+      double new_velocity = velocity_[idx] + velocity_change;
+      double new_position = position_[idx]
+                            + ((velocity_[idx] + new_velocity) * 0.5
+                               * timestep);
+      // Joints stop dead at their limits, as in a protective stop
+      if ((new_position <= min_position_[idx])
+          || (new_position >= max_position_[idx]))
+      {
+        new_position = std::max(min_position_[idx],
+                                std::min(max_position_[idx], new_position));
+        new_velocity = 0.0;
+      }
+      acceleration_[idx] = (new_velocity - velocity_[idx]) / timestep;
+      velocity_[idx] = new_velocity;
+      position_[idx] = new_position;
+    }
+  }
+
+  inline const Array6d& Position() const { return position_; }
+
+  inline const Array6d& Velocity() const { return velocity_; }
+
+  inline const Array6d& Acceleration() const { return acceleration_; }
+
+  inline const Array6d& TargetVelocity() const { return target_velocity_; }
+
+  inline MotionMode Mode() const { return mode_; }
+};
+
+// The waypoint ring buffer of ur_driver_program. Each control period, its
+// command thread moves the setpoint toward the next waypoint, interpolating
+// linearly from the last one reached, and holds the setpoint once the buffer
+// runs dry.
+class EmulatedWaypointBuffer
+{
+private:
+
+  struct Waypoint
+  {
+    double duration;
+    Array6d position;
+  };
+
+  std::deque<Waypoint> waypoints_;
+  size_t capacity_;
+  size_t low_water_mark_;
+  Array6d segment_start_;
+  double segment_elapsed_;
+  bool restart_;
+  int32_t num_consumed_;
+  bool report_pending_;
+  uint64_t num_dropped_;
+
+public:
+
+  EmulatedWaypointBuffer(const size_t capacity, const size_t low_water_mark)
+    : capacity_(capacity), low_water_mark_(low_water_mark),
+      segment_elapsed_(0.0), restart_(true), num_consumed_(0),
+      report_pending_(false), num_dropped_(0)
+  {
+    segment_start_.fill(0.0);
+  }
+
+  EmulatedWaypointBuffer() : EmulatedWaypointBuffer(0, 0) {}
+
+  // Discards buffered waypoints, counting them as consumed
+  void Clear()
+  {
+    num_consumed_ += static_cast<int32_t>(waypoints_.size());
+    waypoints_.clear();
+    restart_ = true;
+    report_pending_ = true;
+  }
+
+  // Waypoints pushed while the buffer is full are dropped, as by the program
+  void Push(const double duration, const Array6d& position)
+  {
+    if (waypoints_.size() < capacity_)
+    {
+      waypoints_.push_back(Waypoint{duration, position});
+    }
+    else
+    {
+      num_dropped_++;
+    }
+  }
+
+  // Setpoint after timestep more seconds. Interpolation restarts from
+  // current_position after a clear, or if restart is set.
+  Array6d Step(const double timestep, const Array6d& current_position,
+               const bool restart)
+  {
+    if (restart || restart_)
+    {
+      segment_start_ = current_position;
+      segment_elapsed_ = 0.0;
+      restart_ = false;
+    }
+    if (waypoints_.empty())
+    {
+      segment_elapsed_ = 0.0;
+      return segment_start_;
+    }
+    const Waypoint& next = waypoints_.front();
+    segment_elapsed_ += timestep;
+    if (segment_elapsed_ >= next.duration)
+    {
+      segment_elapsed_ -= next.duration;
+      segment_start_ = next.position;
+      waypoints_.pop_front();
+      num_consumed_++;
+      if (waypoints_.size() <= low_water_mark_)
+      {
+        report_pending_ = true;
+      }
+      return segment_start_;
+    }
+    const double alpha = segment_elapsed_ / next.duration;
+    Array6d setpoint;
+    for (size_t idx = 0; idx < 6; idx++)
+    {
+      setpoint[idx] = segment_start_[idx]
+                      + (alpha * (next.position[idx] - segment_start_[idx]));
+    }
+    return setpoint;
+  }
+
+  // Returns true, with the total consumed, if the program would report it
+  bool TakeReport(int32_t& num_consumed)
+  {
+    num_consumed = num_consumed_;
+    const bool report = report_pending_;
+    report_pending_ = false;
+    return report;
+  }
+
+  inline size_t Size() const { return waypoints_.size(); }
+
+  inline uint64_t NumDropped() const { return num_dropped_; }
+};
+
+// Constants of an uploaded ur_driver_program, parsed from its source
+class DriverProgramConfig
+{
+private:
+
+  std::string pc_ip_address_;
+  int32_t pc_control_port_;
+  double float_conversion_;
+  double stop_deceleration_;
+  double speed_acceleration_;
+  double speed_command_wait_;
+  double servoj_lookahead_time_;
+  int32_t waypoint_buffer_size_;
+  int32_t waypoint_low_water_mark_;
+
+  static std::string FindAssignment(const std::string& program,
+                                    const std::string& name)
+  {
+    const std::string prefix = name + " = ";
+    const size_t found = program.find(prefix);
+    if (found == std::string::npos)
+    {
+      throw std::invalid_argument("Program does not define " + name);
+    }
+    const size_t value_start = found + prefix.size();
+    const size_t value_end = program.find('\n', value_start);
+    std::string value = program.substr(value_start, value_end - value_start);
+    value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+    return value;
+  }
+
+public:
+
+  explicit DriverProgramConfig(const std::string& program)
+  {
+    pc_ip_address_ = FindAssignment(program, "PC_IP_ADDRESS");
+    pc_control_port_
+        = std::atoi(FindAssignment(program, "PC_CONTROL_PORT").c_str());
+    float_conversion_
+        = std::atof(FindAssignment(program, "FLOAT_CONVERSION").c_str());
+    stop_deceleration_
+        = std::atof(FindAssignment(program, "STOP_DECELERATION").c_str());
+    speed_acceleration_
+        = std::atof(FindAssignment(program, "SPEED_ACCELERATION").c_str());
+    speed_command_wait_
+        = std::atof(FindAssignment(program, "SPEED_COMMAND_WAIT").c_str());
+    servoj_lookahead_time_
+        = std::atof(FindAssignment(program, "SERVOJ_LOOKAHEAD_TIME").c_str());
+    waypoint_buffer_size_
+        = std::atoi(FindAssignment(program, "WAYPOINT_BUFFER_SIZE").c_str());
+    waypoint_low_water_mark_
+        = std::atoi(
+            FindAssignment(program, "WAYPOINT_LOW_WATER_MARK").c_str());
+    if ((pc_control_port_ <= 0) || (float_conversion_ <= 0.0)
+        || (waypoint_buffer_size_ < 0) || (waypoint_low_water_mark_ < 0))
+    {
+      throw std::invalid_argument("Invalid PC_CONTROL_PORT,"
+                                  " FLOAT_CONVERSION or waypoint buffer"
+                                  " size");
+    }
+  }
+
+  DriverProgramConfig()
+    : pc_control_port_(0), float_conversion_(1.0), stop_deceleration_(1.0),
+      speed_acceleration_(1.0), speed_command_wait_(0.008),
+      servoj_lookahead_time_(0.1), waypoint_buffer_size_(0),
+      waypoint_low_water_mark_(0) {}
+
+  inline const std::string& PcIpAddress() const { return pc_ip_address_; }
+
+  inline int32_t PcControlPort() const { return pc_control_port_; }
+
+  inline double FloatConversion() const { return float_conversion_; }
+
+  inline double StopDeceleration() const { return stop_deceleration_; }
+
+  inline double SpeedAcceleration() const { return speed_acceleration_; }
+
+  inline double SpeedCommandWait() const { return speed_command_wait_; }
+
+  inline double ServoJLookaheadTime() const { return servoj_lookahead_time_; }
+
+  inline size_t WaypointBufferSize() const
+  { return static_cast<size_t>(waypoint_buffer_size_); }
+
+  inline size_t WaypointLowWaterMark() const
+  { return static_cast<size_t>(waypoint_low_water_mark_); }
+};
+
+template<typename Layout>
+void EncodeRealtimePacket(
+    const std::array<Array6d, kNumRealtimeFields>& field_values,
+    std::vector<uint8_t>& packet)
+{
+  constexpr size_t num_doubles
+      = (Layout::kMessageLength - sizeof(int32_t)) / sizeof(double);
+  std::array<double, num_doubles> payload;
+  payload.fill(0.0);
+  for (uint32_t field = 0; field < kNumRealtimeFields; field++)
+  {
+    const uint32_t field_offset = Layout::kFieldOffsets[field];
+    if (field_offset != kAbsentRealtimeField)
+    {
+      std::memcpy(payload.data() + field_offset, field_values[field].data(),
+                  kRealtimeFieldSizes[field] * sizeof(double));
+    }
+  }
+  packet.resize(Layout::kMessageLength);
+  const uint32_t network_length = htobe32(Layout::kMessageLength);
+  std::memcpy(packet.data(), &network_length, sizeof(network_length));
+  for (size_t idx = 0; idx < num_doubles; idx++)
+  {
+    uint64_t host_bits = 0;
+    std::memcpy(&host_bits, payload.data() + idx, sizeof(host_bits));
+    const uint64_t network_bits = htobe64(host_bits);
+    std::memcpy(packet.data() + sizeof(int32_t) + (idx * sizeof(double)),
+                &network_bits, sizeof(network_bits));
+  }
+}
+
+// Appends value to a primary interface message in network byte order
+template<typename T>
+void AppendBigEndian(const T value, std::vector<uint8_t>& message)
+{
+  uint8_t bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+  std::reverse(bytes, bytes + sizeof(T));
+#endif
+  message.insert(message.end(), bytes, bytes + sizeof(T));
+}
+
+// Appends the header of a primary interface message or package, returning
+// its offset for EndPrimaryPackage()
+size_t BeginPrimaryPackage(const uint8_t type, std::vector<uint8_t>& message)
+{
+  const size_t package_start = message.size();
+  AppendBigEndian<int32_t>(0, message);
+  message.push_back(type);
+  return package_start;
+}
+
+void EndPrimaryPackage(const size_t package_start,
+                       std::vector<uint8_t>& message)
+{
+  const uint32_t network_length
+      = htobe32(static_cast<uint32_t>(message.size() - package_start));
+  std::memcpy(message.data() + package_start, &network_length,
+              sizeof(network_length));
+}
+
+// Set by the SIGUSR1 handler and handled on the next tick
+volatile sig_atomic_t protective_stop_requested = 0;
+
+void RequestProtectiveStop(int)
+{
+  protective_stop_requested = 1;
+}
+
+class URControllerEmulator
+{
+private:
+
+  struct RealtimeClient
+  {
+    int fd;
+    std::string script_buffer;
+    std::string program;
+    bool in_program;
+  };
+
+  struct RTDEClient
+  {
+    int fd;
+    std::vector<uint8_t> buffer;
+    // Fields of the output recipe, or kNumRealtimeFields where the variable
+    // was not found
+    std::vector<uint32_t> output_fields;
+    uint64_t ticks_per_package;
+    uint64_t ticks_since_package;
+    std::vector<URRTDEDataType> input_types;
+    std::vector<double> input_registers;
+    uint64_t input_packages_received;
+    bool streaming;
+  };
+
+  static constexpr uint8_t kRTDEOutputRecipeId = 1;
+  static constexpr uint8_t kRTDEInputRecipeId = 2;
+  static constexpr uint32_t kNumRTDEInputIntRegisters = 48;
+  static constexpr uint32_t kNumRTDEInputDoubleRegisters = 48;
+  static constexpr uint32_t kFirstRTDEInputBitRegister = 64;
+  static constexpr uint32_t kLastRTDEInputBitRegister = 127;
+
+  // Six targets, six wrench values, six force mode limits, six force mode
+  // selections, control mode, force mode and running flag
+  static constexpr size_t kControlFrameSize = 27 * sizeof(int32_t);
+  static constexpr int32_t kControlModeIdle = 0;
+  static constexpr int32_t kControlModeTeach = 1;
+  static constexpr int32_t kControlModeSpeedJ = 2;
+  static constexpr int32_t kControlModeSpeedL = 3;
+  static constexpr int32_t kControlModeServoJ = 5;
+  static constexpr int32_t kControlModeWaypoints = 6;
+  static constexpr double kControlConnectTimeout = 5.0;
+  static constexpr double kPrimaryStateRate = 10.0;
+  static constexpr int8_t kPrimaryMessageSourceController = -2;
+
+  std::string listen_address_;
+  double rate_;
+  EmulatedArm arm_;
+  double controller_uptime_;
+  uint64_t missed_ticks_;
+  int epoll_fd_;
+  int timer_fd_;
+  int listen_fd_;
+  std::map<int, RealtimeClient> clients_;
+  int rtde_listen_fd_;
+  std::map<int, RTDEClient> rtde_clients_;
+  int primary_listen_fd_;
+  int secondary_listen_fd_;
+  // Primary and secondary clients, and whether each is a primary client
+  std::map<int, bool> primary_clients_;
+  uint64_t ticks_since_primary_state_;
+  int dashboard_listen_fd_;
+  // Partially received request line of each dashboard client
+  std::map<int, std::string> dashboard_clients_;
+  bool protective_stopped_;
+  // Connection of the running ur_driver_program back to the control port
+  DriverProgramConfig driver_program_config_;
+  int control_fd_;
+  bool control_connected_;
+  double control_connect_deadline_;
+  // Where the running driver program calls socket_open, for reporting its
+  // failure as a runtime exception
+  int32_t socket_open_line_;
+  int32_t socket_open_column_;
+  std::vector<uint8_t> control_buffer_;
+  uint64_t control_frames_received_;
+  EmulatedWaypointBuffer waypoint_buffer_;
+  bool waypoint_mode_;
+  // Set when the command thread enters waypoint mode from another mode
+  bool waypoint_mode_entered_;
+  std::vector<uint8_t> packet_;
+
+  void AddToEpoll(const int fd, const uint32_t events)
+  {
+    struct epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+      throw std::runtime_error("Failed to add fd to epoll instance");
+    }
+  }
+
+  int OpenListenSocket(const uint16_t port)
+  {
+    const int listen_fd
+        = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+      throw std::runtime_error("Failed to create listen socket");
+    }
+    const int enable_flag = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable_flag,
+               sizeof(enable_flag));
+    struct sockaddr_in listen_addr;
+    std::memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, listen_address_.c_str(),
+                  &listen_addr.sin_addr) != 1)
+    {
+      throw std::invalid_argument("Invalid listen address "
+                                  + listen_address_);
+    }
+    listen_addr.sin_port = htons(port);
+    if ((bind(listen_fd, reinterpret_cast<struct sockaddr*>(&listen_addr),
+              sizeof(listen_addr)) != 0)
+        || (listen(listen_fd, 4) != 0))
+    {
+      throw std::runtime_error("Failed to listen on port "
+                               + std::to_string(port) + ": "
+                               + std::string(strerror(errno)));
+    }
+    AddToEpoll(listen_fd, EPOLLIN);
+    return listen_fd;
+  }
+
+  void AcceptClient()
+  {
+    const int client_fd
+        = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0)
+    {
+      return;
+    }
+    const int enable_flag = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &enable_flag,
+               sizeof(enable_flag));
+    AddToEpoll(client_fd, EPOLLIN | EPOLLRDHUP);
+    clients_[client_fd] = RealtimeClient{client_fd, "", "", false};
+    printf("Accepted realtime client %d\n", client_fd);
+  }
+
+  void CloseClient(const int client_fd)
+  {
+    close(client_fd);
+    clients_.erase(client_fd);
+    printf("Closed realtime client %d\n", client_fd);
+  }
+
+  void ReadClient(RealtimeClient& client)
+  {
+    char buffer[4096];
+    const ssize_t bytes_read = read(client.fd, buffer, sizeof(buffer));
+    if (bytes_read <= 0)
+    {
+      if ((bytes_read == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+      {
+        CloseClient(client.fd);
+      }
+      return;
+    }
+    client.script_buffer.append(buffer, static_cast<size_t>(bytes_read));
+    // Top-level lines are single statement programs, while "def" starts a
+    // program that runs once its closing unindented "end" arrives
+    size_t line_end = client.script_buffer.find('\n');
+    while (line_end != std::string::npos)
+    {
+      const std::string line = client.script_buffer.substr(0, line_end);
+      client.script_buffer.erase(0, line_end + 1);
+      if (client.in_program)
+      {
+        client.program += line + "\n";
+        if (line == "end")
+        {
+          client.in_program = false;
+          RunProgram(client.program);
+        }
+      }
+      else if (line.compare(0, 4, "def ") == 0)
+      {
+        client.in_program = true;
+        client.program = line + "\n";
+      }
+      else if (!line.empty())
+      {
+        RunStatement(line);
+      }
+      line_end = client.script_buffer.find('\n');
+    }
+  }
+
+  void AcceptRTDEClient()
+  {
+    const int client_fd = accept4(rtde_listen_fd_, nullptr, nullptr,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0)
+    {
+      return;
+    }
+    const int enable_flag = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &enable_flag,
+               sizeof(enable_flag));
+    AddToEpoll(client_fd, EPOLLIN | EPOLLRDHUP);
+    RTDEClient client;
+    client.fd = client_fd;
+    client.ticks_per_package = 1;
+    client.ticks_since_package = 0;
+    client.input_packages_received = 0;
+    client.streaming = false;
+    rtde_clients_[client_fd] = client;
+    printf("Accepted RTDE client %d\n", client_fd);
+  }
+
+  void CloseRTDEClient(const int client_fd)
+  {
+    const auto found_itr = rtde_clients_.find(client_fd);
+    if (found_itr == rtde_clients_.end())
+    {
+      return;
+    }
+    const RTDEClient& client = found_itr->second;
+    std::string registers;
+    for (const double value : client.input_registers)
+    {
+      registers += (registers.empty() ? "" : ", ") + std::to_string(value);
+    }
+    printf("Closed RTDE client %d after %lu input packages, last inputs [%s]\n",
+           client_fd,
+           static_cast<unsigned long>(client.input_packages_received),
+           registers.c_str());
+    close(client_fd);
+    rtde_clients_.erase(found_itr);
+  }
+
+  // Software version matching the packets streamed on the realtime port
+  inline uint8_t MajorVersion() const { return (rate_ > 250.0) ? 5 : 3; }
+
+  inline uint8_t MinorVersion() const { return (rate_ > 250.0) ? 4 : 5; }
+
+  inline bool DriverProgramRunning() const
+  { return control_connect_deadline_ >= 0.0; }
+
+  bool SendRTDEPackage(const int client_fd, const URRTDEPackageType type,
+                       const std::vector<uint8_t>& payload)
+  {
+    const std::vector<uint8_t> package = MakeRTDEPackage(type, payload);
+    return send(client_fd, package.data(), package.size(), MSG_NOSIGNAL)
+           == static_cast<ssize_t>(package.size());
+  }
+
+  static URRTDEDataType RTDEInputType(const std::string& variable_name)
+  {
+    unsigned int index = 0;
+    char trailing = '\0';
+    if ((sscanf(variable_name.c_str(), "input_int_register_%u%c", &index,
+                &trailing) == 1)
+        && (index < kNumRTDEInputIntRegisters))
+    {
+      return kRTDEInt32;
+    }
+    if ((sscanf(variable_name.c_str(), "input_double_register_%u%c", &index,
+                &trailing) == 1)
+        && (index < kNumRTDEInputDoubleRegisters))
+    {
+      return kRTDEDouble;
+    }
+    if ((sscanf(variable_name.c_str(), "input_bit_register_%u%c", &index,
+                &trailing) == 1)
+        && (index >= kFirstRTDEInputBitRegister)
+        && (index <= kLastRTDEInputBitRegister))
+    {
+      return kRTDEBool;
+    }
+    return kRTDENotFound;
+  }
+
+  // Handles one package from an RTDE client, returning false if the client
+  // should be closed
+  bool HandleRTDEPackage(RTDEClient& client, const uint8_t type,
+                         const std::vector<uint8_t>& payload)
+  {
+    const auto join_types = [] (const std::vector<URRTDEDataType>& types)
+    {
+      std::string joined;
+      for (const URRTDEDataType data_type : types)
+      {
+        joined += (joined.empty() ? "" : ",")
+                  + std::string(RTDEDataTypeName(data_type));
+      }
+      return joined;
+    };
+    if ((type == kRTDERequestProtocolVersion) && (payload.size() >= 2))
+    {
+      const uint16_t version
+          = static_cast<uint16_t>((payload[0] << 8) | payload[1]);
+      const uint8_t accepted = (version == kRTDEProtocolVersion) ? 1 : 0;
+      return SendRTDEPackage(client.fd, kRTDERequestProtocolVersion,
+                             std::vector<uint8_t>(1, accepted));
+    }
+    else if (type == kRTDEGetURControlVersion)
+    {
+      std::vector<uint8_t> version(4 * sizeof(uint32_t), 0x00);
+      const std::array<uint32_t, 4> parts = {{MajorVersion(), MinorVersion(),
+                                              0, 0}};
+      for (size_t idx = 0; idx < parts.size(); idx++)
+      {
+        const uint32_t network_value = htobe32(parts[idx]);
+        std::memcpy(version.data() + (idx * sizeof(uint32_t)),
+                    &network_value, sizeof(network_value));
+      }
+      return SendRTDEPackage(client.fd, kRTDEGetURControlVersion, version);
+    }
+    else if ((type == kRTDEControlPackageSetupOutputs)
+             && (payload.size() > sizeof(double)))
+    {
+      double frequency = 0.0;
+      RTDEValueToDoubles(kRTDEDouble, payload.data(), &frequency);
+      if ((frequency <= 0.0) || (frequency > rate_))
+      {
+        printf("Rejecting RTDE output frequency %f Hz\n", frequency);
+        return false;
+      }
+      client.ticks_per_package = static_cast<uint64_t>(
+          std::max(1.0, std::round(rate_ / frequency)));
+      client.output_fields.clear();
+      std::vector<URRTDEDataType> types;
+      const std::string variable_names(payload.begin() + sizeof(double),
+                                       payload.end());
+      for (const std::string& variable_name
+           : SplitRTDEVariableList(variable_names))
+      {
+        uint32_t found_field = kNumRealtimeFields;
+        for (uint32_t field = 0; field < kNumRealtimeFields; field++)
+        {
+          if (variable_name == kRTDEFieldNames[field])
+          {
+            found_field = field;
+          }
+        }
+        client.output_fields.push_back(found_field);
+        types.push_back((found_field < kNumRealtimeFields)
+                        ? kRTDEFieldTypes[found_field] : kRTDENotFound);
+      }
+      const std::string joined_types = join_types(types);
+      std::vector<uint8_t> response(1, kRTDEOutputRecipeId);
+      response.insert(response.end(), joined_types.begin(),
+                      joined_types.end());
+      return SendRTDEPackage(client.fd, kRTDEControlPackageSetupOutputs,
+                             response);
+    }
+    else if ((type == kRTDEControlPackageSetupInputs) && !payload.empty())
+    {
+      client.input_types.clear();
+      const std::string variable_names(payload.begin(), payload.end());
+      for (const std::string& variable_name
+           : SplitRTDEVariableList(variable_names))
+      {
+        client.input_types.push_back(RTDEInputType(variable_name));
+      }
+      client.input_registers.assign(client.input_types.size(), 0.0);
+      const std::string joined_types = join_types(client.input_types);
+      std::vector<uint8_t> response(1, kRTDEInputRecipeId);
+      response.insert(response.end(), joined_types.begin(),
+                      joined_types.end());
+      return SendRTDEPackage(client.fd, kRTDEControlPackageSetupInputs,
+                             response);
+    }
+    else if ((type == kRTDEControlPackageStart)
+             || (type == kRTDEControlPackagePause))
+    {
+      const bool has_outputs
+          = !client.output_fields.empty()
+            && (std::find(client.output_fields.begin(),
+                          client.output_fields.end(), kNumRealtimeFields)
+                == client.output_fields.end());
+      const bool start = (type == kRTDEControlPackageStart);
+      const uint8_t accepted = (!start || has_outputs) ? 1 : 0;
+      client.streaming = start && has_outputs;
+      client.ticks_since_package = 0;
+      if (client.streaming)
+      {
+        printf("RTDE client %d streaming %zu outputs every %lu ticks\n",
+               client.fd, client.output_fields.size(),
+               static_cast<unsigned long>(client.ticks_per_package));
+      }
+      return SendRTDEPackage(client.fd, static_cast<URRTDEPackageType>(type),
+                             std::vector<uint8_t>(1, accepted));
+    }
+    else if ((type == kRTDEDataPackage) && !payload.empty()
+             && (payload[0] == kRTDEInputRecipeId))
+    {
+      size_t offset = 1;
+      for (size_t idx = 0; idx < client.input_types.size(); idx++)
+      {
+        const URRTDEDataType input_type = client.input_types[idx];
+        if ((input_type == kRTDENotFound)
+            || ((offset + RTDEDataTypeSize(input_type)) > payload.size()))
+        {
+          printf("Ignoring malformed RTDE input package\n");
+          return true;
+        }
+        RTDEValueToDoubles(input_type, payload.data() + offset,
+                           &client.input_registers[idx]);
+        offset += RTDEDataTypeSize(input_type);
+      }
+      client.input_packages_received++;
+      return true;
+    }
+    printf("Ignoring RTDE package of type %c with %zu byte payload\n",
+           static_cast<char>(type), payload.size());
+    return true;
+  }
+
+  void ReadRTDEClient(RTDEClient& client)
+  {
+    uint8_t buffer[4096];
+    const ssize_t bytes_read = read(client.fd, buffer, sizeof(buffer));
+    if (bytes_read <= 0)
+    {
+      if ((bytes_read == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+      {
+        CloseRTDEClient(client.fd);
+      }
+      return;
+    }
+    client.buffer.insert(client.buffer.end(), buffer, buffer + bytes_read);
+    size_t package_start = 0;
+    while ((client.buffer.size() - package_start) >= kRTDEHeaderSize)
+    {
+      const size_t package_size
+          = static_cast<size_t>((client.buffer[package_start] << 8)
+                                | client.buffer[package_start + 1]);
+      if (package_size < kRTDEHeaderSize)
+      {
+        printf("Closing RTDE client sending invalid package size %zu\n",
+               package_size);
+        CloseRTDEClient(client.fd);
+        return;
+      }
+      if ((client.buffer.size() - package_start) < package_size)
+      {
+        break;
+      }
+      const uint8_t type = client.buffer[package_start + 2];
+      const std::vector<uint8_t> payload(
+          client.buffer.begin()
+          + static_cast<std::ptrdiff_t>(package_start + kRTDEHeaderSize),
+          client.buffer.begin()
+          + static_cast<std::ptrdiff_t>(package_start + package_size));
+      package_start += package_size;
+      if (!HandleRTDEPackage(client, type, payload))
+      {
+        CloseRTDEClient(client.fd);
+        return;
+      }
+    }
+    client.buffer.erase(client.buffer.begin(),
+                        client.buffer.begin()
+                        + static_cast<std::ptrdiff_t>(package_start));
+  }
+
+  void StreamRTDEOutputs(
+      const std::array<Array6d, kNumRealtimeFields>& field_values)
+  {
+    std::vector<int> failed_clients;
+    for (auto itr = rtde_clients_.begin(); itr != rtde_clients_.end(); ++itr)
+    {
+      RTDEClient& client = itr->second;
+      if (!client.streaming)
+      {
+        continue;
+      }
+      client.ticks_since_package++;
+      if (client.ticks_since_package < client.ticks_per_package)
+      {
+        continue;
+      }
+      client.ticks_since_package = 0;
+      std::vector<uint8_t> payload(1, kRTDEOutputRecipeId);
+      for (const uint32_t field : client.output_fields)
+      {
+        const URRTDEDataType type = kRTDEFieldTypes[field];
+        const size_t offset = payload.size();
+        payload.resize(offset + RTDEDataTypeSize(type), 0x00);
+        DoublesToRTDEValue(type, field_values[field].data(),
+                           payload.data() + offset);
+      }
+      // A client that cannot keep up is dropped, rather than buffered
+      if (!SendRTDEPackage(client.fd, kRTDEDataPackage, payload))
+      {
+        failed_clients.push_back(client.fd);
+      }
+    }
+    for (const int client_fd : failed_clients)
+    {
+      CloseRTDEClient(client_fd);
+    }
+  }
+
+  void AcceptPrimaryClient(const int listen_fd)
+  {
+    const int client_fd = accept4(listen_fd, nullptr, nullptr,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0)
+    {
+      return;
+    }
+    const int enable_flag = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &enable_flag,
+               sizeof(enable_flag));
+    AddToEpoll(client_fd, EPOLLIN | EPOLLRDHUP);
+    const bool is_primary = (listen_fd == primary_listen_fd_);
+    primary_clients_[client_fd] = is_primary;
+    printf("Accepted %s client %d\n", is_primary ? "primary" : "secondary",
+           client_fd);
+    if (!SendPrimaryMessage(client_fd, MakeVersionMessage()))
+    {
+      ClosePrimaryClient(client_fd);
+    }
+  }
+
+  void ClosePrimaryClient(const int client_fd)
+  {
+    const auto found_itr = primary_clients_.find(client_fd);
+    if (found_itr == primary_clients_.end())
+    {
+      return;
+    }
+    printf("Closed %s client %d\n",
+           found_itr->second ? "primary" : "secondary", client_fd);
+    close(client_fd);
+    primary_clients_.erase(found_itr);
+  }
+
+  void ReadPrimaryClient(const int client_fd)
+  {
+    // URScript sent to these ports is not run, so input is only drained
+    char buffer[4096];
+    const ssize_t bytes_read = read(client_fd, buffer, sizeof(buffer));
+    if ((bytes_read == 0)
+        || ((bytes_read < 0) && (errno != EAGAIN) && (errno != EINTR)))
+    {
+      ClosePrimaryClient(client_fd);
+    }
+  }
+
+  static bool SendPrimaryMessage(const int client_fd,
+                                 const std::vector<uint8_t>& message)
+  {
+    return send(client_fd, message.data(), message.size(), MSG_NOSIGNAL)
+           == static_cast<ssize_t>(message.size());
+  }
+
+  // Sends message to primary clients, and to secondary clients unless
+  // primary_only is set
+  void BroadcastPrimaryMessage(const std::vector<uint8_t>& message,
+                               const bool primary_only)
+  {
+    std::vector<int> failed_clients;
+    for (auto itr = primary_clients_.begin(); itr != primary_clients_.end();
+         ++itr)
+    {
+      // A client that cannot keep up is dropped, rather than buffered
+      if ((itr->second || !primary_only)
+          && !SendPrimaryMessage(itr->first, message))
+      {
+        failed_clients.push_back(itr->first);
+      }
+    }
+    for (const int client_fd : failed_clients)
+    {
+      ClosePrimaryClient(client_fd);
+    }
+  }
+
+  // Starts a robot message of message_type, returning its offset for
+  // EndPrimaryPackage()
+  size_t BeginRobotMessage(const URPrimaryRobotMessageType message_type,
+                           std::vector<uint8_t>& message) const
+  {
+    const size_t message_start
+        = BeginPrimaryPackage(kPrimaryRobotMessage, message);
+    AppendBigEndian<uint64_t>(
+        static_cast<uint64_t>(controller_uptime_ * 1e6), message);
+    AppendBigEndian<int8_t>(kPrimaryMessageSourceController, message);
+    message.push_back(message_type);
+    return message_start;
+  }
+
+  std::vector<uint8_t> MakeVersionMessage() const
+  {
+    const std::string project_name = "URControl";
+    const std::string build_date = "emulated";
+    std::vector<uint8_t> message;
+    const size_t message_start
+        = BeginRobotMessage(kPrimaryVersionMessage, message);
+    message.push_back(static_cast<uint8_t>(project_name.size()));
+    message.insert(message.end(), project_name.begin(), project_name.end());
+    message.push_back(MajorVersion());
+    message.push_back(MinorVersion());
+    // Bugfix version and build number
+    AppendBigEndian<int32_t>(0, message);
+    AppendBigEndian<int32_t>(0, message);
+    message.insert(message.end(), build_date.begin(), build_date.end());
+    EndPrimaryPackage(message_start, message);
+    return message;
+  }
+
+  std::vector<uint8_t> MakeRobotStateMessage() const
+  {
+    std::vector<uint8_t> message;
+    const size_t message_start
+        = BeginPrimaryPackage(kPrimaryRobotState, message);
+    const size_t mode_start
+        = BeginPrimaryPackage(kPrimaryRobotModeData, message);
+    AppendBigEndian<uint64_t>(
+        static_cast<uint64_t>(controller_uptime_ * 1e6), message);
+    // Real robot connected, real robot enabled, powered on, emergency
+    // stopped, protective stopped, program running, program paused
+    const std::array<bool, 7> flags = {{true, true, true, false,
+                                        protective_stopped_,
+                                        DriverProgramRunning(), false}};
+    for (const bool flag : flags)
+    {
+      message.push_back(flag ? 1 : 0);
+    }
+    AppendBigEndian<int8_t>(kRobotModeRunning, message);
+    // Control mode position
+    message.push_back(0);
+    // Target speed fraction, speed scaling and target speed fraction limit
+    AppendBigEndian<double>(1.0, message);
+    AppendBigEndian<double>(1.0, message);
+    AppendBigEndian<double>(1.0, message);
+    if (MajorVersion() >= 5)
+    {
+      // Reserved
+      message.push_back(0);
+    }
+    EndPrimaryPackage(mode_start, message);
+    const size_t joint_start
+        = BeginPrimaryPackage(kPrimaryJointData, message);
+    for (size_t idx = 0; idx < 6; idx++)
+    {
+      AppendBigEndian<double>(arm_.Position()[idx], message);
+      AppendBigEndian<double>(arm_.Position()[idx], message);
+      AppendBigEndian<double>(arm_.Velocity()[idx], message);
+      // Current, voltage, motor and microcontroller temperatures
+      AppendBigEndian<float>(0.0f, message);
+      AppendBigEndian<float>(48.0f, message);
+      AppendBigEndian<float>(35.0f, message);
+      AppendBigEndian<float>(35.0f, message);
+      message.push_back(static_cast<uint8_t>(kJointModeRunning));
+    }
+    EndPrimaryPackage(joint_start, message);
+    const size_t tool_start = BeginPrimaryPackage(kPrimaryToolData, message);
+    // Analog input ranges and values
+    AppendBigEndian<int8_t>(0, message);
+    AppendBigEndian<int8_t>(0, message);
+    AppendBigEndian<double>(0.0, message);
+    AppendBigEndian<double>(0.0, message);
+    // 48V supply, output voltage, current, temperature and mode
+    AppendBigEndian<float>(48.0f, message);
+    message.push_back(0);
+    AppendBigEndian<float>(0.0f, message);
+    AppendBigEndian<float>(35.0f, message);
+    message.push_back(static_cast<uint8_t>(kJointModeRunning));
+    EndPrimaryPackage(tool_start, message);
+    EndPrimaryPackage(message_start, message);
+    return message;
+  }
+
+  void SendRuntimeException(const int32_t line_number,
+                            const int32_t column_number,
+                            const std::string& text)
+  {
+    std::vector<uint8_t> message;
+    const size_t message_start
+        = BeginRobotMessage(kPrimaryRuntimeExceptionMessage, message);
+    AppendBigEndian<int32_t>(line_number, message);
+    AppendBigEndian<int32_t>(column_number, message);
+    message.insert(message.end(), text.begin(), text.end());
+    EndPrimaryPackage(message_start, message);
+    BroadcastPrimaryMessage(message, true);
+  }
+
+  void StreamPrimaryState()
+  {
+    ticks_since_primary_state_++;
+    if (static_cast<double>(ticks_since_primary_state_)
+        < (rate_ / kPrimaryStateRate))
+    {
+      return;
+    }
+    ticks_since_primary_state_ = 0;
+    if (!primary_clients_.empty())
+    {
+      BroadcastPrimaryMessage(MakeRobotStateMessage(), false);
+    }
+  }
+
+  void AcceptDashboardClient()
+  {
+    const int client_fd = accept4(dashboard_listen_fd_, nullptr, nullptr,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0)
+    {
+      return;
+    }
+    AddToEpoll(client_fd, EPOLLIN | EPOLLRDHUP);
+    dashboard_clients_[client_fd] = "";
+    printf("Accepted dashboard client %d\n", client_fd);
+    SendDashboardReply(client_fd,
+                       "Connected: Universal Robots Dashboard Server");
+  }
+
+  void CloseDashboardClient(const int client_fd)
+  {
+    close(client_fd);
+    dashboard_clients_.erase(client_fd);
+    printf("Closed dashboard client %d\n", client_fd);
+  }
+
+  static void SendDashboardReply(const int client_fd, const std::string& reply)
+  {
+    // Failures are left for ReadDashboardClient to notice
+    const std::string line = reply + "\n";
+    send(client_fd, line.data(), line.size(), MSG_NOSIGNAL);
+  }
+
+  std::string HandleDashboardRequest(const std::string& request)
+  {
+    if (request == "robotmode")
+    {
+      return "Robotmode: RUNNING";
+    }
+    else if (request == "safetymode")
+    {
+      return protective_stopped_ ? "Safetymode: PROTECTIVE_STOP"
+                                 : "Safetymode: NORMAL";
+    }
+    else if (request == "unlock protective stop")
+    {
+      if (!protective_stopped_)
+      {
+        return "Cannot unlock protective stop, safety mode is not protective"
+               " stop";
+      }
+      protective_stopped_ = false;
+      printf("Protective stop unlocked\n");
+      return "Protective stop releasing";
+    }
+    else if (request == "close safety popup")
+    {
+      return "closing safety popup";
+    }
+    else if (request == "stop")
+    {
+      if (!DriverProgramRunning())
+      {
+        return "Failed to execute: stop";
+      }
+      StopDriverProgram();
+      return "Stopped";
+    }
+    else if (request == "play")
+    {
+      // Only programs sent as URScript are supported, and none is loaded
+      return "Failed to execute: play";
+    }
+    return "could not understand: '" + request + "'";
+  }
+
+  void ReadDashboardClient(const int client_fd)
+  {
+    char buffer[4096];
+    const ssize_t bytes_read = read(client_fd, buffer, sizeof(buffer));
+    if (bytes_read <= 0)
+    {
+      if ((bytes_read == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+      {
+        CloseDashboardClient(client_fd);
+      }
+      return;
+    }
+    std::string& request_buffer = dashboard_clients_[client_fd];
+    request_buffer.append(buffer, static_cast<size_t>(bytes_read));
+    size_t line_end = request_buffer.find('\n');
+    while (line_end != std::string::npos)
+    {
+      std::string request = request_buffer.substr(0, line_end);
+      request_buffer.erase(0, line_end + 1);
+      if (!request.empty() && (request.back() == '\r'))
+      {
+        request.pop_back();
+      }
+      SendDashboardReply(client_fd, HandleDashboardRequest(request));
+      line_end = request_buffer.find('\n');
+    }
+  }
+
+  void TriggerProtectiveStop()
+  {
+    if (protective_stopped_)
+    {
+      return;
+    }
+    protective_stopped_ = true;
+    printf("Protective stop\n");
+    std::vector<uint8_t> message;
+    const size_t message_start
+        = BeginRobotMessage(kPrimarySafetyModeMessage, message);
+    // Code, argument, safety mode, report data type and report data
+    AppendBigEndian<int32_t>(0, message);
+    AppendBigEndian<int32_t>(0, message);
+    message.push_back(static_cast<uint8_t>(kSafetyModeProtectiveStop));
+    AppendBigEndian<uint32_t>(0, message);
+    AppendBigEndian<uint32_t>(0, message);
+    const std::string text = "Protective stop triggered by SIGUSR1";
+    message.insert(message.end(), text.begin(), text.end());
+    EndPrimaryPackage(message_start, message);
+    BroadcastPrimaryMessage(message, true);
+    StopDriverProgram();
+  }
+
+  void RunStatement(const std::string& statement)
+  {
+    Array6d values;
+    double acceleration = 0.0;
+    double time = 0.0;
+    const int speedj_fields
+        = sscanf(statement.c_str(),
+                 " speedj([%lf , %lf , %lf , %lf , %lf , %lf ] , %lf , %lf )",
+                 &values[0], &values[1], &values[2], &values[3], &values[4],
+                 &values[5], &acceleration, &time);
+    if (speedj_fields >= 7)
+    {
+      arm_.SpeedJ(values, acceleration, (speedj_fields == 8) ? time : -1.0);
+      return;
+    }
+    const int speedl_fields
+        = sscanf(statement.c_str(),
+                 " speedl([%lf , %lf , %lf , %lf , %lf , %lf ] , %lf , %lf )",
+                 &values[0], &values[1], &values[2], &values[3], &values[4],
+                 &values[5], &acceleration, &time);
+    if (speedl_fields >= 7)
+    {
+      arm_.SpeedL(values, acceleration, (speedl_fields == 8) ? time : -1.0);
+      return;
+    }
+    if ((sscanf(statement.c_str(), " stopj( %lf )", &acceleration) == 1)
+        || (sscanf(statement.c_str(), " stopl( %lf )", &acceleration) == 1))
+    {
+      arm_.Stop(acceleration);
+      return;
+    }
+    printf("Ignoring unsupported URScript statement [%s]\n",
+           statement.substr(0, 80).c_str());
+  }
+
+  void RunProgram(const std::string& program)
+  {
+    // Like the real controller, a new program replaces the running one
+    StopDriverProgram();
+    if (protective_stopped_)
+    {
+      printf("Ignoring program sent while protective stopped\n");
+      return;
+    }
+    const size_t socket_open_position
+        = program.find("socket_open(PC_IP_ADDRESS, PC_CONTROL_PORT)");
+    if (socket_open_position == std::string::npos)
+    {
+      printf("Ignoring unsupported URScript program [%s]\n",
+             program.substr(0, program.find('\n')).c_str());
+      return;
+    }
+    try
+    {
+      driver_program_config_ = DriverProgramConfig(program);
+    }
+    catch (const std::invalid_argument& ex)
+    {
+      printf("Ignoring invalid driver program: %s\n", ex.what());
+      return;
+    }
+    waypoint_buffer_
+        = EmulatedWaypointBuffer(driver_program_config_.WaypointBufferSize(),
+                                 driver_program_config_.WaypointLowWaterMark());
+    waypoint_mode_ = false;
+    const size_t line_start
+        = program.rfind('\n', socket_open_position) + 1;
+    socket_open_line_ = static_cast<int32_t>(
+        std::count(program.begin(),
+                   program.begin()
+                   + static_cast<std::ptrdiff_t>(socket_open_position),
+                   '\n') + 1);
+    socket_open_column_
+        = static_cast<int32_t>(socket_open_position - line_start + 1);
+    printf("Running driver program, connecting to %s:%d\n",
+           driver_program_config_.PcIpAddress().c_str(),
+           driver_program_config_.PcControlPort());
+    // The driver only starts listening after uploading the program, so
+    // connection attempts are retried on each tick until the deadline
+    control_connect_deadline_ = controller_uptime_ + kControlConnectTimeout;
+    BeginControlConnect();
+  }
+
+  void BeginControlConnect()
+  {
+    control_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+    if (control_fd_ < 0)
+    {
+      throw std::runtime_error("Failed to create control socket");
+    }
+    struct sockaddr_in control_addr;
+    std::memset(&control_addr, 0, sizeof(control_addr));
+    control_addr.sin_family = AF_INET;
+    control_addr.sin_port
+        = htons(static_cast<uint16_t>(driver_program_config_.PcControlPort()));
+    if (inet_pton(AF_INET, driver_program_config_.PcIpAddress().c_str(),
+                  &control_addr.sin_addr) != 1)
+    {
+      printf("Invalid PC_IP_ADDRESS %s\n",
+             driver_program_config_.PcIpAddress().c_str());
+      StopDriverProgram();
+      return;
+    }
+    const int connect_res
+        = connect(control_fd_,
+                  reinterpret_cast<struct sockaddr*>(&control_addr),
+                  sizeof(control_addr));
+    if ((connect_res != 0) && (errno != EINPROGRESS))
+    {
+      close(control_fd_);
+      control_fd_ = -1;
+      return;
+    }
+    control_connected_ = false;
+    AddToEpoll(control_fd_, EPOLLOUT | EPOLLIN | EPOLLRDHUP);
+  }
+
+  void CompleteControlConnect()
+  {
+    int so_error_flag = 0;
+    socklen_t flag_len = sizeof(so_error_flag);
+    getsockopt(control_fd_, SOL_SOCKET, SO_ERROR, &so_error_flag, &flag_len);
+    if (so_error_flag != 0)
+    {
+      // Retried on the next tick
+      close(control_fd_);
+      control_fd_ = -1;
+      return;
+    }
+    struct epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = control_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, control_fd_, &event);
+    const int enable_flag = 1;
+    setsockopt(control_fd_, IPPROTO_TCP, TCP_NODELAY, &enable_flag,
+               sizeof(enable_flag));
+    control_connected_ = true;
+    control_buffer_.clear();
+    printf("Driver program connected to control port\n");
+  }
+
+  void StopDriverProgram()
+  {
+    if (control_fd_ >= 0)
+    {
+      close(control_fd_);
+      printf("Driver program stopped after %lu command frames\n",
+             static_cast<unsigned long>(control_frames_received_));
+      if (waypoint_buffer_.NumDropped() > 0)
+      {
+        printf("Driver program dropped %lu waypoints pushed to a full"
+               " buffer\n",
+               static_cast<unsigned long>(waypoint_buffer_.NumDropped()));
+      }
+    }
+    control_fd_ = -1;
+    waypoint_mode_ = false;
+    control_connected_ = false;
+    control_connect_deadline_ = -1.0;
+    control_frames_received_ = 0;
+    if (arm_.Mode() != EmulatedArm::kStopped)
+    {
+      arm_.Stop(driver_program_config_.StopDeceleration());
+    }
+  }
+
+  void ReadControl()
+  {
+    uint8_t buffer[4096];
+    const ssize_t bytes_read = read(control_fd_, buffer, sizeof(buffer));
+    if (bytes_read <= 0)
+    {
+      if ((bytes_read == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+      {
+        StopDriverProgram();
+      }
+      return;
+    }
+    control_buffer_.insert(control_buffer_.end(), buffer, buffer + bytes_read);
+    size_t frame_start = 0;
+    while ((control_buffer_.size() - frame_start) >= kControlFrameSize)
+    {
+      std::array<int32_t, 27> params;
+      for (size_t idx = 0; idx < params.size(); idx++)
+      {
+        uint32_t network_value = 0;
+        std::memcpy(&network_value,
+                    control_buffer_.data() + frame_start
+                    + (idx * sizeof(int32_t)),
+                    sizeof(network_value));
+        params[idx] = static_cast<int32_t>(be32toh(network_value));
+      }
+      frame_start += kControlFrameSize;
+      control_frames_received_++;
+      if (!ApplyControlFrame(params))
+      {
+        StopDriverProgram();
+        return;
+      }
+    }
+    control_buffer_.erase(control_buffer_.begin(),
+                          control_buffer_.begin()
+                          + static_cast<ssize_t>(frame_start));
+  }
+
+  // Returns false when the frame ends the program
+  bool ApplyControlFrame(const std::array<int32_t, 27>& params)
+  {
+    const double float_conversion = driver_program_config_.FloatConversion();
+    Array6d target;
+    for (size_t idx = 0; idx < 6; idx++)
+    {
+      target[idx] = static_cast<double>(params[idx]) / float_conversion;
+    }
+    const int32_t control_mode = params[24];
+    const bool running = (params[26] == 1);
+    if (!running)
+    {
+      return false;
+    }
+    // Waypoint batches carry up to three positions in place of the target,
+    // wrench and limits, with their durations, count and a clear flag in
+    // place of the selection vector
+    if (control_mode == kControlModeWaypoints)
+    {
+      if (params[22] == 1)
+      {
+        waypoint_buffer_.Clear();
+      }
+      const int32_t num_waypoints = std::max(0, std::min(params[21], 3));
+      for (int32_t waypoint = 0; waypoint < num_waypoints; waypoint++)
+      {
+        const size_t base = static_cast<size_t>(waypoint) * 6;
+        Array6d position;
+        for (size_t idx = 0; idx < 6; idx++)
+        {
+          position[idx]
+              = static_cast<double>(params[base + idx]) / float_conversion;
+        }
+        const double duration
+            = static_cast<double>(params[18 + static_cast<size_t>(waypoint)])
+              / 1000000.0;
+        waypoint_buffer_.Push(duration, position);
+      }
+      if (!waypoint_mode_)
+      {
+        waypoint_mode_ = true;
+        waypoint_mode_entered_ = true;
+      }
+      return true;
+    }
+    waypoint_mode_ = false;
+    // The program's command thread reissues speed and servo commands every
+    // cycle, so they last until the next command
+    if (control_mode == kControlModeSpeedJ)
+    {
+      arm_.SpeedJ(target, driver_program_config_.SpeedAcceleration(), -1.0);
+    }
+    else if (control_mode == kControlModeSpeedL)
+    {
+      arm_.SpeedL(target, driver_program_config_.SpeedAcceleration(), -1.0);
+    }
+    else if (control_mode == kControlModeServoJ)
+    {
+      arm_.ServoJ(target, driver_program_config_.ServoJLookaheadTime());
+    }
+    else if (control_mode == kControlModeTeach)
+    {
+      arm_.Teach();
+    }
+    else if (control_mode == kControlModeIdle)
+    {
+      arm_.Stop(driver_program_config_.StopDeceleration());
+    }
+    return true;
+  }
+
+  void Tick(const uint64_t expirations)
+  {
+    const double period = 1.0 / rate_;
+    // Missed ticks are still simulated, so uptime stays consistent
+    missed_ticks_ += expirations - 1;
+    for (uint64_t tick = 0; tick < expirations; tick++)
+    {
+      if (waypoint_mode_)
+      {
+        arm_.ServoJ(waypoint_buffer_.Step(period, arm_.Position(),
+                                          waypoint_mode_entered_),
+                    driver_program_config_.ServoJLookaheadTime());
+        waypoint_mode_entered_ = false;
+      }
+      arm_.Step(period);
+      controller_uptime_ += period;
+    }
+    int32_t num_consumed = 0;
+    if (waypoint_mode_ && control_connected_
+        && waypoint_buffer_.TakeReport(num_consumed))
+    {
+      // Failures are left for ReadControl to notice
+      const uint32_t network_value
+          = htobe32(static_cast<uint32_t>(num_consumed));
+      send(control_fd_, &network_value, sizeof(network_value), MSG_NOSIGNAL);
+    }
+    if ((control_fd_ < 0) && (control_connect_deadline_ >= 0.0))
+    {
+      if (controller_uptime_ < control_connect_deadline_)
+      {
+        BeginControlConnect();
+      }
+      else
+      {
+        printf("Driver program failed to connect to control port\n");
+        SendRuntimeException(socket_open_line_, socket_open_column_,
+                             "socket_open() failed to connect to "
+                             + driver_program_config_.PcIpAddress() + ":"
+                             + std::to_string(
+                                 driver_program_config_.PcControlPort()));
+        StopDriverProgram();
+      }
+    }
+    if (protective_stop_requested != 0)
+    {
+      protective_stop_requested = 0;
+      TriggerProtectiveStop();
+    }
+    StreamPrimaryState();
+    if (clients_.empty() && rtde_clients_.empty())
+    {
+      return;
+    }
+    const std::array<Array6d, kNumRealtimeFields> field_values
+        = MakeFieldValues();
+    StreamRTDEOutputs(field_values);
+    if (clients_.empty())
+    {
+      return;
+    }
+    if (rate_ > 250.0)
+    {
+      EncodeRealtimePacket<URRealtimeLayout1116>(field_values, packet_);
+    }
+    else
+    {
+      EncodeRealtimePacket<URRealtimeLayout1108>(field_values, packet_);
+    }
+    std::vector<int> failed_clients;
+    for (auto itr = clients_.begin(); itr != clients_.end(); ++itr)
+    {
+      const ssize_t written
+          = send(itr->first, packet_.data(), packet_.size(), MSG_NOSIGNAL);
+      // A client that cannot keep up is dropped, rather than buffered
+      if (written != static_cast<ssize_t>(packet_.size()))
+      {
+        failed_clients.push_back(itr->first);
+      }
+    }
+    for (const int client_fd : failed_clients)
+    {
+      CloseClient(client_fd);
+    }
+  }
+
+  std::array<Array6d, kNumRealtimeFields> MakeFieldValues() const
+  {
+    std::array<Array6d, kNumRealtimeFields> values;
+    for (size_t idx = 0; idx < values.size(); idx++)
+    {
+      values[idx].fill(0.0);
+    }
+    const std::array<Eigen::Isometry3d, 7> frames
+        = ComputeJointFrames(arm_.Position());
+    const Matrix6d jacobian = ComputeTcpJacobian(frames);
+    const Vector6d tcp_twist
+        = jacobian * Eigen::Map<const Vector6d>(arm_.Velocity().data());
+    const Vector6d target_tcp_twist
+        = jacobian * Eigen::Map<const Vector6d>(arm_.TargetVelocity().data());
+    const Array6d tcp_vector = TransformToTcpVector(frames[6]);
+    values[kControllerUptime][0] = controller_uptime_;
+    values[kTargetPosition] = arm_.Position();
+    values[kTargetVelocity] = arm_.TargetVelocity();
+    values[kTargetAcceleration] = arm_.Acceleration();
+    values[kActualPosition] = arm_.Position();
+    values[kActualVelocity] = arm_.Velocity();
+    values[kActualTcpPose] = tcp_vector;
+    values[kTargetTcpPose] = tcp_vector;
+    for (size_t idx = 0; idx < 6; idx++)
+    {
+      const Eigen::Index row = static_cast<Eigen::Index>(idx);
+      values[kActualTcpTwist][idx] = tcp_twist(row);
+      values[kTargetTcpTwist][idx] = target_tcp_twist(row);
+    }
+    values[kMotorTemperature].fill(35.0);
+    values[kControllerRtLoopTime][0] = 0.0005;
+    values[kRobotMode][0] = kRobotModeRunning;
+    values[kJointMode].fill(kJointModeRunning);
+    const double safety_mode
+        = protective_stopped_ ? kSafetyModeProtectiveStop : kSafetyModeNormal;
+    values[kSafetyMode][0] = safety_mode;
+    values[kActualTcpAcceleration][2] = 9.81;
+    values[kTrajectoryLimiterSpeedScaling][0] = 1.0;
+    values[kMainboardVoltage][0] = 48.0;
+    values[kMotorboardVoltage][0] = 48.0;
+    values[kMainboardCurrent][0] = 1.0;
+    values[kJointVoltage].fill(48.0);
+    values[kProgramState][0]
+        = control_connected_ ? kProgramStatePlaying : kProgramStateStopped;
+    const Eigen::Vector3d elbow_position = frames[3].translation();
+    const Eigen::Vector3d elbow_velocity
+        = ComputeTcpJacobian(std::array<Eigen::Isometry3d, 7>{{
+              frames[0], frames[1], frames[2], frames[3], frames[3],
+              frames[3], frames[3]}}).block<3, 6>(0, 0)
+          * Eigen::Map<const Vector6d>(arm_.Velocity().data());
+    for (size_t idx = 0; idx < 3; idx++)
+    {
+      const Eigen::Index row = static_cast<Eigen::Index>(idx);
+      values[kElbowPosition][idx] = elbow_position(row);
+      values[kElbowVelocity][idx] = elbow_velocity(row);
+    }
+    values[kSafetyStatus][0] = safety_mode;
+    return values;
+  }
+
+public:
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  URControllerEmulator(const double rate, const Array6d& initial_position,
+                       const std::string& listen_address)
+    : listen_address_(listen_address), rate_(rate), arm_(initial_position),
+      controller_uptime_(0.0), missed_ticks_(0), ticks_since_primary_state_(0),
+      protective_stopped_(false), control_fd_(-1),
+      control_connected_(false), control_connect_deadline_(-1.0),
+      socket_open_line_(0), socket_open_column_(0),
+      control_frames_received_(0), waypoint_mode_(false),
+      waypoint_mode_entered_(false)
+  {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if ((epoll_fd_ < 0) || (timer_fd_ < 0))
+    {
+      throw std::runtime_error("Failed to create emulator fds");
+    }
+    listen_fd_ = OpenListenSocket(kRealtimePort);
+    rtde_listen_fd_ = OpenListenSocket(kRTDEPort);
+    primary_listen_fd_ = OpenListenSocket(kPrimaryInterfacePort);
+    secondary_listen_fd_ = OpenListenSocket(kSecondaryInterfacePort);
+    dashboard_listen_fd_ = OpenListenSocket(kDashboardServerPort);
+    AddToEpoll(timer_fd_, EPOLLIN);
+  }
+
+  ~URControllerEmulator()
+  {
+    StopDriverProgram();
+    for (auto itr = clients_.begin(); itr != clients_.end(); ++itr)
+    {
+      close(itr->first);
+    }
+    for (auto itr = rtde_clients_.begin(); itr != rtde_clients_.end(); ++itr)
+    {
+      close(itr->first);
+    }
+    for (auto itr = primary_clients_.begin(); itr != primary_clients_.end();
+         ++itr)
+    {
+      close(itr->first);
+    }
+    for (auto itr = dashboard_clients_.begin();
+         itr != dashboard_clients_.end(); ++itr)
+    {
+      close(itr->first);
+    }
+    close(dashboard_listen_fd_);
+    close(secondary_listen_fd_);
+    close(primary_listen_fd_);
+    close(rtde_listen_fd_);
+    close(listen_fd_);
+    close(timer_fd_);
+    close(epoll_fd_);
+  }
+
+  void Run()
+  {
+    const long period_ns = static_cast<long>(1e9 / rate_);
+    struct itimerspec timer_spec;
+    timer_spec.it_value.tv_sec = 0;
+    timer_spec.it_value.tv_nsec = period_ns;
+    timer_spec.it_interval = timer_spec.it_value;
+    if (timerfd_settime(timer_fd_, 0, &timer_spec, nullptr) != 0)
+    {
+      throw std::runtime_error("Failed to arm timerfd");
+    }
+    printf("Streaming realtime packets from %s at %f Hz on port %d, RTDE on"
+           " port %d, primary and secondary on ports %d and %d, dashboard"
+           " server on port %d\n",
+           listen_address_.c_str(), rate_, kRealtimePort, kRTDEPort,
+           kPrimaryInterfacePort, kSecondaryInterfacePort,
+           kDashboardServerPort);
+    double next_report_time = 1.0;
+    const int max_events = 16;
+    struct epoll_event events[max_events];
+    while (true)
+    {
+      const int num_events = epoll_wait(epoll_fd_, events, max_events, -1);
+      if (num_events < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw std::runtime_error("Failed to epoll_wait");
+      }
+      for (int idx = 0; idx < num_events; idx++)
+      {
+        const int event_fd = events[idx].data.fd;
+        if (event_fd == timer_fd_)
+        {
+          uint64_t expirations = 0;
+          if (read(timer_fd_, &expirations, sizeof(expirations))
+              == static_cast<ssize_t>(sizeof(expirations)))
+          {
+            Tick(expirations);
+          }
+        }
+        else if (event_fd == listen_fd_)
+        {
+          AcceptClient();
+        }
+        else if (event_fd == rtde_listen_fd_)
+        {
+          AcceptRTDEClient();
+        }
+        else if ((event_fd == primary_listen_fd_)
+                 || (event_fd == secondary_listen_fd_))
+        {
+          AcceptPrimaryClient(event_fd);
+        }
+        else if (event_fd == dashboard_listen_fd_)
+        {
+          AcceptDashboardClient();
+        }
+        else if ((event_fd == control_fd_) && (control_fd_ >= 0))
+        {
+          if (!control_connected_)
+          {
+            CompleteControlConnect();
+          }
+          else
+          {
+            ReadControl();
+          }
+        }
+        else
+        {
+          const auto found_itr = clients_.find(event_fd);
+          if (found_itr != clients_.end())
+          {
+            ReadClient(found_itr->second);
+          }
+          const auto found_rtde_itr = rtde_clients_.find(event_fd);
+          if (found_rtde_itr != rtde_clients_.end())
+          {
+            ReadRTDEClient(found_rtde_itr->second);
+          }
+          if (primary_clients_.count(event_fd) > 0)
+          {
+            ReadPrimaryClient(event_fd);
+          }
+          if (dashboard_clients_.count(event_fd) > 0)
+          {
+            ReadDashboardClient(event_fd);
+          }
+        }
+      }
+      if (controller_uptime_ >= next_report_time)
+      {
+        if (missed_ticks_ > 0)
+        {
+          printf("Missed %lu ticks so far\n",
+                 static_cast<unsigned long>(missed_ticks_));
+        }
+        next_report_time += 10.0;
+      }
+    }
+  }
+};
+
+constexpr uint8_t URControllerEmulator::kRTDEOutputRecipeId;
+constexpr uint8_t URControllerEmulator::kRTDEInputRecipeId;
+}  // namespace lightweight_ur_interface
+
+int main(int argc, char** argv)
+{
+  const double rate = (argc >= 2) ? std::atof(argv[1]) : 500.0;
+  // Emulators listening on different loopback addresses stand in for the
+  // arms of a multi-arm setup
+  const std::string listen_address = (argc >= 3) ? argv[2] : "0.0.0.0";
+  if ((argc > 3) || ((rate != 125.0) && (rate != 500.0)))
+  {
+    fprintf(stderr, "Usage: %s [125|500] [listen address]\n"
+                    "  125 Hz streams CB3 (3.5+) packets, 500 Hz streams"
+                    " e-Series packets\n", argv[0]);
+    return -1;
+  }
+  // Clients disconnecting mid-write must not kill the emulator
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR1, lightweight_ur_interface::RequestProtectiveStop);
+  const lightweight_ur_interface::Array6d initial_position
+      = {{0.0, -M_PI_2, M_PI_2, -M_PI_2, -M_PI_2, 0.0}};
+  lightweight_ur_interface::URControllerEmulator emulator(
+      rate, initial_position, listen_address);
+  emulator.Run();
+  return 0;
+}
@@ -8,7 +8,6 @@
 #include <iostream>
 #include <chrono>
 #include <thread>
-#include <mutex>
 #include <functional>
 #include <ros/ros.h>
 #include <std_srvs/SetBool.h>
@@ -16,12 +15,17 @@
 #include <geometry_msgs/PoseStamped.h>
 #include <geometry_msgs/TwistStamped.h>
 #include <geometry_msgs/WrenchStamped.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <lightweight_ur_interface/ur_robot_config.hpp>
 #include <lightweight_ur_interface/ur_minimal_realtime_driver.hpp>
+#include <lightweight_ur_interface/latest_value_channel.hpp>
+#include <lightweight_ur_interface/dispatch_thread.hpp>
 #include <lightweight_ur_interface/VelocityCommand.h>
 #include <common_robotics_utilities/print.hpp>
 #include <common_robotics_utilities/math.hpp>
 #include <common_robotics_utilities/ros_conversions.hpp>
+#include <tri_realtime_common/realtime_thread_config.hpp>
+#include <tri_realtime_common/ros_realtime_thread_config.hpp>
 
 namespace lightweight_ur_interface
 {
@@ -35,10 +39,20 @@ using common_robotics_utilities::utility::ClampValueAndWarn;
 using common_robotics_utilities::utility::CollectionsEqual;
 using common_robotics_utilities::utility::GetKeysFromMapLike;
 
+// Only the realtime fields published by PublishState are decoded
+constexpr URRealtimeFieldMask kPublishedRealtimeFields
+    = kMotionRealtimeFields
+      | RealtimeFieldBit(kTargetTorque)
+      | RealtimeFieldBit(kActualTcpTwist)
+      | RealtimeFieldBit(kActualTcpWrench);
+
 class URMinimalHardwareInterface
 {
 private:
 
+  static constexpr size_t STATE_PUBLISH_QUEUE_CAPACITY = 16;
+  static constexpr double DIAGNOSTICS_PERIOD = 1.0;
+
   std::string base_frame_;
   std::string ee_frame_;
   std::vector<std::string> joint_names_;
@@ -51,14 +65,24 @@ private:
   ros::Publisher ee_body_twist_pub_;
   ros::Publisher ee_world_twist_pub_;
   ros::Publisher ee_wrench_pub_;
+  ros::Publisher diagnostics_pub_;
   ros::Subscriber velocity_command_sub_;
   ros::Subscriber twist_command_sub_;
 
+  // Publishes states on its own thread, so the robot recv thread never waits
+  // on ROS message construction. Declared before robot_ptr_ so that the recv
+  // thread is stopped first.
+  std::unique_ptr<DispatchThread<
+      URRealtimeState, Eigen::aligned_allocator<URRealtimeState>>>
+          state_publisher_ptr_;
+  uint64_t reported_dropped_states_;
+  std::string robot_host_;
+  ros::Time last_diagnostics_time_;
+  uint64_t reported_gaps_;
+  // Written by the robot recv thread, read by ROS callbacks. Declared before
+  // robot_ptr_ so that the recv thread is stopped first.
+  LatestValueChannel<URRealtimeState> latest_state_channel_;
   std::unique_ptr<URRealtimeInterface> robot_ptr_;
-  std::mutex latest_state_mutex_;
-  bool valid_latest_state_;
-  sensor_msgs::JointState latest_joint_state_;
-  Eigen::Isometry3d latest_tcp_pose_;
 
 public:
 
@@ -73,14 +97,17 @@ public:
       const std::string& ee_world_twist_topic,
       const std::string& ee_body_twist_topic,
       const std::string& ee_wrench_topic,
+      const std::string& diagnostics_topic,
       const std::string& base_frame,
       const std::string& ee_frame,
       const std::vector<std::string>& ordered_joint_names,
       const std::map<std::string, JointLimits>& joint_limits,
-      const std::string& robot_host)
+      const std::string& robot_host,
+      const URRealtimeConnectionParams& connection_params,
+      const std::string& capture_file,
+      const tri_realtime_common::RealtimeThreadConfig& recv_thread_config)
     : nh_(nh)
   {
-    valid_latest_state_ = false;
     // Make sure our ordered joint names match our joint limits
     joint_names_ = ordered_joint_names;
     if (joint_names_.size() != 6)
@@ -124,6 +151,10 @@ public:
         = nh_.advertise<geometry_msgs::WrenchStamped>(ee_wrench_topic,
                                                       1,
                                                       false);
+    diagnostics_pub_
+        = nh_.advertise<diagnostic_msgs::DiagnosticArray>(diagnostics_topic,
+                                                          1,
+                                                          false);
     velocity_command_sub_
         = nh_.subscribe(velocity_command_topic,
                         1,
@@ -134,11 +165,26 @@ public:
                         1,
                         &URMinimalHardwareInterface::TwistCommandCallback,
                         this);
+    // Build state publisher
+    const std::function<void(const URRealtimeState&)> publish_fn
+        = [&] (const URRealtimeState& latest_state)
+    {
+      return PublishState(joint_names_, base_frame_, ee_frame_, latest_state);
+    };
+    state_publisher_ptr_ = std::unique_ptr<DispatchThread<
+        URRealtimeState, Eigen::aligned_allocator<URRealtimeState>>>(
+            new DispatchThread<
+                URRealtimeState, Eigen::aligned_allocator<URRealtimeState>>(
+                    STATE_PUBLISH_QUEUE_CAPACITY, publish_fn));
+    reported_dropped_states_ = 0;
+    robot_host_ = robot_host;
+    reported_gaps_ = 0;
     // Build robot interface
     const std::function<void(const URRealtimeState&)> callback_fn
         = [&] (const URRealtimeState& latest_state)
     {
-      return PublishState(joint_names_, base_frame_, ee_frame_, latest_state);
+      latest_state_channel_.Publish(latest_state);
+      state_publisher_ptr_->Dispatch(latest_state);
     };
     std::function<void(const std::string&)> logging_fn
         = [] (const std::string& message)
@@ -146,32 +192,129 @@ public:
       ROS_INFO("%s", message.c_str());
     };
     robot_ptr_ = std::unique_ptr<URRealtimeInterface>(
-                   new URRealtimeInterface(robot_host,
-                                           callback_fn,
-                                           logging_fn));
+                   new URRealtimeInterface(
+                       robot_host, callback_fn, logging_fn,
+                       connection_params,
+                       MakeRealtimeDecoderTable<kPublishedRealtimeFields>(),
+                       recv_thread_config));
+    if (!capture_file.empty())
+    {
+      robot_ptr_->StartCapture(capture_file);
+    }
   }
 
   void Run(const double control_rate)
   {
-    // Start robot interface
+    // Start state publisher and robot interface
+    state_publisher_ptr_->Start();
     robot_ptr_->StartRecv();
     // Start ROS spinloop
     ros::Rate looprate(control_rate);
     while (nh_.ok())
     {
       ros::spinOnce();
+      ReportDroppedStates();
+      const ros::Time now = ros::Time::now();
+      if ((now - last_diagnostics_time_).toSec() >= DIAGNOSTICS_PERIOD)
+      {
+        PublishDiagnostics(now);
+        last_diagnostics_time_ = now;
+      }
       looprate.sleep();
     }
     robot_ptr_->StopRecv();
   }
 
+  void ReportDroppedStates()
+  {
+    const uint64_t dropped_states = state_publisher_ptr_->DroppedCount();
+    if (dropped_states > reported_dropped_states_)
+    {
+      ROS_WARN_THROTTLE(1.0, "State publisher fell behind, dropped %lu states"
+                        " (%lu total)",
+                        dropped_states - reported_dropped_states_,
+                        dropped_states);
+      reported_dropped_states_ = dropped_states;
+    }
+  }
+
+  void PublishDiagnostics(const ros::Time& now)
+  {
+    const URRealtimeArrivalStatistics statistics
+        = robot_ptr_->ArrivalStatistics();
+    const auto make_value = [] (const std::string& key, const double value)
+    {
+      diagnostic_msgs::KeyValue key_value;
+      key_value.key = key;
+      key_value.value = std::to_string(value);
+      return key_value;
+    };
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = "UR realtime interface";
+    status.hardware_id = robot_host_;
+    if (!robot_ptr_->IsConnected())
+    {
+      status.level = diagnostic_msgs::DiagnosticStatus::STALE;
+      status.message = "Not connected";
+    }
+    else if (statistics.NumGaps() > reported_gaps_)
+    {
+      status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+      status.message = "Detected "
+                       + std::to_string(statistics.NumGaps() - reported_gaps_)
+                       + " new gaps in state packets";
+    }
+    else
+    {
+      status.level = diagnostic_msgs::DiagnosticStatus::OK;
+      status.message = "Receiving state packets";
+    }
+    reported_gaps_ = statistics.NumGaps();
+    const URRunningStatistic& period = statistics.ArrivalPeriod();
+    const URRunningStatistic& jitter = statistics.Jitter();
+    status.values.push_back(make_value(
+        "Packets", static_cast<double>(statistics.NumPackets())));
+    status.values.push_back(make_value(
+        "Controller period (s)", statistics.ControllerPeriod()));
+    status.values.push_back(make_value("Arrival period mean (s)",
+                                       period.Mean()));
+    status.values.push_back(make_value("Arrival period stddev (s)",
+                                       period.StdDev()));
+    status.values.push_back(make_value("Arrival period min (s)",
+                                       period.Min()));
+    status.values.push_back(make_value("Arrival period max (s)",
+                                       period.Max()));
+    status.values.push_back(make_value("Jitter mean (s)", jitter.Mean()));
+    status.values.push_back(make_value("Jitter stddev (s)", jitter.StdDev()));
+    status.values.push_back(make_value("Jitter min (s)", jitter.Min()));
+    status.values.push_back(make_value("Jitter max (s)", jitter.Max()));
+    status.values.push_back(make_value(
+        "Gaps", static_cast<double>(statistics.NumGaps())));
+    status.values.push_back(make_value(
+        "Missed packets", static_cast<double>(statistics.NumMissedPackets())));
+    const URControllerClockEstimate clock_estimate
+        = robot_ptr_->ControllerClockEstimate();
+    if (clock_estimate.Valid())
+    {
+      status.values.push_back(make_value("Controller clock drift (ppm)",
+                                         clock_estimate.DriftPpm()));
+    }
+    diagnostic_msgs::DiagnosticArray diagnostics_msg;
+    diagnostics_msg.header.stamp = now;
+    diagnostics_msg.status.push_back(status);
+    diagnostics_pub_.publish(diagnostics_msg);
+  }
+
   void PublishState(const std::vector<std::string>& joint_names,
             const std::string& base_frame_name,
             const std::string& ee_frame_name,
             const URRealtimeState& robot_state)
   {
-    // Get the current time
-    const ros::Time state_time = ros::Time::now();
+    // Stamp with the estimated time the controller sampled the state, which
+    // excludes network delay and our own wakeup, decode and dispatch latency
+    ros::Time state_time;
+    state_time.fromNSec(
+        static_cast<uint64_t>(robot_state.SampleTimeNanoseconds()));
     // Joint State
     sensor_msgs::JointState joint_state_msg;
     joint_state_msg.header.stamp = state_time;
@@ -179,11 +322,6 @@ public:
     joint_state_msg.position = robot_state.ActualPosition();
     joint_state_msg.velocity = robot_state.ActualVelocity();
     joint_state_msg.effort = robot_state.TargetTorque();
-    latest_state_mutex_.lock();
-    latest_joint_state_ = joint_state_msg;
-    latest_tcp_pose_ = robot_state.ActualTcpPose();
-    valid_latest_state_ = true;
-    latest_state_mutex_.unlock();
     // EE transform
     geometry_msgs::PoseStamped ee_transform_msg
         = EigenIsometry3dToGeometryPoseStamped(robot_state.ActualTcpPose(),
@@ -385,14 +523,11 @@ public:
                                              twist_command.twist.angular.z};
       if (twist_command.header.frame_id == ee_frame_)
       {
-        latest_state_mutex_.lock();
-        const Eigen::Isometry3d latest_tcp_pose = latest_tcp_pose_;
-        const bool valid_latest_state = valid_latest_state_;
-        latest_state_mutex_.unlock();
-        if (valid_latest_state)
+        latest_state_channel_.Update();
+        if (latest_state_channel_.LatestSequence() > 0)
         {
           const Eigen::Quaterniond latest_tcp_rotation(
-                latest_tcp_pose.rotation());
+                latest_state_channel_.Latest().ActualTcpPose().rotation());
           const Eigen::Vector3d ee_frame_linear_velocity(raw_twist[0],
                                                          raw_twist[1],
                                                          raw_twist[2]);
@@ -446,9 +581,15 @@ int main(int argc, char** argv)
   const std::string DEFAULT_EE_WORLD_TWIST_TOPIC = "/ur10/ee_world_twist";
   const std::string DEFAULT_EE_BODY_TWIST_TOPIC = "/ur10/ee_body_twist";
   const std::string DEFAULT_EE_WRENCH_TOPIC = "/ur10/ee_wrench";
+  const std::string DEFAULT_DIAGNOSTICS_TOPIC = "/diagnostics";
+  const std::string DEFAULT_CAPTURE_FILE = "";
   const std::string DEFAULT_BASE_FRAME = "base";
   const std::string DEFAULT_EE_FRAME = "ur10_ee_frame";
   const std::string DEFAULT_ROBOT_HOSTNAME = "172.31.1.200";
+  const double DEFAULT_CONNECT_TIMEOUT = 1.0;
+  const double DEFAULT_MIN_RECONNECT_BACKOFF = 0.1;
+  const double DEFAULT_MAX_RECONNECT_BACKOFF = 2.0;
+  const double DEFAULT_WATCHDOG_TIMEOUT = 0.5;
   const double DEFAULT_VELOCITY_LIMIT_SCALING = 0.5;
   const double DEFAULT_ACCELERATION_LIMIT_SCALING = 0.5;
   const std::string joint_state_topic
@@ -469,12 +610,26 @@ int main(int argc, char** argv)
                   DEFAULT_EE_BODY_TWIST_TOPIC);
   const std::string ee_wrench_topic
       = nhp.param(std::string("ee_wrench_topic"), DEFAULT_EE_WRENCH_TOPIC);
+  const std::string diagnostics_topic
+      = nhp.param(std::string("diagnostics_topic"), DEFAULT_DIAGNOSTICS_TOPIC);
   const std::string base_frame
       = nhp.param(std::string("base_frame"), DEFAULT_BASE_FRAME);
   const std::string ee_frame
       = nhp.param(std::string("ee_frame"), DEFAULT_EE_FRAME);
   const std::string robot_hostname
       = nhp.param(std::string("robot_hostname"), DEFAULT_ROBOT_HOSTNAME);
+  const double connect_timeout
+      = nhp.param(std::string("connect_timeout"), DEFAULT_CONNECT_TIMEOUT);
+  const double min_reconnect_backoff
+      = nhp.param(std::string("min_reconnect_backoff"),
+                  DEFAULT_MIN_RECONNECT_BACKOFF);
+  const double max_reconnect_backoff
+      = nhp.param(std::string("max_reconnect_backoff"),
+                  DEFAULT_MAX_RECONNECT_BACKOFF);
+  const double watchdog_timeout
+      = nhp.param(std::string("watchdog_timeout"), DEFAULT_WATCHDOG_TIMEOUT);
+  const std::string capture_file
+      = nhp.param(std::string("capture_file"), DEFAULT_CAPTURE_FILE);
   const double velocity_limit_scaling
       = std::abs(nhp.param(std::string("velocity_limit_scaling"),
                            DEFAULT_VELOCITY_LIMIT_SCALING));
@@ -487,6 +642,11 @@ int main(int argc, char** argv)
   const double real_acceleration_limit_scaling
       = common_robotics_utilities::utility::ClampValueAndWarn(
           acceleration_limit_scaling, 0.0, 1.0);
+  const tri_realtime_common::RealtimeThreadConfig recv_thread_config
+      = tri_realtime_common::LoadRealtimeThreadConfig(nhp, "recv_thread");
+  const lightweight_ur_interface::URRealtimeConnectionParams
+      connection_params(connect_timeout, min_reconnect_backoff,
+                        max_reconnect_backoff, watchdog_timeout);
   // Joint names in true order
   const std::vector<std::string> ordered_joint_names
       = lightweight_ur_interface::GetOrderedJointNames();
@@ -497,7 +657,13 @@ int main(int argc, char** argv)
   lightweight_ur_interface::URMinimalHardwareInterface interface(
       nh, velocity_command_topic, twist_command_topic, joint_state_topic,
       ee_pose_topic, ee_world_twist_topic, ee_body_twist_topic, ee_wrench_topic,
-      base_frame, ee_frame, ordered_joint_names, limits, robot_hostname);
+      diagnostics_topic, base_frame, ee_frame, ordered_joint_names, limits,
+      robot_hostname, connection_params, capture_file, recv_thread_config);
+  tri_realtime_common::LockProcessMemoryIfRequested(
+      nhp, [] (const std::string& message)
+  {
+    ROS_INFO("%s", message.c_str());
+  });
   ROS_INFO("...startup complete");
   interface.Run(400.0);
   return 0;
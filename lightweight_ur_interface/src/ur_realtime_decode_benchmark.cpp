@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <common_robotics_utilities/serialization.hpp>
+#include <lightweight_ur_interface/ur_minimal_realtime_driver.hpp>
+#include <lightweight_ur_interface/ur_network_byte_order.hpp>
+
+namespace lightweight_ur_interface
+{
+using common_robotics_utilities::serialization::DeserializeNetworkMemcpyable;
+using common_robotics_utilities::serialization::SerializeNetworkMemcpyable;
+
+// Largest realtime packet (e-Series, 139 doubles after the length field)
+constexpr uint32_t kBenchmarkPacketSize = 1116;
+
+std::vector<uint8_t> MakeBenchmarkPacket()
+{
+  std::vector<uint8_t> packet;
+  SerializeNetworkMemcpyable<int32_t>(
+      static_cast<int32_t>(kBenchmarkPacketSize), packet);
+  while (packet.size() < kBenchmarkPacketSize)
+  {
+    SerializeNetworkMemcpyable<double>(
+        static_cast<double>(packet.size()) * 0.001, packet);
+  }
+  return packet;
+}
+
+// Runs fn for the given number of iterations, repeated over several rounds,
+// and returns the best ns per iteration to reject scheduling noise.
+double TimeIterations(const std::function<void(void)>& fn,
+                      const int64_t iterations)
+{
+  const int32_t num_rounds = 5;
+  double best_ns = std::numeric_limits<double>::infinity();
+  for (int32_t round = 0; round < num_rounds; round++)
+  {
+    const std::chrono::steady_clock::time_point start
+        = std::chrono::steady_clock::now();
+    for (int64_t iteration = 0; iteration < iterations; iteration++)
+    {
+      fn();
+    }
+    const std::chrono::steady_clock::time_point end
+        = std::chrono::steady_clock::now();
+    const double elapsed_ns = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - start).count());
+    best_ns = std::min(best_ns, elapsed_ns / static_cast<double>(iterations));
+  }
+  return best_ns;
+}
+
+int DoMain(const int64_t iterations)
+{
+  const std::vector<uint8_t> packet = MakeBenchmarkPacket();
+  const size_t payload_size
+      = (packet.size() - sizeof(int32_t)) / sizeof(double);
+  alignas(32) double payload[kBenchmarkPacketSize / sizeof(double)];
+  // Keeps the compiler from discarding the conversions
+  volatile double sink = 0.0;
+  const double generic_ns = TimeIterations([&] ()
+  {
+    uint64_t current_position = sizeof(int32_t);
+    for (size_t idx = 0; idx < payload_size; idx++)
+    {
+      const auto deserialized
+          = DeserializeNetworkMemcpyable<double>(packet, current_position);
+      payload[idx] = deserialized.Value();
+      current_position += deserialized.BytesRead();
+    }
+    sink = payload[payload_size - 1];
+  }, iterations);
+  const double scalar_ns = TimeIterations([&] ()
+  {
+    NetworkDoublesToHostScalar(
+        packet.data() + sizeof(int32_t), payload_size, payload);
+    sink = payload[payload_size - 1];
+  }, iterations);
+  const double bulk_ns = TimeIterations([&] ()
+  {
+    NetworkDoublesToHost(
+        packet.data() + sizeof(int32_t), payload_size, payload);
+    sink = payload[payload_size - 1];
+  }, iterations);
+  URRealtimeState state;
+  const double full_decode_ns = TimeIterations([&] ()
+  {
+    state.DeserializeSelf(packet, 0);
+    sink = state.ActualPositionArray()[0];
+  }, iterations);
+  const double motion_decode_ns = TimeIterations([&] ()
+  {
+    state.DeserializeFields<URRealtimeLayout1116, kMotionRealtimeFields>(
+        packet, 0);
+    sink = state.ActualPositionArray()[0];
+  }, iterations);
+  printf("Converting %zu doubles per packet, %ld iterations\n",
+         payload_size, static_cast<long>(iterations));
+  printf("DeserializeNetworkMemcpyable per double: %8.1f ns/packet\n",
+         generic_ns);
+  printf("Scalar bulk byte swap:                   %8.1f ns/packet\n",
+         scalar_ns);
+  printf("Vectorized bulk byte swap:               %8.1f ns/packet\n",
+         bulk_ns);
+  printf("Full state decode:                       %8.1f ns/packet\n",
+         full_decode_ns);
+  printf("Motion fields state decode:              %8.1f ns/packet\n",
+         motion_decode_ns);
+  return 0;
+}
+}  // namespace lightweight_ur_interface
+
+int main(int argc, char** argv)
+{
+  const int64_t iterations = (argc >= 2) ? std::atoll(argv[1]) : 1000000;
+  if (iterations <= 0)
+  {
+    fprintf(stderr, "Usage: %s [iterations > 0]\n", argv[0]);
+    return -1;
+  }
+  return lightweight_ur_interface::DoMain(iterations);
+}
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <cstring>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <lightweight_ur_interface/ur_minimal_realtime_driver.hpp>
+
+namespace lightweight_ur_interface
+{
+int DoMain(const std::string& capture_path, const bool at_recorded_speed)
+{
+  uint64_t num_states = 0;
+  double first_uptime = 0.0;
+  double last_uptime = 0.0;
+  const std::function<void(const URRealtimeState&)> state_fn
+      = [&] (const URRealtimeState& state)
+  {
+    if (num_states == 0)
+    {
+      first_uptime = state.ControllerUptime();
+    }
+    last_uptime = state.ControllerUptime();
+    num_states++;
+  };
+  const std::function<void(const std::string&)> logging_fn
+      = [] (const std::string& message)
+  {
+    printf("%s\n", message.c_str());
+  };
+  URRealtimeReplay replay(capture_path, state_fn, logging_fn);
+  const std::chrono::steady_clock::time_point start
+      = std::chrono::steady_clock::now();
+  const uint64_t replayed_bytes = replay.Run(at_recorded_speed);
+  const std::chrono::steady_clock::time_point end
+      = std::chrono::steady_clock::now();
+  const double elapsed
+      = std::chrono::duration<double>(end - start).count();
+  const URRealtimeArrivalStatistics& statistics = replay.ArrivalStatistics();
+  printf("Replayed %lu bytes, %lu states covering %f seconds of controller"
+         " uptime in %f seconds\n",
+         static_cast<unsigned long>(replayed_bytes),
+         static_cast<unsigned long>(num_states), last_uptime - first_uptime,
+         elapsed);
+  if (num_states > 0)
+  {
+    printf("Decode throughput: %.1f ns/state, %.1f MB/s\n",
+           (elapsed * 1e9) / static_cast<double>(num_states),
+           (static_cast<double>(replayed_bytes) / elapsed) * 1e-6);
+  }
+  printf("Arrival period: mean %f stddev %f min %f max %f\n",
+         statistics.ArrivalPeriod().Mean(), statistics.ArrivalPeriod().StdDev(),
+         statistics.ArrivalPeriod().Min(), statistics.ArrivalPeriod().Max());
+  printf("Jitter: mean %f stddev %f min %f max %f\n",
+         statistics.Jitter().Mean(), statistics.Jitter().StdDev(),
+         statistics.Jitter().Min(), statistics.Jitter().Max());
+  printf("Gaps: %lu (%lu missed packets)\n",
+         static_cast<unsigned long>(statistics.NumGaps()),
+         static_cast<unsigned long>(statistics.NumMissedPackets()));
+  if (replay.ClockEstimate().Valid())
+  {
+    printf("Controller clock drift: %f ppm\n",
+           replay.ClockEstimate().DriftPpm());
+  }
+  return 0;
+}
+}  // namespace lightweight_ur_interface
+
+int main(int argc, char** argv)
+{
+  const bool valid_args
+      = (argc == 2)
+        || ((argc == 3) && (std::strcmp(argv[2], "--recorded-speed") == 0));
+  if (!valid_args)
+  {
+    fprintf(stderr, "Usage: %s <capture file> [--recorded-speed]\n", argv[0]);
+    return -1;
+  }
+  return lightweight_ur_interface::DoMain(std::string(argv[1]), (argc == 3));
+}
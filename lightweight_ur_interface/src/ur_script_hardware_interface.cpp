@@ -2,28 +2,46 @@
 #include <stdio.h>
 #include <cstring>
 #include <cmath>
+#include <array>
 #include <vector>
 #include <map>
 #include <string>
+#include <algorithm>
 #include <iostream>
 #include <chrono>
 #include <thread>
 #include <mutex>
 #include <functional>
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <ros/callback_queue_interface.h>
 #include <std_srvs/SetBool.h>
 #include <sensor_msgs/JointState.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <geometry_msgs/TwistStamped.h>
 #include <geometry_msgs/WrenchStamped.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <trajectory_msgs/JointTrajectory.h>
 #include <lightweight_ur_interface/control_program.hpp>
 #include <lightweight_ur_interface/ur_robot_config.hpp>
 #include <lightweight_ur_interface/ur_minimal_realtime_driver.hpp>
+#include <lightweight_ur_interface/ur_primary_interface.hpp>
+#include <lightweight_ur_interface/ur_dashboard_client.hpp>
+#include <lightweight_ur_interface/ur_shared_memory_channel.hpp>
+#include <lightweight_ur_interface/ur_controller_plugin.hpp>
+#include <lightweight_ur_interface/ur_position_controller.hpp>
+#include <lightweight_ur_interface/ur_cartesian_controller.hpp>
+#include <lightweight_ur_interface/ur_network_byte_order.hpp>
+#include <lightweight_ur_interface/latest_value_channel.hpp>
+#include <lightweight_ur_interface/command_sender_thread.hpp>
+#include <lightweight_ur_interface/dispatch_thread.hpp>
+#include <lightweight_ur_interface/PositionCommand.h>
 #include <lightweight_ur_interface/VelocityCommand.h>
 #include <common_robotics_utilities/print.hpp>
 #include <common_robotics_utilities/math.hpp>
 #include <common_robotics_utilities/ros_conversions.hpp>
-#include <common_robotics_utilities/serialization.hpp>
+#include <tri_realtime_common/realtime_thread_config.hpp>
+#include <tri_realtime_common/ros_realtime_thread_config.hpp>
 
 namespace lightweight_ur_interface
 {
@@ -34,10 +52,16 @@ using common_robotics_utilities::ros_conversions
 using common_robotics_utilities::math::RotateVectorReverse;
 using common_robotics_utilities::math::RotateVector;
 using common_robotics_utilities::utility::ClampValueAndWarn;
-using common_robotics_utilities::serialization::SerializeNetworkMemcpyable;
 using common_robotics_utilities::utility::CollectionsEqual;
 using common_robotics_utilities::utility::GetKeysFromMapLike;
 
+// Only the realtime fields published by PublishState are decoded
+constexpr URRealtimeFieldMask kPublishedRealtimeFields
+    = kMotionRealtimeFields
+      | RealtimeFieldBit(kTargetTorque)
+      | RealtimeFieldBit(kActualTcpTwist)
+      | RealtimeFieldBit(kActualTcpWrench);
+
 class URScriptHardwareInterface
 {
 private:
@@ -50,111 +74,110 @@ private:
                                   MODE_TEACH=1,
                                   MODE_SPEEDJ=2,
                                   MODE_SPEEDL=3,
-                                  MODE_WRENCH=4 };
+                                  MODE_WRENCH=4,
+                                  MODE_SERVOJ=5,
+                                  MODE_WAYPOINTS=6 };
     enum FORCE_MODE : int32_t { MODE_RIGID=0,
                                 MODE_FORCE=1,
                                 MODE_DONT_CHANGE=2,
                                 MODE_KEEP_LIMITS=3 };
 
+    // The control program reads each command as 27 big-endian int32 values:
+    // target, wrench and force mode limits (each 6 values, scaled by the float
+    // conversion ratio), the force mode selection vector (6 values), then the
+    // control mode, force mode and running flag. The target is joint or TCP
+    // speeds in SPEEDJ, SPEEDL and WRENCH modes, and joint positions in SERVOJ
+    // mode.
+    // WAYPOINTS commands reuse the frame for a batch of up to
+    // MAX_BATCH_WAYPOINTS waypoints: their positions fill the scaled values,
+    // and the selection vector carries their durations in microseconds, the
+    // number of waypoints, and a flag that clears the robot's buffer first.
+    static constexpr size_t NUM_SCALED_VALUES = 18;
+    static constexpr size_t NUM_INT_VALUES = 9;
+    static constexpr size_t WIRE_SIZE
+        = (NUM_SCALED_VALUES + NUM_INT_VALUES) * sizeof(int32_t);
+    static constexpr size_t MAX_BATCH_WAYPOINTS = 3;
+
   private:
 
-    std::vector<double> speed_;
-    std::vector<double> wrench_;
-    std::vector<double> force_mode_limits_;
-    std::vector<int32_t> force_mode_selection_vector_;
-    CONTROL_MODE control_mode_;
-    FORCE_MODE force_mode_;
-    bool running_;
+    static constexpr size_t TARGET_OFFSET = 0;
+    static constexpr size_t WRENCH_OFFSET = 6;
+    static constexpr size_t FORCE_MODE_LIMITS_OFFSET = 12;
+    static constexpr size_t FORCE_MODE_SELECTION_OFFSET = 0;
+    static constexpr size_t CONTROL_MODE_INDEX = 6;
+    static constexpr size_t FORCE_MODE_INDEX = 7;
+    static constexpr size_t RUNNING_INDEX = 8;
+    static constexpr size_t WAYPOINT_DURATIONS_OFFSET = 0;
+    static constexpr size_t WAYPOINT_COUNT_INDEX = 3;
+    static constexpr size_t WAYPOINT_CLEAR_INDEX = 4;
+
+    // Values are stored in wire order, so encoding is one bulk conversion of
+    // each array
+    std::array<double, NUM_SCALED_VALUES> scaled_values_;
+    std::array<int32_t, NUM_INT_VALUES> int_values_;
 
-    template<typename T, typename Allocator>
-    static uint64_t SerializeKnownSizeVector(
-        const std::vector<T, Allocator>& vec_to_serialize,
-        std::vector<uint8_t>& buffer,
-        const std::function<uint64_t
-        (const T&, std::vector<uint8_t>&)>& item_serializer)
+    static void CopySixValues(const std::vector<double>& values,
+                              const size_t offset,
+                              std::array<double, NUM_SCALED_VALUES>& dest)
     {
-      const uint64_t start_buffer_size = buffer.size();
-      // Serialize the contained items
-      for (size_t idx = 0; idx < vec_to_serialize.size(); idx++)
-      {
-        const T& current = vec_to_serialize[idx];
-        item_serializer(current, buffer);
-      }
-      // Figure out how many bytes were written
-      const uint64_t end_buffer_size = buffer.size();
-      const uint64_t bytes_written = end_buffer_size - start_buffer_size;
-      return bytes_written;
+      std::copy(values.begin(), values.end(), dest.begin() + offset);
     }
 
-    static uint64_t SerializeKnownSizeInt32Vector(
-        const std::vector<int32_t>& vec_to_serialize,
-        std::vector<uint8_t>& buffer)
+    void SetControlMode(const CONTROL_MODE control_mode)
     {
-      return SerializeKnownSizeVector<int32_t>(
-            vec_to_serialize, buffer, SerializeNetworkMemcpyable<int32_t>);
+      int_values_[CONTROL_MODE_INDEX] = static_cast<int32_t>(control_mode);
+    }
+
+    void SetForceMode(const FORCE_MODE force_mode)
+    {
+      int_values_[FORCE_MODE_INDEX] = static_cast<int32_t>(force_mode);
     }
 
   public:
 
     ControlScriptCommand()
     {
-      speed_.resize(6, 0.0);
-      wrench_.resize(6, 0.0);
-      force_mode_limits_.resize(6, 0.0);
-      force_mode_selection_vector_.resize(6, 0);
-      control_mode_ = MODE_IDLE;
-      force_mode_ = MODE_RIGID;
-      running_ = true;
+      scaled_values_.fill(0.0);
+      int_values_.fill(0);
+      SetControlMode(MODE_IDLE);
+      SetForceMode(MODE_RIGID);
+      int_values_[RUNNING_INDEX] = 1;
     }
 
-    static uint64_t Serialize(const ControlScriptCommand& command,
-                              const double float_conversion_ratio,
-                              std::vector<uint8_t>& buffer)
+    // Motion commands stream speeds, positions or wrenches within the current
+    // mode, and persist on the robot until the next command replaces them.
+    bool IsMotionCommand() const
     {
-      return command.SerializeSelf(float_conversion_ratio, buffer);
+      const int32_t control_mode = int_values_[CONTROL_MODE_INDEX];
+      const int32_t force_mode = int_values_[FORCE_MODE_INDEX];
+      return (int_values_[RUNNING_INDEX] == 1)
+             && ((((control_mode == MODE_SPEEDJ)
+                   || (control_mode == MODE_SPEEDL)
+                   || (control_mode == MODE_SERVOJ))
+                  && (force_mode == MODE_DONT_CHANGE))
+                 || ((control_mode == MODE_WRENCH)
+                     && (force_mode == MODE_KEEP_LIMITS)));
     }
 
-    static std::vector<int32_t> ConvertToInt32Vector(
-        const std::vector<double>& vector, const double float_conversion_ratio)
+    // A motion command makes a pending motion command of the same control
+    // mode redundant, since the robot would only act on the newer one.
+    // Everything else changes modes and must be delivered.
+    bool Supersedes(const ControlScriptCommand& older) const
     {
-      std::vector<int32_t> int32_vector(vector.size());
-      for (size_t idx = 0; idx < vector.size(); idx++)
-      {
-        int32_vector[idx]
-            = static_cast<int32_t>(vector[idx] * float_conversion_ratio);
-      }
-      return int32_vector;
+      return IsMotionCommand() && older.IsMotionCommand()
+             && (int_values_[CONTROL_MODE_INDEX]
+                 == older.int_values_[CONTROL_MODE_INDEX]);
     }
 
-    uint64_t SerializeSelf(const double float_conversion_ratio,
-                           std::vector<uint8_t>& buffer) const
+    // Writes exactly WIRE_SIZE bytes to wire_buffer, which does not need to
+    // be aligned.
+    void Encode(const double float_conversion_ratio,
+                uint8_t* wire_buffer) const
     {
-      const uint64_t start_buffer_size = buffer.size();
-      // Serialize the contained items
-      SerializeKnownSizeInt32Vector(
-            ConvertToInt32Vector(speed_, float_conversion_ratio), buffer);
-      SerializeKnownSizeInt32Vector(
-            ConvertToInt32Vector(wrench_, float_conversion_ratio), buffer);
-      SerializeKnownSizeInt32Vector(
-            ConvertToInt32Vector(force_mode_limits_,
-                                 float_conversion_ratio), buffer);
-      SerializeKnownSizeInt32Vector(force_mode_selection_vector_, buffer);
-      SerializeNetworkMemcpyable<int32_t>(
-          static_cast<int32_t>(control_mode_), buffer);
-      SerializeNetworkMemcpyable<int32_t>(
-          static_cast<int32_t>(force_mode_), buffer);
-      if (running_)
-      {
-        SerializeNetworkMemcpyable<int32_t>(1, buffer);
-      }
-      else
-      {
-        SerializeNetworkMemcpyable<int32_t>(0, buffer);
-      }
-      // Figure out how many bytes were written
-      const uint64_t end_buffer_size = buffer.size();
-      const uint64_t bytes_written = end_buffer_size - start_buffer_size;
-      return bytes_written;
+      ScaledDoublesToNetworkInt32(scaled_values_.data(), NUM_SCALED_VALUES,
+                                  float_conversion_ratio, wire_buffer);
+      Int32ToNetwork(int_values_.data(), NUM_INT_VALUES,
+                     wire_buffer + (NUM_SCALED_VALUES * sizeof(int32_t)));
     }
 
     static ControlScriptCommand MakeSpeedJCommand(
@@ -165,9 +188,9 @@ private:
       {
         throw std::runtime_error("joint_velocities.size() != 6");
       }
-      command.speed_ = joint_velocities;
-      command.control_mode_ = MODE_SPEEDJ;
-      command.force_mode_ = MODE_DONT_CHANGE;
+      CopySixValues(joint_velocities, TARGET_OFFSET, command.scaled_values_);
+      command.SetControlMode(MODE_SPEEDJ);
+      command.SetForceMode(MODE_DONT_CHANGE);
       return command;
     }
 
@@ -179,25 +202,80 @@ private:
       {
         throw std::runtime_error("ee_velocities.size() != 6");
       }
-      command.speed_ = ee_velocities;
-      command.control_mode_ = MODE_SPEEDL;
-      command.force_mode_ = MODE_DONT_CHANGE;
+      CopySixValues(ee_velocities, TARGET_OFFSET, command.scaled_values_);
+      command.SetControlMode(MODE_SPEEDL);
+      command.SetForceMode(MODE_DONT_CHANGE);
+      return command;
+    }
+
+    // The control program servos to joint_positions with servoj, using the
+    // lookahead time and gain it was generated with.
+    static ControlScriptCommand MakeServoJCommand(
+        const std::vector<double>& joint_positions)
+    {
+      ControlScriptCommand command;
+      if (joint_positions.size() != 6)
+      {
+        throw std::runtime_error("joint_positions.size() != 6");
+      }
+      CopySixValues(joint_positions, TARGET_OFFSET, command.scaled_values_);
+      command.SetControlMode(MODE_SERVOJ);
+      command.SetForceMode(MODE_DONT_CHANGE);
+      return command;
+    }
+
+    // Appends waypoints to the control program's waypoint buffer, clearing it
+    // first if clear_buffer is set. Each waypoint is reached duration seconds
+    // after the one before it (or after the robot's position when the buffer
+    // starts), and the robot interpolates between them itself.
+    static ControlScriptCommand MakeWaypointBatchCommand(
+        const std::vector<std::vector<double>>& joint_positions,
+        const std::vector<double>& durations,
+        const bool clear_buffer)
+    {
+      ControlScriptCommand command;
+      if (joint_positions.size() > MAX_BATCH_WAYPOINTS)
+      {
+        throw std::runtime_error(
+            "joint_positions.size() > MAX_BATCH_WAYPOINTS");
+      }
+      if (durations.size() != joint_positions.size())
+      {
+        throw std::runtime_error(
+            "durations.size() != joint_positions.size()");
+      }
+      for (size_t idx = 0; idx < joint_positions.size(); idx++)
+      {
+        if (joint_positions[idx].size() != 6)
+        {
+          throw std::runtime_error("joint_positions[idx].size() != 6");
+        }
+        CopySixValues(joint_positions[idx], TARGET_OFFSET + (6 * idx),
+                      command.scaled_values_);
+        command.int_values_[WAYPOINT_DURATIONS_OFFSET + idx]
+            = static_cast<int32_t>(std::round(durations[idx] * 1000000.0));
+      }
+      command.int_values_[WAYPOINT_COUNT_INDEX]
+          = static_cast<int32_t>(joint_positions.size());
+      command.int_values_[WAYPOINT_CLEAR_INDEX] = clear_buffer ? 1 : 0;
+      command.SetControlMode(MODE_WAYPOINTS);
+      command.SetForceMode(MODE_DONT_CHANGE);
       return command;
     }
 
     static ControlScriptCommand MakeTeachModeCommand()
     {
       ControlScriptCommand command;
-      command.control_mode_ = MODE_TEACH;
-      command.force_mode_ = MODE_RIGID;
+      command.SetControlMode(MODE_TEACH);
+      command.SetForceMode(MODE_RIGID);
       return command;
     }
 
     static ControlScriptCommand MakeExitTeachModeCommand()
     {
       ControlScriptCommand command;
-      command.control_mode_ = MODE_IDLE;
-      command.force_mode_ = MODE_RIGID;
+      command.SetControlMode(MODE_IDLE);
+      command.SetForceMode(MODE_RIGID);
       return command;
     }
 
@@ -211,19 +289,22 @@ private:
       {
         throw std::runtime_error("wrench.size() != 6");
       }
-      command.wrench_ = wrench;
+      CopySixValues(wrench, WRENCH_OFFSET, command.scaled_values_);
       if (force_mode_limits.size() != 6)
       {
         throw std::runtime_error("force_mode_limits.size() != 6");
       }
-      command.force_mode_limits_ = force_mode_limits;
+      CopySixValues(force_mode_limits, FORCE_MODE_LIMITS_OFFSET,
+                    command.scaled_values_);
       if (force_mode_selection_vector.size() != 6)
       {
         throw std::runtime_error("force_mode_selection_vector.size() != 6");
       }
-      command.force_mode_selection_vector_ = force_mode_selection_vector;
-      command.control_mode_ = MODE_WRENCH;
-      command.force_mode_ = MODE_FORCE;
+      std::copy(force_mode_selection_vector.begin(),
+                force_mode_selection_vector.end(),
+                command.int_values_.begin() + FORCE_MODE_SELECTION_OFFSET);
+      command.SetControlMode(MODE_WRENCH);
+      command.SetForceMode(MODE_FORCE);
       return command;
     }
 
@@ -240,41 +321,202 @@ private:
       {
         throw std::runtime_error("wrench.size() != 6");
       }
-      command.speed_ = ee_velocities;
-      command.wrench_ = wrench;
-      command.control_mode_ = MODE_WRENCH;
-      command.force_mode_ = MODE_KEEP_LIMITS;
+      CopySixValues(ee_velocities, TARGET_OFFSET, command.scaled_values_);
+      CopySixValues(wrench, WRENCH_OFFSET, command.scaled_values_);
+      command.SetControlMode(MODE_WRENCH);
+      command.SetForceMode(MODE_KEEP_LIMITS);
       return command;
     }
 
     static ControlScriptCommand MakeIdleModeCommand()
     {
       ControlScriptCommand command;
-      command.control_mode_ = MODE_IDLE;
-      command.force_mode_ = MODE_RIGID;
+      command.SetControlMode(MODE_IDLE);
+      command.SetForceMode(MODE_RIGID);
       return command;
     }
 
     static ControlScriptCommand MakeExitForceModeCommand()
     {
       ControlScriptCommand command;
-      command.control_mode_ = MODE_IDLE;
-      command.force_mode_ = MODE_RIGID;
+      command.SetControlMode(MODE_IDLE);
+      command.SetForceMode(MODE_RIGID);
       return command;
     }
 
     static ControlScriptCommand MakeExitProgramCommand()
     {
       ControlScriptCommand command;
-      command.running_ = false;
+      command.int_values_[RUNNING_INDEX] = 0;
       return command;
     }
   };
 
+  // A trajectory being streamed into the control program's waypoint buffer.
+  // The robot reports the total number of waypoints it has consumed (or
+  // discarded by clearing its buffer), so it holds at most those sent minus
+  // those reported, and waypoints are only sent once they are sure to fit.
+  class WaypointStream
+  {
+  private:
+
+    std::vector<std::vector<double>> joint_positions_;
+    std::vector<double> durations_;
+    size_t next_waypoint_;
+    bool clear_pending_;
+    uint64_t buffer_size_;
+    uint64_t num_sent_;
+    uint64_t num_consumed_;
+
+  public:
+
+    explicit WaypointStream(const size_t buffer_size)
+      : next_waypoint_(0), clear_pending_(false), buffer_size_(buffer_size),
+        num_sent_(0), num_consumed_(0) {}
+
+    // Call when the control program restarts with an empty buffer
+    void Reset()
+    {
+      Cancel();
+      num_sent_ = 0;
+      num_consumed_ = 0;
+    }
+
+    // Replaces the trajectory being streamed. The first batch sent clears
+    // the robot's buffer, so an empty trajectory just stops the robot at its
+    // current target.
+    void Start(const std::vector<std::vector<double>>& joint_positions,
+               const std::vector<double>& durations)
+    {
+      joint_positions_ = joint_positions;
+      durations_ = durations;
+      next_waypoint_ = 0;
+      clear_pending_ = true;
+    }
+
+    // Stops sending the current trajectory, e.g. when another mode is
+    // commanded. Waypoints already on the robot are only used again if it
+    // is commanded back into waypoint mode, which always clears them.
+    void Cancel()
+    {
+      joint_positions_.clear();
+      durations_.clear();
+      next_waypoint_ = 0;
+      clear_pending_ = false;
+    }
+
+    void NotifyConsumed(const uint64_t num_consumed)
+    {
+      // Reports from before a clear may arrive after it, so the count only
+      // grows, and it cannot exceed what has been sent
+      num_consumed_ = std::min(std::max(num_consumed_, num_consumed),
+                               num_sent_);
+    }
+
+    inline bool Active() const
+    {
+      return clear_pending_ || (next_waypoint_ < durations_.size());
+    }
+
+    inline uint64_t NumBuffered() const { return num_sent_ - num_consumed_; }
+
+    // Returns full batches of the remaining waypoints, as many as fit in the
+    // robot's buffer, plus a final partial batch.
+    std::vector<ControlScriptCommand> TakeCommands()
+    {
+      std::vector<ControlScriptCommand> commands;
+      if (clear_pending_)
+      {
+        // Everything sent before the clear is consumed or discarded by it
+        num_consumed_ = num_sent_;
+      }
+      while (Active())
+      {
+        const size_t max_batch_size
+            = ControlScriptCommand::MAX_BATCH_WAYPOINTS;
+        const size_t batch_size
+            = std::min(max_batch_size, durations_.size() - next_waypoint_);
+        if ((NumBuffered() + batch_size) > buffer_size_)
+        {
+          break;
+        }
+        const auto batch_start
+            = static_cast<ssize_t>(next_waypoint_);
+        const auto batch_end
+            = static_cast<ssize_t>(next_waypoint_ + batch_size);
+        commands.push_back(ControlScriptCommand::MakeWaypointBatchCommand(
+            std::vector<std::vector<double>>(
+                joint_positions_.begin() + batch_start,
+                joint_positions_.begin() + batch_end),
+            std::vector<double>(durations_.begin() + batch_start,
+                                durations_.begin() + batch_end),
+            clear_pending_));
+        clear_pending_ = false;
+        next_waypoint_ += batch_size;
+        num_sent_ += batch_size;
+      }
+      return commands;
+    }
+  };
+
+  // Queued on the ROS callback queue when commands arrive through shared
+  // memory, so that they are handled on the same thread as command topics
+  class SharedCommandsCallback : public ros::CallbackInterface
+  {
+  private:
+
+    URScriptHardwareInterface* hardware_interface_;
+
+  public:
+
+    explicit SharedCommandsCallback(
+        URScriptHardwareInterface* hardware_interface)
+      : hardware_interface_(hardware_interface) {}
+
+    virtual ros::CallbackInterface::CallResult call()
+    {
+      hardware_interface_->HandleSharedCommands();
+      return ros::CallbackInterface::Success;
+    }
+  };
+
+  // Command computed by the controller plugins, with the TCP orientation of
+  // the state it was computed from, for tool frame twists
+  struct ControllerPluginCommand
+  {
+    URSharedCommand command;
+    std::array<double, 4> tcp_orientation;
+  };
+
   static constexpr double FLOAT_CONVERSION_RATIO = 1000000.0;
   static constexpr double STOP_DECELERATION = 1.0;
   static constexpr double SPEED_ACCELERATION = 3.2;
   static constexpr double SPEED_COMMAND_WAIT = 0.008;
+  static constexpr size_t STATE_PUBLISH_QUEUE_CAPACITY = 16;
+  // Plugin commands are streamed, so only the newest few are worth keeping
+  static constexpr size_t PLUGIN_COMMAND_QUEUE_CAPACITY = 4;
+  static constexpr double DIAGNOSTICS_PERIOD = 1.0;
+  static constexpr size_t COMMAND_QUEUE_RESERVE_SIZE = 16;
+  static constexpr double PHASE_LOCK_TIMEOUT = 0.1;
+  static constexpr double PRIMARY_WATCHDOG_TIMEOUT = 1.0;
+  // Time allowed for the first start of the control program, and for each
+  // uploaded program to connect back
+  static constexpr double CONTROL_PROGRAM_START_TIMEOUT = 10.0;
+  static constexpr double CONTROL_PROGRAM_CONNECT_TIMEOUT = 2.0;
+  // Delay between attempts to upload the program or unlock a protective stop
+  static constexpr double CONTROL_PROGRAM_RETRY_PERIOD = 0.2;
+  // Waypoints the control program can buffer, and the fill level at which it
+  // asks for more. At a 32 ms waypoint spacing, the buffer holds 2 seconds
+  // of motion and is refilled when under 0.75 seconds remain.
+  static constexpr int32_t WAYPOINT_BUFFER_SIZE = 64;
+  static constexpr int32_t WAYPOINT_LOW_WATER_MARK = 24;
+  // Waypoint durations are sent as int32 microseconds
+  static constexpr double MAX_WAYPOINT_DURATION = 1000.0;
+  // Allows for rounding in trajectories retimed to the velocity limits
+  static constexpr double WAYPOINT_VELOCITY_LIMIT_TOLERANCE = 1.01;
+  // Controller plugins are not stepped across longer gaps between states,
+  // such as a reconnect
+  static constexpr double MAX_PLUGIN_CONTROL_INTERVAL = 0.1;
 
   std::string base_frame_;
   std::string ee_frame_;
@@ -284,7 +526,21 @@ private:
 
   std::string our_ip_address_;
   int32_t control_port_;
-  std::vector<ControlScriptCommand> control_script_command_queue_;
+  double servoj_time_;
+  double servoj_lookahead_time_;
+  double servoj_gain_;
+  double max_servo_step_time_;
+  double min_command_spacing_;
+  tri_realtime_common::RealtimeThreadConfig command_sender_thread_config_;
+  // Reused for every batch of commands, so steady-state sends don't allocate
+  std::vector<uint8_t> control_command_wire_buffer_;
+  // Sends commands from ROS callbacks as soon as they are posted. Declared
+  // after the wire buffer, which its thread uses.
+  std::unique_ptr<CommandSenderThread<ControlScriptCommand>>
+      control_command_sender_ptr_;
+  // Held while replacing the sender or switching teach mode, and by the
+  // controller plugin command thread to post commands
+  std::mutex command_sender_mutex_;
 
   ros::NodeHandle nh_;
   ros::Publisher joint_state_pub_;
@@ -292,44 +548,153 @@ private:
   ros::Publisher ee_world_twist_pub_;
   ros::Publisher ee_body_twist_pub_;
   ros::Publisher ee_wrench_pub_;
+  ros::Publisher diagnostics_pub_;
+  ros::Publisher shared_velocity_command_pub_;
+  ros::Publisher shared_twist_command_pub_;
   ros::Subscriber velocity_command_sub_;
   ros::Subscriber twist_command_sub_;
+  ros::Subscriber servo_command_sub_;
+  ros::Subscriber waypoint_trajectory_sub_;
   ros::ServiceServer switch_teach_mode_server_;
 
   std::atomic<bool> in_teach_mode_;
+  // Only used by ROS callbacks and the housekeeping loop, on the same thread
+  WaypointStream waypoint_stream_;
+  // Bytes of a partially received consumed-waypoint report, owned by the
+  // reactor thread while the control program socket is watched
+  std::array<uint8_t, sizeof(int32_t)> waypoint_report_bytes_;
+  size_t num_waypoint_report_bytes_;
+  // Latest total of consumed waypoints reported by the control program
+  std::atomic<uint64_t> num_waypoints_consumed_;
+  // Set by the reactor thread when the control program closes its socket
+  std::atomic<bool> control_program_disconnected_;
+  // Publishes states on its own thread, so the robot recv thread never waits
+  // on ROS message construction. Declared before robot_ptr_ so that the recv
+  // thread is stopped first.
+  std::unique_ptr<DispatchThread<
+      URRealtimeState, Eigen::aligned_allocator<URRealtimeState>>>
+          state_publisher_ptr_;
+  uint64_t reported_dropped_states_;
+  std::string robot_host_;
+  ros::Time last_diagnostics_time_;
+  uint64_t reported_gaps_;
+  // Times command sends relative to state arrival, if phase-locked sending
+  // is enabled. Declared before robot_ptr_, whose recv thread notifies it.
+  std::unique_ptr<URStatePhaseLock> phase_lock_ptr_;
+  // Shares state and commands with co-located controllers, if enabled.
+  // Declared before robot_ptr_, whose recv thread publishes state to it.
+  std::unique_ptr<URSharedMemoryServer> shared_memory_ptr_;
+  ros::CallbackInterfacePtr shared_commands_callback_;
+  // Set while shared_commands_callback_ is queued and has not yet run
+  std::atomic<bool> shared_commands_queued_;
+  // Controllers run with each state, if any. Declared before robot_ptr_,
+  // whose recv thread runs them.
+  std::vector<std::unique_ptr<URControllerPlugin>> controller_plugins_;
+  // Sample time of the state controller plugins last saw, only used by the
+  // robot recv thread
+  uint64_t last_plugin_sample_time_ns_;
+  // Checks and posts controller plugin commands on their own thread, so the
+  // robot recv thread only computes them and never waits on the sender
+  // lock. Declared before robot_ptr_, whose recv thread dispatches to it.
+  std::unique_ptr<DispatchThread<ControllerPluginCommand>>
+      controller_plugin_command_sender_ptr_;
+  // Set when a controller plugin command is posted, so that housekeeping
+  // cancels any waypoint trajectory
+  std::atomic<bool> controller_plugin_commanded_;
+  // Runs the robot connections and the control program socket, possibly
+  // shared with other arms
+  URIOReactor& reactor_;
+  // Written by the robot recv thread, read by ROS callbacks. Declared before
+  // robot_ptr_ so that the recv thread is stopped first.
+  LatestValueChannel<URRealtimeState> latest_state_channel_;
   std::unique_ptr<URRealtimeInterface> robot_ptr_;
-  std::mutex latest_state_mutex_;
-  bool valid_latest_state_;
-  sensor_msgs::JointState latest_joint_state_;
-  Eigen::Isometry3d latest_tcp_pose_;
+  // Set while a newly uploaded control program has not yet been reported
+  // running, so that the old program stopping is not taken as a failure
+  std::atomic<bool> awaiting_program_start_;
+  // Set once the uploaded control program has connected back
+  std::atomic<bool> control_program_connected_;
+  // Set by the primary interface when the control program stops, e.g. after
+  // a runtime exception or protective stop
+  std::atomic<bool> control_program_stopped_;
+  // Written by the primary interface, read by diagnostics
+  LatestValueChannel<URRobotModeData> robot_mode_data_channel_;
+  // Reports program and safety state, if enabled
+  std::unique_ptr<URPrimaryInterface> primary_ptr_;
+  // Unlocks protective stops, if enabled
+  std::unique_ptr<URDashboardClient> dashboard_ptr_;
+  bool unlock_protective_stops_;
+  std::atomic<bool> protective_stop_unlock_pending_;
+  // Starting the control program, only used by the housekeeping loop
+  bool started_;
+  int32_t control_listen_sock_fd_;
+  int32_t control_program_sock_fd_;
+  bool control_program_uploaded_;
+  std::chrono::steady_clock::time_point control_program_connect_deadline_;
+  std::chrono::steady_clock::time_point next_control_program_upload_time_;
+  std::chrono::steady_clock::time_point control_program_restart_time_;
+  // Sequence of the latest robot mode data when the control program failed
+  uint64_t control_program_failed_sequence_;
 
 public:
 
+  static constexpr double HOUSEKEEPING_PERIOD = 0.01;
+
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
   URScriptHardwareInterface(
       const ros::NodeHandle& nh,
       const std::string& velocity_command_topic,
       const std::string& twist_command_topic,
+      const std::string& servo_command_topic,
+      const std::string& waypoint_trajectory_topic,
       const std::string& joint_state_topic,
       const std::string& ee_pose_topic,
       const std::string& ee_world_twist_topic,
       const std::string& ee_body_twist_topic,
       const std::string& ee_wrench_topic,
+      const std::string& diagnostics_topic,
       const std::string& base_frame,
       const std::string& ee_frame,
       const std::string& teach_mode_service,
       const std::vector<std::string>& ordered_joint_names,
       const std::map<std::string, JointLimits>& joint_limits,
       const std::string& robot_host,
+      const URRealtimeConnectionParams& connection_params,
+      const int32_t primary_port,
+      const int32_t dashboard_port,
+      const bool unlock_protective_stops,
+      const std::string& capture_file,
       const std::string& our_ip_address,
-      const int32_t control_port)
-    : nh_(nh)
+      const int32_t control_port,
+      const double servoj_time,
+      const double servoj_lookahead_time,
+      const double servoj_gain,
+      const double max_servo_step_time,
+      const double min_command_spacing,
+      const bool phase_locked_send,
+      const double send_phase_offset,
+      const std::string& shared_memory_name,
+      std::vector<std::unique_ptr<URControllerPlugin>> controller_plugins,
+      const tri_realtime_common::RealtimeThreadConfig&
+          command_sender_thread_config,
+      URIOReactor& reactor)
+    : nh_(nh), waypoint_stream_(WAYPOINT_BUFFER_SIZE),
+      num_waypoint_report_bytes_(0),
+      controller_plugins_(std::move(controller_plugins)),
+      last_plugin_sample_time_ns_(0), reactor_(reactor)
   {
     our_ip_address_ = our_ip_address;
     control_port_ = control_port;
+    servoj_time_ = servoj_time;
+    servoj_lookahead_time_ = servoj_lookahead_time;
+    servoj_gain_ = servoj_gain;
+    max_servo_step_time_ = max_servo_step_time;
+    min_command_spacing_ = min_command_spacing;
+    command_sender_thread_config_ = command_sender_thread_config;
+    control_command_wire_buffer_.resize(
+        COMMAND_QUEUE_RESERVE_SIZE * ControlScriptCommand::WIRE_SIZE);
     in_teach_mode_.store(false);
-    valid_latest_state_ = false;
+    controller_plugin_commanded_.store(false);
     // Make sure our ordered joint names match our joint limits
     joint_names_ = ordered_joint_names;
     if (joint_names_.size() != 6)
@@ -373,6 +738,10 @@ public:
         = nh_.advertise<geometry_msgs::WrenchStamped>(ee_wrench_topic,
                                                       1,
                                                       false);
+    diagnostics_pub_
+        = nh_.advertise<diagnostic_msgs::DiagnosticArray>(diagnostics_topic,
+                                                          1,
+                                                          false);
     velocity_command_sub_
         = nh_.subscribe(velocity_command_topic,
                         1,
@@ -383,132 +752,793 @@ public:
                         1,
                         &URScriptHardwareInterface::TwistCommandCallback,
                         this);
+    servo_command_sub_
+        = nh_.subscribe(servo_command_topic,
+                        1,
+                        &URScriptHardwareInterface::ServoCommandCallback,
+                        this);
+    waypoint_trajectory_sub_
+        = nh_.subscribe(
+            waypoint_trajectory_topic,
+            1,
+            &URScriptHardwareInterface::WaypointTrajectoryCallback,
+            this);
     switch_teach_mode_server_
         = nh_.advertiseService(teach_mode_service,
                                &URScriptHardwareInterface::SwitchTeachModeCB,
                                this);
+    // Build state publisher
+    const std::function<void(const URRealtimeState&)> publish_fn
+        = [&] (const URRealtimeState& latest_state)
+    {
+      return PublishState(joint_names_, base_frame_, ee_frame_, latest_state);
+    };
+    state_publisher_ptr_ = std::unique_ptr<DispatchThread<
+        URRealtimeState, Eigen::aligned_allocator<URRealtimeState>>>(
+            new DispatchThread<
+                URRealtimeState, Eigen::aligned_allocator<URRealtimeState>>(
+                    STATE_PUBLISH_QUEUE_CAPACITY, publish_fn));
+    reported_dropped_states_ = 0;
+    robot_host_ = robot_host;
+    reported_gaps_ = 0;
+    if (phase_locked_send)
+    {
+      ROS_INFO("Sending commands %f seconds after each state arrives",
+               send_phase_offset);
+      phase_lock_ptr_ = std::unique_ptr<URStatePhaseLock>(
+          new URStatePhaseLock(send_phase_offset));
+    }
     // Build robot interface
     const std::function<void(const URRealtimeState&)> callback_fn
         = [&] (const URRealtimeState& latest_state)
     {
-      return PublishState(joint_names_, base_frame_, ee_frame_, latest_state);
+      if (phase_lock_ptr_)
+      {
+        phase_lock_ptr_->NotifyState(latest_state);
+      }
+      if (shared_memory_ptr_ || !controller_plugins_.empty())
+      {
+        const URSharedState shared_state = MakeSharedState(latest_state);
+        if (shared_memory_ptr_)
+        {
+          shared_memory_ptr_->PublishState(shared_state);
+        }
+        if (!controller_plugins_.empty())
+        {
+          RunControllerPlugins(shared_state);
+        }
+      }
+      latest_state_channel_.Publish(latest_state);
+      state_publisher_ptr_->Dispatch(latest_state);
     };
+    if (!controller_plugins_.empty())
+    {
+      controller_plugin_command_sender_ptr_
+          = std::unique_ptr<DispatchThread<ControllerPluginCommand>>(
+              new DispatchThread<ControllerPluginCommand>(
+                  PLUGIN_COMMAND_QUEUE_CAPACITY,
+                  [this] (const ControllerPluginCommand& command)
+      {
+        SendControllerPluginCommand(command);
+      }));
+    }
     std::function<void(const std::string&)> logging_fn
         = [] (const std::string& message)
     {
       ROS_INFO("%s", message.c_str());
     };
+    shared_commands_queued_.store(false);
+    if (!shared_memory_name.empty())
+    {
+      shared_commands_callback_.reset(new SharedCommandsCallback(this));
+      // Commands received through shared memory are published for
+      // introspection, on topics of their own so they are not run twice
+      shared_velocity_command_pub_
+          = nh_.advertise<lightweight_ur_interface::VelocityCommand>(
+              velocity_command_topic + "_shared", 1, false);
+      shared_twist_command_pub_
+          = nh_.advertise<geometry_msgs::TwistStamped>(
+              twist_command_topic + "_shared", 1, false);
+      shared_memory_ptr_ = std::unique_ptr<URSharedMemoryServer>(
+          new URSharedMemoryServer(shared_memory_name, logging_fn, [this] ()
+      {
+        QueueSharedCommands();
+      }));
+    }
     robot_ptr_ = std::unique_ptr<URRealtimeInterface>(
-                   new URRealtimeInterface(robot_host,
-                                           callback_fn,
-                                           logging_fn));
+                   new URRealtimeInterface(
+                       robot_host, callback_fn, logging_fn,
+                       connection_params,
+                       MakeRealtimeDecoderTable<kPublishedRealtimeFields>()));
+    if (!capture_file.empty())
+    {
+      robot_ptr_->StartCapture(capture_file);
+    }
+    awaiting_program_start_.store(false);
+    control_program_connected_.store(false);
+    control_program_stopped_.store(false);
+    if (primary_port > 0)
+    {
+      // State arrives at only 10 Hz, so the watchdog must allow for more
+      // than one period between packages
+      const double min_primary_watchdog_timeout = PRIMARY_WATCHDOG_TIMEOUT;
+      const URRealtimeConnectionParams primary_connection_params(
+          connection_params.ConnectTimeout(),
+          connection_params.MinReconnectBackoff(),
+          connection_params.MaxReconnectBackoff(),
+          std::max(connection_params.WatchdogTimeout(),
+                   min_primary_watchdog_timeout));
+      primary_ptr_ = std::unique_ptr<URPrimaryInterface>(
+                       new URPrimaryInterface(
+                           robot_host, MakePrimaryCallbacks(), logging_fn,
+                           static_cast<uint16_t>(primary_port),
+                           primary_connection_params));
+    }
+    unlock_protective_stops_ = unlock_protective_stops;
+    protective_stop_unlock_pending_.store(false);
+    if (dashboard_port > 0)
+    {
+      dashboard_ptr_ = std::unique_ptr<URDashboardClient>(
+                         new URDashboardClient(
+                             robot_host, logging_fn,
+                             static_cast<uint16_t>(dashboard_port),
+                             connection_params));
+    }
+    num_waypoints_consumed_.store(0);
+    control_program_disconnected_.store(false);
+    started_ = false;
+    control_listen_sock_fd_ = -1;
+    control_program_sock_fd_ = -1;
+    control_program_uploaded_ = false;
+    control_program_failed_sequence_ = 0;
+  }
+
+  ~URScriptHardwareInterface()
+  {
+    Stop();
+  }
+
+  URPrimaryCallbacks MakePrimaryCallbacks()
+  {
+    URPrimaryCallbacks callbacks;
+    callbacks.robot_mode_data_fn = [this] (const URRobotModeData& data)
+    {
+      // If the old program was replaced between two states, no start is
+      // reported, but running once the new program has connected back can
+      // only be the new program
+      if (data.program_running && control_program_connected_.load())
+      {
+        awaiting_program_start_.store(false);
+      }
+      robot_mode_data_channel_.Publish(data);
+    };
+    callbacks.event_fn = [this] (const URPrimaryEvent& event)
+    {
+      HandlePrimaryEvent(event);
+    };
+    callbacks.robot_message_fn = [] (const URRobotMessage& message)
+    {
+      HandleRobotMessage(message);
+    };
+    return callbacks;
+  }
+
+  // Called from the reactor thread
+  void HandlePrimaryEvent(const URPrimaryEvent& event)
+  {
+    const URRobotModeData& data = *event.robot_mode_data;
+    switch (event.type)
+    {
+      case kPrimaryProgramStarted:
+        awaiting_program_start_.store(false);
+        ROS_INFO("Control program started");
+        break;
+      case kPrimaryProgramStopped:
+        // The program uploaded last replaces the running one, which stops
+        if (!awaiting_program_start_.load())
+        {
+          ROS_ERROR("Control program stopped");
+          control_program_stopped_.store(true);
+        }
+        break;
+      case kPrimaryProtectiveStop:
+      case kPrimaryEmergencyStop:
+        ROS_ERROR("Robot %s, robot mode %s", PrimaryEventName(event.type),
+                  RobotModeName(data.robot_mode));
+        break;
+      case kPrimaryRobotModeChanged:
+        ROS_INFO("Robot mode changed to %s", RobotModeName(data.robot_mode));
+        break;
+      default:
+        ROS_INFO("Robot %s", PrimaryEventName(event.type));
+        break;
+    }
   }
 
-  void Run(const double control_rate)
+  // Called from the reactor thread
+  static void HandleRobotMessage(const URRobotMessage& message)
   {
-    // Start robot interface
-    robot_ptr_->StartRecv();
+    switch (message.message_type)
+    {
+      case kPrimaryRuntimeExceptionMessage:
+        ROS_ERROR("Runtime exception at line %d, column %d: %s",
+                  message.line_number, message.column_number,
+                  message.Text().c_str());
+        break;
+      case kPrimarySafetyModeMessage:
+        ROS_WARN("Safety mode %u (code %d, argument %d): %s",
+                 message.safety_mode, message.code, message.argument,
+                 message.Text().c_str());
+        break;
+      case kPrimaryErrorCodeMessage:
+        ROS_ERROR("Robot error C%dA%d (report level %d): %s",
+                  message.code, message.argument, message.report_level,
+                  message.Text().c_str());
+        break;
+      case kPrimaryTextMessage:
+        ROS_INFO("Robot message: %s", message.Text().c_str());
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Connects to the robot on the reactor, which must be running, and starts
+  // the control program. Blocks until the control program has connected, so
+  // that a robot that cannot run it fails startup.
+  void Start()
+  {
+    // Start state publisher and robot interface
+    state_publisher_ptr_->Start();
+    if (controller_plugin_command_sender_ptr_)
+    {
+      // Plugin commands should reach the sender as quickly as commands
+      // posted directly
+      controller_plugin_command_sender_ptr_->Start([this] ()
+      {
+        tri_realtime_common::ConfigureCurrentThread(
+            command_sender_thread_config_, "ur_plugin_send",
+            [] (const std::string& message)
+        {
+          ROS_INFO("%s", message.c_str());
+        });
+      });
+    }
+    started_ = true;
+    robot_ptr_->StartRecv(reactor_);
     ROS_INFO("Started robot realtime interface");
+    if (primary_ptr_)
+    {
+      primary_ptr_->StartRecv(reactor_);
+      ROS_INFO("Started robot primary interface");
+    }
+    if (dashboard_ptr_)
+    {
+      dashboard_ptr_->StartRecv(reactor_);
+      ROS_INFO("Started robot dashboard client");
+    }
+    // The control program is uploaded over the realtime connection
+    const double connection_timeout = 10.0;
+    if (!robot_ptr_->WaitForConnection(connection_timeout))
+    {
+      throw std::runtime_error("Failed to connect to robot");
+    }
     // Start control program interface
-    const std::pair<int32_t, int32_t> initial_control_program_socket_fds
-        = StartControlProgram(our_ip_address_,
-                              control_port_,
-                              FLOAT_CONVERSION_RATIO,
-                              STOP_DECELERATION,
-                              SPEED_ACCELERATION,
-                              SPEED_COMMAND_WAIT);
-    int32_t control_program_incoming_sock_fd
-        = initial_control_program_socket_fds.first;
-    int32_t control_program_sock_fd = initial_control_program_socket_fds.second;
-    ROS_INFO("Started robot control interface with fds %d, %d",
-             control_program_incoming_sock_fd, control_program_sock_fd);
-    // Start ROS spinloop
-    ros::Rate looprate(control_rate);
-    while (nh_.ok())
-    {
-      ros::spinOnce();
-      for (size_t idx = 0; idx < control_script_command_queue_.size(); idx++)
-      {
-        const ControlScriptCommand& current_command
-            = control_script_command_queue_[idx];
-        std::vector<uint8_t> buffer;
-        current_command.SerializeSelf(FLOAT_CONVERSION_RATIO, buffer);
-        const ssize_t bytes_written = write(control_program_sock_fd,
-                                            buffer.data(),
-                                            buffer.size());
-        if (bytes_written != static_cast<ssize_t>(buffer.size()))
+    control_listen_sock_fd_ = OpenControlListenSocket(control_port_);
+    const std::chrono::steady_clock::time_point start_deadline
+        = SecondsFromNow(CONTROL_PROGRAM_START_TIMEOUT);
+    const double housekeeping_period = HOUSEKEEPING_PERIOD;
+    const std::chrono::duration<double> start_poll_period(housekeeping_period);
+    int32_t control_program_sock_fd = StepControlProgramStart();
+    while (control_program_sock_fd < 0)
+    {
+      if (std::chrono::steady_clock::now() > start_deadline)
+      {
+        throw std::runtime_error("Failed to start control program");
+      }
+      std::this_thread::sleep_for(start_poll_period);
+      control_program_sock_fd = StepControlProgramStart();
+    }
+    ROS_INFO("Started robot control interface with fd %d",
+             control_program_sock_fd);
+    AttachControlProgram(control_program_sock_fd);
+    if (shared_memory_ptr_)
+    {
+      shared_memory_ptr_->Start();
+      ROS_INFO("Started shared memory channel %s",
+               shared_memory_ptr_->Name().c_str());
+    }
+  }
+
+  // Runs after each round of ROS callbacks, on the same thread. Streams
+  // waypoints, publishes diagnostics, and restarts the control program if
+  // it fails.
+  void DoHousekeeping()
+  {
+    // Controller plugin commands replace any waypoint trajectory, like
+    // commands from topics
+    if (controller_plugin_commanded_.exchange(false))
+    {
+      waypoint_stream_.Cancel();
+    }
+    if (control_program_sock_fd_ >= 0)
+    {
+      waypoint_stream_.NotifyConsumed(num_waypoints_consumed_.load());
+      SendWaypoints();
+    }
+    ReportDroppedStates();
+    const ros::Time now = ros::Time::now();
+    if ((now - last_diagnostics_time_).toSec() >= DIAGNOSTICS_PERIOD)
+    {
+      PublishDiagnostics(now);
+      last_diagnostics_time_ = now;
+    }
+    // A stopped program is caught from primary state within one 10 Hz cycle,
+    // and a closed connection as soon as it closes, before a command write
+    // would fail
+    if ((control_program_sock_fd_ >= 0)
+        && (control_command_sender_ptr_->Failed()
+            || control_program_stopped_.exchange(false)
+            || control_program_disconnected_.load()))
+    {
+      ROS_WARN("Control program failed, restarting it...");
+      DetachControlProgram();
+      control_program_restart_time_ = std::chrono::steady_clock::now();
+      next_control_program_upload_time_ = control_program_restart_time_;
+      robot_mode_data_channel_.Update();
+      control_program_failed_sequence_
+          = robot_mode_data_channel_.LatestSequence();
+    }
+    if (control_program_sock_fd_ < 0)
+    {
+      const int32_t control_program_sock_fd = StepControlProgramStart();
+      if (control_program_sock_fd >= 0)
+      {
+        // Commands posted while restarting were left with the old sender,
+        // and the new program starts idle, without a trajectory
+        waypoint_stream_.Reset();
+        in_teach_mode_.store(false);
+        AttachControlProgram(control_program_sock_fd);
+        ROS_INFO("Restarted robot control interface with fd %d after %f"
+                 " seconds", control_program_sock_fd,
+                 std::chrono::duration<double>(
+                     std::chrono::steady_clock::now()
+                     - control_program_restart_time_).count());
+      }
+    }
+  }
+
+  // Exits the control program and disconnects from the robot. Safe to call
+  // more than once.
+  void Stop()
+  {
+    if (!started_)
+    {
+      return;
+    }
+    started_ = false;
+    // No controller plugin command may follow the exit command
+    if (controller_plugin_command_sender_ptr_)
+    {
+      controller_plugin_command_sender_ptr_->Stop();
+    }
+    if (shared_memory_ptr_)
+    {
+      shared_memory_ptr_->Stop();
+      nh_.getCallbackQueue()->removeByID(SharedCommandsCallbackId());
+    }
+    if (control_program_sock_fd_ >= 0)
+    {
+      // Stopping the sender sends any pending commands, ending with the exit
+      control_command_sender_ptr_->Post(
+          ControlScriptCommand::MakeExitProgramCommand());
+      DetachControlProgram();
+    }
+    if (control_listen_sock_fd_ >= 0)
+    {
+      close(control_listen_sock_fd_);
+      control_listen_sock_fd_ = -1;
+    }
+    if (dashboard_ptr_)
+    {
+      dashboard_ptr_->StopRecv();
+    }
+    if (primary_ptr_)
+    {
+      primary_ptr_->StopRecv();
+    }
+    robot_ptr_->StopRecv();
+  }
+
+  // Watches the newly connected control program socket on the reactor, and
+  // starts sending commands to it.
+  void AttachControlProgram(const int32_t control_program_sock_fd)
+  {
+    control_program_sock_fd_ = control_program_sock_fd;
+    num_waypoint_report_bytes_ = 0;
+    num_waypoints_consumed_.store(0);
+    control_program_disconnected_.store(false);
+    // Only the program being replaced can have stopped before now
+    control_program_stopped_.store(false);
+    reactor_.AddSource(control_program_sock_fd, [this, control_program_sock_fd]
+    {
+      return ReceiveWaypointReports(control_program_sock_fd);
+    });
+    StartCommandSender(control_program_sock_fd);
+  }
+
+  void DetachControlProgram()
+  {
+    control_command_sender_ptr_->Stop();
+    reactor_.RemoveSource(control_program_sock_fd_);
+    close(control_program_sock_fd_);
+    control_program_sock_fd_ = -1;
+  }
+
+  inline uint64_t SharedCommandsCallbackId() const
+  {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(this));
+  }
+
+  // Called from the shared memory server thread
+  void QueueSharedCommands()
+  {
+    if (!shared_commands_queued_.exchange(true))
+    {
+      nh_.getCallbackQueue()->addCallback(shared_commands_callback_,
+                                          SharedCommandsCallbackId());
+    }
+  }
+
+  // Handles every command posted through shared memory so far, with the
+  // same checks and limits as the command topics
+  void HandleSharedCommands()
+  {
+    // Commands posted from here on queue the callback again
+    shared_commands_queued_.store(false);
+    URSharedCommand command;
+    while (shared_memory_ptr_->TakeCommand(command))
+    {
+      const std::vector<double> values(command.values.begin(),
+                                       command.values.end());
+      if (!AllFinite(values))
+      {
+        ROS_WARN("Invalid shared memory command, values are NAN or INF");
+      }
+      else if (command.type == kSharedCommandSpeedJ)
+      {
+        PublishSharedVelocityCommand(values);
+        CommandJointVelocities(values);
+      }
+      else if (command.type == kSharedCommandSpeedLBase)
+      {
+        PublishSharedTwistCommand(values, base_frame_);
+        CommandTwist(values, base_frame_);
+      }
+      else if (command.type == kSharedCommandSpeedLTool)
+      {
+        PublishSharedTwistCommand(values, ee_frame_);
+        CommandTwist(values, ee_frame_);
+      }
+      else
+      {
+        ROS_WARN("Invalid shared memory command type %u", command.type);
+      }
+    }
+  }
+
+  void PublishSharedVelocityCommand(const std::vector<double>& velocities)
+  {
+    if (shared_velocity_command_pub_.getNumSubscribers() > 0)
+    {
+      lightweight_ur_interface::VelocityCommand command_msg;
+      command_msg.name = joint_names_;
+      command_msg.velocity = velocities;
+      shared_velocity_command_pub_.publish(command_msg);
+    }
+  }
+
+  void PublishSharedTwistCommand(const std::vector<double>& twist,
+                                 const std::string& frame)
+  {
+    if (shared_twist_command_pub_.getNumSubscribers() > 0)
+    {
+      geometry_msgs::TwistStamped command_msg;
+      command_msg.header.frame_id = frame;
+      command_msg.header.stamp = ros::Time::now();
+      command_msg.twist.linear.x = twist[0];
+      command_msg.twist.linear.y = twist[1];
+      command_msg.twist.linear.z = twist[2];
+      command_msg.twist.angular.x = twist[3];
+      command_msg.twist.angular.y = twist[4];
+      command_msg.twist.angular.z = twist[5];
+      shared_twist_command_pub_.publish(command_msg);
+    }
+  }
+
+  static bool AllFinite(const std::vector<double>& values)
+  {
+    bool all_finite = true;
+    for (const double value : values)
+    {
+      if (!std::isfinite(value))
+      {
+        all_finite = false;
+      }
+    }
+    return all_finite;
+  }
+
+  // Called from the robot recv thread with each state. Steps every
+  // controller plugin, and sends the command of the last to return one.
+  void RunControllerPlugins(const URSharedState& state)
+  {
+    const uint64_t last_sample_time_ns = last_plugin_sample_time_ns_;
+    last_plugin_sample_time_ns_ = state.sample_time_ns;
+    // The interval is only known from the second state on
+    const double control_interval
+        = (state.sample_time_ns > last_sample_time_ns)
+          ? static_cast<double>(state.sample_time_ns - last_sample_time_ns)
+            * 1e-9
+          : 0.0;
+    if ((last_sample_time_ns > 0) && (control_interval > 0.0)
+        && (control_interval <= MAX_PLUGIN_CONTROL_INTERVAL))
+    {
+      bool command_valid = false;
+      URSharedCommand command;
+      for (const auto& controller_plugin : controller_plugins_)
+      {
+        URSharedCommand plugin_command;
+        if (controller_plugin->Update(state, control_interval, plugin_command))
         {
-          perror(nullptr);
-          ROS_ERROR("Failed to send command with %zu bytes, sent %zd instead",
-                    buffer.size(), bytes_written);
-          ROS_INFO(
-              "Trying to restart/reconnect to the robot control script...");
-          close(control_program_sock_fd);
-          close(control_program_incoming_sock_fd);
-          exit(1);
-          const std::pair<int32_t, int32_t> new_control_program_socket_fds
-              = StartControlProgram(our_ip_address_,
-                                    control_port_,
-                                    FLOAT_CONVERSION_RATIO,
-                                    STOP_DECELERATION,
-                                    SPEED_ACCELERATION,
-                                    SPEED_COMMAND_WAIT);
-          control_program_incoming_sock_fd
-              = new_control_program_socket_fds.first;
-          control_program_sock_fd = new_control_program_socket_fds.second;
-          ROS_INFO(
-              "Restarted/reconnected robot control interface with fds %d, %d",
-               control_program_incoming_sock_fd, control_program_sock_fd);
+          command = plugin_command;
+          command_valid = true;
         }
       }
-      control_script_command_queue_.clear();
-      looprate.sleep();
+      if (command_valid)
+      {
+        ControllerPluginCommand plugin_command;
+        plugin_command.command = command;
+        plugin_command.tcp_orientation = state.tcp_orientation;
+        controller_plugin_command_sender_ptr_->Dispatch(plugin_command);
+      }
+    }
+  }
+
+  // Called from the controller plugin command thread. Applies the same
+  // checks and limits as the command topics, and posts the command to the
+  // sender.
+  void SendControllerPluginCommand(
+      const ControllerPluginCommand& plugin_command)
+  {
+    const URSharedCommand& command = plugin_command.command;
+    const std::vector<double> values(command.values.begin(),
+                                     command.values.end());
+    if (!AllFinite(values))
+    {
+      ROS_WARN_THROTTLE(
+          1.0, "Invalid controller plugin command, values are NAN or INF");
+    }
+    else if (command.type == kSharedCommandSpeedJ)
+    {
+      PostControllerPluginCommand(
+          ControlScriptCommand::MakeSpeedJCommand(
+              LimitJointVelocities(values)));
+    }
+    else if (command.type == kSharedCommandSpeedLBase)
+    {
+      PostControllerPluginCommand(
+          ControlScriptCommand::MakeSpeedLCommand(values));
+    }
+    else if (command.type == kSharedCommandSpeedLTool)
+    {
+      const std::array<double, 4>& tcp_orientation
+          = plugin_command.tcp_orientation;
+      const Eigen::Quaterniond tcp_rotation(tcp_orientation[3],
+                                            tcp_orientation[0],
+                                            tcp_orientation[1],
+                                            tcp_orientation[2]);
+      PostControllerPluginCommand(
+          ControlScriptCommand::MakeSpeedLCommand(
+              RotateTwist(tcp_rotation, values)));
+    }
+    else
+    {
+      ROS_WARN_THROTTLE(1.0, "Invalid controller plugin command type %u",
+                        command.type);
+    }
+  }
+
+  void PostControllerPluginCommand(const ControlScriptCommand& command)
+  {
+    std::lock_guard<std::mutex> lock(command_sender_mutex_);
+    if (in_teach_mode_.load())
+    {
+      ROS_WARN_THROTTLE(
+          1.0, "Ignoring controller plugin command since robot is in teach"
+          " mode");
+    }
+    else if (control_command_sender_ptr_)
+    {
+      controller_plugin_commanded_.store(true);
+      control_command_sender_ptr_->Post(command);
+    }
+  }
+
+  static URSharedState MakeSharedState(const URRealtimeState& robot_state)
+  {
+    URSharedState shared_state;
+    shared_state.sample_time_ns
+        = static_cast<uint64_t>(robot_state.SampleTimeNanoseconds());
+    shared_state.joint_position = robot_state.ActualPositionArray();
+    shared_state.joint_velocity = robot_state.ActualVelocityArray();
+    // As published in joint states
+    shared_state.joint_effort = robot_state.TargetTorqueArray();
+    const Eigen::Isometry3d& tcp_pose = robot_state.ActualTcpPose();
+    const Eigen::Vector3d tcp_position = tcp_pose.translation();
+    const Eigen::Quaterniond tcp_orientation(tcp_pose.rotation());
+    shared_state.tcp_position
+        = {{tcp_position.x(), tcp_position.y(), tcp_position.z()}};
+    shared_state.tcp_orientation
+        = {{tcp_orientation.x(), tcp_orientation.y(), tcp_orientation.z(),
+            tcp_orientation.w()}};
+    const Eigen::Matrix<double, 6, 1>& tcp_twist
+        = robot_state.ActualTcpTwist();
+    std::copy(tcp_twist.data(), tcp_twist.data() + 6,
+              shared_state.tcp_twist.begin());
+    return shared_state;
+  }
+
+  void StartCommandSender(const int32_t control_program_sock_fd)
+  {
+    const std::function<bool(const std::vector<ControlScriptCommand>&)>
+        send_fn = [this, control_program_sock_fd] (
+            const std::vector<ControlScriptCommand>& commands)
+    {
+      return SendCommands(control_program_sock_fd, commands);
+    };
+    // When phase-locked, each batch waits for the send time of the next
+    // state, but is sent anyway if the robot stops streaming states. That
+    // already limits sends to one per state, so no extra spacing is needed.
+    std::function<void(void)> pace_fn;
+    double min_send_spacing = min_command_spacing_;
+    if (phase_lock_ptr_)
+    {
+      pace_fn = [this] ()
+      {
+        phase_lock_ptr_->WaitForSendTime(PHASE_LOCK_TIMEOUT);
+      };
+      min_send_spacing = 0.0;
     }
-    const ControlScriptCommand exit_command
-        = ControlScriptCommand::MakeExitProgramCommand();
-    std::vector<uint8_t> buffer;
-    exit_command.SerializeSelf(FLOAT_CONVERSION_RATIO, buffer);
+    std::unique_ptr<CommandSenderThread<ControlScriptCommand>>
+        control_command_sender(
+            new CommandSenderThread<ControlScriptCommand>(
+                COMMAND_QUEUE_RESERVE_SIZE, min_send_spacing, send_fn,
+                pace_fn));
+    std::lock_guard<std::mutex> lock(command_sender_mutex_);
+    control_command_sender_ptr_ = std::move(control_command_sender);
+    control_command_sender_ptr_->Start([this] ()
+    {
+      tri_realtime_common::ConfigureCurrentThread(
+          command_sender_thread_config_, "ur_command_send",
+          [] (const std::string& message)
+      {
+        ROS_INFO("%s", message.c_str());
+      });
+    });
+  }
+
+  // Called from the sender thread. Sends all commands with a single write.
+  bool SendCommands(const int32_t control_program_sock_fd,
+                    const std::vector<ControlScriptCommand>& commands)
+  {
+    const size_t encoded_size
+        = EncodeCommands(commands, control_command_wire_buffer_);
     const ssize_t bytes_written = write(control_program_sock_fd,
-                                        buffer.data(),
-                                        buffer.size());
-    if (bytes_written != static_cast<ssize_t>(buffer.size()))
+                                        control_command_wire_buffer_.data(),
+                                        encoded_size);
+    if (bytes_written != static_cast<ssize_t>(encoded_size))
     {
       perror(nullptr);
-      ROS_ERROR("Failed to send command with %zu bytes, sent %zd instead",
-                buffer.size(), bytes_written);
+      ROS_ERROR("Failed to send commands with %zu bytes, sent %zd instead",
+                encoded_size, bytes_written);
+      return false;
     }
-    close(control_program_sock_fd);
-    close(control_program_incoming_sock_fd);
-    robot_ptr_->StopRecv();
+    return true;
   }
 
-  std::pair<int32_t, int32_t> StartControlProgram(
-      const std::string& our_ip_address,
-      const int32_t control_port,
-      const double float_conversion_ratio,
-      const double stop_deceleration,
-      const double speed_acceleration,
-      const double speed_command_wait)
+  // Encodes commands back-to-back into wire_buffer, which only grows when a
+  // batch is larger than any before it. Returns the number of bytes encoded.
+  static size_t EncodeCommands(
+      const std::vector<ControlScriptCommand>& commands,
+      std::vector<uint8_t>& wire_buffer)
   {
-    const std::string control_script_string
-        = lightweight_ur_driver::MakeControlProgram(our_ip_address,
-                                                    control_port,
-                                                    float_conversion_ratio,
-                                                    stop_deceleration,
-                                                    speed_acceleration,
-                                                    speed_command_wait);
-    const bool success = robot_ptr_->SendURScriptCommand(control_script_string);
-    if (success)
+    const size_t encoded_size
+        = commands.size() * ControlScriptCommand::WIRE_SIZE;
+    if (wire_buffer.size() < encoded_size)
     {
-      ROS_INFO("Uploaded control program");
+      wire_buffer.resize(encoded_size);
     }
-    else
+    for (size_t idx = 0; idx < commands.size(); idx++)
     {
-      throw std::runtime_error("Failed to upload control program");
+      commands[idx].Encode(
+          FLOAT_CONVERSION_RATIO,
+          wire_buffer.data() + (idx * ControlScriptCommand::WIRE_SIZE));
     }
-    // Setup communications with the control program
-    int incoming_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (incoming_sock_fd < 0)
+    return encoded_size;
+  }
+
+  // Called from the reactor thread whenever the control program socket is
+  // readable. Reads the running totals of consumed waypoints the control
+  // program reports as its buffer drains, without blocking. Returns false
+  // once the program has closed its connection, so the reactor stops
+  // watching the socket.
+  bool ReceiveWaypointReports(const int32_t control_program_sock_fd)
+  {
+    while (true)
+    {
+      const ssize_t bytes_read
+          = recv(control_program_sock_fd,
+                 waypoint_report_bytes_.data() + num_waypoint_report_bytes_,
+                 waypoint_report_bytes_.size() - num_waypoint_report_bytes_,
+                 MSG_DONTWAIT);
+      if (bytes_read < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        {
+          return true;
+        }
+      }
+      if (bytes_read <= 0)
+      {
+        control_program_disconnected_.store(true);
+        return false;
+      }
+      num_waypoint_report_bytes_ += static_cast<size_t>(bytes_read);
+      if (num_waypoint_report_bytes_ == waypoint_report_bytes_.size())
+      {
+        uint32_t network_value = 0;
+        std::memcpy(&network_value, waypoint_report_bytes_.data(),
+                    sizeof(network_value));
+        const int32_t num_consumed
+            = static_cast<int32_t>(be32toh(network_value));
+        num_waypoints_consumed_.store(
+            static_cast<uint64_t>(std::max(num_consumed, 0)));
+        num_waypoint_report_bytes_ = 0;
+      }
+    }
+  }
+
+  void SendWaypoints()
+  {
+    const std::vector<ControlScriptCommand> commands
+        = waypoint_stream_.TakeCommands();
+    for (const ControlScriptCommand& command : commands)
+    {
+      control_command_sender_ptr_->Post(command);
+    }
+  }
+
+  static std::chrono::steady_clock::time_point SecondsFromNow(
+      const double seconds)
+  {
+    return std::chrono::steady_clock::now()
+           + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+               std::chrono::duration<double>(seconds));
+  }
+
+  // Opens the socket the control program connects back to. It is
+  // non-blocking, so that the housekeeping loop keeps running while a program
+  // starts.
+  static int32_t OpenControlListenSocket(const int32_t control_port)
+  {
+    const int32_t listen_sock_fd
+        = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_sock_fd < 0)
     {
       throw std::runtime_error(
             "ERROR opening socket for control program communication");
@@ -524,13 +1554,14 @@ public:
     serv_addr.sin_port = htons(static_cast<uint16_t>(control_port));
     int flag = 1;
     setsockopt(
-        incoming_sock_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+        listen_sock_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
     setsockopt(
-        incoming_sock_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(int));
-    if (bind(incoming_sock_fd, reinterpret_cast<struct sockaddr*>(&serv_addr),
+        listen_sock_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(int));
+    if (bind(listen_sock_fd, reinterpret_cast<struct sockaddr*>(&serv_addr),
              sizeof(serv_addr))
         < 0)
     {
+      close(listen_sock_fd);
       throw std::runtime_error(
             "ERROR on binding socket for control program communication");
     }
@@ -538,23 +1569,298 @@ public:
     {
       ROS_INFO("Bound socket for control program communication");
     }
-    listen(incoming_sock_fd, 5);
-    struct sockaddr_in cli_addr;
-    socklen_t clilen;
-    clilen = sizeof(cli_addr);
-    int new_sock_fd = accept(
-        incoming_sock_fd, reinterpret_cast<struct sockaddr*>(&cli_addr),
-        &clilen);
-    if (new_sock_fd < 0)
+    listen(listen_sock_fd, 5);
+    return listen_sock_fd;
+  }
+
+  bool UploadControlProgram()
+  {
+    const std::string control_script_string
+        = lightweight_ur_driver::MakeControlProgram(our_ip_address_,
+                                                    control_port_,
+                                                    FLOAT_CONVERSION_RATIO,
+                                                    STOP_DECELERATION,
+                                                    SPEED_ACCELERATION,
+                                                    SPEED_COMMAND_WAIT,
+                                                    servoj_time_,
+                                                    servoj_lookahead_time_,
+                                                    servoj_gain_,
+                                                    WAYPOINT_BUFFER_SIZE,
+                                                    WAYPOINT_LOW_WATER_MARK);
+    awaiting_program_start_.store(true);
+    control_program_connected_.store(false);
+    if (robot_ptr_->SendURScriptCommand(control_script_string))
     {
-      throw std::runtime_error(
-            "ERROR on accepting control program communication");
+      ROS_INFO("Uploaded control program");
+      return true;
+    }
+    else
+    {
+      ROS_WARN("Failed to upload control program");
+      return false;
+    }
+  }
+
+  // Asks the dashboard server to unlock a protective stop, unless disabled
+  // or already asked. Controllers refuse for the first few seconds after the
+  // stop, so this is retried until it succeeds.
+  void UnlockProtectiveStop()
+  {
+    if (!dashboard_ptr_ || !unlock_protective_stops_)
+    {
+      ROS_WARN_THROTTLE(5.0, "Waiting for the protective stop to be unlocked"
+                        " on the teach pendant");
+      return;
+    }
+    if (protective_stop_unlock_pending_.exchange(true))
+    {
+      return;
+    }
+    dashboard_ptr_->UnlockProtectiveStop(
+        [this] (const URDashboardReply& reply)
+    {
+      if (reply.success)
+      {
+        ROS_INFO("Unlocked protective stop");
+      }
+      else
+      {
+        ROS_WARN_THROTTLE(1.0, "Failed to unlock protective stop [%s]",
+                          reply.reply.c_str());
+      }
+      protective_stop_unlock_pending_.store(false);
+    });
+  }
+
+  // Advances starting the control program by one step without blocking:
+  // waits out protective stops (unlocking them if enabled), uploads the
+  // program, and accepts its connection back. Returns the connected socket,
+  // or -1 until the program has connected.
+  int32_t StepControlProgramStart()
+  {
+    const std::chrono::steady_clock::time_point now
+        = std::chrono::steady_clock::now();
+    if (control_program_uploaded_)
+    {
+      const int32_t sock_fd = accept4(control_listen_sock_fd_, nullptr,
+                                      nullptr, SOCK_CLOEXEC);
+      if (sock_fd >= 0)
+      {
+        ROS_INFO("Accepted connection for control program communication");
+        control_program_uploaded_ = false;
+        control_program_connected_.store(true);
+        return sock_fd;
+      }
+      if (now < control_program_connect_deadline_)
+      {
+        return -1;
+      }
+      ROS_WARN("Control program did not connect within %f seconds",
+               CONTROL_PROGRAM_CONNECT_TIMEOUT);
+      control_program_uploaded_ = false;
+    }
+    if (now < next_control_program_upload_time_)
+    {
+      return -1;
+    }
+    // A closed connection is seen before primary state shows why the program
+    // stopped, so wait for state from after the failure
+    if (primary_ptr_ && primary_ptr_->IsConnected())
+    {
+      robot_mode_data_channel_.Update();
+      if (robot_mode_data_channel_.LatestSequence()
+          <= control_program_failed_sequence_)
+      {
+        return -1;
+      }
+    }
+    next_control_program_upload_time_
+        = SecondsFromNow(CONTROL_PROGRAM_RETRY_PERIOD);
+    if (!robot_ptr_->IsConnected())
+    {
+      ROS_WARN_THROTTLE(5.0, "Waiting for the robot connection to start the"
+                        " control program");
+      return -1;
+    }
+    if (primary_ptr_)
+    {
+      robot_mode_data_channel_.Update();
+      if (primary_ptr_->IsConnected()
+          && (robot_mode_data_channel_.LatestSequence() > 0))
+      {
+        const URRobotModeData& robot_mode_data
+            = robot_mode_data_channel_.Latest();
+        if (robot_mode_data.emergency_stopped)
+        {
+          ROS_WARN_THROTTLE(5.0, "Waiting for the emergency stop to be"
+                            " released");
+          return -1;
+        }
+        if (robot_mode_data.protective_stopped)
+        {
+          UnlockProtectiveStop();
+          return -1;
+        }
+      }
+    }
+    if (UploadControlProgram())
+    {
+      control_program_uploaded_ = true;
+      control_program_connect_deadline_
+          = SecondsFromNow(CONTROL_PROGRAM_CONNECT_TIMEOUT);
+    }
+    return -1;
+  }
+
+  void ReportDroppedStates()
+  {
+    const uint64_t dropped_states = state_publisher_ptr_->DroppedCount();
+    if (dropped_states > reported_dropped_states_)
+    {
+      ROS_WARN_THROTTLE(1.0, "State publisher fell behind, dropped %lu states"
+                        " (%lu total)",
+                        dropped_states - reported_dropped_states_,
+                        dropped_states);
+      reported_dropped_states_ = dropped_states;
+    }
+  }
+
+  void PublishDiagnostics(const ros::Time& now)
+  {
+    const URRealtimeArrivalStatistics statistics
+        = robot_ptr_->ArrivalStatistics();
+    const auto make_value = [] (const std::string& key, const double value)
+    {
+      diagnostic_msgs::KeyValue key_value;
+      key_value.key = key;
+      key_value.value = std::to_string(value);
+      return key_value;
+    };
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = "UR realtime interface";
+    status.hardware_id = robot_host_;
+    if (!robot_ptr_->IsConnected())
+    {
+      status.level = diagnostic_msgs::DiagnosticStatus::STALE;
+      status.message = "Not connected";
+    }
+    else if (statistics.NumGaps() > reported_gaps_)
+    {
+      status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+      status.message = "Detected "
+                       + std::to_string(statistics.NumGaps() - reported_gaps_)
+                       + " new gaps in state packets";
     }
     else
     {
-      ROS_INFO("Accepted connection for control program communication");
+      status.level = diagnostic_msgs::DiagnosticStatus::OK;
+      status.message = "Receiving state packets";
+    }
+    reported_gaps_ = statistics.NumGaps();
+    const URRunningStatistic& period = statistics.ArrivalPeriod();
+    const URRunningStatistic& jitter = statistics.Jitter();
+    status.values.push_back(make_value(
+        "Packets", static_cast<double>(statistics.NumPackets())));
+    status.values.push_back(make_value(
+        "Controller period (s)", statistics.ControllerPeriod()));
+    status.values.push_back(make_value("Arrival period mean (s)",
+                                       period.Mean()));
+    status.values.push_back(make_value("Arrival period stddev (s)",
+                                       period.StdDev()));
+    status.values.push_back(make_value("Arrival period min (s)",
+                                       period.Min()));
+    status.values.push_back(make_value("Arrival period max (s)",
+                                       period.Max()));
+    status.values.push_back(make_value("Jitter mean (s)", jitter.Mean()));
+    status.values.push_back(make_value("Jitter stddev (s)", jitter.StdDev()));
+    status.values.push_back(make_value("Jitter min (s)", jitter.Min()));
+    status.values.push_back(make_value("Jitter max (s)", jitter.Max()));
+    status.values.push_back(make_value(
+        "Gaps", static_cast<double>(statistics.NumGaps())));
+    status.values.push_back(make_value(
+        "Missed packets", static_cast<double>(statistics.NumMissedPackets())));
+    const URControllerClockEstimate clock_estimate
+        = robot_ptr_->ControllerClockEstimate();
+    if (clock_estimate.Valid())
+    {
+      status.values.push_back(make_value("Controller clock drift (ppm)",
+                                         clock_estimate.DriftPpm()));
+    }
+    if (primary_ptr_)
+    {
+      robot_mode_data_channel_.Update();
+      if (primary_ptr_->IsConnected()
+          && (robot_mode_data_channel_.LatestSequence() > 0))
+      {
+        const URRobotModeData& robot_mode_data
+            = robot_mode_data_channel_.Latest();
+        if (robot_mode_data.protective_stopped
+            || robot_mode_data.emergency_stopped)
+        {
+          status.level = diagnostic_msgs::DiagnosticStatus::ERROR;
+          status.message = robot_mode_data.emergency_stopped
+                           ? "Emergency stopped" : "Protective stopped";
+        }
+        else if (!robot_mode_data.program_running
+                 && (status.level == diagnostic_msgs::DiagnosticStatus::OK))
+        {
+          status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+          status.message = "Control program not running";
+        }
+        diagnostic_msgs::KeyValue robot_mode;
+        robot_mode.key = "Robot mode";
+        robot_mode.value = RobotModeName(robot_mode_data.robot_mode);
+        status.values.push_back(robot_mode);
+        status.values.push_back(make_value(
+            "Program running", robot_mode_data.program_running ? 1.0 : 0.0));
+        status.values.push_back(make_value(
+            "Protective stopped",
+            robot_mode_data.protective_stopped ? 1.0 : 0.0));
+        status.values.push_back(make_value(
+            "Emergency stopped",
+            robot_mode_data.emergency_stopped ? 1.0 : 0.0));
+        status.values.push_back(make_value("Speed scaling",
+                                           robot_mode_data.speed_scaling));
+      }
+    }
+    status.values.push_back(make_value(
+        "Commands posted",
+        static_cast<double>(control_command_sender_ptr_->NumPosted())));
+    status.values.push_back(make_value(
+        "Commands superseded",
+        static_cast<double>(control_command_sender_ptr_->NumSuperseded())));
+    status.values.push_back(make_value(
+        "Commands sent",
+        static_cast<double>(control_command_sender_ptr_->NumDelivered())));
+    if (waypoint_stream_.Active() || (waypoint_stream_.NumBuffered() > 0))
+    {
+      status.values.push_back(make_value(
+          "Waypoints buffered (at most)",
+          static_cast<double>(waypoint_stream_.NumBuffered())));
+    }
+    if (phase_lock_ptr_)
+    {
+      const URPhaseLockStatistics phase_lock_statistics
+          = phase_lock_ptr_->Statistics();
+      const URRunningStatistic& send_phase
+          = phase_lock_statistics.SendPhase();
+      status.values.push_back(make_value("Send phase mean (s)",
+                                         send_phase.Mean()));
+      status.values.push_back(make_value("Send phase stddev (s)",
+                                         send_phase.StdDev()));
+      status.values.push_back(make_value("Send phase max (s)",
+                                         send_phase.Max()));
+      status.values.push_back(make_value(
+          "Send overruns",
+          static_cast<double>(phase_lock_statistics.NumOverruns())));
+      status.values.push_back(make_value(
+          "States without a send",
+          static_cast<double>(phase_lock_statistics.NumSkippedStates())));
     }
-    return std::make_pair(incoming_sock_fd, new_sock_fd);
+    diagnostic_msgs::DiagnosticArray diagnostics_msg;
+    diagnostics_msg.header.stamp = now;
+    diagnostics_msg.status.push_back(status);
+    diagnostics_pub_.publish(diagnostics_msg);
   }
 
   void PublishState(const std::vector<std::string>& joint_names,
@@ -562,8 +1868,11 @@ public:
             const std::string& ee_frame_name,
             const URRealtimeState& robot_state)
   {
-    // Get the current time
-    const ros::Time state_time = ros::Time::now();
+    // Stamp with the estimated time the controller sampled the state, which
+    // excludes network delay and our own wakeup, decode and dispatch latency
+    ros::Time state_time;
+    state_time.fromNSec(
+        static_cast<uint64_t>(robot_state.SampleTimeNanoseconds()));
     // Joint State
     sensor_msgs::JointState joint_state_msg;
     joint_state_msg.header.stamp = state_time;
@@ -571,11 +1880,6 @@ public:
     joint_state_msg.position = robot_state.ActualPosition();
     joint_state_msg.velocity = robot_state.ActualVelocity();
     joint_state_msg.effort = robot_state.TargetTorque();
-    latest_state_mutex_.lock();
-    latest_joint_state_ = joint_state_msg;
-    latest_tcp_pose_ = robot_state.ActualTcpPose();
-    valid_latest_state_ = true;
-    latest_state_mutex_.unlock();
     // EE transform
     geometry_msgs::PoseStamped ee_transform_msg
         = EigenIsometry3dToGeometryPoseStamped(robot_state.ActualTcpPose(),
@@ -625,11 +1929,14 @@ public:
   bool SwitchTeachModeCB(std_srvs::SetBool::Request& req,
                          std_srvs::SetBool::Response& res)
   {
+    // No controller plugin command may be posted after entering teach mode
+    std::lock_guard<std::mutex> lock(command_sender_mutex_);
     if (req.data)
     {
       if (in_teach_mode_.load() == false)
       {
-        control_script_command_queue_.push_back(
+        waypoint_stream_.Cancel();
+        control_command_sender_ptr_->Post(
               ControlScriptCommand::MakeTeachModeCommand());
         in_teach_mode_.store(true);
         res.success = true;
@@ -645,7 +1952,7 @@ public:
     {
       if (in_teach_mode_.load() == true)
       {
-        control_script_command_queue_.push_back(
+        control_command_sender_ptr_->Post(
               ControlScriptCommand::MakeExitTeachModeCommand());
         in_teach_mode_.store(false);
         res.success = true;
@@ -684,48 +1991,295 @@ public:
         const auto found_itr = command_map.find(joint_name);
         if (found_itr != command_map.end())
         {
-          const double velocity = found_itr->second;
+          target_velocity[idx] = found_itr->second;
+        }
+        else
+        {
+          ROS_WARN("Invalid VelocityCommand: joint %s missing",
+                   joint_name.c_str());
+          command_valid = false;
+        }
+      }
+      if (command_valid)
+      {
+        CommandJointVelocities(target_velocity);
+      }
+    }
+    else
+    {
+      ROS_WARN("Invalid VelocityCommand: %zu names, %zu velocities",
+               config_target.name.size(), config_target.velocity.size());
+    }
+  }
+
+  // Limits joint velocities, in joint name order
+  std::vector<double> LimitJointVelocities(
+      const std::vector<double>& target_velocity) const
+  {
+    std::vector<double> limited_target_velocity(target_velocity);
+    for (size_t idx = 0; idx < joint_names_.size(); idx++)
+    {
+      // Get the limits for the joint
+      const auto limits_found_itr = joint_limits_.find(joint_names_[idx]);
+      // If we have limits saved, limit the joint command. If we don't have
+      // limits saved, then we don't need to limit.
+      if (limits_found_itr != joint_limits_.end())
+      {
+        const double velocity_limit = limits_found_itr->second.MaxVelocity();
+        limited_target_velocity[idx]
+            = ClampValueAndWarn(target_velocity[idx], -velocity_limit,
+                                velocity_limit);
+      }
+    }
+    return limited_target_velocity;
+  }
+
+  // Limits joint velocities, in joint name order, and sends them to the
+  // robot with speedj
+  void CommandJointVelocities(const std::vector<double>& target_velocity)
+  {
+    if (in_teach_mode_.load() == false)
+    {
+      waypoint_stream_.Cancel();
+      control_command_sender_ptr_->Post(
+            ControlScriptCommand::MakeSpeedJCommand(
+                LimitJointVelocities(target_velocity)));
+    }
+    else
+    {
+      ROS_WARN("Ignoring velocity command since robot is in teach mode");
+    }
+  }
+
+  // Streams joint position setpoints to the robot, which tracks them with
+  // servoj. Setpoints should be sent at the robot's control rate, each a
+  // small step from the last; the robot makes no attempt to limit the
+  // velocity needed to reach a distant setpoint.
+  void ServoCommandCallback(
+      lightweight_ur_interface::PositionCommand config_target)
+  {
+    if (config_target.name.size() == config_target.position.size())
+    {
+      // Push the command into a map
+      std::map<std::string, double> command_map;
+      for (size_t idx = 0; idx < config_target.name.size(); idx++)
+      {
+        const std::string& name = config_target.name[idx];
+        const double command = config_target.position[idx];
+        command_map[name] = command;
+      }
+      // Extract the joint commands in order
+      std::vector<double> target_position(joint_names_.size(), 0.0);
+      bool command_valid = true;
+      for (size_t idx = 0; idx < joint_names_.size(); idx++)
+      {
+        const std::string& joint_name = joint_names_[idx];
+        const auto found_itr = command_map.find(joint_name);
+        if ((found_itr != command_map.end())
+            && std::isfinite(found_itr->second))
+        {
+          const double position = found_itr->second;
           // Get the limits for the joint
           const auto limits_found_itr = joint_limits_.find(joint_name);
           // If we have limits saved, limit the joint command
           if (limits_found_itr != joint_limits_.end())
           {
-            const double velocity_limit
-                = limits_found_itr->second.MaxVelocity();
-            const double limited_velocity
-                = ClampValueAndWarn(velocity, -velocity_limit, velocity_limit);
-            target_velocity[idx] = limited_velocity;
+            target_position[idx]
+                = ClampValueAndWarn(position,
+                                    limits_found_itr->second.MinPosition(),
+                                    limits_found_itr->second.MaxPosition());
           }
           // If we don't have limits saved, then we don't need to limit
           else
           {
-            target_velocity[idx] = velocity;
+            target_position[idx] = position;
           }
         }
         else
         {
-          ROS_WARN("Invalid VelocityCommand: joint %s missing",
-                   joint_name.c_str());
+          ROS_WARN("Invalid servo PositionCommand: joint %s missing or not"
+                   " finite", joint_name.c_str());
           command_valid = false;
         }
       }
       if (command_valid)
+      {
+        command_valid = LimitServoStep(target_position);
+      }
+      if (command_valid)
       {
         if (in_teach_mode_.load() == false)
         {
-          control_script_command_queue_.push_back(
-                ControlScriptCommand::MakeSpeedJCommand(target_velocity));
+          waypoint_stream_.Cancel();
+          control_command_sender_ptr_->Post(
+                ControlScriptCommand::MakeServoJCommand(target_position));
         }
         else
         {
-          ROS_WARN("Ignoring VelocityCommand since robot is in teach mode");
+          ROS_WARN("Ignoring servo PositionCommand since robot is in teach"
+                   " mode");
         }
       }
     }
     else
     {
-      ROS_WARN("Invalid VelocityCommand: %zu names, %zu velocities",
-               config_target.name.size(), config_target.velocity.size());
+      ROS_WARN("Invalid servo PositionCommand: %zu names, %zu positions",
+               config_target.name.size(), config_target.position.size());
+    }
+  }
+
+  // servoj moves as fast as it must to reach a setpoint, so clamps each joint
+  // setpoint to what the joint can cover in max_servo_step_time_ at its
+  // velocity limit from its latest actual position. Returns false if there
+  // is no state to check setpoints against.
+  bool LimitServoStep(std::vector<double>& target_position)
+  {
+    latest_state_channel_.Update();
+    if (latest_state_channel_.LatestSequence() > 0)
+    {
+      const std::array<double, 6>& actual_position
+          = latest_state_channel_.Latest().ActualPositionArray();
+      for (size_t idx = 0; idx < joint_names_.size(); idx++)
+      {
+        const std::string& joint_name = joint_names_[idx];
+        const auto limits_found_itr = joint_limits_.find(joint_name);
+        if (limits_found_itr != joint_limits_.end())
+        {
+          const double max_step
+              = limits_found_itr->second.MaxVelocity() * max_servo_step_time_;
+          const double step = target_position[idx] - actual_position[idx];
+          if (std::abs(step) > max_step)
+          {
+            ROS_WARN_THROTTLE(1.0, "Servo setpoint for joint %s is %f from"
+                              " its actual position, limiting to %f",
+                              joint_name.c_str(), step, max_step);
+            target_position[idx] = actual_position[idx]
+                                   + std::copysign(max_step, step);
+          }
+        }
+      }
+      return true;
+    }
+    else
+    {
+      ROS_WARN("Ignoring servo PositionCommand as latest state invalid");
+      return false;
+    }
+  }
+
+  // Streams a timed trajectory into the control program's waypoint buffer,
+  // replacing any trajectory being executed. The robot interpolates between
+  // the points itself and holds the final point, so brief network stalls do
+  // not disturb the motion. Points should be at least servoj_time apart. An
+  // empty trajectory stops the robot at its current target.
+  void WaypointTrajectoryCallback(trajectory_msgs::JointTrajectory trajectory)
+  {
+    // The first waypoint is reached from the current position
+    latest_state_channel_.Update();
+    if (latest_state_channel_.LatestSequence() == 0)
+    {
+      ROS_WARN("Ignoring waypoint JointTrajectory as latest state invalid");
+      return;
+    }
+    const std::array<double, 6>& actual_position
+        = latest_state_channel_.Latest().ActualPositionArray();
+    std::vector<double> previous_position(actual_position.begin(),
+                                          actual_position.end());
+    std::vector<std::vector<double>> waypoint_positions;
+    std::vector<double> waypoint_durations;
+    double previous_time = 0.0;
+    for (size_t tdx = 0; tdx < trajectory.points.size(); tdx++)
+    {
+      const trajectory_msgs::JointTrajectoryPoint& current_point
+          = trajectory.points[tdx];
+      if (current_point.positions.size() != trajectory.joint_names.size())
+      {
+        ROS_WARN("Invalid waypoint JointTrajectory: point %zu has %zu"
+                 " positions for %zu joints", tdx,
+                 current_point.positions.size(),
+                 trajectory.joint_names.size());
+        return;
+      }
+      const double time = current_point.time_from_start.toSec();
+      const double duration = time - previous_time;
+      if (!std::isfinite(time) || (duration <= 0.0)
+          || (duration > MAX_WAYPOINT_DURATION))
+      {
+        ROS_WARN("Invalid waypoint JointTrajectory: point %zu at %f seconds"
+                 " follows one at %f seconds", tdx, time, previous_time);
+        return;
+      }
+      // Push the point into a map
+      std::map<std::string, double> command_map;
+      for (size_t idx = 0; idx < trajectory.joint_names.size(); idx++)
+      {
+        const std::string& name = trajectory.joint_names[idx];
+        const double position = current_point.positions[idx];
+        command_map[name] = position;
+      }
+      // Extract the joint positions in order
+      std::vector<double> target_position(joint_names_.size(), 0.0);
+      for (size_t idx = 0; idx < joint_names_.size(); idx++)
+      {
+        const std::string& joint_name = joint_names_[idx];
+        const auto found_itr = command_map.find(joint_name);
+        if ((found_itr == command_map.end())
+            || !std::isfinite(found_itr->second))
+        {
+          ROS_WARN("Invalid waypoint JointTrajectory: joint %s missing or not"
+                   " finite", joint_name.c_str());
+          return;
+        }
+        const double position = found_itr->second;
+        const auto limits_found_itr = joint_limits_.find(joint_name);
+        if (limits_found_itr != joint_limits_.end())
+        {
+          target_position[idx]
+              = ClampValueAndWarn(position,
+                                  limits_found_itr->second.MinPosition(),
+                                  limits_found_itr->second.MaxPosition());
+        }
+        else
+        {
+          target_position[idx] = position;
+        }
+      }
+      // Each waypoint must be reachable from the one before it within the
+      // joint velocity limits, since the robot moves to it regardless
+      for (size_t idx = 0; idx < joint_names_.size(); idx++)
+      {
+        const std::string& joint_name = joint_names_[idx];
+        const auto limits_found_itr = joint_limits_.find(joint_name);
+        const double velocity
+            = std::abs(target_position[idx] - previous_position[idx])
+              / duration;
+        if ((limits_found_itr != joint_limits_.end())
+            && (velocity > (limits_found_itr->second.MaxVelocity()
+                            * WAYPOINT_VELOCITY_LIMIT_TOLERANCE)))
+        {
+          ROS_WARN("Invalid waypoint JointTrajectory: reaching point %zu needs"
+                   " %f rad/s on joint %s, above its limit of %f rad/s", tdx,
+                   velocity, joint_name.c_str(),
+                   limits_found_itr->second.MaxVelocity());
+          return;
+        }
+      }
+      previous_position = target_position;
+      waypoint_positions.push_back(target_position);
+      waypoint_durations.push_back(duration);
+      previous_time = time;
+    }
+    if (in_teach_mode_.load() == false)
+    {
+      ROS_INFO("Streaming %zu waypoints over %f seconds",
+               waypoint_positions.size(), previous_time);
+      waypoint_stream_.Start(waypoint_positions, waypoint_durations);
+      SendWaypoints();
+    }
+    else
+    {
+      ROS_WARN("Ignoring waypoint JointTrajectory since robot is in teach"
+               " mode");
     }
   }
 
@@ -776,84 +2330,156 @@ public:
                                              twist_command.twist.angular.x,
                                              twist_command.twist.angular.y,
                                              twist_command.twist.angular.z};
-      if (in_teach_mode_.load() == false)
+      CommandTwist(raw_twist, twist_command.header.frame_id);
+    }
+  }
+
+  // Rotates a twist in the end effector frame into the base frame
+  static std::vector<double> RotateTwist(
+      const Eigen::Quaterniond& tcp_rotation,
+      const std::vector<double>& ee_frame_twist)
+  {
+    const Eigen::Vector3d ee_frame_linear_velocity(ee_frame_twist[0],
+                                                   ee_frame_twist[1],
+                                                   ee_frame_twist[2]);
+    const Eigen::Vector3d ee_frame_angular_velocity(ee_frame_twist[3],
+                                                    ee_frame_twist[4],
+                                                    ee_frame_twist[5]);
+    const Eigen::Vector3d base_frame_linear_velocity
+        = RotateVector(tcp_rotation, ee_frame_linear_velocity);
+    const Eigen::Vector3d base_frame_angular_velocity
+        = RotateVector(tcp_rotation, ee_frame_angular_velocity);
+    return {base_frame_linear_velocity.x(),
+            base_frame_linear_velocity.y(),
+            base_frame_linear_velocity.z(),
+            base_frame_angular_velocity.x(),
+            base_frame_angular_velocity.y(),
+            base_frame_angular_velocity.z()};
+  }
+
+  // Sends a twist in the base or end effector frame to the robot with speedl
+  void CommandTwist(const std::vector<double>& raw_twist,
+                    const std::string& frame)
+  {
+    if (in_teach_mode_.load() == false)
+    {
+      if (frame == ee_frame_)
       {
-        if (twist_command.header.frame_id == ee_frame_)
-        {
-          latest_state_mutex_.lock();
-          const Eigen::Isometry3d latest_tcp_pose = latest_tcp_pose_;
-          const bool valid_latest_state = valid_latest_state_;
-          latest_state_mutex_.unlock();
-          if (valid_latest_state)
-          {
-            const Eigen::Quaterniond latest_tcp_rotation(
-                  latest_tcp_pose.rotation());
-            const Eigen::Vector3d ee_frame_linear_velocity(raw_twist[0],
-                                                           raw_twist[1],
-                                                           raw_twist[2]);
-            const Eigen::Vector3d ee_frame_angular_velocity(raw_twist[3],
-                                                            raw_twist[4],
-                                                            raw_twist[5]);
-            const Eigen::Vector3d base_frame_linear_velocity
-                = RotateVector(latest_tcp_rotation, ee_frame_linear_velocity);
-            const Eigen::Vector3d base_frame_angular_velocity
-                = RotateVector(latest_tcp_rotation, ee_frame_angular_velocity);
-            const std::vector<double> base_frame_twist
-                = {base_frame_linear_velocity.x(),
-                   base_frame_linear_velocity.y(),
-                   base_frame_linear_velocity.z(),
-                   base_frame_angular_velocity.x(),
-                   base_frame_angular_velocity.y(),
-                   base_frame_angular_velocity.z()};
-            control_script_command_queue_.push_back(
-                  ControlScriptCommand::MakeSpeedLCommand(base_frame_twist));
-          }
-          else
-          {
-            ROS_WARN("Ignoring ee-frame Twist as latest state invalid");
-          }
-        }
-        else if (twist_command.header.frame_id == base_frame_)
+        latest_state_channel_.Update();
+        if (latest_state_channel_.LatestSequence() > 0)
         {
-          control_script_command_queue_.push_back(
-                ControlScriptCommand::MakeSpeedLCommand(raw_twist));
+          const Eigen::Quaterniond latest_tcp_rotation(
+                latest_state_channel_.Latest().ActualTcpPose().rotation());
+          waypoint_stream_.Cancel();
+          control_command_sender_ptr_->Post(
+                ControlScriptCommand::MakeSpeedLCommand(
+                    RotateTwist(latest_tcp_rotation, raw_twist)));
         }
         else
         {
-          ROS_WARN("Invalid Twist frame: got [%s] needs [%s] or [%s]",
-                   twist_command.header.frame_id.c_str(), base_frame_.c_str(),
-                   ee_frame_.c_str());
+          ROS_WARN("Ignoring ee-frame Twist as latest state invalid");
         }
       }
+      else if (frame == base_frame_)
+      {
+        waypoint_stream_.Cancel();
+        control_command_sender_ptr_->Post(
+              ControlScriptCommand::MakeSpeedLCommand(raw_twist));
+      }
       else
       {
-        ROS_WARN("Ignoring Twist since robot is in teach mode");
+        ROS_WARN("Invalid Twist frame: got [%s] needs [%s] or [%s]",
+                 frame.c_str(), base_frame_.c_str(), ee_frame_.c_str());
       }
     }
+    else
+    {
+      ROS_WARN("Ignoring Twist since robot is in teach mode");
+    }
   }
 };
 }
 
-int main(int argc, char** argv)
+// Builds the controller plugin plugin_name from the params in nhp. Unless set
+// by params, its topics and services are those of the standalone controller
+// of the same name, with topic_prefix for the arm's topics and topic_prefix
+// and plugin_name for its own.
+std::unique_ptr<lightweight_ur_interface::URControllerPlugin>
+MakeControllerPlugin(
+    const std::string& plugin_name, const ros::NodeHandle& nh,
+    const ros::NodeHandle& nhp, const std::string& topic_prefix,
+    const std::string& base_frame, const std::string& ee_frame)
 {
-  ros::init(argc, argv, "ur_script_hardware_interface");
-  ROS_INFO("Starting ur_script_hardware_interface...");
-  ros::NodeHandle nh;
-  ros::NodeHandle nhp("~");
-  const std::string DEFAULT_JOINT_STATE_TOPIC = "/ur10/joint_states";
+  const std::string controller_prefix = topic_prefix + plugin_name + "/";
+  if (plugin_name == "position_controller")
+  {
+    return lightweight_ur_interface::MakePositionController(
+        nh, nhp, topic_prefix, controller_prefix, true);
+  }
+  else if (plugin_name == "cartesian_controller")
+  {
+    return lightweight_ur_interface::MakeCartesianController(
+        nh, nhp, topic_prefix, controller_prefix, base_frame, ee_frame, true);
+  }
+  else
+  {
+    throw std::invalid_argument("Unknown controller plugin " + plugin_name);
+  }
+}
+
+// Builds the interface for one arm from the params in nhp. Unless set by
+// params, topic and service names start with topic_prefix, the end effector
+// frame with frame_prefix, and the control program connects back to
+// default_control_port.
+std::unique_ptr<lightweight_ur_interface::URScriptHardwareInterface>
+MakeScriptHardwareInterface(
+    const ros::NodeHandle& nh, const ros::NodeHandle& nhp,
+    const std::string& topic_prefix, const std::string& frame_prefix,
+    const int32_t default_control_port,
+    lightweight_ur_interface::URIOReactor& reactor)
+{
+  const std::string DEFAULT_JOINT_STATE_TOPIC = topic_prefix + "joint_states";
   const std::string DEFAULT_VELOCITY_COMMAND_TOPIC
-      = "/ur10/joint_command_velocity";
-  const std::string DEFAULT_TWIST_COMMAND_TOPIC = "/ur10/ee_twist_command";
-  const std::string DEFAULT_EE_POSE_TOPIC = "/ur10/ee_pose";
-  const std::string DEFAULT_EE_WORLD_TWIST_TOPIC = "/ur10/ee_world_twist";
-  const std::string DEFAULT_EE_BODY_TWIST_TOPIC = "/ur10/ee_body_twist";
-  const std::string DEFAULT_EE_WRENCH_TOPIC = "/ur10/ee_wrench";
+      = topic_prefix + "joint_command_velocity";
+  const std::string DEFAULT_TWIST_COMMAND_TOPIC
+      = topic_prefix + "ee_twist_command";
+  const std::string DEFAULT_SERVO_COMMAND_TOPIC
+      = topic_prefix + "joint_command_servo";
+  const std::string DEFAULT_WAYPOINT_TRAJECTORY_TOPIC
+      = topic_prefix + "joint_command_waypoints";
+  const std::string DEFAULT_EE_POSE_TOPIC = topic_prefix + "ee_pose";
+  const std::string DEFAULT_EE_WORLD_TWIST_TOPIC
+      = topic_prefix + "ee_world_twist";
+  const std::string DEFAULT_EE_BODY_TWIST_TOPIC
+      = topic_prefix + "ee_body_twist";
+  const std::string DEFAULT_EE_WRENCH_TOPIC = topic_prefix + "ee_wrench";
+  const std::string DEFAULT_DIAGNOSTICS_TOPIC = "/diagnostics";
+  const std::string DEFAULT_CAPTURE_FILE = "";
   const std::string DEFAULT_BASE_FRAME = "base";
-  const std::string DEFAULT_EE_FRAME = "ur10_ee_frame";
-  const std::string DEFAULT_TEACH_MODE_SERVICE = "/ur10/switch_teach_mode";
+  const std::string DEFAULT_EE_FRAME = frame_prefix + "ee_frame";
+  const std::string DEFAULT_TEACH_MODE_SERVICE
+      = topic_prefix + "switch_teach_mode";
   const std::string DEFAULT_ROBOT_HOSTNAME = "172.31.1.200";
+  const double DEFAULT_CONNECT_TIMEOUT = 1.0;
+  const double DEFAULT_MIN_RECONNECT_BACKOFF = 0.1;
+  const double DEFAULT_MAX_RECONNECT_BACKOFF = 2.0;
+  const double DEFAULT_WATCHDOG_TIMEOUT = 0.5;
+  // Program and safety state is read from the primary interface, 0 disables
+  const int32_t DEFAULT_PRIMARY_PORT = 30001;
+  // Protective stops are unlocked through the dashboard server, 0 disables
+  const int32_t DEFAULT_DASHBOARD_PORT = 29999;
+  const bool DEFAULT_UNLOCK_PROTECTIVE_STOPS = false;
   const std::string DEFAULT_OUR_IP_ADDRESS = "172.31.1.100";
-  const int32_t DEFAULT_CONTROL_PORT = 50007;
+  // servoj blocks for one control period: 0.008 on CB3, 0.002 on e-Series
+  const double DEFAULT_SERVOJ_TIME = 0.008;
+  const double DEFAULT_SERVOJ_LOOKAHEAD_TIME = 0.1;
+  const double DEFAULT_SERVOJ_GAIN = 300.0;
+  const double DEFAULT_MIN_COMMAND_SPACING = 0.002;
+  const bool DEFAULT_PHASE_LOCKED_SEND = false;
+  const double DEFAULT_SEND_PHASE_OFFSET = 0.0005;
+  // State and commands are shared with co-located controllers through this
+  // POSIX shared memory segment, empty disables
+  const std::string DEFAULT_SHARED_MEMORY_NAME = "";
   const double DEFAULT_VELOCITY_LIMIT_SCALING = 0.5;
   const double DEFAULT_ACCELERATION_LIMIT_SCALING = 0.5;
   const std::string joint_state_topic
@@ -864,6 +2490,12 @@ int main(int argc, char** argv)
   const std::string twist_command_topic
       = nhp.param(std::string("twist_command_topic"),
                   DEFAULT_TWIST_COMMAND_TOPIC);
+  const std::string servo_command_topic
+      = nhp.param(std::string("servo_command_topic"),
+                  DEFAULT_SERVO_COMMAND_TOPIC);
+  const std::string waypoint_trajectory_topic
+      = nhp.param(std::string("waypoint_trajectory_topic"),
+                  DEFAULT_WAYPOINT_TRAJECTORY_TOPIC);
   const std::string ee_pose_topic
       = nhp.param(std::string("ee_pose_topic"), DEFAULT_EE_POSE_TOPIC);
   const std::string ee_world_twist_topic
@@ -874,6 +2506,8 @@ int main(int argc, char** argv)
                   DEFAULT_EE_BODY_TWIST_TOPIC);
   const std::string ee_wrench_topic
       = nhp.param(std::string("ee_wrench_topic"), DEFAULT_EE_WRENCH_TOPIC);
+  const std::string diagnostics_topic
+      = nhp.param(std::string("diagnostics_topic"), DEFAULT_DIAGNOSTICS_TOPIC);
   const std::string base_frame
       = nhp.param(std::string("base_frame"), DEFAULT_BASE_FRAME);
   const std::string ee_frame
@@ -883,10 +2517,59 @@ int main(int argc, char** argv)
                   DEFAULT_TEACH_MODE_SERVICE);
   const std::string robot_hostname
       = nhp.param(std::string("robot_hostname"), DEFAULT_ROBOT_HOSTNAME);
+  const double connect_timeout
+      = nhp.param(std::string("connect_timeout"), DEFAULT_CONNECT_TIMEOUT);
+  const double min_reconnect_backoff
+      = nhp.param(std::string("min_reconnect_backoff"),
+                  DEFAULT_MIN_RECONNECT_BACKOFF);
+  const double max_reconnect_backoff
+      = nhp.param(std::string("max_reconnect_backoff"),
+                  DEFAULT_MAX_RECONNECT_BACKOFF);
+  const double watchdog_timeout
+      = nhp.param(std::string("watchdog_timeout"), DEFAULT_WATCHDOG_TIMEOUT);
+  const int32_t primary_port
+      = std::abs(nhp.param(std::string("primary_port"), DEFAULT_PRIMARY_PORT));
+  const int32_t dashboard_port
+      = std::abs(nhp.param(std::string("dashboard_port"),
+                           DEFAULT_DASHBOARD_PORT));
+  const bool unlock_protective_stops
+      = nhp.param(std::string("unlock_protective_stops"),
+                  DEFAULT_UNLOCK_PROTECTIVE_STOPS);
+  const std::string capture_file
+      = nhp.param(std::string("capture_file"), DEFAULT_CAPTURE_FILE);
   const std::string our_ip_address
       = nhp.param(std::string("our_ip_address"), DEFAULT_OUR_IP_ADDRESS);
   const int32_t control_port
-      = std::abs(nhp.param(std::string("control_port"), DEFAULT_CONTROL_PORT));
+      = std::abs(nhp.param(std::string("control_port"), default_control_port));
+  const double servoj_time
+      = std::abs(nhp.param(std::string("servoj_time"), DEFAULT_SERVOJ_TIME));
+  // The controller only accepts lookahead times in [0.03, 0.2] and gains in
+  // [100, 2000]
+  const double servoj_lookahead_time
+      = common_robotics_utilities::utility::ClampValueAndWarn(
+          nhp.param(std::string("servoj_lookahead_time"),
+                    DEFAULT_SERVOJ_LOOKAHEAD_TIME), 0.03, 0.2);
+  const double servoj_gain
+      = common_robotics_utilities::utility::ClampValueAndWarn(
+          nhp.param(std::string("servoj_gain"), DEFAULT_SERVOJ_GAIN),
+          100.0, 2000.0);
+  // Servo setpoints may lead the actual position by at most this long at
+  // the joint velocity limits. By default, one servoj step plus the tracking
+  // lag its lookahead allows.
+  const double max_servo_step_time
+      = std::abs(nhp.param(std::string("max_servo_step_time"),
+                           servoj_time + servoj_lookahead_time));
+  const double min_command_spacing
+      = std::abs(nhp.param(std::string("min_command_spacing"),
+                           DEFAULT_MIN_COMMAND_SPACING));
+  const bool phase_locked_send
+      = nhp.param(std::string("phase_locked_send"), DEFAULT_PHASE_LOCKED_SEND);
+  const double send_phase_offset
+      = std::abs(nhp.param(std::string("send_phase_offset"),
+                           DEFAULT_SEND_PHASE_OFFSET));
+  const std::string shared_memory_name
+      = nhp.param(std::string("shared_memory_name"),
+                  DEFAULT_SHARED_MEMORY_NAME);
   const double velocity_limit_scaling
       = std::abs(nhp.param(std::string("velocity_limit_scaling"),
                            DEFAULT_VELOCITY_LIMIT_SCALING));
@@ -899,6 +2582,25 @@ int main(int argc, char** argv)
   const double real_acceleration_limit_scaling
       = common_robotics_utilities::utility::ClampValueAndWarn(
           acceleration_limit_scaling, 0.0, 1.0);
+  const tri_realtime_common::RealtimeThreadConfig command_sender_thread_config
+      = tri_realtime_common::LoadRealtimeThreadConfig(
+          nhp, "command_sender_thread");
+  // Controllers run in process with each state, each configured by params
+  // under its own name
+  std::vector<std::string> controller_plugin_names;
+  nhp.getParam(std::string("controller_plugins"), controller_plugin_names);
+  std::vector<std::unique_ptr<lightweight_ur_interface::URControllerPlugin>>
+      controller_plugins;
+  for (const std::string& plugin_name : controller_plugin_names)
+  {
+    ROS_INFO("Loading controller plugin %s", plugin_name.c_str());
+    controller_plugins.push_back(MakeControllerPlugin(
+        plugin_name, nh, ros::NodeHandle(nhp, plugin_name), topic_prefix,
+        base_frame, ee_frame));
+  }
+  const lightweight_ur_interface::URRealtimeConnectionParams
+      connection_params(connect_timeout, min_reconnect_backoff,
+                        max_reconnect_backoff, watchdog_timeout);
   // Joint names in true order
   const std::vector<std::string> ordered_joint_names
       = lightweight_ur_interface::GetOrderedJointNames();
@@ -906,12 +2608,102 @@ int main(int argc, char** argv)
   const std::map<std::string, lightweight_ur_interface::JointLimits> limits
       = lightweight_ur_interface::GetLimits(real_velocity_limit_scaling,
                                             real_acceleration_limit_scaling);
-  lightweight_ur_interface::URScriptHardwareInterface interface(
-      nh, velocity_command_topic, twist_command_topic, joint_state_topic,
-      ee_pose_topic, ee_world_twist_topic, ee_body_twist_topic, ee_wrench_topic,
-      base_frame, ee_frame, teach_mode_service, ordered_joint_names, limits,
-      robot_hostname, our_ip_address, control_port);
+  return std::unique_ptr<lightweight_ur_interface::URScriptHardwareInterface>(
+      new lightweight_ur_interface::URScriptHardwareInterface(
+        nh, velocity_command_topic, twist_command_topic, servo_command_topic,
+        waypoint_trajectory_topic, joint_state_topic, ee_pose_topic,
+        ee_world_twist_topic, ee_body_twist_topic, ee_wrench_topic,
+        diagnostics_topic, base_frame, ee_frame, teach_mode_service,
+        ordered_joint_names, limits, robot_hostname, connection_params,
+        primary_port, dashboard_port, unlock_protective_stops, capture_file,
+        our_ip_address, control_port, servoj_time, servoj_lookahead_time,
+        servoj_gain, max_servo_step_time, min_command_spacing,
+        phase_locked_send, send_phase_offset,
+        shared_memory_name, std::move(controller_plugins),
+        command_sender_thread_config, reactor));
+}
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "ur_script_hardware_interface");
+  ROS_INFO("Starting ur_script_hardware_interface...");
+  ros::NodeHandle nh;
+  ros::NodeHandle nhp("~");
+  const int32_t DEFAULT_CONTROL_PORT = 50007;
+  const std::function<void(const std::string&)> logging_fn
+      = [] (const std::string& message)
+  {
+    ROS_INFO("%s", message.c_str());
+  };
+  // The connections of every arm run on one shared reactor thread, except
+  // for arms that configure a recv thread of their own
+  const tri_realtime_common::RealtimeThreadConfig recv_thread_config
+      = tri_realtime_common::LoadRealtimeThreadConfig(nhp, "recv_thread");
+  std::vector<std::unique_ptr<lightweight_ur_interface::URIOReactor>>
+      reactors;
+  reactors.emplace_back(new lightweight_ur_interface::URIOReactor(
+      logging_fn, recv_thread_config, "ur_recv"));
+  // With no arms listed, a single arm is configured by the node's own params
+  std::vector<std::string> arm_names;
+  nhp.getParam(std::string("arms"), arm_names);
+  std::vector<std::unique_ptr<
+      lightweight_ur_interface::URScriptHardwareInterface>> arms;
+  if (arm_names.empty())
+  {
+    arms.push_back(MakeScriptHardwareInterface(
+        nh, nhp, "/ur10/", "ur10_", DEFAULT_CONTROL_PORT,
+        *reactors.front()));
+  }
+  for (size_t idx = 0; idx < arm_names.size(); idx++)
+  {
+    // Each arm's topics and services are in its own namespace, and its
+    // params are under the node's private namespace
+    const std::string& arm_name = arm_names.at(idx);
+    const ros::NodeHandle arm_nh(nh, arm_name);
+    const ros::NodeHandle arm_nhp(nhp, arm_name);
+    const tri_realtime_common::RealtimeThreadConfig arm_recv_thread_config
+        = tri_realtime_common::LoadRealtimeThreadConfig(arm_nhp,
+                                                        "recv_thread");
+    lightweight_ur_interface::URIOReactor* arm_reactor = reactors.front().get();
+    if (!arm_recv_thread_config.IsDefault())
+    {
+      ROS_INFO("Arm %s has its own recv thread", arm_name.c_str());
+      reactors.emplace_back(new lightweight_ur_interface::URIOReactor(
+          logging_fn, arm_recv_thread_config, "ur_recv_" + arm_name));
+      arm_reactor = reactors.back().get();
+    }
+    ROS_INFO("Hosting arm %s", arm_name.c_str());
+    arms.push_back(MakeScriptHardwareInterface(
+        arm_nh, arm_nhp, "", arm_name + "_",
+        DEFAULT_CONTROL_PORT + static_cast<int32_t>(idx), *arm_reactor));
+  }
+  tri_realtime_common::LockProcessMemoryIfRequested(nhp, logging_fn);
+  for (const auto& reactor : reactors)
+  {
+    reactor->Start();
+  }
+  for (const auto& arm : arms)
+  {
+    arm->Start();
+  }
   ROS_INFO("...startup complete");
-  interface.Run(400.0);
+  // Callbacks are handled as soon as they arrive, and the commands they post
+  // are sent immediately by each arm's sender thread
+  ros::CallbackQueue* callback_queue = ros::getGlobalCallbackQueue();
+  const double housekeeping_period
+      = lightweight_ur_interface::URScriptHardwareInterface
+          ::HOUSEKEEPING_PERIOD;
+  while (nh.ok())
+  {
+    callback_queue->callAvailable(ros::WallDuration(housekeeping_period));
+    for (const auto& arm : arms)
+    {
+      arm->DoHousekeeping();
+    }
+  }
+  for (const auto& arm : arms)
+  {
+    arm->Stop();
+  }
   return 0;
 }
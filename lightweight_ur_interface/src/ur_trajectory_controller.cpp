@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <cstring>
 #include <cmath>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <string>
@@ -11,11 +12,14 @@
 #include <mutex>
 #include <functional>
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <std_srvs/Empty.h>
 #include <sensor_msgs/JointState.h>
 #include <control_msgs/JointTrajectoryControllerState.h>
 #include <trajectory_msgs/JointTrajectory.h>
 #include <lightweight_ur_interface/ur_robot_config.hpp>
+#include <lightweight_ur_interface/ur_shared_memory_channel.hpp>
+#include <lightweight_ur_interface/PositionCommand.h>
 #include <lightweight_ur_interface/VelocityCommand.h>
 #include <common_robotics_utilities/print.hpp>
 #include <common_robotics_utilities/math.hpp>
@@ -49,12 +53,28 @@ private:
   std::vector<double> joint_acceleration_limits_;
   std::vector<PIDParams> joint_controller_parameters_;
   bool limit_acceleration_;
+  // If set, trajectory positions are streamed to the robot to track with
+  // servoj, instead of velocity commands from the PID controller
+  bool servo_trajectory_;
+  // If set, each trajectory is sampled every waypoint_interval_ seconds and
+  // sent ahead to the robot's waypoint buffer, which executes it without
+  // further commands from us
+  bool waypoint_trajectory_;
+  double waypoint_interval_;
 
   bool current_config_valid_;
+  // Set by each valid state feedback message, cleared by each state-triggered
+  // controller step
+  bool new_state_feedback_;
   ros::Time active_trajectory_start_time_;
   std::shared_ptr<Trajectory> active_trajectory_;
   std::vector<double> current_config_;
   std::vector<double> current_velocities_;
+  // Exchanges state and velocity commands with the hardware interface
+  // through shared memory instead of topics, if enabled
+  std::unique_ptr<URSharedMemoryClient> shared_memory_ptr_;
+  // Index of each of our joints in the robot's joint order
+  std::vector<size_t> shared_joint_indices_;
 
   std::vector<double> position_error_integrals_;
   std::vector<double> last_position_errors_;
@@ -62,6 +82,8 @@ private:
   ros::NodeHandle nh_;
   ros::Publisher status_pub_;
   ros::Publisher command_pub_;
+  ros::Publisher servo_command_pub_;
+  ros::Publisher waypoint_trajectory_pub_;
   ros::Subscriber feedback_sub_;
   ros::Subscriber trajectory_command_sub_;
   ros::ServiceServer abort_server_;
@@ -73,15 +95,33 @@ public:
       const std::string& trajectory_command_topic,
       const std::string& state_feedback_topic,
       const std::string& velocity_command_topic,
+      const std::string& servo_command_topic,
+      const std::string& waypoint_trajectory_topic,
+      const double waypoint_interval,
       const std::string& status_topic,
       const std::string& abort_service,
+      const std::string& shared_memory_name,
       const std::map<std::string, JointLimits>& joint_limits,
       const std::map<std::string, PIDParams> joint_controller_params,
       const bool limit_acceleration)
     : nh_(nh)
   {
     limit_acceleration_ = limit_acceleration;
+    servo_trajectory_ = !servo_command_topic.empty();
+    waypoint_trajectory_ = !waypoint_trajectory_topic.empty();
+    if (servo_trajectory_ && waypoint_trajectory_)
+    {
+      throw std::invalid_argument(
+          "Only one of servo_command_topic and waypoint_trajectory_topic may"
+          " be set");
+    }
+    if (waypoint_interval <= 0.0)
+    {
+      throw std::invalid_argument("waypoint_interval must be > 0");
+    }
+    waypoint_interval_ = waypoint_interval;
     current_config_valid_ = false;
+    new_state_feedback_ = false;
     current_config_ = std::vector<double>();
     current_velocities_ = std::vector<double>();
     joint_names_ = GetKeysFromMapLike<std::string, JointLimits>(joint_limits);
@@ -108,14 +148,51 @@ public:
     status_pub_
         = nh_.advertise<control_msgs::JointTrajectoryControllerState>(
             status_topic, 1, false);
+    if (servo_trajectory_)
+    {
+      ROS_INFO("Streaming trajectory positions to %s",
+               servo_command_topic.c_str());
+      servo_command_pub_
+          = nh_.advertise<lightweight_ur_interface::PositionCommand>(
+              servo_command_topic, 1, false);
+    }
+    if (waypoint_trajectory_)
+    {
+      ROS_INFO("Sending trajectories as waypoints every %f seconds to %s",
+               waypoint_interval_, waypoint_trajectory_topic.c_str());
+      waypoint_trajectory_pub_
+          = nh_.advertise<trajectory_msgs::JointTrajectory>(
+              waypoint_trajectory_topic, 1, false);
+    }
+    if (!shared_memory_name.empty())
+    {
+      ROS_INFO("Exchanging state and velocity commands through shared memory"
+               " %s", shared_memory_name.c_str());
+      shared_memory_ptr_ = std::unique_ptr<URSharedMemoryClient>(
+          new URSharedMemoryClient(shared_memory_name,
+                                   [] (const std::string& message)
+      {
+        ROS_INFO("%s", message.c_str());
+      }));
+      shared_joint_indices_ = GetOrderedJointIndices(joint_names_);
+    }
+    else
+    {
+      feedback_sub_
+          = nh_.subscribe(state_feedback_topic,
+                          1,
+                          &URTrajectoryController::StateFeedbackCallback,
+                          this);
+    }
+    // Commands that go to the hardware interface directly are still
+    // published for introspection, but on a topic of their own, as the
+    // hardware interface would execute them again from its command topic
+    const std::string command_topic
+        = (!shared_memory_name.empty())
+          ? velocity_command_topic + "_mirror" : velocity_command_topic;
     command_pub_
         = nh_.advertise<lightweight_ur_interface::VelocityCommand>(
-            velocity_command_topic, 1, false);
-    feedback_sub_
-        = nh_.subscribe(state_feedback_topic,
-                        1,
-                        &URTrajectoryController::StateFeedbackCallback,
-                        this);
+            command_topic, 1, false);
     trajectory_command_sub_
         = nh_.subscribe(trajectory_command_topic,
                         1,
@@ -127,7 +204,30 @@ public:
                                this);
   }
 
-  void Loop(const double control_rate)
+  // Handles callbacks as they arrive, for up to timeout seconds, until a new
+  // state feedback message has been received. Returns false if none arrived.
+  bool WaitForStateFeedback(const double timeout)
+  {
+    if (shared_memory_ptr_)
+    {
+      // Wait on shared memory, and handle other callbacks once per state
+      URSharedState shared_state;
+      const bool received
+          = shared_memory_ptr_->WaitForNewState(timeout, shared_state);
+      ros::getGlobalCallbackQueue()->callAvailable();
+      if (received)
+      {
+        SharedStateFeedback(shared_state);
+      }
+      return received;
+    }
+    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(timeout));
+    const bool received = new_state_feedback_;
+    new_state_feedback_ = false;
+    return received;
+  }
+
+  void Loop(const double control_rate, const bool state_triggered)
   {
     const double control_interval = 1.0 / control_rate;
     ros::Rate spin_rate(control_rate);
@@ -137,7 +237,25 @@ public:
     while (ros::ok())
     {
       // Process callbacks
-      ros::spinOnce();
+      if (state_triggered)
+      {
+        // Step once per state feedback message, as soon as it arrives, so
+        // that commands keep a fixed phase relative to the robot's cycle
+        if (!WaitForStateFeedback(control_interval))
+        {
+          continue;
+        }
+      }
+      else
+      {
+        ros::spinOnce();
+        URSharedState shared_state;
+        if (shared_memory_ptr_
+            && shared_memory_ptr_->ReadNewState(shared_state))
+        {
+          SharedStateFeedback(shared_state);
+        }
+      }
       // Run controller
       if (iteration_count == supersample_rate)
       {
@@ -145,7 +263,29 @@ public:
         {
           const double elapsed_time
               = (ros::Time::now() - active_trajectory_start_time_).toSec();
-          if (elapsed_time <= active_trajectory_->Duration())
+          if (servo_trajectory_ || waypoint_trajectory_)
+          {
+            // The robot tracks the positions itself, so no feedback terms
+            // are needed. Past the end, the final position is held. Waypoint
+            // trajectories are already on the robot, so only status is
+            // published for them.
+            const std::pair<Eigen::VectorXd, Eigen::VectorXd> target_pos_vel
+                = active_trajectory_->GetPositionVelocity(
+                    std::min(elapsed_time, active_trajectory_->Duration()));
+            const std::vector<double> current_target_position
+                = EigenVectorXdToStdVectorDouble(target_pos_vel.first);
+            const std::vector<double> current_target_velocity
+                = EigenVectorXdToStdVectorDouble(target_pos_vel.second);
+            if (servo_trajectory_)
+            {
+              CommandPositions(current_target_position);
+            }
+            PublishState(current_target_position,
+                         current_target_velocity,
+                         current_config_,
+                         current_velocities_);
+          }
+          else if (elapsed_time <= active_trajectory_->Duration())
           {
             const std::pair<Eigen::VectorXd, Eigen::VectorXd> current_pos_vel
                 = active_trajectory_->GetPositionVelocity(elapsed_time);
@@ -244,7 +384,10 @@ public:
         iteration_count++;
       }
       // Spin
-      spin_rate.sleep();
+      if (!state_triggered)
+      {
+        spin_rate.sleep();
+      }
     }
   }
 
@@ -413,13 +556,77 @@ public:
   {
     if (velocities.size() == joint_names_.size())
     {
-      lightweight_ur_interface::VelocityCommand command_msg;
+      if (shared_memory_ptr_)
+      {
+        URSharedCommand command;
+        command.type = kSharedCommandSpeedJ;
+        command.reserved = 0;
+        for (size_t idx = 0; idx < joint_names_.size(); idx++)
+        {
+          command.values[shared_joint_indices_[idx]] = velocities[idx];
+        }
+        if (!shared_memory_ptr_->PostCommand(command))
+        {
+          ROS_WARN_THROTTLE(1.0, "Failed to post shared memory command");
+        }
+      }
+      // Mirrored commands are only built if someone is listening
+      const bool publish_command
+          = !shared_memory_ptr_ || (command_pub_.getNumSubscribers() > 0);
+      if (publish_command)
+      {
+        lightweight_ur_interface::VelocityCommand command_msg;
+        command_msg.name = joint_names_;
+        command_msg.velocity = velocities;
+        command_pub_.publish(command_msg);
+      }
+    }
+  }
+
+  void CommandPositions(const std::vector<double>& positions)
+  {
+    if (positions.size() == joint_names_.size())
+    {
+      lightweight_ur_interface::PositionCommand command_msg;
       command_msg.name = joint_names_;
-      command_msg.velocity = velocities;
-      command_pub_.publish(command_msg);
+      command_msg.position = positions;
+      servo_command_pub_.publish(command_msg);
     }
   }
 
+  // Samples the active trajectory every waypoint_interval_ seconds, ending
+  // exactly at its end, and sends the samples to the robot in one message.
+  // Without an active trajectory, the empty message stops the robot at its
+  // current target.
+  void SendWaypointTrajectory()
+  {
+    trajectory_msgs::JointTrajectory waypoint_msg;
+    waypoint_msg.header.stamp = ros::Time::now();
+    waypoint_msg.joint_names = joint_names_;
+    if (active_trajectory_)
+    {
+      const double duration = active_trajectory_->Duration();
+      // Stops at the end of the trajectory, so that no two waypoints share a
+      // time, which the hardware interface rejects
+      double previous_time = 0.0;
+      for (size_t idx = 1; previous_time < duration; idx++)
+      {
+        const double time
+            = std::min(static_cast<double>(idx) * waypoint_interval_,
+                       duration);
+        previous_time = time;
+        const std::pair<Eigen::VectorXd, Eigen::VectorXd> pos_vel
+            = active_trajectory_->GetPositionVelocity(time);
+        trajectory_msgs::JointTrajectoryPoint waypoint;
+        waypoint.positions = EigenVectorXdToStdVectorDouble(pos_vel.first);
+        waypoint.velocities = EigenVectorXdToStdVectorDouble(pos_vel.second);
+        waypoint.time_from_start = ros::Duration(time);
+        waypoint_msg.points.push_back(waypoint);
+      }
+    }
+    waypoint_trajectory_pub_.publish(waypoint_msg);
+  }
+
   void TrajectoryCommandCallback(trajectory_msgs::JointTrajectory trajectory)
   {
     if (current_config_valid_ == false)
@@ -539,6 +746,25 @@ public:
                provided_joint_names.c_str(), our_joint_names.c_str());
       active_trajectory_.reset();
     }
+    if (waypoint_trajectory_)
+    {
+      SendWaypointTrajectory();
+    }
+  }
+
+  void SharedStateFeedback(const URSharedState& shared_state)
+  {
+    std::vector<double> current_config(joint_names_.size(), 0.0);
+    std::vector<double> current_velocities(joint_names_.size(), 0.0);
+    for (size_t idx = 0; idx < joint_names_.size(); idx++)
+    {
+      const size_t shared_idx = shared_joint_indices_[idx];
+      current_config[idx] = shared_state.joint_position[shared_idx];
+      current_velocities[idx] = shared_state.joint_velocity[shared_idx];
+    }
+    current_config_ = current_config;
+    current_velocities_ = current_velocities;
+    current_config_valid_ = true;
   }
 
   void StateFeedbackCallback(sensor_msgs::JointState config_feedback)
@@ -583,6 +809,7 @@ public:
         current_config_ = current_config;
         current_velocities_ = current_velocities;
         current_config_valid_ = true;
+        new_state_feedback_ = true;
       }
     }
     else
@@ -607,8 +834,18 @@ int main(int argc, char** argv)
   const std::string DEFAULT_STATE_FEEDBACK_TOPIC = "/ur10/joint_states";
   const std::string DEFAULT_VELOCITY_COMMAND_TOPIC
       = "/ur10/joint_command_velocity";
+  // If set, positions are streamed to this topic instead of velocity commands
+  const std::string DEFAULT_SERVO_COMMAND_TOPIC = "";
+  // If set, trajectories are sent ahead to the robot as waypoints on this
+  // topic, spaced waypoint_interval apart
+  const std::string DEFAULT_WAYPOINT_TRAJECTORY_TOPIC = "";
+  const double DEFAULT_WAYPOINT_INTERVAL = 0.032;
   const std::string DEFAULT_ABORT_SERVICE = "/ur10_trajectory_controller/abort";
   const double DEFAULT_CONTROL_RATE = 200.0;
+  const bool DEFAULT_STATE_TRIGGERED = false;
+  // If set, state feedback and velocity commands use the hardware interface's
+  // shared memory channel instead of topics
+  const std::string DEFAULT_SHARED_MEMORY_NAME = "";
   const double DEFAULT_VELOCITY_LIMIT_SCALING = 0.5;
   const double DEFAULT_ACCELERATION_LIMIT_SCALING = 0.25;
   const double DEFAULT_BASE_KP = 1.0;
@@ -623,12 +860,27 @@ int main(int argc, char** argv)
   const std::string velocity_command_topic
       = nhp.param(std::string("velocity_command_topic"),
                   DEFAULT_VELOCITY_COMMAND_TOPIC);
+  const std::string servo_command_topic
+      = nhp.param(std::string("servo_command_topic"),
+                  DEFAULT_SERVO_COMMAND_TOPIC);
+  const std::string waypoint_trajectory_topic
+      = nhp.param(std::string("waypoint_trajectory_topic"),
+                  DEFAULT_WAYPOINT_TRAJECTORY_TOPIC);
+  const double waypoint_interval
+      = std::abs(nhp.param(std::string("waypoint_interval"),
+                           DEFAULT_WAYPOINT_INTERVAL));
   const std::string status_topic
       = nhp.param(std::string("status_topic"), DEFAULT_STATUS_TOPIC);
   const std::string abort_service
       = nhp.param(std::string("abort_service"), DEFAULT_ABORT_SERVICE);
+  const std::string shared_memory_name
+      = nhp.param(std::string("shared_memory_name"),
+                  DEFAULT_SHARED_MEMORY_NAME);
   const double control_rate
       = nhp.param(std::string("control_rate"), DEFAULT_CONTROL_RATE);
+  // When state-triggered, control_rate should match the rate of state feedback
+  const bool state_triggered
+      = nhp.param(std::string("state_triggered"), DEFAULT_STATE_TRIGGERED);
   const double velocity_limit_scaling
       = std::abs(nhp.param(std::string("velocity_limit_scaling"),
                            DEFAULT_VELOCITY_LIMIT_SCALING));
@@ -658,9 +910,10 @@ int main(int argc, char** argv)
           base_kp, 0.0, base_kd, 0.0);
   lightweight_ur_interface::URTrajectoryController controller(
       nh, trajectory_command_topic, state_feedback_topic,
-      velocity_command_topic, status_topic, abort_service, limits, params,
-      limit_acceleration);
+      velocity_command_topic, servo_command_topic, waypoint_trajectory_topic,
+      waypoint_interval, status_topic, abort_service, shared_memory_name,
+      limits, params, limit_acceleration);
   ROS_INFO("...startup complete");
-  controller.Loop(control_rate);
+  controller.Loop(control_rate, state_triggered);
   return 0;
 }
@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <schunk_wsg_driver/schunk_wsg_driver_common.hpp>
+#include <tri_realtime_common/realtime_thread_config.hpp>
 
 namespace schunk_wsg_driver
 {
@@ -29,6 +30,7 @@ private:
   int can_socket_fd_;
   uint32_t gripper_send_can_id_;
   uint32_t gripper_recv_can_id_;
+  tri_realtime_common::RealtimeThreadConfig recv_thread_config_;
   std::thread recv_thread_;
   std::atomic<bool> active_;
   std::mutex status_mutex_;
@@ -38,7 +40,10 @@ public:
 
   WSGCANInterface(const std::function<void(const std::string&)>& logging_fn,
                   const std::string& socketcan_interface,
-                  const uint32_t gripper_send_can_id);
+                  const uint32_t gripper_send_can_id,
+                  const tri_realtime_common::RealtimeThreadConfig&
+                      recv_thread_config
+                          = tri_realtime_common::RealtimeThreadConfig());
 
   ~WSGCANInterface();
 
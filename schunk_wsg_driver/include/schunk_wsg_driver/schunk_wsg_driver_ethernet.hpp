@@ -14,6 +14,7 @@
 #include <chrono>
 #include <netinet/in.h>
 #include <schunk_wsg_driver/schunk_wsg_driver_common.hpp>
+#include <tri_realtime_common/realtime_thread_config.hpp>
 
 namespace schunk_wsg_driver
 {
@@ -25,6 +26,7 @@ private:
   int recv_socket_fd_;
   struct sockaddr_in local_sockaddr_;
   struct sockaddr_in gripper_sockaddr_;
+  tri_realtime_common::RealtimeThreadConfig recv_thread_config_;
   std::thread recv_thread_;
   std::atomic<bool> active_;
   std::mutex status_mutex_;
@@ -35,7 +37,10 @@ public:
   WSGUDPInterface(const std::function<void(const std::string&)>& logging_fn,
                   const std::string& gripper_ip_address,
                   const uint16_t gripper_port,
-                  const uint16_t local_port);
+                  const uint16_t local_port,
+                  const tri_realtime_common::RealtimeThreadConfig&
+                      recv_thread_config
+                          = tri_realtime_common::RealtimeThreadConfig());
 
   ~WSGUDPInterface();
 
@@ -6,10 +6,12 @@ namespace schunk_wsg_driver
 WSGCANInterface::WSGCANInterface(
     const std::function<void(const std::string&)>& logging_fn,
     const std::string& socketcan_interface,
-    const uint32_t gripper_send_can_id)
+    const uint32_t gripper_send_can_id,
+    const tri_realtime_common::RealtimeThreadConfig& recv_thread_config)
   : WSGInterface(logging_fn),
     gripper_send_can_id_(gripper_send_can_id),
-    gripper_recv_can_id_(gripper_send_can_id + 1u)
+    gripper_recv_can_id_(gripper_send_can_id + 1u),
+    recv_thread_config_(recv_thread_config)
 {
   Log("Attempting to create WSG gripper CAN interface with socketcan interface "
       + socketcan_interface + " gripper base_can_id "
@@ -140,6 +142,9 @@ std::vector<WSGRawStatusMessage> WSGCANInterface::GetStatusQueue()
 
 void WSGCANInterface::RecvFromGripper()
 {
+  tri_realtime_common::ConfigureCurrentThread(
+      recv_thread_config_, "wsg_recv",
+      [&] (const std::string& message) { Log(message); });
   std::vector<uint8_t> recv_buffer;
   while (active_.load())
   {
@@ -10,8 +10,9 @@ WSGUDPInterface::WSGUDPInterface(
     const std::function<void(const std::string&)>& logging_fn,
     const std::string& gripper_ip_address,
     const uint16_t gripper_port,
-    const uint16_t local_port)
-  : WSGInterface(logging_fn)
+    const uint16_t local_port,
+    const tri_realtime_common::RealtimeThreadConfig& recv_thread_config)
+  : WSGInterface(logging_fn), recv_thread_config_(recv_thread_config)
 {
   Log("Attempting to create WSG gripper UDP interface with gripper IP "
       + gripper_ip_address + " gripper port " + std::to_string(gripper_port)
@@ -102,6 +103,9 @@ std::vector<WSGRawStatusMessage> WSGUDPInterface::GetStatusQueue()
 
 void WSGUDPInterface::RecvFromGripper()
 {
+  tri_realtime_common::ConfigureCurrentThread(
+      recv_thread_config_, "wsg_recv",
+      [&] (const std::string& message) { Log(message); });
   std::vector<uint8_t> recv_buffer(1024, 0x00);
   struct sockaddr_storage source_sockaddr;
   socklen_t source_sockaddr_len = sizeof(source_sockaddr);
@@ -5,6 +5,8 @@
 #include <schunk_wsg_driver/schunk_wsg_driver_can.hpp>
 #include <schunk_wsg_driver/WSGCommand.h>
 #include <schunk_wsg_driver/WSGState.h>
+#include <tri_realtime_common/realtime_thread_config.hpp>
+#include <tri_realtime_common/ros_realtime_thread_config.hpp>
 // ROS
 #include <ros/ros.h>
 #include <ros/xmlrpc_manager.h>
@@ -126,6 +128,9 @@ int main(int argc, char** argv)
       std::cout << "[Post-shutdown] " << message << std::endl;
     }
   };
+  const tri_realtime_common::RealtimeThreadConfig recv_thread_config
+      = tri_realtime_common::LoadRealtimeThreadConfig(nhp, "recv_thread");
+  tri_realtime_common::LockProcessMemoryIfRequested(nhp, logging_fn);
   if (interface_type == "udp")
   {
     const std::string gripper_ip_address
@@ -141,7 +146,8 @@ int main(int argc, char** argv)
           new schunk_wsg_driver::WSGUDPInterface(logging_fn,
                                                  gripper_ip_address,
                                                  gripper_port,
-                                                 local_port));
+                                                 local_port,
+                                                 recv_thread_config));
     schunk_wsg_driver::SchunkWSGDriver gripper(nh,
                                                gripper_interface,
                                                command_topic,
@@ -160,7 +166,8 @@ int main(int argc, char** argv)
     std::shared_ptr<schunk_wsg_driver::WSGCANInterface> gripper_interface(
           new schunk_wsg_driver::WSGCANInterface(logging_fn,
                                                  can_interface,
-                                                 gripper_send_can_id));
+                                                 gripper_send_can_id,
+                                                 recv_thread_config));
     schunk_wsg_driver::SchunkWSGDriver gripper(nh,
                                                gripper_interface,
                                                command_topic,
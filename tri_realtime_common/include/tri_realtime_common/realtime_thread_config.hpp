@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace tri_realtime_common
+{
+// Scheduling, placement, and stack settings for a driver I/O or control
+// thread. A default-constructed config leaves the thread unchanged.
+class RealtimeThreadConfig
+{
+private:
+
+  int32_t fifo_priority_;
+  std::vector<int32_t> cpu_affinity_;
+  size_t prefault_stack_size_;
+
+public:
+
+  RealtimeThreadConfig(const int32_t fifo_priority,
+                       const std::vector<int32_t>& cpu_affinity,
+                       const size_t prefault_stack_size)
+    : fifo_priority_(fifo_priority), cpu_affinity_(cpu_affinity),
+      prefault_stack_size_(prefault_stack_size)
+  {
+    if ((fifo_priority_ < 0) || (fifo_priority_ > 99))
+    {
+      throw std::invalid_argument("fifo_priority must be in [0, 99]");
+    }
+    for (const int32_t cpu : cpu_affinity_)
+    {
+      if (cpu < 0)
+      {
+        throw std::invalid_argument("cpu_affinity entries must be >= 0");
+      }
+    }
+  }
+
+  RealtimeThreadConfig()
+    : fifo_priority_(0), prefault_stack_size_(0) {}
+
+  // SCHED_FIFO priority, or 0 to keep the default (SCHED_OTHER) policy
+  inline int32_t FifoPriority() const { return fifo_priority_; }
+
+  // CPUs the thread may run on, or empty to allow all CPUs
+  inline const std::vector<int32_t>& CpuAffinity() const
+  { return cpu_affinity_; }
+
+  // Bytes of stack to touch before the thread starts its loop, or 0
+  inline size_t PrefaultStackSize() const { return prefault_stack_size_; }
+
+  inline bool IsDefault() const
+  {
+    return ((fifo_priority_ == 0) && cpu_affinity_.empty()
+            && (prefault_stack_size_ == 0));
+  }
+};
+
+// Applies config to the calling thread and names it thread_name (truncated to
+// the 15 characters Linux allows). Settings that need privileges the process
+// lacks (CAP_SYS_NICE or an RLIMIT_RTPRIO for SCHED_FIFO) are logged and
+// skipped, so the thread runs with whatever could be applied. Returns true if
+// every setting was applied.
+bool ConfigureCurrentThread(
+    const RealtimeThreadConfig& config, const std::string& thread_name,
+    const std::function<void(const std::string&)>& logging_fn);
+
+// Locks all current and future pages of the process into memory with
+// mlockall(), so page faults do not stall realtime threads. Unless the
+// process has CAP_IPC_LOCK or an unlimited RLIMIT_MEMLOCK, only the current
+// pages are locked, since locking future pages would make allocations fail
+// once the limit is reached. Failure is logged, not thrown. Returns true if
+// memory was locked.
+bool LockProcessMemory(
+    const std::function<void(const std::string&)>& logging_fn);
+}  // namespace tri_realtime_common
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <ros/ros.h>
+#include <tri_realtime_common/realtime_thread_config.hpp>
+
+namespace tri_realtime_common
+{
+// Loads the config for one driver thread from the params
+//   <thread_name>_fifo_priority (int, default 0 = default scheduling)
+//   <thread_name>_cpu_affinity (list of ints, default [] = any CPU)
+//   <thread_name>_prefault_stack_size (bytes, default 0 = none)
+// so e.g. _recv_thread_fifo_priority:=80 _recv_thread_cpu_affinity:=[3]
+// configures a thread named recv_thread.
+inline RealtimeThreadConfig LoadRealtimeThreadConfig(
+    const ros::NodeHandle& nh, const std::string& thread_name)
+{
+  const int32_t fifo_priority
+      = nh.param(thread_name + "_fifo_priority", 0);
+  std::vector<int32_t> cpu_affinity;
+  nh.getParam(thread_name + "_cpu_affinity", cpu_affinity);
+  const int32_t prefault_stack_size
+      = nh.param(thread_name + "_prefault_stack_size", 0);
+  if (prefault_stack_size < 0)
+  {
+    throw std::invalid_argument(thread_name + "_prefault_stack_size < 0");
+  }
+  return RealtimeThreadConfig(fifo_priority, cpu_affinity,
+                              static_cast<size_t>(prefault_stack_size));
+}
+
+// Locks process memory if the lock_memory param (default false) is set.
+// Call once at startup; memory allocated later is locked as it is faulted in.
+inline void LockProcessMemoryIfRequested(
+    const ros::NodeHandle& nh,
+    const std::function<void(const std::string&)>& logging_fn)
+{
+  if (nh.param(std::string("lock_memory"), false))
+  {
+    LockProcessMemory(logging_fn);
+  }
+}
+}  // namespace tri_realtime_common
@@ -0,0 +1,209 @@
+#include <tri_realtime_common/realtime_thread_config.hpp>
+#include <alloca.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+
+namespace tri_realtime_common
+{
+namespace
+{
+// Bit of CAP_IPC_LOCK in the capability sets of /proc/self/status
+constexpr uint64_t kCapIpcLockBit = 14;
+
+std::string ErrorString(const int error)
+{
+  return std::string(strerror(error));
+}
+
+// Touches one byte per page of a size-byte block below the caller's frame, so
+// those stack pages are mapped (and locked, after mlockall(MCL_FUTURE))
+// before the thread's loop needs them. Kept out of line so the block is
+// released on return while the pages stay resident.
+__attribute__((noinline)) void PrefaultStack(const size_t size)
+{
+  volatile uint8_t* const block = static_cast<volatile uint8_t*>(alloca(size));
+  const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  for (size_t offset = 0; offset < size; offset += page_size)
+  {
+    block[offset] = 0x00;
+  }
+  block[size - 1] = 0x00;
+}
+
+// Size of the calling thread's stack, or 0 if it cannot be determined
+size_t CurrentThreadStackSize()
+{
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0)
+  {
+    return 0;
+  }
+  size_t stack_size = 0;
+  if (pthread_attr_getstacksize(&attr, &stack_size) != 0)
+  {
+    stack_size = 0;
+  }
+  pthread_attr_destroy(&attr);
+  return stack_size;
+}
+
+// True if the process may lock memory beyond RLIMIT_MEMLOCK, i.e. its
+// effective capabilities include CAP_IPC_LOCK
+bool HasIpcLockCapability()
+{
+  std::ifstream status_file("/proc/self/status");
+  std::string line;
+  while (std::getline(status_file, line))
+  {
+    if (line.compare(0, 7, "CapEff:") == 0)
+    {
+      const uint64_t effective_caps
+          = std::stoull(line.substr(7), nullptr, 16);
+      return ((effective_caps >> kCapIpcLockBit) & 0x01) != 0;
+    }
+  }
+  return false;
+}
+}  // namespace
+
+bool ConfigureCurrentThread(
+    const RealtimeThreadConfig& config, const std::string& thread_name,
+    const std::function<void(const std::string&)>& logging_fn)
+{
+  const pthread_t thread = pthread_self();
+  bool all_applied = true;
+  const std::string short_name = thread_name.substr(0, 15);
+  const int name_result = pthread_setname_np(thread, short_name.c_str());
+  if (name_result != 0)
+  {
+    logging_fn("Failed to name thread [" + thread_name + "]: "
+               + ErrorString(name_result));
+  }
+  if (!config.CpuAffinity().empty())
+  {
+    const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (const int32_t cpu : config.CpuAffinity())
+    {
+      if ((cpu < num_cpus) && (cpu < CPU_SETSIZE))
+      {
+        CPU_SET(static_cast<size_t>(cpu), &cpus);
+      }
+      else
+      {
+        logging_fn("Ignoring CPU " + std::to_string(cpu) + " for thread ["
+                   + thread_name + "], only " + std::to_string(num_cpus)
+                   + " CPUs are configured");
+      }
+    }
+    const int affinity_result
+        = (CPU_COUNT(&cpus) > 0)
+            ? pthread_setaffinity_np(thread, sizeof(cpus), &cpus)
+            : EINVAL;
+    if (affinity_result != 0)
+    {
+      logging_fn("Failed to set CPU affinity of thread [" + thread_name
+                 + "]: " + ErrorString(affinity_result)
+                 + ", it may run on any CPU");
+      all_applied = false;
+    }
+  }
+  if (config.FifoPriority() > 0)
+  {
+    const int32_t max_priority = sched_get_priority_max(SCHED_FIFO);
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = std::min(config.FifoPriority(), max_priority);
+    const int sched_result = pthread_setschedparam(thread, SCHED_FIFO, &param);
+    if (sched_result == 0)
+    {
+      logging_fn("Thread [" + thread_name + "] running SCHED_FIFO priority "
+                 + std::to_string(param.sched_priority));
+    }
+    else if (sched_result == EPERM)
+    {
+      logging_fn("Not permitted to set SCHED_FIFO priority "
+                 + std::to_string(param.sched_priority) + " for thread ["
+                 + thread_name + "] (needs CAP_SYS_NICE or an rtprio limit),"
+                 " it keeps the default scheduling policy");
+      all_applied = false;
+    }
+    else
+    {
+      logging_fn("Failed to set SCHED_FIFO priority for thread ["
+                 + thread_name + "]: " + ErrorString(sched_result)
+                 + ", it keeps the default scheduling policy");
+      all_applied = false;
+    }
+  }
+  if (config.PrefaultStackSize() > 0)
+  {
+    // Leave room for the frames already on the stack and the guard page
+    const size_t stack_size = CurrentThreadStackSize();
+    const size_t stack_margin = 64 * 1024;
+    size_t prefault_size = config.PrefaultStackSize();
+    if ((stack_size > 0) && (prefault_size + stack_margin > stack_size))
+    {
+      prefault_size
+          = (stack_size > 2 * stack_margin) ? stack_size - 2 * stack_margin : 0;
+      logging_fn("Thread [" + thread_name + "] has a "
+                 + std::to_string(stack_size) + " byte stack, prefaulting "
+                 + std::to_string(prefault_size) + " bytes instead of "
+                 + std::to_string(config.PrefaultStackSize()));
+      all_applied = false;
+    }
+    if (prefault_size > 0)
+    {
+      PrefaultStack(prefault_size);
+    }
+  }
+  return all_applied;
+}
+
+bool LockProcessMemory(
+    const std::function<void(const std::string&)>& logging_fn)
+{
+  // With a finite memlock limit, MCL_FUTURE would make later allocations
+  // (including new thread stacks) fail once the limit is reached, so only the
+  // current pages are locked.
+  struct rlimit memlock_limit;
+  const bool limited
+      = (getrlimit(RLIMIT_MEMLOCK, &memlock_limit) != 0)
+        || ((memlock_limit.rlim_cur != RLIM_INFINITY)
+            && !HasIpcLockCapability());
+  const int flags = limited ? MCL_CURRENT : (MCL_CURRENT | MCL_FUTURE);
+  if (mlockall(flags) == 0)
+  {
+    if (limited)
+    {
+      logging_fn("Locked current process memory; memlock is limited, so"
+                 " memory allocated later is not locked");
+    }
+    else
+    {
+      logging_fn("Locked process memory");
+    }
+    return true;
+  }
+  const int error = errno;
+  if ((error == EPERM) || (error == ENOMEM))
+  {
+    logging_fn("Not permitted to lock process memory (needs CAP_IPC_LOCK or"
+               " a larger memlock limit), pages may be swapped or faulted: "
+               + ErrorString(error));
+  }
+  else
+  {
+    logging_fn("Failed to lock process memory: " + ErrorString(error));
+  }
+  return false;
+}
+}  // namespace tri_realtime_common